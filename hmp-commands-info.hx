@@ -145,6 +145,39 @@ STEXI
 @item info ioapic
 @findex info ioapic
 Show io APIC state
+ETEXI
+
+#if defined(TARGET_I386)
+    {
+        .name       = "nv2a",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show nv2a texture and shader cache statistics",
+        .cmd        = hmp_info_nv2a,
+    },
+#endif
+
+STEXI
+@item info nv2a
+@findex info nv2a
+Show nv2a texture and shader cache statistics
+ETEXI
+
+#if defined(TARGET_I386)
+    {
+        .name       = "mcpx-apu",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show mcpx apu frame and audio statistics",
+        .cmd        = hmp_info_mcpx_apu,
+    },
+#endif
+
+STEXI
+@item info mcpx-apu
+@findex info mcpx-apu
+Show mcpx apu frame counts, the frame latency histogram and the audio
+output buffer state
 ETEXI
 
     {
@@ -49,6 +49,11 @@ struct DSPState {
     dsp_core_t core;
     DSPDMAState dma;
     int save_cycles;
+    bool idle_skip_disabled;
+
+    /* cycles executed, and left unused by an idle core */
+    uint64_t cycles_run;
+    uint64_t cycles_idle;
 
     uint32_t interrupts;
 };
@@ -86,6 +91,7 @@ void dsp_reset(DSPState* dsp)
 
 void dsp_destroy(DSPState* dsp)
 {
+    dsp56k_free_jit(&dsp->core);
     free(dsp);
 }
 
@@ -148,6 +154,27 @@ static void write_peripheral(dsp_core_t* core, uint32_t address, uint32_t value)
 }
 
 
+/**
+ * Nothing but dsp_start_frame, host memory writes and the host side of DMA
+ * change what the core sees, and none of those happen during dsp_run. A
+ * core that branched to itself will keep doing so, typically polling the
+ * frame interrupt bit, and one that executed WAIT is waiting for the same.
+ * REP, DO loops and interrupts in progress move on by themselves.
+ */
+static bool dsp_is_idle(dsp_core_t* core, uint32_t prev_pc)
+{
+    if (core->cur_inst == 0x000086) {
+        /* wait */
+        return true;
+    }
+
+    return core->pc == prev_pc
+        && !core->loop_rep
+        && !(core->registers[DSP_REG_SR] & (1 << DSP_SR_LF))
+        && core->interrupt_state == DSP_INTERRUPT_NONE
+        && core->interrupt_counter == 0;
+}
+
 void dsp_step(DSPState* dsp)
 {
     dsp56k_execute_instruction(&dsp->core);
@@ -170,17 +197,45 @@ void dsp_run(DSPState* dsp, int cycles)
     //  printf("--> %d\n", dsp->core.save_cycles);
     while (dsp->save_cycles > 0)
     {
-        dsp56k_execute_instruction(&dsp->core);
-        dsp->save_cycles -= dsp->core.instr_cycle;
+        uint32_t pc;
+        int cycles = dsp56k_execute_block(&dsp->core, dsp->save_cycles, &pc);
+        dsp->save_cycles -= cycles;
+        dsp->cycles_run += cycles;
+
+        if (!dsp->idle_skip_disabled && dsp_is_idle(&dsp->core, pc)) {
+            if (dsp->save_cycles > 0) {
+                dsp->cycles_idle += dsp->save_cycles;
+                dsp->save_cycles = 0;
+            }
+            break;
+        }
     }
 
 } 
 
+void dsp_set_idle_skip(DSPState* dsp, bool enabled)
+{
+    dsp->idle_skip_disabled = !enabled;
+}
+
 void dsp_bootstrap(DSPState* dsp)
 {
     // scratch memory is dma'd in to pram by the bootrom
     dsp->dma.scratch_rw(dsp->dma.rw_opaque,
         (uint8_t*)dsp->core.pram, 0, 0x800*4, false);
+    dsp56k_invalidate_opcode_cache(&dsp->core);
+}
+
+void dsp_set_opcode_cache(DSPState* dsp, bool enabled)
+{
+    dsp->core.opcode_cache_disabled = !enabled;
+    dsp56k_invalidate_opcode_cache(&dsp->core);
+}
+
+void dsp_set_jit(DSPState* dsp, bool enabled)
+{
+    dsp->core.jit_disabled = !enabled;
+    dsp56k_invalidate_opcode_cache(&dsp->core);
 }
 
 void dsp_start_frame(DSPState* dsp)
@@ -288,6 +343,9 @@ void dsp_info(DSPState* dsp)
         printf(" %04hx", dsp->core.interrupt_is_pending[i]);
     }
     printf("\n");
+
+    printf("- Cycles: %" PRIu64 " run, %" PRIu64 " skipped while idle\n",
+           dsp->cycles_run, dsp->cycles_idle);
 }
 
 /**
@@ -388,13 +446,14 @@ int dsp_get_register_address(DSPState* dsp, const char *regname, uint32_t **addr
         { "R6",  &dsp->core.registers[DSP_REG_R6],  32, BITMASK(16) },
         { "R7",  &dsp->core.registers[DSP_REG_R7],  32, BITMASK(16) },
 
-        { "SSH", &dsp->core.registers[DSP_REG_SSH], 32, BITMASK(16) },
-        { "SSL", &dsp->core.registers[DSP_REG_SSL], 32, BITMASK(16) },
         { "SP",  &dsp->core.registers[DSP_REG_SP],  32, BITMASK(6) },
 
         /* 16-bit status register */
         { "SR",  &dsp->core.registers[DSP_REG_SR],  32, 0xefff },
 
+        { "SSH", &dsp->core.registers[DSP_REG_SSH], 32, BITMASK(16) },
+        { "SSL", &dsp->core.registers[DSP_REG_SSL], 32, BITMASK(16) },
+
         /* 48-bit X register */
         { "X0",  &dsp->core.registers[DSP_REG_X0],  32, BITMASK(24) },
         { "X1",  &dsp->core.registers[DSP_REG_X1],  32, BITMASK(24) },
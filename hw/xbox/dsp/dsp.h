@@ -33,8 +33,11 @@ typedef struct DSPState DSPState;
 
 typedef void (*dsp_scratch_rw_func)(
     void *opaque, uint8_t *ptr, uint32_t addr, size_t len, bool dir);
+/* item_size is 2 for 16 bit samples, 4 for 24 bit samples in the low bits
+ * of 32 bit words */
 typedef void (*dsp_fifo_rw_func)(
-    void *opaque, uint8_t *ptr, unsigned int index, size_t len, bool dir);
+    void *opaque, uint8_t *ptr, unsigned int index, unsigned int item_size,
+    size_t len, bool dir);
 
 /* Dsp commands */
 DSPState *dsp_init(void *rw_opaque,
@@ -44,11 +47,19 @@ void dsp_destroy(DSPState* dsp);
 void dsp_reset(DSPState* dsp);
 
 void dsp_step(DSPState* dsp);
+/* Stops early, dropping the cycles left, once the core is idle */
 void dsp_run(DSPState* dsp, int cycles);
+void dsp_set_idle_skip(DSPState* dsp, bool enabled);
 
 void dsp_bootstrap(DSPState* dsp);
 void dsp_start_frame(DSPState* dsp);
 
+/* Decoded instructions are cached per PRAM address unless disabled */
+void dsp_set_opcode_cache(DSPState* dsp, bool enabled);
+/* dsp_run translates basic blocks to host code, where it can, unless
+ * disabled. The interpreter runs whatever isn't translated. */
+void dsp_set_jit(DSPState* dsp, bool enabled);
+
 
 /* Dsp Debugger commands */
 uint32_t dsp_read_memory(DSPState* dsp, char space, uint32_t addr);
@@ -23,6 +23,8 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
@@ -352,6 +354,8 @@ static const OpcodeEntry nonparallel_opcodes[] = {
 static bool matches_initialised;
 static uint32_t nonparallel_matches[ARRAYSIZE(nonparallel_opcodes)][2];
 
+#include "dsp_jit.inl"
+
 /**********************************
  *  Emulator kernel
  **********************************/
@@ -409,6 +413,8 @@ void dsp56k_reset_cpu(dsp_core_t* dsp)
     /* Misc */
     dsp->loop_rep = 0;
 
+    dsp56k_invalidate_opcode_cache(dsp);
+
 
     /* runtime shit */
 
@@ -437,6 +443,26 @@ static OpcodeEntry lookup_opcode(uint32_t op) {
     return r;
 }
 
+void dsp56k_invalidate_opcode_cache(dsp_core_t* dsp)
+{
+    memset(dsp->opcode_cache, 0, sizeof(dsp->opcode_cache));
+    if (dsp->jit) {
+        dsp->jit->flush = true;
+    }
+}
+
+static emu_func_t decode_opcode(dsp_core_t* dsp)
+{
+    emu_func_t emu_func = dsp->opcode_cache[dsp->pc];
+    if (emu_func == NULL) {
+        emu_func = lookup_opcode(dsp->cur_inst).emu_func;
+        if (!dsp->opcode_cache_disabled) {
+            dsp->opcode_cache[dsp->pc] = emu_func;
+        }
+    }
+    return emu_func;
+}
+
 static uint16_t disasm_instruction(dsp_core_t* dsp, dsp_trace_disasm_t mode)
 {
     dsp->disasm_mode = mode;
@@ -659,10 +685,11 @@ void dsp56k_execute_instruction(dsp_core_t* dsp)
     }
             
     if (dsp->cur_inst < 0x100000) {
-        const OpcodeEntry op = lookup_opcode(dsp->cur_inst);
-        if (op.emu_func) {
-            op.emu_func(dsp);
+        const emu_func_t emu_func = decode_opcode(dsp);
+        if (emu_func) {
+            emu_func(dsp);
         } else {
+            const OpcodeEntry op = lookup_opcode(dsp->cur_inst);
             printf("%x - %s\n", dsp->cur_inst, op.name);
             emu_undefined(dsp);
         }
@@ -716,6 +743,27 @@ void dsp56k_execute_instruction(dsp_core_t* dsp)
 #endif
 }
 
+int dsp56k_execute_block(dsp_core_t* dsp, int cycles, uint32_t *last_pc)
+{
+    const dsp_jit_block_t *block = dsp_jit_lookup(dsp);
+    int cycles_left;
+
+    if (block == NULL) {
+        *last_pc = dsp->pc;
+        dsp56k_execute_instruction(dsp);
+        return dsp->instr_cycle;
+    }
+
+    dsp->jit_exit = false;
+    cycles_left = block->code(dsp, cycles, last_pc);
+
+    /* As for the last instruction interpreted */
+    dsp_postexecute_update_pc(dsp);
+    dsp_postexecute_interrupts(dsp);
+
+    return cycles - cycles_left;
+}
+
 /**********************************
  *  Update the PC
 **********************************/
@@ -787,6 +835,7 @@ void dsp56k_add_interrupt(dsp_core_t* dsp, uint16_t inter)
     if (dsp->interrupt_is_pending[inter] == 0) { 
         dsp->interrupt_is_pending[inter] = 1;
         dsp->interrupt_counter ++;
+        dsp->jit_exit = true;
     }
 }
 
@@ -1020,6 +1069,8 @@ static void write_memory_raw(dsp_core_t* dsp, int space, uint32_t address, uint3
     } else if (space == DSP_SPACE_P) {
         assert(address < DSP_PRAM_SIZE);
         dsp->pram[address] = value;
+        dsp->opcode_cache[address] = NULL;
+        dsp_jit_write_p(dsp, address);
     } else {
         assert(false);
     }
@@ -152,6 +152,7 @@ typedef struct dsp_interrupt_s {
 } dsp_interrupt_t;
 
 typedef struct dsp_core_s dsp_core_t;
+typedef struct dsp_jit_s dsp_jit_t;
 
 struct dsp_core_s {
     /* DSP instruction Cycle counter */
@@ -193,6 +194,18 @@ struct dsp_core_s {
 
     /* runtime data */
 
+    /* Decoded non-parallel instructions, indexed by PRAM address. NULL until
+     * the instruction is first executed, and again after its word is
+     * written. */
+    void (*opcode_cache[DSP_PRAM_SIZE])(dsp_core_t* dsp);
+    bool opcode_cache_disabled;
+
+    /* Translated basic blocks, allocated when first run */
+    dsp_jit_t *jit;
+    bool jit_disabled;
+    /* Set to return from the running block after the current instruction */
+    bool jit_exit;
+
     /* Instructions per second */
 #ifdef DSP_COUNT_IPS
     uint32_t start_time;
@@ -245,7 +258,10 @@ struct dsp_core_s {
 /* Functions */
 void dsp56k_reset_cpu(dsp_core_t* dsp);		/* Set dsp_core to use */
 void dsp56k_execute_instruction(dsp_core_t* dsp);	/* Execute 1 instruction */
+int dsp56k_execute_block(dsp_core_t* dsp, int cycles, uint32_t *last_pc);	/* Execute a translated block, or else 1 instruction, within cycles. Returns the cycles taken and the address of the last instruction */
+void dsp56k_free_jit(dsp_core_t* dsp);
 uint16_t dsp56k_execute_one_disasm_instruction(dsp_core_t* dsp, FILE *out, uint32_t pc);	/* Execute 1 instruction in disasm mode */
+void dsp56k_invalidate_opcode_cache(dsp_core_t* dsp);	/* PRAM changed behind the core's back */
 
 uint32_t dsp56k_read_memory(dsp_core_t* dsp, int space, uint32_t address);
 void dsp56k_write_memory(dsp_core_t* dsp, int space, uint32_t address, uint32_t value);
@@ -250,7 +250,7 @@ static void dsp_dma_run(DSPDMAState *s)
             case 0x3: {
                 unsigned int fifo_index = buf_id;
                 s->fifo_rw(s->rw_opaque,
-                    scratch_buf, fifo_index, transfer_size, 1);
+                    scratch_buf, fifo_index, item_size, transfer_size, 1);
                 break;
             }
             case 0xE:
@@ -0,0 +1,673 @@
+/*
+ * DSP56300 basic block translator
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Runs of PRAM are translated to x86-64 code that calls the same emu
+ * functions as the interpreter, one after the other. What goes is the
+ * per instruction fetch, decode, PC update, interrupt check and the
+ * dsp_run loop around them. The instructions and their decoding are
+ * fixed when translating; the 56 bit arithmetic and parallel moves stay
+ * exactly the interpreter's.
+ *
+ * A block only holds instructions which carry on to the next one and
+ * can't touch what the interpreter checks between instructions: no flow
+ * control, no REP or DO, nothing writing SR, OMR, the stack, LA or LC.
+ * One of those ends the block as its last instruction. After the last
+ * instruction, dsp_postexecute_update_pc and dsp_postexecute_interrupts
+ * run as usual, so branches, loop ends and interrupts are all handled
+ * by the interpreter's code. A block is only entered outside REP and
+ * interrupt processing, and with no interrupt pending, and not when the
+ * current DO loop ends inside it but before its last instruction; the
+ * address is then remembered as a block end for next time. A block that
+ * is a whole DO loop body goes round the loop itself, for as long as
+ * nothing else would happen at its end. It returns early when the cycle
+ * budget runs out, or after an instruction that raised an interrupt or
+ * wrote translated PRAM.
+ *
+ * Translations are dropped all at once when PRAM they came from is
+ * written, or when the code buffer is full.
+ */
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define DSP_JIT_HOST 1
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#else
+#define DSP_JIT_HOST 0
+#endif
+
+static OpcodeEntry lookup_opcode(uint32_t op);
+static uint16_t disasm_instruction(dsp_core_t* dsp, dsp_trace_disasm_t mode);
+
+#define DSP_JIT_BUFFER_SIZE (1024 * 1024)
+#define DSP_JIT_MAX_INSTRUCTIONS 64
+/* Generous, an instruction takes at most 112 bytes with its exit, the
+ * prologue and a loop back less than 128 */
+#define DSP_JIT_MAX_BLOCK_SIZE (128 + DSP_JIT_MAX_INSTRUCTIONS * 128)
+
+typedef int (*dsp_jit_code_t)(dsp_core_t* dsp, int cycles, uint32_t *last_pc);
+
+typedef struct dsp_jit_block_s {
+    dsp_jit_code_t code;
+    /* Address of the last instruction */
+    uint32_t last_pc;
+} dsp_jit_block_t;
+
+struct dsp_jit_s {
+    uint8_t *buffer;
+    size_t used;
+
+    /* Drop all translations before running any */
+    bool flush;
+
+    /* Indexed by the address of the first instruction */
+    dsp_jit_block_t blocks[DSP_PRAM_SIZE];
+
+    /* PRAM words some block was translated from */
+    bool translated[DSP_PRAM_SIZE];
+
+    /* Last instructions of DO loops, blocks end there */
+    bool loop_end[DSP_PRAM_SIZE];
+};
+
+/* An instruction at address was written */
+static void dsp_jit_write_p(dsp_core_t* dsp, uint32_t address)
+{
+    if (dsp->jit && dsp->jit->translated[address]) {
+        dsp->jit->flush = true;
+        dsp->jit_exit = true;
+    }
+}
+
+#if DSP_JIT_HOST
+
+static void dsp_jit_flush(dsp_jit_t *jit)
+{
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->translated, 0, sizeof(jit->translated));
+    jit->used = 0;
+    jit->flush = false;
+}
+
+/**********************************
+ *  x86-64 code emitter
+ **********************************/
+
+#ifdef _WIN64
+/* mov rbx, rcx; mov r12d, edx; mov r13, r8 */
+static const uint8_t jit_load_args[] = {
+    0x48, 0x89, 0xcb, 0x41, 0x89, 0xd4, 0x4d, 0x89, 0xc5
+};
+/* mov rcx, rbx */
+static const uint8_t jit_arg_dsp[] = { 0x48, 0x89, 0xd9 };
+/* mov edx, imm32; mov r8d, imm32 */
+static const uint8_t jit_arg1_imm[] = { 0xba };
+static const uint8_t jit_arg2_imm[] = { 0x41, 0xb8 };
+#else
+/* mov rbx, rdi; mov r12d, esi; mov r13, rdx */
+static const uint8_t jit_load_args[] = {
+    0x48, 0x89, 0xfb, 0x41, 0x89, 0xf4, 0x49, 0x89, 0xd5
+};
+/* mov rdi, rbx */
+static const uint8_t jit_arg_dsp[] = { 0x48, 0x89, 0xdf };
+/* mov esi, imm32; mov edx, imm32 */
+static const uint8_t jit_arg1_imm[] = { 0xbe };
+static const uint8_t jit_arg2_imm[] = { 0xba };
+#endif
+
+/* push rbx; push r12; push r13; sub rsp, 32 */
+static const uint8_t jit_prologue[] = {
+    0x53, 0x41, 0x54, 0x41, 0x55, 0x48, 0x83, 0xec, 0x20
+};
+
+/* mov eax, r12d; add rsp, 32; pop r13; pop r12; pop rbx; ret */
+static const uint8_t jit_epilogue[] = {
+    0x44, 0x89, 0xe0, 0x48, 0x83, 0xc4, 0x20, 0x41, 0x5d, 0x41, 0x5c, 0x5b,
+    0xc3
+};
+
+static void jit_emit(uint8_t **p, const uint8_t *bytes, size_t len)
+{
+    memcpy(*p, bytes, len);
+    *p += len;
+}
+
+static void jit_emit8(uint8_t **p, uint8_t v)
+{
+    *(*p)++ = v;
+}
+
+static void jit_emit16(uint8_t **p, uint16_t v)
+{
+    memcpy(*p, &v, 2);
+    *p += 2;
+}
+
+static void jit_emit32(uint8_t **p, uint32_t v)
+{
+    memcpy(*p, &v, 4);
+    *p += 4;
+}
+
+static void jit_emit64(uint8_t **p, uint64_t v)
+{
+    memcpy(*p, &v, 8);
+    *p += 8;
+}
+
+/* mov dword [rbx + offset], v */
+static void jit_store32(uint8_t **p, size_t offset, uint32_t v)
+{
+    jit_emit8(p, 0xc7);
+    jit_emit8(p, 0x83);
+    jit_emit32(p, offset);
+    jit_emit32(p, v);
+}
+
+/* mov word [rbx + offset], v */
+static void jit_store16(uint8_t **p, size_t offset, uint16_t v)
+{
+    jit_emit8(p, 0x66);
+    jit_emit8(p, 0xc7);
+    jit_emit8(p, 0x83);
+    jit_emit32(p, offset);
+    jit_emit16(p, v);
+}
+
+/* jcc rel32 to be patched, returns where the offset goes */
+static uint8_t *jit_jcc(uint8_t **p, uint8_t cc)
+{
+    uint8_t *rel;
+
+    jit_emit8(p, 0x0f);
+    jit_emit8(p, 0x80 | cc);
+    rel = *p;
+    jit_emit32(p, 0);
+    return rel;
+}
+
+static void jit_patch(uint8_t *rel, const uint8_t *target)
+{
+    uint32_t v = target - (rel + 4);
+    memcpy(rel, &v, 4);
+}
+
+/* mov rax, func; call rax */
+static void jit_call(uint8_t **p, const void *func)
+{
+    jit_emit8(p, 0x48);
+    jit_emit8(p, 0xb8);
+    jit_emit64(p, (uintptr_t)func);
+    jit_emit8(p, 0xff);
+    jit_emit8(p, 0xd0);
+}
+
+/* jmp rel32 to be patched, returns where the offset goes */
+static uint8_t *jit_jmp(uint8_t **p)
+{
+    uint8_t *rel;
+
+    jit_emit8(p, 0xe9);
+    rel = *p;
+    jit_emit32(p, 0);
+    return rel;
+}
+
+#define JIT_CC_E  0x4
+#define JIT_CC_NE 0x5
+#define JIT_CC_LE 0xe
+
+/* The buffer is never writable and executable at once: it's made
+ * writable to translate and executable again before anything runs */
+static uint8_t *dsp_jit_alloc_buffer(void)
+{
+    void *buffer;
+#ifdef _WIN32
+    buffer = VirtualAlloc(NULL, DSP_JIT_BUFFER_SIZE, MEM_RESERVE | MEM_COMMIT,
+                          PAGE_EXECUTE_READ);
+#else
+    buffer = mmap(NULL, DSP_JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        buffer = NULL;
+    }
+#endif
+    return buffer;
+}
+
+static bool dsp_jit_protect_buffer(uint8_t *buffer, bool writable)
+{
+#ifdef _WIN32
+    DWORD old;
+    if (!VirtualProtect(buffer, DSP_JIT_BUFFER_SIZE,
+                        writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old)) {
+        return false;
+    }
+    if (!writable) {
+        FlushInstructionCache(GetCurrentProcess(), buffer,
+                              DSP_JIT_BUFFER_SIZE);
+    }
+    return true;
+#else
+    return mprotect(buffer, DSP_JIT_BUFFER_SIZE,
+                    writable ? PROT_READ | PROT_WRITE
+                             : PROT_READ | PROT_EXEC) == 0;
+#endif
+}
+
+static void dsp_jit_free_buffer(uint8_t *buffer)
+{
+#ifdef _WIN32
+    VirtualFree(buffer, 0, MEM_RELEASE);
+#else
+    munmap(buffer, DSP_JIT_BUFFER_SIZE);
+#endif
+}
+
+/**********************************
+ *  Translation
+ **********************************/
+
+/* Whether the instruction always goes on to the next one, and leaves the
+ * registers checked between instructions alone */
+static bool dsp_jit_is_sequential(emu_func_t emu_func, uint32_t inst)
+{
+    /* 6 bit register fields, from SR up are the control registers */
+    uint32_t reg_lo = inst & BITMASK(6);
+    uint32_t reg_hi = (inst >> 8) & BITMASK(6);
+
+    if (inst >= 0x100000) {
+        /* Parallel move fields don't reach the control registers */
+        return true;
+    }
+
+    if (emu_func == emu_bchg_reg || emu_func == emu_bclr_reg
+        || emu_func == emu_bset_reg || emu_func == emu_btst_reg
+        || emu_func == emu_movep_0) {
+        return reg_hi < DSP_REG_SR;
+    }
+    if (emu_func == emu_move_x_long || emu_func == emu_movec_imm
+        || emu_func == emu_movec_ea || emu_func == emu_movec_aa) {
+        return reg_lo < DSP_REG_SR;
+    }
+    if (emu_func == emu_movec_reg) {
+        return reg_lo < DSP_REG_SR && reg_hi < DSP_REG_SR;
+    }
+
+    return emu_func == emu_add_imm || emu_func == emu_add_long
+        || emu_func == emu_and_imm || emu_func == emu_and_long
+        || emu_func == emu_asl_imm || emu_func == emu_asr_imm
+        || emu_func == emu_bchg_ea || emu_func == emu_bchg_aa
+        || emu_func == emu_bchg_pp || emu_func == emu_bclr_ea
+        || emu_func == emu_bclr_aa || emu_func == emu_bclr_pp
+        || emu_func == emu_bset_ea || emu_func == emu_bset_aa
+        || emu_func == emu_bset_pp || emu_func == emu_btst_ea
+        || emu_func == emu_btst_aa || emu_func == emu_btst_pp
+        || emu_func == emu_cmp_imm || emu_func == emu_cmp_long
+        || emu_func == emu_cmpu || emu_func == emu_dec
+        || emu_func == emu_div || emu_func == emu_inc
+        || emu_func == emu_lua || emu_func == emu_lua_rel
+        || emu_func == emu_move_x_imm || emu_func == emu_move_y_imm
+        || emu_func == emu_movep_23 || emu_func == emu_movep_x_qq
+        || emu_func == emu_mpyi || emu_func == emu_nop
+        || emu_func == emu_norm || emu_func == emu_or_long
+        || emu_func == emu_sub_imm || emu_func == emu_sub_long
+        || emu_func == emu_tcc;
+}
+
+/*
+ * Called after the last instruction of a block which ends a DO loop
+ * starting at the block's first instruction. When the loop goes round
+ * again and nothing else needs checking, does what
+ * dsp_postexecute_update_pc would and returns 1 for the block to run
+ * again. Otherwise returns 0 and leaves it all to the interpreter's code.
+ */
+static int dsp_jit_loop_back(dsp_core_t* dsp, uint32_t start, uint32_t end)
+{
+    uint32_t lc;
+
+    if (dsp->jit_exit || dsp->jit->flush
+        || dsp->pc + dsp->cur_inst_len != end
+        || dsp->loop_rep
+        || (dsp->registers[DSP_REG_SR] & ((1<<DSP_SR_LF)|(1<<DSP_SR_T)))
+            != (1<<DSP_SR_LF)
+        || dsp->registers[DSP_REG_LA] + 1 != end
+        || dsp->registers[DSP_REG_SSH] != start
+        || dsp->interrupt_state != DSP_INTERRUPT_NONE
+        || dsp->interrupt_counter) {
+        return 0;
+    }
+
+    lc = (dsp->registers[DSP_REG_LC] - 1) & BITMASK(16);
+    if (lc == 0) {
+        return 0;
+    }
+    dsp->registers[DSP_REG_LC] = lc;
+    dsp->pc = start;
+    return 1;
+}
+
+static uint32_t dsp_jit_instruction_length(dsp_core_t* dsp, uint32_t address)
+{
+    uint32_t pc = dsp->pc;
+    uint32_t len;
+
+    dsp->pc = address;
+    len = disasm_instruction(dsp, DSP_DISASM_MODE);
+    dsp->pc = pc;
+    return len;
+}
+
+/*
+ * Each instruction is
+ *
+ *     mov dword [rbx + pc], address
+ *     mov dword [rbx + cur_inst], instruction
+ *     mov dword [rbx + cur_inst_len], 1
+ *     mov word [rbx + instr_cycle], 2
+ *     mov rdi, rbx
+ *     mov rax, emu_func
+ *     call rax
+ *     movzx eax, word [rbx + instr_cycle]
+ *     sub r12d, eax
+ *
+ * followed, but for the last one, by a branch to its exit if it didn't
+ * have the length expected, if jit_exit got set or if the cycles ran out.
+ * The exit stores the address of the instruction for dsp_run's idle check
+ * and returns the cycles left. When the block is the body of a DO loop,
+ * the last one is followed by
+ *
+ *     test r12d, r12d
+ *     jle exit
+ *     mov rdi, rbx
+ *     mov esi, start
+ *     mov edx, end
+ *     mov rax, dsp_jit_loop_back
+ *     call rax
+ *     test eax, eax
+ *     jz exit
+ *     jmp first instruction
+ */
+static dsp_jit_block_t *dsp_jit_emit_block(dsp_core_t* dsp, uint32_t start)
+{
+    dsp_jit_t *jit = dsp->jit;
+    uint32_t addresses[DSP_JIT_MAX_INSTRUCTIONS];
+    uint8_t *exits[DSP_JIT_MAX_INSTRUCTIONS][3];
+    uint8_t *loop_exits[2] = { NULL, NULL };
+    uint32_t address = start;
+    uint8_t *code, *p, *top, *done = NULL;
+    int count = 0;
+    int i, j;
+
+    if (jit->used + DSP_JIT_MAX_BLOCK_SIZE > DSP_JIT_BUFFER_SIZE) {
+        dsp_jit_flush(jit);
+    }
+    code = p = jit->buffer + jit->used;
+
+    jit_emit(&p, jit_prologue, sizeof(jit_prologue));
+    jit_emit(&p, jit_load_args, sizeof(jit_load_args));
+    top = p;
+
+    while (count < DSP_JIT_MAX_INSTRUCTIONS) {
+        uint32_t inst, len;
+        emu_func_t emu_func;
+        bool last;
+
+        /* Leave the last word to the interpreter, it can't be followed
+         * by an extension word */
+        if (address >= DSP_PRAM_SIZE - 1) {
+            break;
+        }
+
+        inst = read_memory_p(dsp, address);
+        if (inst >= 0x100000) {
+            emu_func = opcodes_parmove[(inst >> 20) & BITMASK(4)];
+        } else {
+            emu_func = lookup_opcode(inst).emu_func;
+            if (emu_func == NULL) {
+                break;
+            }
+        }
+        len = dsp_jit_instruction_length(dsp, address);
+        if (address + len > DSP_PRAM_SIZE) {
+            break;
+        }
+
+        last = !dsp_jit_is_sequential(emu_func, inst)
+            || jit->loop_end[address + len - 1]
+            || count == DSP_JIT_MAX_INSTRUCTIONS - 1;
+
+        jit_store32(&p, offsetof(dsp_core_t, pc), address);
+        jit_store32(&p, offsetof(dsp_core_t, cur_inst), inst);
+        jit_store32(&p, offsetof(dsp_core_t, cur_inst_len), 1);
+        jit_store16(&p, offsetof(dsp_core_t, instr_cycle), 2);
+        jit_emit(&p, jit_arg_dsp, sizeof(jit_arg_dsp));
+        jit_call(&p, emu_func);
+        /* movzx eax, word [rbx + instr_cycle] */
+        jit_emit8(&p, 0x0f);
+        jit_emit8(&p, 0xb7);
+        jit_emit8(&p, 0x83);
+        jit_emit32(&p, offsetof(dsp_core_t, instr_cycle));
+        /* sub r12d, eax */
+        jit_emit8(&p, 0x41);
+        jit_emit8(&p, 0x29);
+        jit_emit8(&p, 0xc4);
+
+        memset(exits[count], 0, sizeof(exits[count]));
+        if (!last) {
+            /* cmp dword [rbx + cur_inst_len], len */
+            jit_emit8(&p, 0x83);
+            jit_emit8(&p, 0xbb);
+            jit_emit32(&p, offsetof(dsp_core_t, cur_inst_len));
+            jit_emit8(&p, len);
+            exits[count][0] = jit_jcc(&p, JIT_CC_NE);
+            /* cmp byte [rbx + jit_exit], 0 */
+            jit_emit8(&p, 0x80);
+            jit_emit8(&p, 0xbb);
+            jit_emit32(&p, offsetof(dsp_core_t, jit_exit));
+            jit_emit8(&p, 0);
+            exits[count][1] = jit_jcc(&p, JIT_CC_NE);
+            /* test r12d, r12d */
+            jit_emit8(&p, 0x45);
+            jit_emit8(&p, 0x85);
+            jit_emit8(&p, 0xe4);
+            exits[count][2] = jit_jcc(&p, JIT_CC_LE);
+        } else if (jit->loop_end[address + len - 1]
+                   && dsp_jit_is_sequential(emu_func, inst)) {
+            /* test r12d, r12d */
+            jit_emit8(&p, 0x45);
+            jit_emit8(&p, 0x85);
+            jit_emit8(&p, 0xe4);
+            loop_exits[0] = jit_jcc(&p, JIT_CC_LE);
+            jit_emit(&p, jit_arg_dsp, sizeof(jit_arg_dsp));
+            jit_emit(&p, jit_arg1_imm, sizeof(jit_arg1_imm));
+            jit_emit32(&p, start);
+            jit_emit(&p, jit_arg2_imm, sizeof(jit_arg2_imm));
+            jit_emit32(&p, address + len);
+            jit_call(&p, dsp_jit_loop_back);
+            /* test eax, eax */
+            jit_emit8(&p, 0x85);
+            jit_emit8(&p, 0xc0);
+            loop_exits[1] = jit_jcc(&p, JIT_CC_E);
+            jit_patch(jit_jmp(&p), top);
+        }
+
+        addresses[count++] = address;
+        address += len;
+        if (last) {
+            break;
+        }
+    }
+
+    if (count == 0) {
+        return NULL;
+    }
+
+    /* The last instruction falls through to its exit */
+    for (i = count - 1; i >= 0; i--) {
+        uint8_t *stub = p;
+        for (j = 0; j < 3; j++) {
+            if (exits[i][j]) {
+                jit_patch(exits[i][j], stub);
+            }
+        }
+        if (i == count - 1) {
+            for (j = 0; j < 2; j++) {
+                if (loop_exits[j]) {
+                    jit_patch(loop_exits[j], stub);
+                }
+            }
+        }
+        /* mov dword [r13], address */
+        jit_emit8(&p, 0x41);
+        jit_emit8(&p, 0xc7);
+        jit_emit8(&p, 0x45);
+        jit_emit8(&p, 0x00);
+        jit_emit32(&p, addresses[i]);
+        if (i == count - 1) {
+            done = p;
+            jit_emit(&p, jit_epilogue, sizeof(jit_epilogue));
+        } else {
+            /* jmp done */
+            jit_patch(jit_jmp(&p), done);
+        }
+    }
+
+    assert(p - code <= DSP_JIT_MAX_BLOCK_SIZE);
+    jit->used += p - code;
+
+    for (i = start; i < address; i++) {
+        jit->translated[i] = true;
+    }
+
+    jit->blocks[start].code = (dsp_jit_code_t)code;
+    jit->blocks[start].last_pc = addresses[count - 1];
+    return &jit->blocks[start];
+}
+
+static dsp_jit_block_t *dsp_jit_translate(dsp_core_t* dsp, uint32_t start)
+{
+    dsp_jit_block_t *block;
+
+    if (!dsp_jit_protect_buffer(dsp->jit->buffer, true)) {
+        fprintf(stderr, "dsp: can't write the translation buffer, "
+                        "interpreting\n");
+        dsp->jit_disabled = true;
+        return NULL;
+    }
+    block = dsp_jit_emit_block(dsp, start);
+    if (!dsp_jit_protect_buffer(dsp->jit->buffer, false)) {
+        fprintf(stderr, "dsp: can't run the translation buffer, "
+                        "interpreting\n");
+        dsp->jit_disabled = true;
+        return NULL;
+    }
+    return block;
+}
+
+static dsp_jit_t *dsp_jit_new(void)
+{
+    dsp_jit_t *jit = calloc(1, sizeof(dsp_jit_t));
+    if (jit == NULL) {
+        return NULL;
+    }
+    jit->buffer = dsp_jit_alloc_buffer();
+    if (jit->buffer == NULL) {
+        free(jit);
+        return NULL;
+    }
+    return jit;
+}
+
+void dsp56k_free_jit(dsp_core_t* dsp)
+{
+    if (dsp->jit) {
+        dsp_jit_free_buffer(dsp->jit->buffer);
+        free(dsp->jit);
+        dsp->jit = NULL;
+    }
+}
+
+/* The block to run at PC, or NULL to interpret one instruction */
+static const dsp_jit_block_t *dsp_jit_lookup(dsp_core_t* dsp)
+{
+    dsp_jit_t *jit;
+    dsp_jit_block_t *block;
+
+    if (dsp->jit_disabled || TRACE_DSP_DISASM
+        || dsp->loop_rep
+        || dsp->interrupt_state != DSP_INTERRUPT_NONE
+        || dsp->interrupt_counter
+        || (dsp->registers[DSP_REG_SR] & (1<<DSP_SR_T))
+        || dsp->pc >= DSP_PRAM_SIZE) {
+        return NULL;
+    }
+
+    if (dsp->jit == NULL) {
+        dsp->jit = dsp_jit_new();
+        if (dsp->jit == NULL) {
+            dsp->jit_disabled = true;
+            return NULL;
+        }
+    }
+    jit = dsp->jit;
+
+    if (jit->flush) {
+        dsp_jit_flush(jit);
+    }
+
+    block = &jit->blocks[dsp->pc];
+    if (block->code == NULL && dsp_jit_translate(dsp, dsp->pc) == NULL) {
+        return NULL;
+    }
+
+    if (dsp->registers[DSP_REG_SR] & (1<<DSP_SR_LF)) {
+        uint32_t la = dsp->registers[DSP_REG_LA];
+        if (la >= dsp->pc && la < block->last_pc) {
+            if (jit->loop_end[la]) {
+                /* LA isn't the end of an instruction in the block */
+                return NULL;
+            }
+            /* The loop ends inside, split there from now on */
+            jit->loop_end[la] = true;
+            dsp_jit_flush(jit);
+            if (dsp_jit_translate(dsp, dsp->pc) == NULL
+                || (la >= dsp->pc && la < block->last_pc)) {
+                return NULL;
+            }
+        }
+    }
+
+    return block;
+}
+
+#else
+
+void dsp56k_free_jit(dsp_core_t* dsp)
+{
+}
+
+static const dsp_jit_block_t *dsp_jit_lookup(dsp_core_t* dsp)
+{
+    return NULL;
+}
+
+#endif
@@ -19,16 +19,38 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
 #include "hw/hw.h"
 #include "hw/i386/pc.h"
 #include "hw/pci/pci.h"
 #include "cpu.h"
+#include "monitor/monitor.h"
+#include "monitor/hmp-target.h"
+#include "sysemu/sysemu.h"
 #include "hw/xbox/dsp/dsp.h"
+#include "hw/xbox/mcpx_vp_mix.h"
+#include "audio/audio.h"
+#include "qapi/error.h"
 #include <math.h>
 
 #define NUM_SAMPLES_PER_FRAME 32
 #define NUM_MIXBINS 32
 
+/* The GP and EP run at 160MHz, frames are 32 samples at 48kHz */
+#define DSP_CYCLES_PER_FRAME (160000000 / 48000 * NUM_SAMPLES_PER_FRAME)
+#define SE_FRAME_NS (NANOSECONDS_PER_SECOND / 48000 * NUM_SAMPLES_PER_FRAME)
+
+/* Further behind than this, frames are dropped rather than caught up */
+#define SE_MAX_FRAMES_BEHIND 16
+
+/* Frame latency histogram, the first bucket is under 16us and each
+ * following one twice as wide, the last one takes the rest */
+#define SE_LATENCY_BUCKETS 12
+#define SE_LATENCY_FIRST_US 16
+
 #include "hw/xbox/mcpx_apu.h"
 
 #define NV_PAPU_ISTS                                     0x00001000
@@ -58,6 +80,7 @@
 #       define NV_PAPU_SECTL_XCNTMODE_OFF                       0
 #define NV_PAPU_XGSCNT                                   0x0000200C
 #define NV_PAPU_VPVADDR                                  0x0000202C
+#define NV_PAPU_VPSGEADDR                                0x00002030
 #define NV_PAPU_GPSADDR                                  0x00002040
 #define NV_PAPU_GPFADDR                                  0x00002044
 #define NV_PAPU_EPSADDR                                  0x00002048
@@ -146,21 +169,111 @@ static const struct {
 #   define NV1BA0_PIO_VOICE_ON_HANDLE                       0x0000FFFF
 #define NV1BA0_PIO_VOICE_OFF                             0x00000128
 #   define NV1BA0_PIO_VOICE_OFF_HANDLE                      0x0000FFFF
+#define NV1BA0_PIO_VOICE_RELEASE                         0x0000012C
+#   define NV1BA0_PIO_VOICE_RELEASE_HANDLE                  0x0000FFFF
 #define NV1BA0_PIO_VOICE_PAUSE                           0x00000140
 #   define NV1BA0_PIO_VOICE_PAUSE_HANDLE                    0x0000FFFF
 #   define NV1BA0_PIO_VOICE_PAUSE_ACTION                    (1 << 18)
 #define NV1BA0_PIO_SET_CURRENT_VOICE                     0x000002F8
+#   define NV1BA0_PIO_SET_CURRENT_VOICE_HANDLE              0x0000FFFF
+/* these are at the same offset into the voice structure, plus 0x300 */
+#define NV1BA0_PIO_SET_VOICE_CFG_VBIN                    0x00000300
+#define NV1BA0_PIO_SET_VOICE_CFG_FMT                     0x00000304
+#define NV1BA0_PIO_SET_VOICE_CFG_ENV0                    0x00000308
+#define NV1BA0_PIO_SET_VOICE_CFG_ENVA                    0x0000030C
+#define NV1BA0_PIO_SET_VOICE_CFG_MISC                    0x00000318
+#define NV1BA0_PIO_SET_VOICE_TAR_VOLA                    0x00000360
+#define NV1BA0_PIO_SET_VOICE_TAR_VOLB                    0x00000364
+#define NV1BA0_PIO_SET_VOICE_TAR_VOLC                    0x00000368
+#define NV1BA0_PIO_SET_VOICE_LFO_ENV                     0x0000036C
+#define NV1BA0_PIO_SET_VOICE_TAR_PITCH                   0x0000037C
+#   define NV1BA0_PIO_SET_VOICE_TAR_PITCH_STEP              0xFFFF0000
+#define NV1BA0_PIO_SET_VOICE_BUF_BASE                    0x000003A0
+#   define NV1BA0_PIO_SET_VOICE_BUF_BASE_OFFSET             0x00FFFFFF
+#define NV1BA0_PIO_SET_VOICE_BUF_LBO                     0x000003A4
+#   define NV1BA0_PIO_SET_VOICE_BUF_LBO_OFFSET              0x00FFFFFF
+#define NV1BA0_PIO_SET_VOICE_BUF_EBO                     0x000003D8
+#   define NV1BA0_PIO_SET_VOICE_BUF_EBO_OFFSET              0x00FFFFFF
+#define NV1BA0_PIO_SET_VOICE_BUF_CBO                     0x000003DC
+#   define NV1BA0_PIO_SET_VOICE_BUF_CBO_OFFSET              0x00FFFFFF
 
 #define SE2FE_IDLE_VOICE                                 0x00008000
 
 
 /* voice structure */
 #define NV_PAVS_SIZE                                     0x00000080
+#define NV_PAVS_VOICE_CFG_VBIN                           0x00000000
+#   define NV_PAVS_VOICE_CFG_VBIN_V0BIN                     (0x1F << 0)
+#   define NV_PAVS_VOICE_CFG_VBIN_V1BIN                     (0x1F << 5)
+#   define NV_PAVS_VOICE_CFG_VBIN_V2BIN                     (0x1F << 10)
+#   define NV_PAVS_VOICE_CFG_VBIN_V3BIN                     (0x1F << 16)
+#   define NV_PAVS_VOICE_CFG_VBIN_V4BIN                     (0x1F << 21)
+#   define NV_PAVS_VOICE_CFG_VBIN_V5BIN                     (0x1F << 26)
+#define NV_PAVS_VOICE_CFG_FMT                            0x00000004
+#   define NV_PAVS_VOICE_CFG_FMT_V6BIN                      (0x1F << 0)
+#   define NV_PAVS_VOICE_CFG_FMT_V7BIN                      (0x1F << 5)
+#   define NV_PAVS_VOICE_CFG_FMT_DATA_TYPE                  (1 << 24)
+#   define NV_PAVS_VOICE_CFG_FMT_LOOP                       (1 << 25)
+#   define NV_PAVS_VOICE_CFG_FMT_STEREO                     (1 << 27)
+#   define NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE                (0x3 << 28)
+#       define NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_U8             0
+#       define NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_S16            1
+#       define NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_S24            2
+#       define NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_S32            3
+#   define NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE             (0x3 << 30)
+#       define NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE_B8          0
+#       define NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE_B16         1
+#       define NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE_ADPCM       2
+#       define NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE_B32         3
+#define NV_PAVS_VOICE_CFG_ENV0                           0x00000008
+#   define NV_PAVS_VOICE_CFG_ENV0_EA_ATTACKRATE             (0xFFF << 0)
+#   define NV_PAVS_VOICE_CFG_ENV0_EA_DELAYTIME              (0xFFF << 12)
+#define NV_PAVS_VOICE_CFG_ENVA                           0x0000000C
+#   define NV_PAVS_VOICE_CFG_ENVA_EA_DECAYRATE              (0xFFF << 0)
+#   define NV_PAVS_VOICE_CFG_ENVA_EA_HOLDTIME               (0xFFF << 12)
+#   define NV_PAVS_VOICE_CFG_ENVA_EA_SUSTAINLEVEL           (0xFF << 24)
+#define NV_PAVS_VOICE_CUR_PSL_START                      0x00000020
+#   define NV_PAVS_VOICE_CUR_PSL_START_BA                   0x00FFFFFF
+#define NV_PAVS_VOICE_CUR_PSH_SAMPLE                     0x00000024
+#   define NV_PAVS_VOICE_CUR_PSH_SAMPLE_LBO                 0x00FFFFFF
+/* Each VOL register has two 12 bit volumes and a nibble of volumes 6 and 7 */
+#define NV_PAVS_VOICE_CUR_VOLA                           0x00000030
+#   define NV_PAVS_VOICE_CUR_VOLA_VOLUME6_B3_0              0x0000000F
+#   define NV_PAVS_VOICE_CUR_VOLA_VOLUME0                   0x0000FFF0
+#   define NV_PAVS_VOICE_CUR_VOLA_VOLUME7_B3_0              0x000F0000
+#   define NV_PAVS_VOICE_CUR_VOLA_VOLUME1                   0xFFF00000
+#define NV_PAVS_VOICE_CUR_VOLB                           0x00000034
+#define NV_PAVS_VOICE_CUR_VOLC                           0x00000038
+#define NV_PAVS_VOICE_CUR_ECNT                           0x0000003C
+#   define NV_PAVS_VOICE_CUR_ECNT_EACOUNT                   0x0000FFFF
 #define NV_PAVS_VOICE_PAR_STATE                          0x00000054
 #   define NV_PAVS_VOICE_PAR_STATE_PAUSED                   (1 << 18)
 #   define NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE             (1 << 21)
+#   define NV_PAVS_VOICE_PAR_STATE_EACUR                    (0xF << 28)
+#       define NV_PAVS_VOICE_PAR_STATE_EACUR_OFF                0
+#       define NV_PAVS_VOICE_PAR_STATE_EACUR_DELAY              1
+#       define NV_PAVS_VOICE_PAR_STATE_EACUR_ATTACK             2
+#       define NV_PAVS_VOICE_PAR_STATE_EACUR_HOLD               3
+#       define NV_PAVS_VOICE_PAR_STATE_EACUR_DECAY              4
+#       define NV_PAVS_VOICE_PAR_STATE_EACUR_SUSTAIN            5
+#       define NV_PAVS_VOICE_PAR_STATE_EACUR_RELEASE            6
+#       define NV_PAVS_VOICE_PAR_STATE_EACUR_FORCE_RELEASE      7
+#define NV_PAVS_VOICE_PAR_OFFSET                         0x00000058
+#   define NV_PAVS_VOICE_PAR_OFFSET_CBO                     0x00FFFFFF
+#   define NV_PAVS_VOICE_PAR_OFFSET_EALVL                   0xFF000000
+#define NV_PAVS_VOICE_PAR_NEXT                           0x0000005C
+#   define NV_PAVS_VOICE_PAR_NEXT_EBO                       0x00FFFFFF
+#define NV_PAVS_VOICE_TAR_VOLA                           0x00000060
+#define NV_PAVS_VOICE_TAR_VOLB                           0x00000064
+#define NV_PAVS_VOICE_TAR_VOLC                           0x00000068
+#define NV_PAVS_VOICE_TAR_LFO_ENV                        0x0000006C
+#   define NV_PAVS_VOICE_TAR_LFO_ENV_EA_RELEASERATE         (0xFFF << 0)
 #define NV_PAVS_VOICE_TAR_PITCH_LINK                     0x0000007c
 #   define NV_PAVS_VOICE_TAR_PITCH_LINK_NEXT_VOICE_HANDLE   0x0000FFFF
+#   define NV_PAVS_VOICE_TAR_PITCH_LINK_PITCH               0xFFFF0000
+
+/* Envelope times and rates count blocks of this many samples */
+#define VP_ENVELOPE_STEP 16
 
 
 #define GP_DSP_MIXBUF_BASE 0x001400
@@ -191,6 +304,57 @@ static const struct {
 /* More debug functionality */
 #define GENERATE_MIXBIN_BEEP      0
 
+/* must be a power of two */
+#define APU_COMMAND_RING_SIZE 1024
+
+/* Stereo 16 bit frames at 48kHz, must be a power of two */
+#define APU_AUDIO_RING_FRAMES 16384
+
+/* How full the audio ring gets before playback (re)starts, doubled on
+ * every underrun and brought down by an eighth after this many frames
+ * without one. The frame thread drops output past twice the target. */
+#define APU_AUDIO_TARGET_MIN 256
+#define APU_AUDIO_TARGET_START 1024
+#define APU_AUDIO_TARGET_MAX (APU_AUDIO_RING_FRAMES / 4)
+#define APU_AUDIO_SHRINK_FRAMES (48000 * 5)
+
+enum APUBlock {
+    APU_BLOCK_APU,
+    APU_BLOCK_VP,
+    APU_BLOCK_GP,
+    APU_BLOCK_EP,
+};
+
+typedef struct APUCommand {
+    uint32_t block;
+    uint32_t addr;
+    uint32_t val;
+} APUCommand;
+
+/*
+ * MMIO writes on their way to the frame thread. There is a single producer,
+ * as MMIO runs under the iothread lock, and a single consumer at a time,
+ * whoever holds the APU lock. The head and tail counters run freely and
+ * are masked on access.
+ */
+typedef struct APUCommandRing {
+    APUCommand entries[APU_COMMAND_RING_SIZE];
+    unsigned int head;      /* written by the producer */
+    unsigned int tail;      /* written by the consumer */
+} APUCommandRing;
+
+/*
+ * EP output on its way to the host audio backend. The frame thread
+ * produces and the audio callback on the main loop consumes, neither ever
+ * waits for the other. Counted in stereo frames like the command ring.
+ */
+typedef struct APUAudioRing {
+    int16_t frames[APU_AUDIO_RING_FRAMES][2];
+    unsigned int head;      /* written by the frame thread */
+    unsigned int tail;      /* written by the audio callback */
+    unsigned int target;    /* written by the audio callback */
+} APUAudioRing;
+
 typedef struct MCPXAPUState {
     PCIDevice dev;
 
@@ -199,14 +363,51 @@ typedef struct MCPXAPUState {
 
     MemoryRegion mmio;
 
+    /*
+     * Frames run on their own thread, paced by QEMU_CLOCK_VIRTUAL. All
+     * device state below is owned by whoever holds the lock: the frame
+     * thread while it runs a frame, or an MMIO read catching up on queued
+     * writes. Frame boundaries are the sync points with guest time, every
+     * write queued before a frame is due is applied before it runs. Reads
+     * racing a frame go without the lock, see apu_lock_for_read.
+     */
+    QemuThread thread;
+    QemuMutex lock;
+    QemuSemaphore kick;
+    bool exiting;
+
+    APUCommandRing commands;
+    unsigned int command_ring_full;
+    unsigned int reads_during_frame;
+
+    /* interrupt state changed without the iothread lock, the frame thread
+     * passes it on after the frame */
+    bool irq_pending;
+
     /* Setup Engine */
     struct {
-        QEMUTimer *frame_timer;
+        bool running;
+        int64_t next_frame_ns;
+
+        uint64_t frames;
+        uint64_t frames_dropped;
+        uint64_t latency[SE_LATENCY_BUCKETS];
     } se;
 
     /* Voice Processor */
     struct {
         MemoryRegion mmio;
+
+        VPMixbins mix;
+
+        /* position between source samples, kept on the host */
+        float frac[0x10000];
+
+        /* scratch for a voice's frame */
+        VPVoiceScratch scratch;
+        float src[2][VP_MAX_SOURCE_SAMPLES];
+
+        uint64_t voices_mixed;
     } vp;
 
     /* Global Processor */
@@ -223,6 +424,24 @@ typedef struct MCPXAPUState {
         uint32_t regs[0x10000];
     } ep;
 
+    /* Host audio output, fed from the first EP output FIFO */
+    struct {
+        QEMUSoundCard card;
+        SWVoiceOut *voice;
+        APUAudioRing ring;
+
+        /* audio callback side */
+        bool playing;
+        unsigned int played;        /* frames since the target last moved */
+        uint64_t underruns;
+
+        /* frame thread side */
+        uint64_t overruns;          /* frames dropped */
+
+        char *capture_path;
+        CaptureState capture;
+    } audio;
+
     uint32_t regs[0x20000];
 
 } MCPXAPUState;
@@ -230,14 +449,18 @@ typedef struct MCPXAPUState {
 #define MCPX_APU_DEVICE(obj) \
     OBJECT_CHECK(MCPXAPUState, (obj), "mcpx-apu")
 
+static hwaddr voice_addr(MCPXAPUState *d, unsigned int voice_handle)
+{
+    assert(voice_handle < 0xFFFF);
+    return d->regs[NV_PAPU_VPVADDR] + voice_handle * NV_PAVS_SIZE;
+}
+
 static uint32_t voice_get_mask(MCPXAPUState *d,
                                unsigned int voice_handle,
                                hwaddr offset,
                                uint32_t mask)
 {
-    assert(voice_handle < 0xFFFF);
-    hwaddr voice = d->regs[NV_PAPU_VPVADDR]
-                    + voice_handle * NV_PAVS_SIZE;
+    hwaddr voice = voice_addr(d, voice_handle);
     return (ldl_le_phys(&address_space_memory, voice + offset) & mask)
               >> ctz32(mask);
 }
@@ -247,27 +470,41 @@ static void voice_set_mask(MCPXAPUState *d,
                            uint32_t mask,
                            uint32_t val)
 {
-    assert(voice_handle < 0xFFFF);
-    hwaddr voice = d->regs[NV_PAPU_VPVADDR]
-                    + voice_handle * NV_PAVS_SIZE;
+    hwaddr voice = voice_addr(d, voice_handle);
     uint32_t v = ldl_le_phys(&address_space_memory, voice + offset) & ~mask;
     stl_le_phys(&address_space_memory, voice + offset,
                 v | ((val << ctz32(mask)) & mask));
 }
 
+static void voice_copy(MCPXAPUState *d, unsigned int voice_handle,
+                       hwaddr to, hwaddr from)
+{
+    hwaddr voice = voice_addr(d, voice_handle);
+    stl_le_phys(&address_space_memory, voice + to,
+                ldl_le_phys(&address_space_memory, voice + from));
+}
+
 static void update_irq(MCPXAPUState *d)
 {
+    bool level;
+
     if ((d->regs[NV_PAPU_IEN] & NV_PAPU_ISTS_GINTSTS)
         && ((d->regs[NV_PAPU_ISTS] & ~NV_PAPU_ISTS_GINTSTS)
               & d->regs[NV_PAPU_IEN])) {
 
         d->regs[NV_PAPU_ISTS] |= NV_PAPU_ISTS_GINTSTS;
         MCPX_DPRINTF("mcpx irq raise\n");
-        pci_irq_assert(&d->dev);
+        level = true;
     } else {
         d->regs[NV_PAPU_ISTS] &= ~NV_PAPU_ISTS_GINTSTS;
         MCPX_DPRINTF("mcpx irq lower\n");
-        pci_irq_deassert(&d->dev);
+        level = false;
+    }
+
+    if (qemu_mutex_iothread_locked()) {
+        pci_set_irq(&d->dev, level);
+    } else {
+        d->irq_pending = true;
     }
 }
 
@@ -308,10 +545,11 @@ static void mcpx_apu_write(void *opaque, hwaddr addr,
     case NV_PAPU_SECTL:
         if (((val & NV_PAPU_SECTL_XCNTMODE) >> 3)
               == NV_PAPU_SECTL_XCNTMODE_OFF) {
-            timer_del(d->se.frame_timer);
-        } else {
-            timer_mod(d->se.frame_timer,
-                qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + 10);
+            d->se.running = false;
+        } else if (!d->se.running) {
+            d->se.running = true;
+            d->se.next_frame_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)
+                                      + SE_FRAME_NS;
         }
         d->regs[addr] = val;
         break;
@@ -330,9 +568,121 @@ static void mcpx_apu_write(void *opaque, hwaddr addr,
     }
 }
 
+static void vp_write(void *opaque, hwaddr addr,
+                     uint64_t val, unsigned int size);
+static void gp_write(void *opaque, hwaddr addr,
+                     uint64_t val, unsigned int size);
+static void ep_write(void *opaque, hwaddr addr,
+                     uint64_t val, unsigned int size);
+
+/* Applies the queued writes, with the lock held */
+static void apu_run_commands(MCPXAPUState *d)
+{
+    APUCommandRing *ring = &d->commands;
+    unsigned int tail = atomic_read(&ring->tail);
+
+    while (atomic_load_acquire(&ring->head) != tail) {
+        APUCommand *cmd = &ring->entries[tail & (APU_COMMAND_RING_SIZE - 1)];
+        switch (cmd->block) {
+        case APU_BLOCK_APU:
+            mcpx_apu_write(d, cmd->addr, cmd->val, 4);
+            break;
+        case APU_BLOCK_VP:
+            vp_write(d, cmd->addr, cmd->val, 4);
+            break;
+        case APU_BLOCK_GP:
+            gp_write(d, cmd->addr, cmd->val, 4);
+            break;
+        case APU_BLOCK_EP:
+            ep_write(d, cmd->addr, cmd->val, 4);
+            break;
+        default:
+            assert(false);
+            break;
+        }
+        tail++;
+        atomic_store_release(&ring->tail, tail);
+    }
+}
+
+/* MMIO side, under the iothread lock */
+static void apu_queue_write(MCPXAPUState *d, enum APUBlock block,
+                            hwaddr addr, uint64_t val)
+{
+    APUCommandRing *ring = &d->commands;
+    unsigned int head = atomic_read(&ring->head);
+
+    if (head - atomic_load_acquire(&ring->tail) == APU_COMMAND_RING_SIZE) {
+        /* the frame thread is behind, catch up on its behalf */
+        qemu_mutex_lock(&d->lock);
+        d->command_ring_full++;
+        apu_run_commands(d);
+        qemu_mutex_unlock(&d->lock);
+    }
+
+    APUCommand *cmd = &ring->entries[head & (APU_COMMAND_RING_SIZE - 1)];
+    cmd->block = block;
+    cmd->addr = addr;
+    cmd->val = val;
+    atomic_store_release(&ring->head, head + 1);
+
+    /* starting or stopping the frame clock shouldn't wait for a frame */
+    if (block == APU_BLOCK_APU && addr == NV_PAPU_SECTL) {
+        qemu_sem_post(&d->kick);
+    }
+}
+
+/*
+ * MMIO side, takes the lock for a read unless a frame holds it. The frame
+ * thread only ever stores whole registers and DSP words, so while it runs
+ * a read sees either the value before or after the store, the same as it
+ * would if the frame had run a moment earlier or later. Reads only wait
+ * when the guest has writes queued, so that it reads back what it wrote.
+ * Returns whether the lock was taken.
+ */
+static bool apu_lock_for_read(MCPXAPUState *d)
+{
+    APUCommandRing *ring = &d->commands;
+
+    if (qemu_mutex_trylock(&d->lock) != 0) {
+        if (atomic_read(&ring->head) == atomic_load_acquire(&ring->tail)) {
+            d->reads_during_frame++;
+            return false;
+        }
+        qemu_mutex_lock(&d->lock);
+    }
+    apu_run_commands(d);
+    return true;
+}
+
+static uint64_t mcpx_apu_mmio_read(void *opaque,
+                                   hwaddr addr, unsigned int size)
+{
+    MCPXAPUState *d = opaque;
+
+    /* the sample counter follows the virtual clock, no state involved */
+    if (addr == NV_PAPU_XGSCNT) {
+        return mcpx_apu_read(d, addr, size);
+    }
+
+    bool locked = apu_lock_for_read(d);
+    uint64_t r = mcpx_apu_read(d, addr, size);
+    if (locked) {
+        qemu_mutex_unlock(&d->lock);
+    }
+
+    return r;
+}
+
+static void mcpx_apu_mmio_write(void *opaque, hwaddr addr,
+                                uint64_t val, unsigned int size)
+{
+    apu_queue_write(opaque, APU_BLOCK_APU, addr, val);
+}
+
 static const MemoryRegionOps mcpx_apu_mmio_ops = {
-    .read = mcpx_apu_read,
-    .write = mcpx_apu_write,
+    .read = mcpx_apu_mmio_read,
+    .write = mcpx_apu_mmio_write,
 };
 
 static void fe_method(MCPXAPUState *d,
@@ -345,6 +695,8 @@ static void fe_method(MCPXAPUState *d,
     d->regs[NV_PAPU_FEDECMETH] = method;
     d->regs[NV_PAPU_FEDECPARAM] = argument;
     unsigned int selected_handle, list;
+    unsigned int current_voice = GET_MASK(d->regs[NV_PAPU_FECV],
+                                          NV1BA0_PIO_SET_CURRENT_VOICE_HANDLE);
     switch (method) {
     case NV1BA0_PIO_SET_ANTECEDENT_VOICE:
         d->regs[NV_PAPU_FEAV] = argument;
@@ -382,6 +734,27 @@ static void fe_method(MCPXAPUState *d,
                 NV_PAVS_VOICE_PAR_STATE,
                 NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE,
                 1);
+
+        /* start from the target volumes and the top of the envelope */
+        voice_copy(d, selected_handle,
+                   NV_PAVS_VOICE_CUR_VOLA, NV_PAVS_VOICE_TAR_VOLA);
+        voice_copy(d, selected_handle,
+                   NV_PAVS_VOICE_CUR_VOLB, NV_PAVS_VOICE_TAR_VOLB);
+        voice_copy(d, selected_handle,
+                   NV_PAVS_VOICE_CUR_VOLC, NV_PAVS_VOICE_TAR_VOLC);
+        voice_set_mask(d, selected_handle,
+                NV_PAVS_VOICE_PAR_STATE,
+                NV_PAVS_VOICE_PAR_STATE_EACUR,
+                NV_PAVS_VOICE_PAR_STATE_EACUR_DELAY);
+        voice_set_mask(d, selected_handle,
+                NV_PAVS_VOICE_CUR_ECNT,
+                NV_PAVS_VOICE_CUR_ECNT_EACOUNT,
+                0);
+        voice_set_mask(d, selected_handle,
+                NV_PAVS_VOICE_PAR_OFFSET,
+                NV_PAVS_VOICE_PAR_OFFSET_EALVL,
+                0);
+        d->vp.frac[selected_handle] = 0.0f;
         break;
     case NV1BA0_PIO_VOICE_OFF:
         voice_set_mask(d, argument & NV1BA0_PIO_VOICE_OFF_HANDLE,
@@ -389,6 +762,18 @@ static void fe_method(MCPXAPUState *d,
                 NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE,
                 0);
         break;
+    case NV1BA0_PIO_VOICE_RELEASE:
+        /* the envelope fades out from its current level */
+        selected_handle = argument & NV1BA0_PIO_VOICE_RELEASE_HANDLE;
+        voice_set_mask(d, selected_handle,
+                NV_PAVS_VOICE_PAR_STATE,
+                NV_PAVS_VOICE_PAR_STATE_EACUR,
+                NV_PAVS_VOICE_PAR_STATE_EACUR_RELEASE);
+        voice_set_mask(d, selected_handle,
+                NV_PAVS_VOICE_CUR_ECNT,
+                NV_PAVS_VOICE_CUR_ECNT_EACOUNT,
+                0);
+        break;
     case NV1BA0_PIO_VOICE_PAUSE:
         voice_set_mask(d, argument & NV1BA0_PIO_VOICE_PAUSE_HANDLE,
                 NV_PAVS_VOICE_PAR_STATE,
@@ -398,6 +783,51 @@ static void fe_method(MCPXAPUState *d,
     case NV1BA0_PIO_SET_CURRENT_VOICE:
         d->regs[NV_PAPU_FECV] = argument;
         break;
+    case NV1BA0_PIO_SET_VOICE_CFG_VBIN:
+    case NV1BA0_PIO_SET_VOICE_CFG_FMT:
+    case NV1BA0_PIO_SET_VOICE_CFG_ENV0:
+    case NV1BA0_PIO_SET_VOICE_CFG_ENVA:
+    case NV1BA0_PIO_SET_VOICE_CFG_MISC:
+    case NV1BA0_PIO_SET_VOICE_TAR_VOLA:
+    case NV1BA0_PIO_SET_VOICE_TAR_VOLB:
+    case NV1BA0_PIO_SET_VOICE_TAR_VOLC:
+    case NV1BA0_PIO_SET_VOICE_LFO_ENV:
+        voice_set_mask(d, current_voice,
+                method - NV1BA0_PIO_SET_VOICE_CFG_VBIN,
+                0xFFFFFFFF,
+                argument);
+        break;
+    case NV1BA0_PIO_SET_VOICE_TAR_PITCH:
+        voice_set_mask(d, current_voice,
+                NV_PAVS_VOICE_TAR_PITCH_LINK,
+                NV_PAVS_VOICE_TAR_PITCH_LINK_PITCH,
+                GET_MASK(argument, NV1BA0_PIO_SET_VOICE_TAR_PITCH_STEP));
+        break;
+    case NV1BA0_PIO_SET_VOICE_BUF_BASE:
+        voice_set_mask(d, current_voice,
+                NV_PAVS_VOICE_CUR_PSL_START,
+                NV_PAVS_VOICE_CUR_PSL_START_BA,
+                argument & NV1BA0_PIO_SET_VOICE_BUF_BASE_OFFSET);
+        break;
+    case NV1BA0_PIO_SET_VOICE_BUF_LBO:
+        voice_set_mask(d, current_voice,
+                NV_PAVS_VOICE_CUR_PSH_SAMPLE,
+                NV_PAVS_VOICE_CUR_PSH_SAMPLE_LBO,
+                argument & NV1BA0_PIO_SET_VOICE_BUF_LBO_OFFSET);
+        break;
+    case NV1BA0_PIO_SET_VOICE_BUF_EBO:
+        voice_set_mask(d, current_voice,
+                NV_PAVS_VOICE_PAR_NEXT,
+                NV_PAVS_VOICE_PAR_NEXT_EBO,
+                argument & NV1BA0_PIO_SET_VOICE_BUF_EBO_OFFSET);
+        break;
+    case NV1BA0_PIO_SET_VOICE_BUF_CBO:
+        voice_set_mask(d, current_voice,
+                NV_PAVS_VOICE_PAR_OFFSET,
+                NV_PAVS_VOICE_PAR_OFFSET_CBO,
+                argument & NV1BA0_PIO_SET_VOICE_BUF_CBO_OFFSET);
+        d->vp.frac[current_voice] = 0.0f;
+        break;
     case SE2FE_IDLE_VOICE:
         if (d->regs[NV_PAPU_FETFORCE1] & NV_PAPU_FETFORCE1_SE2FE_IDLE_VOICE) {
 
@@ -445,8 +875,23 @@ static void vp_write(void *opaque, hwaddr addr,
     case NV1BA0_PIO_SET_ANTECEDENT_VOICE:
     case NV1BA0_PIO_VOICE_ON:
     case NV1BA0_PIO_VOICE_OFF:
+    case NV1BA0_PIO_VOICE_RELEASE:
     case NV1BA0_PIO_VOICE_PAUSE:
     case NV1BA0_PIO_SET_CURRENT_VOICE:
+    case NV1BA0_PIO_SET_VOICE_CFG_VBIN:
+    case NV1BA0_PIO_SET_VOICE_CFG_FMT:
+    case NV1BA0_PIO_SET_VOICE_CFG_ENV0:
+    case NV1BA0_PIO_SET_VOICE_CFG_ENVA:
+    case NV1BA0_PIO_SET_VOICE_CFG_MISC:
+    case NV1BA0_PIO_SET_VOICE_TAR_VOLA:
+    case NV1BA0_PIO_SET_VOICE_TAR_VOLB:
+    case NV1BA0_PIO_SET_VOICE_TAR_VOLC:
+    case NV1BA0_PIO_SET_VOICE_LFO_ENV:
+    case NV1BA0_PIO_SET_VOICE_TAR_PITCH:
+    case NV1BA0_PIO_SET_VOICE_BUF_BASE:
+    case NV1BA0_PIO_SET_VOICE_BUF_LBO:
+    case NV1BA0_PIO_SET_VOICE_BUF_EBO:
+    case NV1BA0_PIO_SET_VOICE_BUF_CBO:
         /* TODO: these should instead be queueing up fe commands */
         fe_method(d, addr, val);
         break;
@@ -455,9 +900,15 @@ static void vp_write(void *opaque, hwaddr addr,
     }
 }
 
+static void vp_mmio_write(void *opaque, hwaddr addr,
+                          uint64_t val, unsigned int size)
+{
+    apu_queue_write(opaque, APU_BLOCK_VP, addr, val);
+}
+
 static const MemoryRegionOps vp_ops = {
     .read = vp_read,
-    .write = vp_write,
+    .write = vp_mmio_write,
 };
 
 static void scatter_gather_rw(MCPXAPUState *d,
@@ -560,9 +1011,96 @@ static uint32_t circular_scatter_gather_rw(MCPXAPUState *d,
     return cur;
 }
 
+/*
+ * Frame thread side of the audio ring. The first EP output FIFO is what
+ * goes out over AC97, stereo at 48kHz. Its samples are either 16 bit or
+ * 24 bit in 32 bit words, the ring holds 16 bit ones.
+ */
+static void apu_audio_push(MCPXAPUState *d, const uint8_t *ptr,
+                           unsigned int item_size, size_t len)
+{
+    APUAudioRing *ring = &d->audio.ring;
+    unsigned int head = atomic_read(&ring->head);
+    unsigned int fill = head - atomic_load_acquire(&ring->tail);
+    unsigned int count = len / (2 * item_size);
+    unsigned int i;
+
+    if (!d->audio.voice) {
+        return;
+    }
+
+    /* the guest is running ahead of the host's audio clock, drop the new
+     * frames rather than let latency build up */
+    if (fill + count > MIN(2 * atomic_read(&ring->target),
+                           APU_AUDIO_RING_FRAMES)) {
+        d->audio.overruns += count;
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        int16_t *frame = ring->frames[(head + i) & (APU_AUDIO_RING_FRAMES - 1)];
+        if (item_size == 4) {
+            /* keep the top 16 of the 24 bits */
+            frame[0] = ldl_le_p(ptr + i * 8) >> 8;
+            frame[1] = ldl_le_p(ptr + i * 8 + 4) >> 8;
+        } else {
+            frame[0] = lduw_le_p(ptr + i * 4);
+            frame[1] = lduw_le_p(ptr + i * 4 + 2);
+        }
+    }
+    atomic_store_release(&ring->head, head + count);
+}
+
+/* Audio backend side, on the main loop */
+static void apu_audio_callback(void *opaque, int avail)
+{
+    MCPXAPUState *d = opaque;
+    APUAudioRing *ring = &d->audio.ring;
+    unsigned int tail = atomic_read(&ring->tail);
+    unsigned int fill = atomic_load_acquire(&ring->head) - tail;
+    unsigned int target = atomic_read(&ring->target);
+    unsigned int wanted = avail / 4;
+
+    if (!d->audio.playing) {
+        if (fill < target) {
+            return;
+        }
+        d->audio.playing = true;
+    } else if (fill == 0) {
+        /* the backend is about to run dry, buffer more before resuming */
+        d->audio.underruns++;
+        d->audio.playing = false;
+        d->audio.played = 0;
+        atomic_set(&ring->target, MIN(target * 2, APU_AUDIO_TARGET_MAX));
+        return;
+    }
+
+    while (fill > 0 && wanted > 0) {
+        unsigned int start = tail & (APU_AUDIO_RING_FRAMES - 1);
+        unsigned int chunk = MIN(MIN(fill, wanted),
+                                 APU_AUDIO_RING_FRAMES - start);
+        unsigned int written = AUD_write(d->audio.voice, ring->frames[start],
+                                         chunk * 4) / 4;
+        tail += written;
+        fill -= written;
+        wanted -= written;
+        d->audio.played += written;
+        if (written < chunk) {
+            break;
+        }
+    }
+    atomic_store_release(&ring->tail, tail);
+
+    if (d->audio.played >= APU_AUDIO_SHRINK_FRAMES) {
+        d->audio.played = 0;
+        atomic_set(&ring->target,
+                   MAX(target - target / 8, APU_AUDIO_TARGET_MIN));
+    }
+}
+
 static void gp_fifo_rw(void *opaque, uint8_t *ptr,
-                       unsigned int index, size_t len,
-                       bool dir)
+                       unsigned int index, unsigned int item_size,
+                       size_t len, bool dir)
 {
     MCPXAPUState *d = opaque;
     uint32_t base;
@@ -600,8 +1138,8 @@ static void gp_fifo_rw(void *opaque, uint8_t *ptr,
 }
 
 static void ep_fifo_rw(void *opaque, uint8_t *ptr,
-                       unsigned int index, size_t len,
-                       bool dir)
+                       unsigned int index, unsigned int item_size,
+                       size_t len, bool dir)
 {
     MCPXAPUState *d = opaque;
     uint32_t base;
@@ -636,6 +1174,10 @@ static void ep_fifo_rw(void *opaque, uint8_t *ptr,
         ptr, base, end, cur, len, dir);
 
     SET_MASK(d->regs[cur_reg], NV_PAPU_GPOFCUR0_VALUE, cur);
+
+    if (dir && index == 0) {
+        apu_audio_push(d, ptr, item_size, len);
+    }
 }
 
 static void proc_rst_write(DSPState *dsp, uint32_t oldval, uint32_t val)
@@ -730,9 +1272,33 @@ static void gp_write(void *opaque, hwaddr addr,
     }
 }
 
+static uint64_t gp_mmio_read(void *opaque,
+                             hwaddr addr,
+                             unsigned int size)
+{
+    MCPXAPUState *d = opaque;
+
+    bool locked = apu_lock_for_read(d);
+    uint64_t r = gp_read(d, addr, size);
+    if (locked) {
+        qemu_mutex_unlock(&d->lock);
+    }
+
+    return r;
+}
+
+static void gp_mmio_write(void *opaque, hwaddr addr,
+                          uint64_t val, unsigned int size)
+{
+    assert(size == 4);
+    assert(addr % 4 == 0);
+
+    apu_queue_write(opaque, APU_BLOCK_GP, addr, val);
+}
+
 static const MemoryRegionOps gp_ops = {
-    .read = gp_read,
-    .write = gp_write,
+    .read = gp_mmio_read,
+    .write = gp_mmio_write,
 };
 
 /* Encode Processor - encoding DSP */
@@ -806,31 +1372,263 @@ static void ep_write(void *opaque, hwaddr addr,
     }
 }
 
+static uint64_t ep_mmio_read(void *opaque,
+                             hwaddr addr,
+                             unsigned int size)
+{
+    MCPXAPUState *d = opaque;
+
+    bool locked = apu_lock_for_read(d);
+    uint64_t r = ep_read(d, addr, size);
+    if (locked) {
+        qemu_mutex_unlock(&d->lock);
+    }
+
+    return r;
+}
+
+static void ep_mmio_write(void *opaque, hwaddr addr,
+                          uint64_t val, unsigned int size)
+{
+    assert(size == 4);
+    assert(addr % 4 == 0);
+
+    apu_queue_write(opaque, APU_BLOCK_EP, addr, val);
+}
+
 static const MemoryRegionOps ep_ops = {
-    .read = ep_read,
-    .write = ep_write,
+    .read = ep_mmio_read,
+    .write = ep_mmio_write,
 };
 
-static void process_voice(MCPXAPUState *d,
-                          int32_t mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME],
-                          uint32_t voice)
+static enum VPSampleFormat voice_format(uint32_t fmt)
 {
-    /* FIXME: Implement */
+    switch (GET_MASK(fmt, NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE)) {
+    case NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE_B8:
+        return VP_FORMAT_U8;
+    case NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE_B16:
+        return VP_FORMAT_S16;
+    case NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE_ADPCM:
+        return VP_FORMAT_ADPCM;
+    default:
+        /* 32 bit containers hold 24 or 32 bit samples */
+        if (GET_MASK(fmt, NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE)
+              == NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_S32) {
+            return VP_FORMAT_S32;
+        }
+        return VP_FORMAT_S24;
+    }
 }
 
-/* This routine must run at 1500 Hz */
-/* TODO: this should be on a thread so it waits on the voice lock */
-static void se_frame(void *opaque)
+/* Voice sample data is addressed through the VP's scatter gather list */
+static void voice_read(void *opaque, uint32_t offset, uint8_t *buf,
+                       size_t len)
 {
     MCPXAPUState *d = opaque;
+
+    scatter_gather_rw(d, d->regs[NV_PAPU_VPSGEADDR], UINT_MAX, buf,
+                      offset, len, false);
+}
+
+/*
+ * Steps the amplitude envelope through a frame, updating the voice's copy
+ * of its state. Returns false once the release has run out.
+ */
+static bool voice_envelope(uint8_t *v, float gain[VP_FRAME_SAMPLES])
+{
+    uint32_t env0 = ldl_le_p(v + NV_PAVS_VOICE_CFG_ENV0);
+    uint32_t enva = ldl_le_p(v + NV_PAVS_VOICE_CFG_ENVA);
+    uint32_t lfo_env = ldl_le_p(v + NV_PAVS_VOICE_TAR_LFO_ENV);
+    uint32_t state = ldl_le_p(v + NV_PAVS_VOICE_PAR_STATE);
+    uint32_t offset = ldl_le_p(v + NV_PAVS_VOICE_PAR_OFFSET);
+    uint32_t ecnt = ldl_le_p(v + NV_PAVS_VOICE_CUR_ECNT);
+
+    VPEnvelope env = {
+        .phase = GET_MASK(state, NV_PAVS_VOICE_PAR_STATE_EACUR),
+        .count = GET_MASK(ecnt, NV_PAVS_VOICE_CUR_ECNT_EACOUNT),
+        .level = GET_MASK(offset, NV_PAVS_VOICE_PAR_OFFSET_EALVL),
+        .delay = GET_MASK(env0, NV_PAVS_VOICE_CFG_ENV0_EA_DELAYTIME)
+                     * VP_ENVELOPE_STEP,
+        .attack = GET_MASK(env0, NV_PAVS_VOICE_CFG_ENV0_EA_ATTACKRATE)
+                      * VP_ENVELOPE_STEP,
+        .hold = GET_MASK(enva, NV_PAVS_VOICE_CFG_ENVA_EA_HOLDTIME)
+                    * VP_ENVELOPE_STEP,
+        .decay = GET_MASK(enva, NV_PAVS_VOICE_CFG_ENVA_EA_DECAYRATE)
+                     * VP_ENVELOPE_STEP,
+        .sustain = GET_MASK(enva, NV_PAVS_VOICE_CFG_ENVA_EA_SUSTAINLEVEL),
+        .release = GET_MASK(lfo_env, NV_PAVS_VOICE_TAR_LFO_ENV_EA_RELEASERATE)
+                       * VP_ENVELOPE_STEP,
+    };
+    QEMU_BUILD_BUG_ON(VP_ENVELOPE_DELAY != NV_PAVS_VOICE_PAR_STATE_EACUR_DELAY);
+    QEMU_BUILD_BUG_ON(VP_ENVELOPE_FORCE_RELEASE
+                      != NV_PAVS_VOICE_PAR_STATE_EACUR_FORCE_RELEASE);
+    bool playing = vp_envelope_run(&env, gain);
+
+    SET_MASK(state, NV_PAVS_VOICE_PAR_STATE_EACUR, env.phase);
+    SET_MASK(offset, NV_PAVS_VOICE_PAR_OFFSET_EALVL, env.level);
+    SET_MASK(ecnt, NV_PAVS_VOICE_CUR_ECNT_EACOUNT, env.count);
+    stl_le_p(v + NV_PAVS_VOICE_PAR_STATE, state);
+    stl_le_p(v + NV_PAVS_VOICE_PAR_OFFSET, offset);
+    stl_le_p(v + NV_PAVS_VOICE_CUR_ECNT, ecnt);
+
+    return playing;
+}
+
+static void voice_get_bins(const uint8_t *v, unsigned int bins[VP_VOICE_BINS])
+{
+    uint32_t vbin = ldl_le_p(v + NV_PAVS_VOICE_CFG_VBIN);
+    uint32_t fmt = ldl_le_p(v + NV_PAVS_VOICE_CFG_FMT);
+
+    bins[0] = GET_MASK(vbin, NV_PAVS_VOICE_CFG_VBIN_V0BIN);
+    bins[1] = GET_MASK(vbin, NV_PAVS_VOICE_CFG_VBIN_V1BIN);
+    bins[2] = GET_MASK(vbin, NV_PAVS_VOICE_CFG_VBIN_V2BIN);
+    bins[3] = GET_MASK(vbin, NV_PAVS_VOICE_CFG_VBIN_V3BIN);
+    bins[4] = GET_MASK(vbin, NV_PAVS_VOICE_CFG_VBIN_V4BIN);
+    bins[5] = GET_MASK(vbin, NV_PAVS_VOICE_CFG_VBIN_V5BIN);
+    bins[6] = GET_MASK(fmt, NV_PAVS_VOICE_CFG_FMT_V6BIN);
+    bins[7] = GET_MASK(fmt, NV_PAVS_VOICE_CFG_FMT_V7BIN);
+}
+
+/* vola is the first of CUR or TAR VOLA, VOLB and VOLC */
+static void voice_get_volumes(const uint8_t *v, hwaddr vola,
+                              float gain[VP_VOICE_BINS])
+{
+    uint32_t a = ldl_le_p(v + vola);
+    uint32_t b = ldl_le_p(v + vola + 4);
+    uint32_t c = ldl_le_p(v + vola + 8);
+
+    gain[0] = vp_volume_gain(GET_MASK(a, NV_PAVS_VOICE_CUR_VOLA_VOLUME0));
+    gain[1] = vp_volume_gain(GET_MASK(a, NV_PAVS_VOICE_CUR_VOLA_VOLUME1));
+    gain[2] = vp_volume_gain(GET_MASK(b, NV_PAVS_VOICE_CUR_VOLA_VOLUME0));
+    gain[3] = vp_volume_gain(GET_MASK(b, NV_PAVS_VOICE_CUR_VOLA_VOLUME1));
+    gain[4] = vp_volume_gain(GET_MASK(c, NV_PAVS_VOICE_CUR_VOLA_VOLUME0));
+    gain[5] = vp_volume_gain(GET_MASK(c, NV_PAVS_VOICE_CUR_VOLA_VOLUME1));
+    gain[6] = vp_volume_gain(GET_MASK(a, NV_PAVS_VOICE_CUR_VOLA_VOLUME6_B3_0)
+                 | GET_MASK(b, NV_PAVS_VOICE_CUR_VOLA_VOLUME6_B3_0) << 4
+                 | GET_MASK(c, NV_PAVS_VOICE_CUR_VOLA_VOLUME6_B3_0) << 8);
+    gain[7] = vp_volume_gain(GET_MASK(a, NV_PAVS_VOICE_CUR_VOLA_VOLUME7_B3_0)
+                 | GET_MASK(b, NV_PAVS_VOICE_CUR_VOLA_VOLUME7_B3_0) << 4
+                 | GET_MASK(c, NV_PAVS_VOICE_CUR_VOLA_VOLUME7_B3_0) << 8);
+}
+
+static void process_voice(MCPXAPUState *d, uint32_t voice)
+{
+    hwaddr addr = voice_addr(d, voice);
+    uint8_t v[NV_PAVS_SIZE];
+    float gain[VP_FRAME_SAMPLES];
+    float samples[2][VP_FRAME_SAMPLES];
+    unsigned int bins[VP_VOICE_BINS];
+    float start[VP_VOICE_BINS], end[VP_VOICE_BINS];
+    unsigned int i;
+
+    cpu_physical_memory_read(addr, v, NV_PAVS_SIZE);
+
+    uint32_t fmt = ldl_le_p(v + NV_PAVS_VOICE_CFG_FMT);
+    if (ldl_le_p(v + NV_PAVS_VOICE_PAR_STATE)
+          & NV_PAVS_VOICE_PAR_STATE_PAUSED) {
+        return;
+    }
+    if (fmt & NV_PAVS_VOICE_CFG_FMT_DATA_TYPE) {
+        /* FIXME: stream voices, fed through the SSL instead of a buffer */
+        return;
+    }
+
+    VPVoiceBuffer buf = {
+        .base = GET_MASK(ldl_le_p(v + NV_PAVS_VOICE_CUR_PSL_START),
+                         NV_PAVS_VOICE_CUR_PSL_START_BA),
+        .format = voice_format(fmt),
+        .channels = (fmt & NV_PAVS_VOICE_CFG_FMT_STEREO) ? 2 : 1,
+        .lbo = GET_MASK(ldl_le_p(v + NV_PAVS_VOICE_CUR_PSH_SAMPLE),
+                        NV_PAVS_VOICE_CUR_PSH_SAMPLE_LBO),
+        .ebo = GET_MASK(ldl_le_p(v + NV_PAVS_VOICE_PAR_NEXT),
+                        NV_PAVS_VOICE_PAR_NEXT_EBO),
+        .loop = (fmt & NV_PAVS_VOICE_CFG_FMT_LOOP) != 0,
+        .read = voice_read,
+        .opaque = d,
+    };
+    if (buf.lbo > buf.ebo) {
+        buf.loop = false;
+    }
+
+    /* 4.12 octaves */
+    int16_t pitch = GET_MASK(ldl_le_p(v + NV_PAVS_VOICE_TAR_PITCH_LINK),
+                             NV_PAVS_VOICE_TAR_PITCH_LINK_PITCH);
+    float rate = exp2f(pitch / 4096.0f);
+    float frac = d->vp.frac[voice];
+    uint32_t cbo = GET_MASK(ldl_le_p(v + NV_PAVS_VOICE_PAR_OFFSET),
+                            NV_PAVS_VOICE_PAR_OFFSET_CBO);
+
+    bool playing = voice_envelope(v, gain);
+
+    vp_voice_fill(&buf, &d->vp.scratch, cbo, vp_resample_span(frac, rate),
+                  d->vp.src[0], d->vp.src[1]);
+    for (i = 0; i < buf.channels; i++) {
+        vp_resample(d->vp.src[i], frac, rate, samples[i]);
+    }
+
+    /* volumes ramp from the current to the target ones over the frame */
+    voice_get_bins(v, bins);
+    voice_get_volumes(v, NV_PAVS_VOICE_CUR_VOLA, start);
+    voice_get_volumes(v, NV_PAVS_VOICE_TAR_VOLA, end);
+
+    if (buf.channels == 1) {
+        vp_mix(&d->vp.mix, samples[0], gain, bins, start, end,
+               VP_VOICE_BINS);
+    } else {
+        /* even volumes take the left channel, odd ones the right */
+        unsigned int side_bins[2][VP_VOICE_BINS / 2];
+        float side_start[2][VP_VOICE_BINS / 2], side_end[2][VP_VOICE_BINS / 2];
+        for (i = 0; i < VP_VOICE_BINS; i++) {
+            side_bins[i % 2][i / 2] = bins[i];
+            side_start[i % 2][i / 2] = start[i];
+            side_end[i % 2][i / 2] = end[i];
+        }
+        for (i = 0; i < 2; i++) {
+            vp_mix(&d->vp.mix, samples[i], gain, side_bins[i],
+                   side_start[i], side_end[i], VP_VOICE_BINS / 2);
+        }
+    }
+
+    if (!vp_voice_advance(&buf, &cbo, &frac, rate)) {
+        playing = false;
+    }
+    d->vp.frac[voice] = frac;
+
+    uint32_t state = ldl_le_p(v + NV_PAVS_VOICE_PAR_STATE);
+    uint32_t offset = ldl_le_p(v + NV_PAVS_VOICE_PAR_OFFSET);
+    if (!playing) {
+        state &= ~NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE;
+    }
+    SET_MASK(offset, NV_PAVS_VOICE_PAR_OFFSET_CBO, cbo);
+
+    stl_le_phys(&address_space_memory, addr + NV_PAVS_VOICE_PAR_STATE, state);
+    stl_le_phys(&address_space_memory, addr + NV_PAVS_VOICE_PAR_OFFSET,
+                offset);
+    stl_le_phys(&address_space_memory, addr + NV_PAVS_VOICE_CUR_ECNT,
+                ldl_le_p(v + NV_PAVS_VOICE_CUR_ECNT));
+    for (i = 0; i < 3; i++) {
+        stl_le_phys(&address_space_memory,
+                    addr + NV_PAVS_VOICE_CUR_VOLA + i * 4,
+                    ldl_le_p(v + NV_PAVS_VOICE_TAR_VOLA + i * 4));
+    }
+
+    d->vp.voices_mixed++;
+}
+
+/* Runs at 1500 Hz on the frame thread, with the lock held */
+static void se_frame(MCPXAPUState *d)
+{
     int mixbin;
     int sample;
 
-    timer_mod(d->se.frame_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + 10);
     MCPX_DPRINTF("mcpx frame ping\n");
 
+    QEMU_BUILD_BUG_ON(NUM_MIXBINS != VP_NUM_MIXBINS);
+    QEMU_BUILD_BUG_ON(NUM_SAMPLES_PER_FRAME != VP_FRAME_SAMPLES);
+
     /* Buffer for all mixbins for this frame */
-    int32_t mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME] = { 0 };
+    int32_t mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME];
+    memset(&d->vp.mix, 0, sizeof(d->vp.mix));
 
     /* Process all voices, mixing each into the affected MIXBINs */
     int list;
@@ -852,12 +1650,13 @@ static void se_frame(void *opaque)
                 MCPX_DPRINTF("voice %d not active...!\n", d->regs[current]);
                 fe_method(d, SE2FE_IDLE_VOICE, d->regs[current]);
             } else {
-                process_voice(d, mixbins, d->regs[current]);
+                process_voice(d, d->regs[current]);
             }
             MCPX_DPRINTF("next voice %d\n", d->regs[next]);
             d->regs[current] = d->regs[next];
         }
     }
+    vp_mixbins_to_s24(&d->vp.mix, mixbins);
 
 #if GENERATE_MIXBIN_BEEP
     /* Inject some audio to the mixbin for debugging.
@@ -887,17 +1686,93 @@ static void se_frame(void *opaque)
     if ((d->gp.regs[NV_PAPU_GPRST] & NV_PAPU_GPRST_GPRST)
         && (d->gp.regs[NV_PAPU_GPRST] & NV_PAPU_GPRST_GPDSPRST)) {
         dsp_start_frame(d->gp.dsp);
-
-        // hax
-        dsp_run(d->gp.dsp, 1000);
+        dsp_run(d->gp.dsp, DSP_CYCLES_PER_FRAME);
     }
     if ((d->ep.regs[NV_PAPU_EPRST] & NV_PAPU_GPRST_GPRST)
         && (d->ep.regs[NV_PAPU_EPRST] & NV_PAPU_GPRST_GPDSPRST)) {
         dsp_start_frame(d->ep.dsp);
+        dsp_run(d->ep.dsp, DSP_CYCLES_PER_FRAME);
+    }
+}
+
+static void se_record_latency(MCPXAPUState *d, int64_t latency_ns)
+{
+    int64_t limit_ns = SE_LATENCY_FIRST_US * SCALE_US;
+    unsigned int i;
 
-        // hax
-        // dsp_run(d->ep.dsp, 1000);
+    for (i = 0; i < SE_LATENCY_BUCKETS - 1; i++) {
+        if (latency_ns < limit_ns) {
+            break;
+        }
+        limit_ns *= 2;
     }
+    d->se.latency[i]++;
+}
+
+/* Interrupt changes made without the iothread lock are passed on here */
+static void se_flush_irq(MCPXAPUState *d)
+{
+    if (!d->irq_pending) {
+        return;
+    }
+
+    qemu_mutex_unlock(&d->lock);
+    qemu_mutex_lock_iothread();
+    qemu_mutex_lock(&d->lock);
+    d->irq_pending = false;
+    update_irq(d);
+    qemu_mutex_unlock_iothread();
+}
+
+static void *se_frame_thread(void *opaque)
+{
+    MCPXAPUState *d = opaque;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&d->lock);
+    while (!d->exiting) {
+        apu_run_commands(d);
+        se_flush_irq(d);
+
+        if (!d->se.running) {
+            qemu_mutex_unlock(&d->lock);
+            qemu_sem_wait(&d->kick);
+            qemu_mutex_lock(&d->lock);
+            continue;
+        }
+
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        if (now < d->se.next_frame_ns) {
+            int64_t wait_ns = d->se.next_frame_ns - now;
+            qemu_mutex_unlock(&d->lock);
+            if (runstate_is_running()) {
+                g_usleep(DIV_ROUND_UP(wait_ns, SCALE_US));
+            } else {
+                /* guest time stands still */
+                qemu_sem_timedwait(&d->kick, 100);
+            }
+            qemu_mutex_lock(&d->lock);
+            continue;
+        }
+
+        if (now - d->se.next_frame_ns > SE_MAX_FRAMES_BEHIND * SE_FRAME_NS) {
+            unsigned int behind = (now - d->se.next_frame_ns) / SE_FRAME_NS;
+            d->se.frames_dropped += behind;
+            d->se.next_frame_ns += behind * SE_FRAME_NS;
+        }
+        int64_t deadline = d->se.next_frame_ns;
+        d->se.next_frame_ns += SE_FRAME_NS;
+
+        se_frame(d);
+        d->se.frames++;
+        se_record_latency(d, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)
+                                 - deadline);
+    }
+    qemu_mutex_unlock(&d->lock);
+
+    rcu_unregister_thread();
+    return NULL;
 }
 
 static void mcpx_apu_realize(PCIDevice *dev, Error **errp)
@@ -924,11 +1799,72 @@ static void mcpx_apu_realize(PCIDevice *dev, Error **errp)
     pci_register_bar(&d->dev, 0, PCI_BASE_ADDRESS_SPACE_MEMORY, &d->mmio);
 
 
-    d->se.frame_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, se_frame, d);
+    vp_mix_init();
+
+    struct audsettings as = {
+        .freq = 48000,
+        .nchannels = 2,
+        .fmt = AUD_FMT_S16,
+        .endianness = AUDIO_HOST_ENDIANNESS,
+    };
+    AUD_register_card("mcpx-apu", &d->audio.card);
+    d->audio.voice = AUD_open_out(&d->audio.card, NULL, "mcpx-apu", d,
+                                  apu_audio_callback, &as);
+    if (!d->audio.voice) {
+        AUD_remove_card(&d->audio.card);
+        error_setg(errp, "Initializing audio voice failed");
+        return;
+    }
+    d->audio.ring.target = APU_AUDIO_TARGET_START;
+    AUD_set_active_out(d->audio.voice, 1);
+
+    /* what the backend plays, underruns and all, for offline comparison */
+    if (d->audio.capture_path
+        && wav_start_capture(&d->audio.capture, d->audio.capture_path,
+                             48000, 16, 2)) {
+        error_setg(errp, "Failed to start wav capture to %s",
+                   d->audio.capture_path);
+        AUD_close_out(&d->audio.card, d->audio.voice);
+        AUD_remove_card(&d->audio.card);
+        return;
+    }
+
     d->gp.dsp = dsp_init(d, gp_scratch_rw, gp_fifo_rw);
     d->ep.dsp = dsp_init(d, ep_scratch_rw, ep_fifo_rw);
+
+    qemu_mutex_init(&d->lock);
+    qemu_sem_init(&d->kick, 0);
+    qemu_thread_create(&d->thread, "mcpx.apu_frame_thread",
+                       se_frame_thread, d, QEMU_THREAD_JOINABLE);
+}
+
+static void mcpx_apu_exitfn(PCIDevice *dev)
+{
+    MCPXAPUState *d = MCPX_APU_DEVICE(dev);
+
+    qemu_mutex_lock(&d->lock);
+    d->exiting = true;
+    qemu_mutex_unlock(&d->lock);
+    qemu_sem_post(&d->kick);
+    qemu_thread_join(&d->thread);
+
+    qemu_sem_destroy(&d->kick);
+    qemu_mutex_destroy(&d->lock);
+    dsp_destroy(d->gp.dsp);
+    dsp_destroy(d->ep.dsp);
+
+    if (d->audio.capture.opaque) {
+        d->audio.capture.ops.destroy(d->audio.capture.opaque);
+    }
+    AUD_close_out(&d->audio.card, d->audio.voice);
+    AUD_remove_card(&d->audio.card);
 }
 
+static Property mcpx_apu_properties[] = {
+    DEFINE_PROP_STRING("wavcapture", MCPXAPUState, audio.capture_path),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void mcpx_apu_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -939,8 +1875,10 @@ static void mcpx_apu_class_init(ObjectClass *klass, void *data)
     k->revision = 210;
     k->class_id = PCI_CLASS_MULTIMEDIA_AUDIO;
     k->realize = mcpx_apu_realize;
+    k->exit = mcpx_apu_exitfn;
 
     dc->desc = "MCPX Audio Processing Unit";
+    dc->props = mcpx_apu_properties;
 }
 
 static const TypeInfo mcpx_apu_info = {
@@ -969,3 +1907,45 @@ void mcpx_apu_init(PCIBus *bus, int devfn, MemoryRegion *ram)
     d->ram = ram;
     d->ram_ptr = memory_region_get_ram_ptr(d->ram);
 }
+
+void hmp_info_mcpx_apu(Monitor *mon, const QDict *qdict)
+{
+    Object *obj = object_resolve_path_type("", "mcpx-apu", NULL);
+    if (!obj) {
+        monitor_printf(mon, "No mcpx-apu device\n");
+        return;
+    }
+
+    MCPXAPUState *d = MCPX_APU_DEVICE(obj);
+    unsigned int i;
+
+    qemu_mutex_lock(&d->lock);
+    monitor_printf(mon, "mcpx apu: %" PRIu64 " frames, %" PRIu64 " dropped, "
+                        "%u waits on a full command ring, "
+                        "%u reads during a frame, "
+                        "%" PRIu64 " voices mixed\n",
+                   d->se.frames, d->se.frames_dropped, d->command_ring_full,
+                   d->reads_during_frame,
+                   d->vp.voices_mixed);
+    monitor_printf(mon, "  frame latency:");
+    for (i = 0; i < SE_LATENCY_BUCKETS; i++) {
+        if (i < SE_LATENCY_BUCKETS - 1) {
+            monitor_printf(mon, " <%uus: %" PRIu64,
+                           SE_LATENCY_FIRST_US << i, d->se.latency[i]);
+        } else {
+            monitor_printf(mon, " more: %" PRIu64, d->se.latency[i]);
+        }
+    }
+    monitor_printf(mon, "\n");
+
+    APUAudioRing *ring = &d->audio.ring;
+    monitor_printf(mon, "  audio: %u of %u frames buffered, target %u, "
+                        "%" PRIu64 " underruns, %" PRIu64 " frames dropped\n",
+                   atomic_read(&ring->head) - atomic_read(&ring->tail),
+                   APU_AUDIO_RING_FRAMES, atomic_read(&ring->target),
+                   d->audio.underruns, d->audio.overruns);
+    if (d->audio.capture.opaque) {
+        d->audio.capture.ops.info(d->audio.capture.opaque);
+    }
+    qemu_mutex_unlock(&d->lock);
+}
@@ -0,0 +1,453 @@
+/*
+ * QEMU MCPX Voice Processor sample decoding and mixing
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "mcpx_vp_mix.h"
+#include <math.h>
+
+#define VP_VECTORS (VP_FRAME_SAMPLES / VP_LANES)
+
+static const int16_t adpcm_step_table[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+    19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+    130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+    876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+    5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t adpcm_index_table[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8,
+    -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+unsigned int vp_sample_frame_size(enum VPSampleFormat format,
+                                  unsigned int channels)
+{
+    switch (format) {
+    case VP_FORMAT_U8:
+        return channels;
+    case VP_FORMAT_S16:
+        return 2 * channels;
+    case VP_FORMAT_S24:
+    case VP_FORMAT_S32:
+        return 4 * channels;
+    case VP_FORMAT_ADPCM:
+        return VP_ADPCM_BLOCK_SIZE * channels;
+    default:
+        assert(false);
+        return 0;
+    }
+}
+
+static inline float decode_pcm_sample(enum VPSampleFormat format,
+                                      const uint8_t *src)
+{
+    switch (format) {
+    case VP_FORMAT_U8:
+        return (src[0] - 0x80) / 128.0f;
+    case VP_FORMAT_S16:
+        return (int16_t)lduw_le_p(src) / 32768.0f;
+    case VP_FORMAT_S24:
+        return ((int32_t)ldl_le_p(src) >> 8) / 8388608.0f;
+    case VP_FORMAT_S32:
+        return (int32_t)ldl_le_p(src) / 2147483648.0f;
+    default:
+        assert(false);
+        return 0.0f;
+    }
+}
+
+/* format is a constant in each caller, so the switch is out of the loop */
+static inline void decode_pcm(enum VPSampleFormat format,
+                              unsigned int channels, const uint8_t *src,
+                              unsigned int count, float *left, float *right)
+{
+    unsigned int size = vp_sample_frame_size(format, 1);
+    unsigned int i;
+
+    if (channels == 1) {
+        for (i = 0; i < count; i++) {
+            left[i] = decode_pcm_sample(format, src + i * size);
+        }
+    } else {
+        for (i = 0; i < count; i++) {
+            left[i] = decode_pcm_sample(format, src + i * 2 * size);
+            right[i] = decode_pcm_sample(format, src + (i * 2 + 1) * size);
+        }
+    }
+}
+
+void vp_decode_pcm(enum VPSampleFormat format, unsigned int channels,
+                   const uint8_t *src, unsigned int count,
+                   float *left, float *right)
+{
+    assert(channels == 1 || channels == 2);
+
+    switch (format) {
+    case VP_FORMAT_U8:
+        decode_pcm(VP_FORMAT_U8, channels, src, count, left, right);
+        break;
+    case VP_FORMAT_S16:
+        decode_pcm(VP_FORMAT_S16, channels, src, count, left, right);
+        break;
+    case VP_FORMAT_S24:
+        decode_pcm(VP_FORMAT_S24, channels, src, count, left, right);
+        break;
+    case VP_FORMAT_S32:
+        decode_pcm(VP_FORMAT_S32, channels, src, count, left, right);
+        break;
+    default:
+        assert(false);
+        break;
+    }
+}
+
+typedef struct ADPCMChannel {
+    int predictor;
+    int index;
+} ADPCMChannel;
+
+static float adpcm_decode_nibble(ADPCMChannel *c, unsigned int nibble)
+{
+    int step = adpcm_step_table[c->index];
+    int diff = step >> 3;
+
+    if (nibble & 4) {
+        diff += step;
+    }
+    if (nibble & 2) {
+        diff += step >> 1;
+    }
+    if (nibble & 1) {
+        diff += step >> 2;
+    }
+    if (nibble & 8) {
+        c->predictor -= diff;
+    } else {
+        c->predictor += diff;
+    }
+    c->predictor = MIN(MAX(c->predictor, -32768), 32767);
+    c->index = MIN(MAX(c->index + adpcm_index_table[nibble], 0), 88);
+
+    return c->predictor / 32768.0f;
+}
+
+/* 4 bytes of nibbles, low nibble first, are 8 samples */
+static void adpcm_decode_word(ADPCMChannel *c, const uint8_t *src, float *dst)
+{
+    unsigned int i;
+
+    for (i = 0; i < 4; i++) {
+        dst[i * 2] = adpcm_decode_nibble(c, src[i] & 0xF);
+        dst[i * 2 + 1] = adpcm_decode_nibble(c, src[i] >> 4);
+    }
+}
+
+static void adpcm_start_block(ADPCMChannel *c, const uint8_t *header,
+                              float *dst)
+{
+    c->predictor = (int16_t)lduw_le_p(header);
+    c->index = MIN(header[2], 88);
+    dst[0] = c->predictor / 32768.0f;
+}
+
+void vp_decode_adpcm(unsigned int channels, const uint8_t *src,
+                     unsigned int count, float *left, float *right)
+{
+    unsigned int block, word;
+    ADPCMChannel l, r;
+
+    assert(channels == 1 || channels == 2);
+
+    for (block = 0; block < count; block++) {
+        adpcm_start_block(&l, src, left);
+        if (channels == 1) {
+            for (word = 0; word < 8; word++) {
+                adpcm_decode_word(&l, src + 4 + word * 4,
+                                  left + 1 + word * 8);
+            }
+        } else {
+            adpcm_start_block(&r, src + 4, right);
+            for (word = 0; word < 8; word++) {
+                adpcm_decode_word(&l, src + 8 + word * 8,
+                                  left + 1 + word * 8);
+                adpcm_decode_word(&r, src + 12 + word * 8,
+                                  right + 1 + word * 8);
+            }
+            right += VP_ADPCM_SAMPLES_PER_BLOCK;
+        }
+        src += VP_ADPCM_BLOCK_SIZE * channels;
+        left += VP_ADPCM_SAMPLES_PER_BLOCK;
+    }
+}
+
+/* Decodes count samples from sample first on, which mustn't pass the end */
+static void voice_fetch(const VPVoiceBuffer *buf, VPVoiceScratch *scratch,
+                        uint32_t first, unsigned int count,
+                        float *left, float *right)
+{
+    unsigned int size = vp_sample_frame_size(buf->format, buf->channels);
+
+    if (buf->format != VP_FORMAT_ADPCM) {
+        buf->read(buf->opaque, buf->base + first * size, scratch->raw,
+                  count * size);
+        vp_decode_pcm(buf->format, buf->channels, scratch->raw, count,
+                      left, right);
+        return;
+    }
+
+    /* whole blocks are decoded and the samples wanted picked out */
+    unsigned int block = first / VP_ADPCM_SAMPLES_PER_BLOCK;
+    unsigned int skip = first % VP_ADPCM_SAMPLES_PER_BLOCK;
+    unsigned int blocks = DIV_ROUND_UP(skip + count,
+                                       VP_ADPCM_SAMPLES_PER_BLOCK);
+
+    buf->read(buf->opaque, buf->base + block * size, scratch->raw,
+              blocks * size);
+    vp_decode_adpcm(buf->channels, scratch->raw, blocks,
+                    scratch->adpcm[0], scratch->adpcm[1]);
+    memcpy(left, &scratch->adpcm[0][skip], count * sizeof(float));
+    if (buf->channels == 2) {
+        memcpy(right, &scratch->adpcm[1][skip], count * sizeof(float));
+    }
+}
+
+void vp_voice_fill(const VPVoiceBuffer *buf, VPVoiceScratch *scratch,
+                   uint32_t pos, unsigned int count,
+                   float *left, float *right)
+{
+    unsigned int filled = 0;
+
+    assert(count <= VP_MAX_SOURCE_SAMPLES);
+
+    while (filled < count) {
+        if (pos > buf->ebo) {
+            if (!buf->loop) {
+                memset(&left[filled], 0, (count - filled) * sizeof(float));
+                memset(&right[filled], 0, (count - filled) * sizeof(float));
+                break;
+            }
+            pos = buf->lbo;
+        }
+        unsigned int n = MIN(count - filled, buf->ebo - pos + 1);
+        voice_fetch(buf, scratch, pos, n, &left[filled], &right[filled]);
+        filled += n;
+        pos += n;
+    }
+}
+
+bool vp_voice_advance(const VPVoiceBuffer *buf, uint32_t *pos,
+                      float *frac, float rate)
+{
+    float next = *frac + VP_FRAME_SAMPLES * rate;
+    uint32_t advance = next;
+
+    *frac = next - advance;
+    *pos += advance;
+    if (*pos > buf->ebo) {
+        if (!buf->loop) {
+            *pos = buf->ebo;
+            return false;
+        }
+        *pos = buf->lbo + (*pos - buf->ebo - 1) % (buf->ebo - buf->lbo + 1);
+    }
+    return true;
+}
+
+static unsigned int envelope_length(const VPEnvelope *env,
+                                    unsigned int phase)
+{
+    switch (phase) {
+    case VP_ENVELOPE_DELAY:
+        return env->delay;
+    case VP_ENVELOPE_ATTACK:
+        return env->attack;
+    case VP_ENVELOPE_HOLD:
+        return env->hold;
+    case VP_ENVELOPE_DECAY:
+        return env->decay;
+    case VP_ENVELOPE_RELEASE:
+    case VP_ENVELOPE_FORCE_RELEASE:
+        return env->release;
+    default:
+        /* off and sustain last until the voice is released */
+        return UINT_MAX;
+    }
+}
+
+bool vp_envelope_run(VPEnvelope *env, float gain[VP_FRAME_SAMPLES])
+{
+    unsigned int phase = env->phase;
+    unsigned int count = env->count;
+    float sustain = env->sustain / 255.0f;
+    bool releasing = phase == VP_ENVELOPE_RELEASE
+                     || phase == VP_ENVELOPE_FORCE_RELEASE;
+    bool playing = true;
+    unsigned int i;
+
+    for (i = 0; i < VP_FRAME_SAMPLES; i++) {
+        unsigned int length = envelope_length(env, phase);
+
+        if (releasing && count >= length) {
+            memset(&gain[i], 0, (VP_FRAME_SAMPLES - i) * sizeof(float));
+            playing = false;
+            break;
+        }
+        while (count >= length) {
+            /* delay, attack, hold and decay lead into each other */
+            phase++;
+            count = 0;
+            length = envelope_length(env, phase);
+        }
+
+        float t = length == UINT_MAX ? 0.0f : count / (float)length;
+        switch (phase) {
+        case VP_ENVELOPE_DELAY:
+            gain[i] = 0.0f;
+            break;
+        case VP_ENVELOPE_ATTACK:
+            gain[i] = t;
+            break;
+        case VP_ENVELOPE_HOLD:
+            gain[i] = 1.0f;
+            break;
+        case VP_ENVELOPE_DECAY:
+            gain[i] = 1.0f - (1.0f - sustain) * t;
+            break;
+        case VP_ENVELOPE_SUSTAIN:
+            gain[i] = sustain;
+            break;
+        case VP_ENVELOPE_RELEASE:
+        case VP_ENVELOPE_FORCE_RELEASE:
+            gain[i] = env->level / 255.0f * (1.0f - t);
+            break;
+        default:
+            gain[i] = 1.0f;
+            break;
+        }
+        if (length != UINT_MAX) {
+            count++;
+        }
+    }
+
+    if (!releasing) {
+        env->level = lrintf(gain[VP_FRAME_SAMPLES - 1] * 255.0f);
+    }
+    env->phase = phase;
+    env->count = count;
+
+    return playing;
+}
+
+unsigned int vp_resample_span(float frac, float rate)
+{
+    return (unsigned int)(frac + (VP_FRAME_SAMPLES - 1) * rate) + 2;
+}
+
+void vp_resample(const float *src, float frac, float rate,
+                 float dst[VP_FRAME_SAMPLES])
+{
+    unsigned int v, lane;
+
+    /* Positions come from the start of the frame rather than adding up
+     * rate, so they don't drift over the frame */
+    for (v = 0; v < VP_VECTORS; v++) {
+        VPLanes pos, a, b, t, out;
+        for (lane = 0; lane < VP_LANES; lane++) {
+            float p = frac + (v * VP_LANES + lane) * rate;
+            unsigned int index = p;
+            pos[lane] = p;
+            a[lane] = src[index];
+            b[lane] = src[index + 1];
+            t[lane] = index;
+        }
+        t = pos - t;
+        out = a + (b - a) * t;
+        memcpy(&dst[v * VP_LANES], &out, sizeof(out));
+    }
+}
+
+void vp_mix(VPMixbins *mix, const float samples[VP_FRAME_SAMPLES],
+            const float gain[VP_FRAME_SAMPLES],
+            const unsigned int bins[], const float start[],
+            const float end[], unsigned int num_bins)
+{
+    VPLanes in[VP_VECTORS], ramp[VP_VECTORS];
+    unsigned int v, lane, i;
+
+    for (v = 0; v < VP_VECTORS; v++) {
+        VPLanes s, g;
+        memcpy(&s, &samples[v * VP_LANES], sizeof(s));
+        memcpy(&g, &gain[v * VP_LANES], sizeof(g));
+        in[v] = s * g;
+        for (lane = 0; lane < VP_LANES; lane++) {
+            ramp[v][lane] = (v * VP_LANES + lane) / (float)VP_FRAME_SAMPLES;
+        }
+    }
+
+    for (i = 0; i < num_bins; i++) {
+        if (bins[i] >= VP_NUM_MIXBINS) {
+            continue;
+        }
+        VPLanes *out = mix->bins[bins[i]];
+        float delta = end[i] - start[i];
+        if (start[i] == 0.0f && delta == 0.0f) {
+            continue;
+        }
+        for (v = 0; v < VP_VECTORS; v++) {
+            out[v] += in[v] * (start[i] + ramp[v] * delta);
+        }
+    }
+}
+
+void vp_mixbins_to_s24(const VPMixbins *mix,
+                       int32_t out[VP_NUM_MIXBINS][VP_FRAME_SAMPLES])
+{
+    unsigned int bin, i;
+
+    for (bin = 0; bin < VP_NUM_MIXBINS; bin++) {
+        const float *in = (const float *)mix->bins[bin];
+        for (i = 0; i < VP_FRAME_SAMPLES; i++) {
+            float s = in[i] * 8388608.0f;
+            s = MIN(MAX(s, -8388608.0f), 8388607.0f);
+            out[bin][i] = (int32_t)s;
+        }
+    }
+}
+
+static float volume_table[0x1000];
+
+void vp_mix_init(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < 0xFFF; i++) {
+        volume_table[i] = powf(10.0f, -(i / 64.0f) / 20.0f);
+    }
+    volume_table[0xFFF] = 0.0f;
+}
+
+float vp_volume_gain(unsigned int attenuation)
+{
+    assert(attenuation < 0x1000);
+    return volume_table[attenuation];
+}
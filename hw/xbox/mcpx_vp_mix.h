@@ -0,0 +1,170 @@
+/*
+ * QEMU MCPX Voice Processor sample decoding and mixing
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_MCPX_VP_MIX_H
+#define HW_MCPX_VP_MIX_H
+
+/*
+ * The device independent half of the VP: turns guest sample data into
+ * floats, resamples a voice to the 48kHz frame and accumulates it into the
+ * mixbins. Samples are floats in [-1, 1), mixbins are float accumulators
+ * converted to the GP's 24 bit words once every voice is in.
+ */
+
+#define VP_FRAME_SAMPLES 32
+#define VP_NUM_MIXBINS 32
+#define VP_VOICE_BINS 8
+
+/* IMA ADPCM, a 4 byte header with the first sample then 64 nibbles, per
+ * channel. Stereo blocks interleave the channels every 4 bytes. */
+#define VP_ADPCM_BLOCK_SIZE 36
+#define VP_ADPCM_SAMPLES_PER_BLOCK 65
+
+/* Pitch is signed 4.12 octaves, the source is read at most 256x as fast */
+#define VP_MAX_RATE 256
+#define VP_MAX_SOURCE_SAMPLES \
+    (VP_FRAME_SAMPLES * VP_MAX_RATE + VP_ADPCM_SAMPLES_PER_BLOCK + 2)
+
+typedef float VPLanes __attribute__((vector_size(16)));
+#define VP_LANES (sizeof(VPLanes) / sizeof(float))
+
+typedef struct VPMixbins {
+    VPLanes bins[VP_NUM_MIXBINS][VP_FRAME_SAMPLES / VP_LANES];
+} VPMixbins;
+
+enum VPSampleFormat {
+    VP_FORMAT_U8,
+    VP_FORMAT_S16,
+    VP_FORMAT_S24,      /* in the top of a 32 bit container */
+    VP_FORMAT_S32,
+    VP_FORMAT_ADPCM,
+};
+
+/* Builds the volume table, once before anything is mixed */
+void vp_mix_init(void);
+
+/* Bytes of guest data one sample of every channel takes, or one block of
+ * every channel for ADPCM */
+unsigned int vp_sample_frame_size(enum VPSampleFormat format,
+                                  unsigned int channels);
+
+/* count PCM samples, interleaved when stereo, to one plane per channel */
+void vp_decode_pcm(enum VPSampleFormat format, unsigned int channels,
+                   const uint8_t *src, unsigned int count,
+                   float *left, float *right);
+
+/* count whole ADPCM blocks, VP_ADPCM_SAMPLES_PER_BLOCK samples each */
+void vp_decode_adpcm(unsigned int channels, const uint8_t *src,
+                     unsigned int count, float *left, float *right);
+
+/* Reads len bytes of a voice's sample data from offset on */
+typedef void VPReadFunc(void *opaque, uint32_t offset, uint8_t *buf,
+                        size_t len);
+
+/* Where a voice's samples are and how they're laid out. Positions count
+ * samples of every channel, as the CBO, LBO and EBO do. */
+typedef struct VPVoiceBuffer {
+    uint32_t base;              /* byte offset passed on to read */
+    enum VPSampleFormat format;
+    unsigned int channels;
+    uint32_t lbo;               /* first sample looped back to */
+    uint32_t ebo;               /* last sample */
+    bool loop;
+
+    VPReadFunc *read;
+    void *opaque;
+} VPVoiceBuffer;
+
+/* Room to decode a frame of one voice */
+typedef struct VPVoiceScratch {
+    uint8_t raw[VP_MAX_SOURCE_SAMPLES * 8];
+    float adpcm[2][VP_MAX_SOURCE_SAMPLES + VP_ADPCM_SAMPLES_PER_BLOCK];
+} VPVoiceScratch;
+
+/* Decodes count samples from pos on, following the loop or running out
+ * into silence. count is at most VP_MAX_SOURCE_SAMPLES. */
+void vp_voice_fill(const VPVoiceBuffer *buf, VPVoiceScratch *scratch,
+                   uint32_t pos, unsigned int count,
+                   float *left, float *right);
+
+/* Moves pos and frac on by a frame read at rate, following the loop.
+ * Returns false once a voice without a loop has run past its end, pos is
+ * left on the last sample then. */
+bool vp_voice_advance(const VPVoiceBuffer *buf, uint32_t *pos,
+                      float *frac, float rate);
+
+/* The amplitude envelope phases, as NV_PAVS_VOICE_PAR_STATE_EACUR */
+enum VPEnvelopePhase {
+    VP_ENVELOPE_OFF,
+    VP_ENVELOPE_DELAY,
+    VP_ENVELOPE_ATTACK,
+    VP_ENVELOPE_HOLD,
+    VP_ENVELOPE_DECAY,
+    VP_ENVELOPE_SUSTAIN,
+    VP_ENVELOPE_RELEASE,
+    VP_ENVELOPE_FORCE_RELEASE,
+};
+
+/*
+ * The state of a voice's amplitude envelope, lengths in samples. The level
+ * is kept in level, except during release where level holds the one it
+ * started from.
+ */
+typedef struct VPEnvelope {
+    unsigned int phase;
+    unsigned int count;         /* samples into the phase */
+    unsigned int level;         /* 0 to 255 */
+
+    unsigned int delay;
+    unsigned int attack;
+    unsigned int hold;
+    unsigned int decay;
+    unsigned int sustain;       /* level, 0 to 255 */
+    unsigned int release;
+} VPEnvelope;
+
+/* Steps the envelope through a frame, returns false once the release has
+ * run out */
+bool vp_envelope_run(VPEnvelope *env, float gain[VP_FRAME_SAMPLES]);
+
+/*
+ * Linearly interpolates a frame of output samples from src, reading it at
+ * rate source samples per output sample from frac. src has to hold
+ * vp_resample_span(frac, rate) samples.
+ */
+unsigned int vp_resample_span(float frac, float rate);
+void vp_resample(const float *src, float frac, float rate,
+                 float dst[VP_FRAME_SAMPLES]);
+
+/*
+ * Adds samples times gain into the mixbins, each of the voice's bins with
+ * its own volume ramping from start to end over the frame. Bins set to
+ * VP_NUM_MIXBINS or higher are skipped.
+ */
+void vp_mix(VPMixbins *mix, const float samples[VP_FRAME_SAMPLES],
+            const float gain[VP_FRAME_SAMPLES],
+            const unsigned int bins[], const float start[],
+            const float end[], unsigned int num_bins);
+
+/* Converts to the GP's 24 bit words, saturating */
+void vp_mixbins_to_s24(const VPMixbins *mix,
+                       int32_t out[VP_NUM_MIXBINS][VP_FRAME_SAMPLES]);
+
+/* 12 bit attenuation in 1/64 dB steps to a gain, all set is silence */
+float vp_volume_gain(unsigned int attenuation);
+
+#endif
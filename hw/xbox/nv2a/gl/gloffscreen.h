@@ -55,6 +55,9 @@ bool glo_check_extension(const char* ext_name);
 /* Create an OpenGL context */
 GloContext *glo_context_create(void);
 
+/* Create an OpenGL context sharing objects with an existing one */
+GloContext *glo_context_create_shared(GloContext *shared);
+
 /* Destroy a previouslu created OpenGL context */
 void glo_context_destroy(GloContext *context);
 
@@ -38,6 +38,12 @@ struct _GloContext {
 /* Create an OpenGL context for a certain pixel format. formatflags are from 
  * the GLO_ constants */
 GloContext *glo_context_create(void)
+{
+    return glo_context_create_shared(NULL);
+}
+
+/* Create an OpenGL context sharing objects with an existing one */
+GloContext *glo_context_create_shared(GloContext *shared)
 {
     CGLError err;
 
@@ -56,7 +62,8 @@ GloContext *glo_context_create(void)
     err = CGLChoosePixelFormat(attributes, &pix, &num);
     if (err) return NULL;
 
-    err = CGLCreateContext(pix, NULL, &context->cglContext);
+    err = CGLCreateContext(pix, shared ? shared->cglContext : NULL,
+                           &context->cglContext);
     if (err) return NULL;
 
     CGLDestroyPixelFormat(pix);
@@ -35,14 +35,24 @@ struct _GloContext {
 };
 
 static Display* x_display;
+static bool initialized = false;
 
+static GloContext *glo_context_create_internal(GloContext *shared);
+
+/*
+ * Shared contexts may be current on several threads at once. Xlib needs
+ * XInitThreads before any other Xlib call in the process, which the
+ * display backends make long before the first context is created, so it
+ * runs before main.
+ */
+static void __attribute__((constructor)) glo_init_threads(void)
+{
+    XInitThreads();
+}
 
 /* Create an OpenGL context */
 GloContext *glo_context_create(void)
 {
-
-    static bool initialized = false;
-
     if (!initialized) {    
         x_display = XOpenDisplay(0);     
         printf("gloffscreen: GLX_VERSION = %s\n", glXGetClientString(x_display, GLX_VERSION));
@@ -51,6 +61,23 @@ GloContext *glo_context_create(void)
         printf("gloffscreen already inited\n");
         exit(EXIT_FAILURE);
     }
+
+    return glo_context_create_internal(NULL);
+}
+
+/* Create an OpenGL context sharing objects with an existing one */
+GloContext *glo_context_create_shared(GloContext *shared)
+{
+    if (!initialized || !shared) {
+        printf("gloffscreen: no context to share with\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return glo_context_create_internal(shared);
+}
+
+static GloContext *glo_context_create_internal(GloContext *shared)
+{
     GloContext *context = (GloContext *)malloc(sizeof(GloContext));
 
     int fb_attribute_list[] = {
@@ -100,7 +127,8 @@ GloContext *glo_context_create(void)
         GLX_CONTEXT_PROFILE_MASK_ARB, GLX_CONTEXT_CORE_PROFILE_BIT_ARB,
         None
     };
-    context->glx_context = glXCreateContextAttribsARB(x_display, configs[0], 0, True, context_attribute_list);
+    context->glx_context = glXCreateContextAttribsARB(x_display, configs[0],
+        shared ? shared->glx_context : 0, True, context_attribute_list);
     XSync(x_display, False);
     if (context->glx_context == NULL) return NULL;
     glo_set_current(context);
@@ -155,6 +155,10 @@ static void glo_kill(void) {
 }
 
 GloContext *glo_context_create(void) {
+    return glo_context_create_shared(NULL);
+}
+
+GloContext *glo_context_create_shared(GloContext *shared) {
     if (!glo_inited)
       glo_init();
 
@@ -170,7 +174,8 @@ GloContext *glo_context_create(void) {
     };
 
     context->hDC = glo.hDC;
-    context->hContext = wglCreateContextAttribsARB(context->hDC, 0, ctx_attri);
+    context->hContext = wglCreateContextAttribsARB(context->hDC,
+        shared ? shared->hContext : 0, ctx_attri);
     if (context->hContext == NULL) {
         printf("Unable to create GL context\n");
         exit(EXIT_FAILURE);
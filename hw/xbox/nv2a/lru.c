@@ -36,6 +36,87 @@
 #define lru_dprintf(...) do {} while(0)
 #endif
 
+#define LRU_MIN_BINS 64
+
+static struct lru_node **lru_bin(struct lru *lru, uint64_t hash)
+{
+    return &lru->bins[hash & (lru->num_bins - 1)];
+}
+
+/*
+ * Resize the hash table, keeping at least as many bins as objects
+ */
+static void lru_rehash(struct lru *lru, size_t num_bins)
+{
+    struct lru_node *node;
+
+    free(lru->bins);
+    lru->num_bins = num_bins;
+    lru->bins = calloc(num_bins, sizeof(struct lru_node *));
+    assert(lru->bins != NULL);
+
+    for (node = lru->active_head; node != NULL; node = node->next) {
+        struct lru_node **bin = lru_bin(lru, node->hash);
+        node->bin_next = *bin;
+        *bin = node;
+    }
+}
+
+/*
+ * Unlink a node from the active list and its hash bin
+ */
+static void lru_unlink(struct lru *lru, struct lru_node *node)
+{
+    struct lru_node **bin = lru_bin(lru, node->hash);
+
+    while (*bin != node) {
+        assert(*bin != NULL);
+        bin = &(*bin)->bin_next;
+    }
+    *bin = node->bin_next;
+
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        lru->active_head = node->next;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    } else {
+        lru->active_tail = node->prev;
+    }
+
+    lru->num_active--;
+    lru->size -= node->size;
+}
+
+/*
+ * Link a node at the front of the active list
+ */
+static void lru_push_front(struct lru *lru, struct lru_node *node)
+{
+    node->prev = NULL;
+    node->next = lru->active_head;
+    if (lru->active_head != NULL) {
+        lru->active_head->prev = node;
+    } else {
+        lru->active_tail = node;
+    }
+    lru->active_head = node;
+}
+
+/*
+ * Evict an active object, returning it to the free list
+ */
+static void lru_evict(struct lru *lru, struct lru_node *node)
+{
+    lru_dprintf("Evicting %p\n", node);
+    lru_unlink(lru, node);
+    lru->obj_deinit(node);
+    lru_add_free(lru, node);
+    lru->num_evicted++;
+}
+
 /*
  * Create the LRU cache
  */
@@ -43,22 +124,31 @@ struct lru *lru_init(
     struct lru               *lru,
     lru_obj_init_func         obj_init,
     lru_obj_deinit_func       obj_deinit,
-    lru_obj_key_compare_func  obj_key_compare
+    lru_obj_key_compare_func  obj_key_compare,
+    size_t                    max_size
     )
 {
     assert(lru != NULL);
 
-    lru->active = NULL;
+    lru->active_head = NULL;
+    lru->active_tail = NULL;
     lru->free = NULL;
+    lru->bins = NULL;
+    lru_rehash(lru, LRU_MIN_BINS);
 
     lru->obj_init = obj_init;
     lru->obj_deinit = obj_deinit;
     lru->obj_key_compare = obj_key_compare;
 
+    lru->max_size = max_size;
+    lru->size = 0;
+
     lru->num_free = 0;
+    lru->num_active = 0;
     lru->num_collisions = 0;
     lru->num_hit = 0;
     lru->num_miss = 0;
+    lru->num_evicted = 0;
 
     return lru;
 }
@@ -69,8 +159,16 @@ struct lru *lru_init(
 struct lru_node *lru_add_free(struct lru *lru, struct lru_node *node)
 {
     node->next = lru->free;
+    node->prev = NULL;
+    node->bin_next = NULL;
+    node->size = 0;
     lru->free = node;
     lru->num_free++;
+
+    if (lru->num_free + lru->num_active > lru->num_bins) {
+        lru_rehash(lru, lru->num_bins * 2);
+    }
+
     return node;
 }
 
@@ -80,90 +178,56 @@ struct lru_node *lru_add_free(struct lru *lru, struct lru_node *node)
  * - If not found,
  *   - If cache is full, evict LRU, deinit object and add it to free list
  *   - Allocate object from free list, init, move to front of RU list
+ *   - Evict LRU objects until the cache is back within its byte budget
  */
 struct lru_node *lru_lookup(struct lru *lru, uint64_t hash, void *key)
 {
-    struct lru_node *prev, *node;
+    struct lru_node *node;
 
     assert(lru != NULL);
-    assert((lru->active != NULL) || (lru->free != NULL));
-
-    /* Walk through the cache in order of recent use */
-    prev = NULL;
-    node = lru->active;
+    assert((lru->active_head != NULL) || (lru->free != NULL));
 
     lru_dprintf("Looking for hash %016lx...\n", hash);
 
-    if (node != NULL) {
-        do {
-            lru_dprintf("  %016lx\n", node->hash);
-
-            /* Fast hash compare */
-            if (node->hash == hash) {
-                /* Detailed key comparison */
-                if (lru->obj_key_compare(node, key) == 0) {
-                    lru_dprintf("Hit, node=%p!\n", node);
-                    lru->num_hit++;
-
-                    if (prev == NULL) {
-                        /* Node is already at the front of the RU list */
-                        return node;
-                    }
-
-                    /* Unlink and promote node */
-                    lru_dprintf("Promoting node %p\n", node);
-                    prev->next = node->next;
-                    node->next = lru->active;
-                    lru->active = node;
-                    return node;
-                }
+    for (node = *lru_bin(lru, hash); node != NULL; node = node->bin_next) {
+        lru_dprintf("  %016lx\n", node->hash);
 
-                /* Hash collision! Get a better hashing function... */
-                lru_dprintf("Hash collision detected!\n");
-                lru->num_collisions++;
-            }
+        /* Fast hash compare */
+        if (node->hash != hash) {
+            continue;
+        }
 
-            if (node->next == NULL) {
-                /* No more nodes left to look at after this... Stop here as we
-                 * may need to evict this final (last recently used) node.
-                 */
-                break;
+        /* Detailed key comparison */
+        if (lru->obj_key_compare(node, key) == 0) {
+            lru_dprintf("Hit, node=%p!\n", node);
+            lru->num_hit++;
+
+            if (node != lru->active_head) {
+                /* Unlink and promote node */
+                lru_dprintf("Promoting node %p\n", node);
+                node->prev->next = node->next;
+                if (node->next != NULL) {
+                    node->next->prev = node->prev;
+                } else {
+                    lru->active_tail = node->prev;
+                }
+                lru_push_front(lru, node);
             }
+            return node;
+        }
 
-            prev = node;
-            node = node->next;
-        } while (1);
+        /* Hash collision! Get a better hashing function... */
+        lru_dprintf("Hash collision detected!\n");
+        lru->num_collisions++;
     }
 
     lru_dprintf("Miss\n");
     lru->num_miss++;
 
-    /* Reached the end of the active list.
-     *
-     * `node` points to:
-     * - NULL if there are no active objects in the cache, or
-     * - the last object in the RU list
-     *
-     * `prev` points to:
-     * - NULL if there are <= 1 active objects in the cache, or
-     * - the second to last object in the RU list
-     */
-
     if (lru->free == NULL) {
-        /* No free nodes left, must evict a node. `node` is LRU. */
-        assert(node != NULL); /* Sanity check: there must be an active object */
-        lru_dprintf("Evicting %p\n", node);
-
-        if (prev == NULL) {
-            /* This was the only node */
-            lru->active = NULL;
-        } else {
-            /* Unlink node */
-            prev->next = node->next;
-        }
-
-        lru->obj_deinit(node);
-        lru_add_free(lru, node);
+        /* No free nodes left, must evict the LRU node */
+        assert(lru->active_tail != NULL);
+        lru_evict(lru, lru->active_tail);
     }
 
     /* Allocate a node from the free list */
@@ -172,11 +236,23 @@ struct lru_node *lru_lookup(struct lru *lru, uint64_t hash, void *key)
     lru->free = node->next;
     lru->num_free--;
 
-    /* Initialize, promote, and return the node */
+    /* Initialize, promote, and index the node */
+    node->size = 0;
     lru->obj_init(node, key);
     node->hash = hash;
-    node->next = lru->active;
-    lru->active = node;
+    lru_push_front(lru, node);
+    struct lru_node **bin = lru_bin(lru, hash);
+    node->bin_next = *bin;
+    *bin = node;
+    lru->num_active++;
+    lru->size += node->size;
+
+    /* Stay within budget, but never evict the object being returned */
+    while (lru->max_size != 0 && lru->size > lru->max_size
+           && lru->active_tail != node) {
+        lru_evict(lru, lru->active_tail);
+    }
+
     return node;
 }
 
@@ -185,17 +261,21 @@ struct lru_node *lru_lookup(struct lru *lru, uint64_t hash, void *key)
  */
 void lru_flush(struct lru *lru)
 {
-    struct lru_node *node, *next;
-
-    node = lru->active;
-    next = NULL;
-
-    while (node != NULL) {
-        next = node->next;
+    while (lru->active_head != NULL) {
+        struct lru_node *node = lru->active_head;
+        lru_unlink(lru, node);
         lru->obj_deinit(node);
         lru_add_free(lru, node);
-        node = next;
     }
+}
 
-    lru->active = NULL;
+/*
+ * Flush the cache and release the hash table
+ */
+void lru_destroy(struct lru *lru)
+{
+    lru_flush(lru);
+    free(lru->bins);
+    lru->bins = NULL;
+    lru->num_bins = 0;
 }
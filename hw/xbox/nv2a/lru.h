@@ -4,15 +4,18 @@
  * - Designed for pre-allocated array of objects which are accessed frequently
  * - Objects are identified by a hash and an opaque `key` data structure
  * - Lookups are first done by hash, then confirmed by callback compare function
- * - Two singly linked lists are maintained: a free list and an active list
+ * - Active objects are indexed by a hash table and kept on a doubly linked
+ *   list in order of recent use; unused objects are kept on a free list
  * - On cache miss, object is created from free list or by evicting the LRU
  * - When created, a callback function is called to fully initialize the object
+ * - Objects may carry a size, in which case the active objects are kept within
+ *   a byte budget by evicting the least recently used ones
  *
  * Setup
  * -----
  * - Create an object data structure, embed in it `struct lru_node`
  * - Create an init, deinit, and compare function
- * - Call `lru_init`
+ * - Call `lru_init`, optionally with a byte budget
  * - Allocate a number of these objects
  * - For each object, call `lru_add_free` to populate entries in the cache
  *
@@ -21,16 +24,18 @@
  * - Initialize custom key data structure (will be used for comparison)
  * - Create 64b hash of the object and/or key
  * - Call `lru_lookup` with the hash and key
- *   - The active list is searched, the compare callback will be called if an
- *     object with matching hash is found
+ *   - The hash table bin for the hash is searched, the compare callback will
+ *     be called if an object with matching hash is found
  *   - If object is found in the cache, it will be moved to the front of the
  *     active list and returned
  *   - If object is not found in the cache:
  *     - If no free items are available, the LRU will be evicted, deinit
  *       callback will be called
  *     - An object is popped from the free list and the init callback is called
- *       on the object
- *     - The object is added to the front of the active list and returned
+ *       on the object. The init callback may set `size` on the node.
+ *     - The object is added to the front of the active list
+ *     - While over the byte budget, the LRU objects are evicted
+ *     - The object is returned
  *
  * ---
  *
@@ -68,34 +73,47 @@ typedef struct lru_node *(*lru_obj_deinit_func)(struct lru_node *obj);
 typedef int              (*lru_obj_key_compare_func)(struct lru_node *obj, void *key);
 
 struct lru {
-	struct lru_node *active; /* Singly-linked list tracking recently active */
-	struct lru_node *free;   /* Singly-linked list tracking available objects */
+	struct lru_node *active_head; /* Doubly-linked list, most recent first */
+	struct lru_node *active_tail; /* Least recently used object */
+	struct lru_node *free;        /* Singly-linked list of available objects */
+	struct lru_node **bins;       /* Hash table of active objects */
+	size_t num_bins;
 
 	lru_obj_init_func         obj_init;
 	lru_obj_deinit_func       obj_deinit;
 	lru_obj_key_compare_func  obj_key_compare;
 
+	size_t max_size;              /* Byte budget, 0 for no limit */
+	size_t size;                  /* Bytes used by active objects */
+
 	size_t num_free;
+	size_t num_active;
 	size_t num_collisions;
 	size_t num_hit;
 	size_t num_miss;
+	size_t num_evicted;
 };
 
 /* This should be embedded in the object structure */
 struct lru_node {
 	uint64_t hash;
+	size_t size;                  /* Set by the init callback */
 	struct lru_node *next;
+	struct lru_node *prev;
+	struct lru_node *bin_next;
 };
 
 struct lru *lru_init(
 	struct lru *lru,
 	lru_obj_init_func obj_init,
 	lru_obj_deinit_func obj_deinit,
-	lru_obj_key_compare_func obj_key_compare
+	lru_obj_key_compare_func obj_key_compare,
+	size_t max_size
 	);
 
 struct lru_node *lru_add_free(struct lru *lru, struct lru_node *node);
 struct lru_node *lru_lookup(struct lru *lru, uint64_t hash, void *key);
 void lru_flush(struct lru *lru);
+void lru_destroy(struct lru *lru);
 
 #endif
@@ -20,6 +20,7 @@
  */
 
 #include <assert.h>
+#include <math.h>
 
 #include "qemu/osdep.h"
 #include "qemu/thread.h"
@@ -33,8 +34,13 @@
 #include "hw/display/vga_regs.h"
 #include "hw/pci/pci.h"
 #include "cpu.h"
+#include "monitor/monitor.h"
+#include "monitor/hmp-target.h"
+#include "sysemu/sysemu.h"
 
 #include "swizzle.h"
+#include "vertex_convert.h"
+#include "nv2a_soft_raster.h"
 
 #include "hw/xbox/nv2a/nv2a_int.h"
 
@@ -99,7 +105,7 @@ static void update_irq(NV2AState *d)
     }
 }
 
-static DMAObject nv_dma_load(NV2AState *d, hwaddr dma_obj_address)
+static DMAObject nv_dma_decode(NV2AState *d, hwaddr dma_obj_address)
 {
     assert(dma_obj_address < memory_region_size(&d->ramin));
 
@@ -116,15 +122,27 @@ static DMAObject nv_dma_load(NV2AState *d, hwaddr dma_obj_address)
     };
 }
 
-static void *nv_dma_map(NV2AState *d, hwaddr dma_obj_address, hwaddr *len)
+/* Goes through the DMA object cache, so only for the puller thread */
+static DMAObject nv_dma_load(NV2AState *d, hwaddr dma_obj_address)
 {
-    DMAObject dma = nv_dma_load(d, dma_obj_address);
+    DMACacheEntry *entry =
+        &d->dma_cache[(dma_obj_address >> 4) % NV2A_DMA_CACHE_SIZE];
 
-    /* TODO: Handle targets and classes properly */
-    NV2A_DPRINTF("dma_map %" HWADDR_PRIx " - %x, %x, %" HWADDR_PRIx " %" HWADDR_PRIx "\n",
-                 dma_obj_address,
-                 dma.dma_class, dma.dma_target, dma.address, dma.limit);
+    if (entry->valid && entry->address == dma_obj_address) {
+        d->dma_cache_hits++;
+        return entry->dma;
+    }
+
+    entry->dma = nv_dma_decode(d, dma_obj_address);
+    entry->address = dma_obj_address;
+    entry->valid = true;
+    d->dma_cache_misses++;
+    return entry->dma;
+}
 
+static void *nv_dma_map_object(NV2AState *d, DMAObject dma, hwaddr *len)
+{
+    /* TODO: Handle targets and classes properly */
     dma.address &= 0x07FFFFFF;
 
     assert(dma.address < memory_region_size(d->vram));
@@ -133,10 +151,38 @@ static void *nv_dma_map(NV2AState *d, hwaddr dma_obj_address, hwaddr *len)
     return d->vram_ptr + dma.address;
 }
 
+static void *nv_dma_map(NV2AState *d, hwaddr dma_obj_address, hwaddr *len)
+{
+    DMAObject dma = nv_dma_load(d, dma_obj_address);
+
+    NV2A_DPRINTF("dma_map %" HWADDR_PRIx " - %x, %x, %" HWADDR_PRIx " %" HWADDR_PRIx "\n",
+                 dma_obj_address,
+                 dma.dma_class, dma.dma_target, dma.address, dma.limit);
+
+    return nv_dma_map_object(d, dma, len);
+}
+
+/* Drops the cached RAMHT entries and DMA objects if the guest wrote to
+ * RAMIN since the last call. Called on the puller thread before each batch
+ * of methods is resolved. */
+static void nv2a_ramin_check_dirty(NV2AState *d)
+{
+    if (!memory_region_test_and_clear_dirty(&d->ramin, 0,
+                                            memory_region_size(&d->ramin),
+                                            DIRTY_MEMORY_NV2A)) {
+        return;
+    }
+
+    memset(d->pfifo.ramht_cache, 0, sizeof(d->pfifo.ramht_cache));
+    memset(d->dma_cache, 0, sizeof(d->dma_cache));
+    d->ramin_invalidations++;
+}
+
 #include "nv2a_pbus.c"
 #include "nv2a_pcrtc.c"
 #include "nv2a_pfb.c"
 #include "nv2a_pgraph.c"
+#include "nv2a_pgraph_soft.c"
 #include "nv2a_pfifo.c"
 #include "nv2a_pmc.c"
 #include "nv2a_pramdac.c"
@@ -380,8 +426,27 @@ static void nv2a_init_memory(NV2AState *d, MemoryRegion *ram)
     d->ramin_ptr = memory_region_get_ram_ptr(&d->ramin);
 
     memory_region_set_log(d->vram, true, DIRTY_MEMORY_NV2A);
+    memory_region_set_log(d->vram, true, DIRTY_MEMORY_NV2A_TEX);
     memory_region_set_dirty(d->vram, 0, memory_region_size(d->vram));
 
+    /* invalidates the RAMHT and DMA object caches */
+    memory_region_set_log(&d->ramin, true, DIRTY_MEMORY_NV2A);
+    memory_region_set_dirty(&d->ramin, 0, memory_region_size(&d->ramin));
+
+    qemu_mutex_init(&d->capture_lock);
+    if (d->capture_path) {
+        d->capture = capture_file_create(d->capture_path,
+                                         memory_region_size(d->vram),
+                                         memory_region_size(&d->ramin));
+    }
+    if (d->capture) {
+        /* everything goes into the first memory record */
+        memory_region_set_log(d->vram, true, DIRTY_MEMORY_NV2A_CAPTURE);
+        memory_region_set_log(&d->ramin, true, DIRTY_MEMORY_NV2A_CAPTURE);
+        memory_region_set_dirty(d->vram, 0, memory_region_size(d->vram));
+        memory_region_set_dirty(&d->ramin, 0, memory_region_size(&d->ramin));
+    }
+
     /* hacky. swap out vga's vram */
     memory_region_destroy(&d->vga.vram);
     // memory_region_unref(&d->vga.vram); // FIXME: Is ths right?
@@ -390,6 +455,14 @@ static void nv2a_init_memory(NV2AState *d, MemoryRegion *ram)
     d->vga.vram_ptr = memory_region_get_ram_ptr(&d->vga.vram);
     vga_dirty_log_start(&d->vga);
 
+    if (d->renderer_name && !strcmp(d->renderer_name,
+                                    pgraph_soft_renderer.name)) {
+        d->pgraph.renderer = &pgraph_soft_renderer;
+    } else if (d->renderer_name && strcmp(d->renderer_name, "gl")) {
+        fprintf(stderr, "nv2a: unknown renderer %s, drawing with GL\n",
+                d->renderer_name);
+    }
+
     pgraph_init(d);
 
     /* fire up puller */
@@ -452,8 +525,10 @@ static void nv2a_realize(PCIDevice *dev, Error **errp)
     qemu_mutex_init(&d->pfifo.lock);
     qemu_cond_init(&d->pfifo.puller_cond);
     qemu_cond_init(&d->pfifo.pusher_cond);
+    method_ring_init(&d->pfifo.ring);
 
     d->pfifo.regs[NV_PFIFO_CACHE1_STATUS] |= NV_PFIFO_CACHE1_STATUS_LOW_MARK;
+    d->pfifo.rate_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 }
 
 static void nv2a_exitfn(PCIDevice *dev)
@@ -465,12 +540,37 @@ static void nv2a_exitfn(PCIDevice *dev)
 
     qemu_cond_broadcast(&d->pfifo.puller_cond);
     qemu_cond_broadcast(&d->pfifo.pusher_cond);
+    qemu_event_set(&d->pfifo.ring.not_empty);
+    qemu_event_set(&d->pfifo.ring.not_full);
     qemu_thread_join(&d->pfifo.puller_thread);
     qemu_thread_join(&d->pfifo.pusher_thread);
+    method_ring_destroy(&d->pfifo.ring);
+
+    if (d->capture) {
+        capture_file_close(d->capture);
+    }
+    qemu_mutex_destroy(&d->capture_lock);
 
     pgraph_destroy(&d->pgraph);
 }
 
+static Property nv2a_properties[] = {
+    DEFINE_PROP_STRING("shader-cache", NV2AState, shader_cache_path),
+    DEFINE_PROP_UINT32("shader-threads", NV2AState, shader_threads, 0),
+    DEFINE_PROP_BOOL("shader-skip-draws", NV2AState, shader_skip_draws, false),
+    DEFINE_PROP_UINT32("texture-cache-mb", NV2AState, texture_cache_mb, 256),
+    DEFINE_PROP_UINT32("texture-threads", NV2AState, texture_threads, 0),
+    DEFINE_PROP_BOOL("pfifo-direct", NV2AState, pfifo_direct, false),
+    DEFINE_PROP_STRING("pfifo-capture", NV2AState, capture_path),
+    DEFINE_PROP_STRING("pfifo-replay", NV2AState, replay_path),
+    DEFINE_PROP_BOOL("pfifo-replay-pusher", NV2AState, replay_pusher, false),
+    DEFINE_PROP_STRING("renderer", NV2AState, renderer_name),
+    DEFINE_PROP_UINT32("renderer-threads", NV2AState, renderer_threads, 0),
+    DEFINE_PROP_STRING("vsh-cpu", NV2AState, vsh_cpu_name),
+    DEFINE_PROP_STRING("zpass-reports", NV2AState, zpass_report_name),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void nv2a_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -484,6 +584,7 @@ static void nv2a_class_init(ObjectClass *klass, void *data)
     k->exit      = nv2a_exitfn;
 
     dc->desc = "GeForce NV2A Integrated Graphics";
+    dc->props = nv2a_properties;
 }
 
 static const TypeInfo nv2a_info = {
@@ -509,3 +610,21 @@ void nv2a_init(PCIBus *bus, int devfn, MemoryRegion *ram)
     NV2AState *d = NV2A_DEVICE(dev);
     nv2a_init_memory(d, ram);
 }
+
+void hmp_info_nv2a(Monitor *mon, const QDict *qdict)
+{
+    Object *obj = object_resolve_path_type("", "nv2a", NULL);
+    if (!obj) {
+        monitor_printf(mon, "No nv2a device\n");
+        return;
+    }
+
+    NV2AState *d = NV2A_DEVICE(obj);
+    qemu_mutex_lock(&d->pfifo.lock);
+    pfifo_print_stats(d, mon);
+    qemu_mutex_unlock(&d->pfifo.lock);
+
+    qemu_mutex_lock(&d->pgraph.lock);
+    pgraph_print_stats(&d->pgraph, mon);
+    qemu_mutex_unlock(&d->pgraph.lock);
+}
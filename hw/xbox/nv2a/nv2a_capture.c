@@ -0,0 +1,172 @@
+/*
+ * QEMU Geforce NV2A method stream capture files
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "nv2a_debug.h"
+#include "nv2a_capture.h"
+
+CaptureFile *capture_file_create(const char *path, uint32_t vram_size,
+                                 uint32_t ramin_size)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "nv2a: failed to create capture %s: %s\n",
+                path, strerror(errno));
+        return NULL;
+    }
+
+    CaptureHeader header = {
+        .magic = CAPTURE_MAGIC,
+        .version = CAPTURE_VERSION,
+        .vram_size = vram_size,
+        .ramin_size = ramin_size,
+    };
+    fwrite(&header, sizeof(header), 1, file);
+
+    CaptureFile *f = g_malloc0(sizeof(CaptureFile));
+    qemu_mutex_init(&f->lock);
+    f->file = file;
+    f->writing = true;
+    f->bytes = sizeof(header);
+
+    return f;
+}
+
+CaptureFile *capture_file_open(const char *path, CaptureHeader *header)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "nv2a: failed to open capture %s: %s\n",
+                path, strerror(errno));
+        return NULL;
+    }
+
+    if (fread(header, sizeof(*header), 1, file) != 1
+        || memcmp(header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0
+        || header->version != CAPTURE_VERSION) {
+        fprintf(stderr, "nv2a: %s is not a version %d capture\n",
+                path, CAPTURE_VERSION);
+        fclose(file);
+        return NULL;
+    }
+
+    CaptureFile *f = g_malloc0(sizeof(CaptureFile));
+    qemu_mutex_init(&f->lock);
+    f->file = file;
+    f->bytes = sizeof(*header);
+    f->max_record_length = sizeof(CaptureMemory)
+                           + MAX(header->vram_size, header->ramin_size);
+
+    return f;
+}
+
+void capture_file_close(CaptureFile *f)
+{
+    if (f->writing) {
+        fprintf(stderr, "nv2a: capture: %" PRIu64 " methods, %" PRIu64
+                        " MiB of memory, %" PRIu64 " MiB total\n",
+                f->methods, f->memory_bytes >> 20, f->bytes >> 20);
+    }
+
+    fclose(f->file);
+    qemu_mutex_destroy(&f->lock);
+    g_free(f->payload);
+    g_free(f);
+}
+
+/* Called with the lock held */
+static void capture_write_record(CaptureFile *f, uint32_t type,
+                                 const void *a, size_t a_length,
+                                 const void *b, size_t b_length)
+{
+    CaptureRecord record = {
+        .type = type,
+        .length = a_length + b_length,
+    };
+
+    fwrite(&record, sizeof(record), 1, f->file);
+    fwrite(a, a_length, 1, f->file);
+    if (b_length) {
+        fwrite(b, b_length, 1, f->file);
+    }
+    f->bytes += sizeof(record) + record.length;
+}
+
+void capture_write_memory(CaptureFile *f, uint32_t space, uint32_t offset,
+                          const void *data, uint32_t length)
+{
+    CaptureMemory memory = {
+        .space = space,
+        .offset = offset,
+    };
+
+    qemu_mutex_lock(&f->lock);
+    capture_write_record(f, CAPTURE_RECORD_MEMORY, &memory, sizeof(memory),
+                         data, length);
+    f->memory_bytes += length;
+    qemu_mutex_unlock(&f->lock);
+}
+
+void capture_write_methods(CaptureFile *f, const CaptureMethod *methods,
+                           unsigned int count)
+{
+    qemu_mutex_lock(&f->lock);
+    capture_write_record(f, CAPTURE_RECORD_METHODS,
+                         methods, count * sizeof(methods[0]), NULL, 0);
+    f->methods += count;
+    qemu_mutex_unlock(&f->lock);
+}
+
+void capture_write_register(CaptureFile *f, uint32_t addr, uint32_t value)
+{
+    CaptureRegister reg = {
+        .addr = addr,
+        .value = value,
+    };
+
+    qemu_mutex_lock(&f->lock);
+    capture_write_record(f, CAPTURE_RECORD_REGISTER, &reg, sizeof(reg),
+                         NULL, 0);
+    qemu_mutex_unlock(&f->lock);
+}
+
+const void *capture_read_record(CaptureFile *f, CaptureRecord *record)
+{
+    if (fread(record, sizeof(*record), 1, f->file) != 1) {
+        return NULL;
+    }
+
+    if (record->length > f->max_record_length) {
+        fprintf(stderr, "nv2a: capture: record of %u bytes is larger than "
+                        "the captured memory\n", record->length);
+        f->error = true;
+        return NULL;
+    }
+    if (record->length > f->payload_size) {
+        f->payload_size = MAX(record->length, f->payload_size * 2);
+        f->payload = g_realloc(f->payload, f->payload_size);
+    }
+    if (record->length > 0
+        && fread(f->payload, record->length, 1, f->file) != 1) {
+        NV2A_DPRINTF("capture: truncated record\n");
+        return NULL;
+    }
+    f->bytes += sizeof(*record) + record->length;
+
+    return f->payload;
+}
@@ -0,0 +1,124 @@
+/*
+ * QEMU Geforce NV2A method stream capture files
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_NV2A_CAPTURE_H
+#define HW_NV2A_CAPTURE_H
+
+#include <stdio.h>
+
+#include "qemu/thread.h"
+
+/*
+ * A capture is a header followed by a stream of records, in the order the
+ * emulator saw them:
+ *
+ *  - memory records hold VRAM or RAMIN pages written since the previous
+ *    memory record. The first ones hold everything, later ones are deltas
+ *    taken just before each batch of methods is handed to PGRAPH, so a
+ *    replay always has the data the methods refer to.
+ *  - method records hold the methods pulled from the FIFO, after object
+ *    handles have been looked up in RAMHT.
+ *  - register records hold guest writes to PGRAPH registers.
+ *
+ * Everything is stored in host byte order.
+ */
+
+#define CAPTURE_MAGIC   "NV2ACAP"
+#define CAPTURE_VERSION 1
+
+enum CaptureRecordType {
+    CAPTURE_RECORD_MEMORY = 1,
+    CAPTURE_RECORD_METHODS = 2,
+    CAPTURE_RECORD_REGISTER = 3,
+};
+
+enum CaptureSpace {
+    CAPTURE_SPACE_VRAM = 0,
+    CAPTURE_SPACE_RAMIN = 1,
+};
+
+typedef struct CaptureHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t vram_size;
+    uint32_t ramin_size;
+    uint32_t reserved;
+} CaptureHeader;
+
+typedef struct CaptureRecord {
+    uint32_t type;
+    uint32_t length;    /* of the payload following the record */
+} CaptureRecord;
+
+/* payload of CAPTURE_RECORD_MEMORY, followed by the data */
+typedef struct CaptureMemory {
+    uint32_t space;
+    uint32_t offset;
+} CaptureMemory;
+
+/* payload of CAPTURE_RECORD_METHODS is an array of these */
+typedef struct CaptureMethod {
+    uint16_t method;
+    uint8_t subchannel;
+    uint8_t flags;
+    uint32_t parameter;
+} CaptureMethod;
+
+#define CAPTURE_METHOD_CHANNEL_ID     0x1F  /* only set for method 0 */
+#define CAPTURE_METHOD_NONINCREASING  (1 << 7)
+
+/* payload of CAPTURE_RECORD_REGISTER */
+typedef struct CaptureRegister {
+    uint32_t addr;
+    uint32_t value;
+} CaptureRegister;
+
+typedef struct CaptureFile {
+    QemuMutex lock;
+    FILE *file;
+    bool writing;
+
+    /* scratch space for reading payloads */
+    uint8_t *payload;
+    size_t payload_size;
+    /* reading only, larger records can't be valid */
+    uint32_t max_record_length;
+    /* reading stopped at an oversized record */
+    bool error;
+
+    uint64_t bytes;
+    uint64_t memory_bytes;
+    uint64_t methods;
+} CaptureFile;
+
+CaptureFile *capture_file_create(const char *path, uint32_t vram_size,
+                                 uint32_t ramin_size);
+CaptureFile *capture_file_open(const char *path, CaptureHeader *header);
+void capture_file_close(CaptureFile *f);
+
+/* Writers may be called from several threads */
+void capture_write_memory(CaptureFile *f, uint32_t space, uint32_t offset,
+                          const void *data, uint32_t length);
+void capture_write_methods(CaptureFile *f, const CaptureMethod *methods,
+                           unsigned int count);
+void capture_write_register(CaptureFile *f, uint32_t addr, uint32_t value);
+
+/* Returns a pointer to the payload, valid until the next call, or NULL at
+ * the end of the file */
+const void *capture_read_record(CaptureFile *f, CaptureRecord *record);
+
+#endif
@@ -23,6 +23,7 @@
 #define HW_NV2A_INT_H
 
 #include "qemu/osdep.h"
+#include "qemu/queue.h"
 
 #include "hw/hw.h"
 // #include "hw/i386/pc.h"
@@ -35,6 +36,12 @@
 
 #include "hw/xbox/nv2a/nv2a_debug.h"
 #include "hw/xbox/nv2a/nv2a_shaders.h"
+#include "hw/xbox/nv2a/nv2a_shader_cache.h"
+#include "hw/xbox/nv2a/nv2a_shader_compiler.h"
+#include "hw/xbox/nv2a/nv2a_vertex_stream.h"
+#include "hw/xbox/nv2a/nv2a_method_ring.h"
+#include "hw/xbox/nv2a/nv2a_capture.h"
+#include "hw/xbox/nv2a/nv2a_texture_decode.h"
 #include "hw/xbox/nv2a/nv2a_debug.h"
 #include "hw/xbox/nv2a/nv2a_regs.h"
 
@@ -71,6 +78,32 @@ typedef struct DMAObject {
     hwaddr limit;
 } DMAObject;
 
+typedef struct RAMHTEntry {
+    uint32_t handle;
+    hwaddr instance;
+    enum FIFOEngine engine;
+    unsigned int channel_id : 5;
+    bool valid;
+} RAMHTEntry;
+
+/* Objects resolved from RAMIN, kept until the guest writes to RAMIN again.
+ * Both caches are direct mapped and only used on the puller thread. */
+#define NV2A_RAMHT_CACHE_SIZE 64
+#define NV2A_DMA_CACHE_SIZE   32
+
+typedef struct RAMHTCacheEntry {
+    bool valid;
+    uint32_t handle;
+    unsigned int channel_id;
+    RAMHTEntry entry;
+} RAMHTCacheEntry;
+
+typedef struct DMACacheEntry {
+    bool valid;
+    hwaddr address;
+    DMAObject dma;
+} DMACacheEntry;
+
 typedef struct VertexAttribute {
     bool dma_select;
     hwaddr offset;
@@ -87,12 +120,15 @@ typedef struct VertexAttribute {
     uint32_t stride;
 
     bool needs_conversion;
+    /* scratch space for converting inline arrays */
     uint8_t *converted_buffer;
-    unsigned int converted_elements;
+    size_t converted_buffer_size;
     unsigned int converted_size;
     unsigned int converted_count;
 
+    /* allocated once and kept between batches */
     float *inline_buffer;
+    bool inline_buffer_populated;
 
     GLint gl_count;
     GLenum gl_type;
@@ -102,15 +138,148 @@ typedef struct VertexAttribute {
     GLuint gl_inline_buffer;
 } VertexAttribute;
 
+/* The VRAM a cached texture or vertex array was made from. Ranges are
+ * indexed by the 64KiB blocks they cover, so a write only has to flag the
+ * objects on the blocks written. */
+#define NV2A_VRAM_RANGE_BLOCK_SHIFT 16
+
+typedef struct VramRangeIndex {
+    GPtrArray **blocks;     /* of VramRange *, allocated on first use */
+    unsigned int num_blocks;
+} VramRangeIndex;
+
+typedef struct VramRange {
+    hwaddr start;
+    hwaddr end;
+    bool *dirty;            /* set when the guest writes to the range */
+    VramRangeIndex *index;  /* NULL when not indexed */
+} VramRange;
+
+/* Identifies a converted vertex array in VRAM. Zero-initialise before
+ * filling in, keys are compared with memcmp. */
+typedef struct VertexConversionKey {
+    hwaddr addr;
+    uint32_t stride;
+    unsigned int format;
+    unsigned int count;
+} VertexConversionKey;
+
+typedef struct VertexConversion {
+    QTAILQ_ENTRY(VertexConversion) entry;
+    VertexConversionKey key;
+
+    /* the source pages were written since it was converted */
+    bool dirty;
+    VramRange range;
+    unsigned int elements;
+    unsigned int capacity;
+    uint8_t *data;
+    GLuint gl_buffer;
+} VertexConversion;
+
+#define NV2A_VERTEX_CONVERSION_CACHE_SIZE 256
+
+/* Where the CPU reads a vertex attribute from for the current draw */
+typedef struct VertexAttributeSource {
+    const uint8_t *data;    /* NULL to use value for every vertex */
+    const uint8_t *end;
+    unsigned int stride;
+    unsigned int format;
+    unsigned int count;
+    unsigned int size;
+    const float *value;
+} VertexAttributeSource;
+
+enum VshCpuMode {
+    VSH_CPU_OFF,
+    VSH_CPU_ON,
+    /* programs start on the CPU, and move to GL once used for enough
+     * draws that compiling them pays off */
+    VSH_CPU_AUTO,
+};
+
+#define NV2A_VSH_PROGRAM_CACHE_SIZE 64
+#define NV2A_VSH_CPU_AUTO_DRAWS 64
+/* Largest range of vertices transformed on the CPU for one draw */
+#define NV2A_VSH_CPU_MAX_VERTICES (1 << 20)
+
+/* Decoded vertex program, keyed by its tokens */
+typedef struct VshProgramEntry {
+    QTAILQ_ENTRY(VshProgramEntry) entry;
+    uint32_t tokens[NV2A_MAX_TRANSFORM_PROGRAM_LENGTH][VSH_TOKEN_SIZE];
+    unsigned int length;
+    VshProgram *program;    /* NULL if it can only be run by GL */
+    unsigned int draws;
+} VshProgramEntry;
+
+/* GL calls made by PGRAPH, counted per frame */
+typedef struct PGRAPHGLCalls {
+    unsigned int draws;
+    unsigned int uniforms;
+    unsigned int uniform_buffer_uploads;
+} PGRAPHGLCalls;
+
 typedef struct Surface {
     bool draw_dirty;
-    bool buffer_dirty;
     bool write_enabled_cache;
     unsigned int pitch;
 
     hwaddr offset;
 } Surface;
 
+/* Identifies a render target in VRAM. Zero-initialise before filling in,
+ * keys are compared with memcmp. */
+typedef struct SurfaceKey {
+    hwaddr vram_addr;
+    unsigned int pitch;
+    bool color;
+    bool swizzle;
+    unsigned int format;
+    unsigned int width, height;
+} SurfaceKey;
+
+/* A surface download in flight. glReadPixels writes into a pixel pack
+ * buffer and the copy into VRAM is deferred until the guest can observe it,
+ * or the fence shows the GPU is done anyway. */
+typedef struct SurfaceReadback {
+    GLuint gl_buffer;
+    size_t buffer_size;
+    GLsync fence;
+    bool pending;
+
+    SurfaceKey key;
+    unsigned int bytes_per_pixel;
+} SurfaceReadback;
+
+#define NV2A_SURFACE_READBACKS 4
+
+/* A zpass pixel count report waiting for its occlusion queries. The count
+ * is written to report memory once the queries have finished, and titles
+ * poll the report until it shows up. */
+typedef struct ZpassReport {
+    GLuint *gl_queries;
+    unsigned int query_count;
+    unsigned int queries_size;
+    /* CLEAR_REPORT_VALUE came before these queries */
+    bool clear;
+    bool pending;
+
+    hwaddr dma_report;
+    hwaddr offset;
+    uint64_t timestamp;
+} ZpassReport;
+
+#define NV2A_ZPASS_REPORTS 64
+
+enum ZpassReportMode {
+    /* wait for the queries on every report, like the hardware */
+    ZPASS_REPORT_SYNC,
+    ZPASS_REPORT_DEFERRED,
+    /* answer at once with the count the report held last time, usually
+     * the previous frame's, and write the real count later */
+    ZPASS_REPORT_LATENCY,
+};
+
 typedef struct SurfaceShape {
     unsigned int z_format;
     unsigned int color_format;
@@ -138,14 +307,63 @@ typedef struct TextureBinding {
     unsigned int refcnt;
 } TextureBinding;
 
+/* One glTexImage call for a face or mip level, reading from the staging
+ * buffer at offset */
+typedef struct TextureUpload {
+    GLenum gl_target;
+    int level;
+    unsigned int width, height, depth;
+    size_t offset;
+    size_t compressed_size;
+} TextureUpload;
+
+/* 6 faces of up to 15 levels, or bands of a linear texture. Bands are
+ * NV2A_TEXTURE_DECODE_BAND rows, or taller when a texture would need more
+ * than NV2A_TEXTURE_MAX_SLICES of them. */
+#define NV2A_TEXTURE_MAX_SLICES 96
+#define NV2A_TEXTURE_DECODE_BAND 64
+#define NV2A_TEXTURE_STAGING_BUFFERS 4
+
 typedef struct TextureKey {
     struct lru_node node;
     TextureShape state;
     uint8_t *texture_data;
     uint8_t *palette_data;
+    size_t length;
+    size_t palette_length;
+
+    /* Content hash of the texture and palette at upload time. Only
+     * recomputed once the guest pages backing the entry have been written
+     * to, as reported by DIRTY_MEMORY_NV2A_TEX. */
+    uint64_t content_hash;
+    bool dirty;
+    VramRange texture_range, palette_range;
+
     TextureBinding *binding;
 } TextureKey;
 
+/* A render target kept resident in GL. Surfaces that are not bound are
+ * always in sync with VRAM unless upload_pending is set. */
+typedef struct SurfaceBinding {
+    QTAILQ_ENTRY(SurfaceBinding) entry;
+    SurfaceKey key;
+    unsigned int bytes_per_pixel;
+    GLenum gl_format, gl_type;
+    GLuint gl_buffer;
+
+    /* VRAM was written since the last upload */
+    bool upload_pending;
+    /* bumped whenever the GL contents change */
+    unsigned int generation;
+
+    /* copy of the surface for sampling it as a texture */
+    TextureBinding *texture;
+    unsigned int texture_format;
+    unsigned int texture_generation;
+} SurfaceBinding;
+
+#define NV2A_SURFACE_CACHE_SIZE 32
+
 typedef struct KelvinState {
     hwaddr object_instance;
 } KelvinState;
@@ -168,7 +386,22 @@ typedef struct ImageBlitState {
     unsigned int width, height;
 } ImageBlitState;
 
+struct NV2AState;
+struct PGRAPHState;
+
+/* Draws in place of GL, the state is still tracked by pgraph_method */
+typedef struct PGRAPHRenderer {
+    const char *name;
+    void (*init)(struct NV2AState *d);
+    void (*destroy)(struct PGRAPHState *pg);
+    /* NV097_SET_BEGIN_END with NV097_SET_BEGIN_END_OP_END */
+    void (*draw)(struct NV2AState *d);
+    void (*clear_surface)(struct NV2AState *d, uint32_t parameter);
+    void (*print_stats)(struct PGRAPHState *pg, Monitor *mon);
+} PGRAPHRenderer;
+
 typedef struct PGRAPHState {
+    /* taken after pfifo.lock, see NV2AState */
     QemuMutex lock;
 
     uint32_t pending_interrupts;
@@ -189,13 +422,57 @@ typedef struct PGRAPHState {
     SurfaceShape surface_shape;
     SurfaceShape last_surface_shape;
 
+    /* cached render targets, most recently used first */
+    QTAILQ_HEAD(SurfaceBindingHead, SurfaceBinding) surfaces;
+    unsigned int num_surfaces;
+    SurfaceBinding *color_binding, *zeta_binding;
+    unsigned int surface_hits;
+    unsigned int surface_misses;
+    unsigned int surface_uploads;
+    unsigned int surface_texture_copies;
+    unsigned int image_blits_gpu;
+    unsigned int image_blits_uploaded;
+    unsigned int image_blits_cpu;
+    unsigned int image_blits_read;
+
     hwaddr dma_a, dma_b;
     struct lru texture_cache;
+    VramRangeIndex vram_ranges;
+    SurfaceReadback readbacks[NV2A_SURFACE_READBACKS];
+    unsigned int readback_head;
+    unsigned int readbacks_pending;
+    unsigned int readbacks_issued;
+    unsigned int readbacks_stalled;
+    unsigned int readback_frames;
+    int64_t readback_stall_frame_ns;
+    int64_t readback_stall_last_frame_ns;
+    int64_t readback_stall_max_frame_ns;
+    int64_t readback_stall_total_ns;
+
     struct TextureKey *texture_cache_entries;
+    unsigned int texture_hashes_skipped;
+    unsigned int texture_reuploads;
+    TextureDecoder texture_decoder;
+    GLuint gl_texture_staging[NV2A_TEXTURE_STAGING_BUFFERS];
+    size_t texture_staging_size[NV2A_TEXTURE_STAGING_BUFFERS];
+    unsigned int texture_staging_head;
+    unsigned int textures_generated;
+    int64_t texture_generate_total_ns;
+    int64_t texture_generate_max_ns;
     bool texture_dirty[NV2A_MAX_TEXTURES];
     TextureBinding *texture_binding[NV2A_MAX_TEXTURES];
 
+    /* Palettes the pixel shader looks up indices in, kept apart from the
+     * index textures so that either can change without the other */
+    GLuint gl_palette_textures[NV2A_MAX_TEXTURES];
+    uint64_t palette_hash[NV2A_MAX_TEXTURES];
+    bool palette_valid[NV2A_MAX_TEXTURES];
+    unsigned int palette_uploads;
+
     GHashTable *shader_cache;
+    ShaderDiskCache *shader_disk_cache;
+    ShaderCompiler shader_compiler;
+    bool shader_skip_draws;
     ShaderBinding *shader_binding;
 
     bool texture_matrix_enable[NV2A_MAX_TEXTURES];
@@ -203,9 +480,14 @@ typedef struct PGRAPHState {
     /* FIXME: Move to NV_PGRAPH_BUMPMAT... */
     float bump_env_matrix[NV2A_MAX_TEXTURES - 1][4]; /* 3 allowed stages with 2x2 matrix each */
 
+    /* NULL when drawing with GL */
+    const PGRAPHRenderer *renderer;
+    void *renderer_opaque;
+
     GloContext *gl_context;
     GLuint gl_framebuffer;
-    GLuint gl_color_buffer, gl_zeta_buffer;
+    GLuint gl_default_color_buffer;
+    GLuint gl_blit_framebuffers[2];
 
     hwaddr dma_state;
     hwaddr dma_notifies;
@@ -216,7 +498,20 @@ typedef struct PGRAPHState {
     bool zpass_pixel_count_enable;
     unsigned int zpass_pixel_count_result;
     unsigned int gl_zpass_pixel_count_query_count;
+    unsigned int gl_zpass_pixel_count_queries_size;
     GLuint *gl_zpass_pixel_count_queries;
+    bool zpass_pixel_count_clear;
+    enum ZpassReportMode zpass_report_mode;
+    /* finished query objects, reused instead of deleted */
+    GLuint *gl_zpass_query_pool;
+    unsigned int zpass_query_pool_count;
+    unsigned int zpass_query_pool_size;
+    ZpassReport zpass_reports[NV2A_ZPASS_REPORTS];
+    unsigned int zpass_report_head;
+    unsigned int zpass_reports_pending;
+    unsigned int zpass_reports_written;
+    unsigned int zpass_reports_stalled;
+    unsigned int zpass_queries_created;
 
     hwaddr dma_vertex_a, dma_vertex_b;
 
@@ -224,18 +519,36 @@ typedef struct PGRAPHState {
 
     bool enable_vertex_program_write;
 
+    /* vertex programs run on the CPU, see pgraph_get_vsh_program */
+    enum VshCpuMode vsh_cpu_mode;
+    GHashTable *vsh_program_cache;
+    QTAILQ_HEAD(VshProgramHead, VshProgramEntry) vsh_programs;
+    unsigned int num_vsh_programs;
+    /* set between BEGIN and END when GL draws with the passthrough shader */
+    const VshProgram *vsh_cpu_program;
+    float (*vsh_outputs)[VSH_OUTPUTS][4];
+    unsigned int vsh_outputs_size;
+    GLuint gl_vsh_output_buffer;
+    uint64_t vsh_cpu_draws;
+    uint64_t vsh_cpu_vertices;
+    unsigned int vsh_cpu_draws_dropped;
+
     uint32_t program_data[NV2A_MAX_TRANSFORM_PROGRAM_LENGTH][VSH_TOKEN_SIZE];
 
     uint32_t vsh_constants[NV2A_VERTEXSHADER_CONSTANTS][4];
     bool vsh_constants_dirty[NV2A_VERTEXSHADER_CONSTANTS];
 
-    /* lighting constant arrays */
+    GLuint gl_vsh_constant_buffer;
+
+    /* lighting constant arrays, kept back to back so the whole lighting
+     * bank can be sent to its uniform buffer at once */
     uint32_t ltctxa[NV2A_LTCTXA_COUNT][4];
-    bool ltctxa_dirty[NV2A_LTCTXA_COUNT];
     uint32_t ltctxb[NV2A_LTCTXB_COUNT][4];
-    bool ltctxb_dirty[NV2A_LTCTXB_COUNT];
     uint32_t ltc1[NV2A_LTC1_COUNT][4];
+    bool ltctxa_dirty[NV2A_LTCTXA_COUNT];
+    bool ltctxb_dirty[NV2A_LTCTXB_COUNT];
     bool ltc1_dirty[NV2A_LTC1_COUNT];
+    GLuint gl_lighting_constant_buffer;
 
     // should figure out where these are in lighting context
     float light_infinite_half_vector[NV2A_MAX_LIGHTS][3];
@@ -245,9 +558,20 @@ typedef struct PGRAPHState {
 
     VertexAttribute vertex_attributes[NV2A_VERTEXSHADER_ATTRIBUTES];
 
+    /* converted vertex arrays, most recently used first */
+    GHashTable *vertex_conversion_cache;
+    QTAILQ_HEAD(VertexConversionHead, VertexConversion) vertex_conversions;
+    unsigned int num_vertex_conversions;
+    unsigned int vertex_conversion_hits;
+    unsigned int vertex_conversion_misses;
+    uint64_t vertex_elements_converted;
+
     unsigned int inline_array_length;
     uint32_t inline_array[NV2A_MAX_BATCH_LENGTH];
     GLuint gl_inline_array_buffer;
+    /* where the current inline array was uploaded to */
+    GLuint gl_inline_array_source;
+    GLintptr inline_array_source_offset;
 
     unsigned int inline_elements_length;
     uint32_t inline_elements[NV2A_MAX_BATCH_LENGTH];
@@ -262,6 +586,26 @@ typedef struct PGRAPHState {
 
     GLuint gl_element_buffer;
     GLuint gl_memory_buffer;
+    VertexStream vertex_stream;
+
+    PGRAPHGLCalls gl_calls;
+    PGRAPHGLCalls gl_calls_last_frame;
+    PGRAPHGLCalls gl_calls_total;
+
+    /* Replaying a capture, the guest is not around to service interrupts
+     * or flips so PGRAPH never waits on it */
+    bool replaying;
+
+    /* methods that skipped pgraph_method, see pgraph_method_run */
+    uint64_t methods_burst;
+
+    /* vertex data sent to GL, VRAM pages and streamed data respectively */
+    uint64_t vertex_upload_frame_bytes;
+    uint64_t vertex_stream_frame_bytes;
+    uint64_t vertex_upload_last_frame_bytes;
+    uint64_t vertex_stream_last_frame_bytes;
+    uint64_t vertex_upload_max_frame_bytes;
+    unsigned int vertex_upload_ranges;
     GLuint gl_vertex_array;
 
     uint32_t regs[0x2000];
@@ -274,13 +618,34 @@ typedef struct NV2AState {
 
     VGACommonState vga;
     GraphicHwOps hw_ops;
+    char *shader_cache_path;
+    uint32_t shader_threads;
+    bool shader_skip_draws;
+    uint32_t texture_cache_mb;
+    uint32_t texture_threads;
+    bool pfifo_direct;
+    char *capture_path;
+    char *replay_path;
+    bool replay_pusher;
+    char *renderer_name;
+    uint32_t renderer_threads;
+    char *vsh_cpu_name;
+    char *zpass_report_name;
     QEMUTimer *vblank_timer;
 
+    /* method stream capture, see pfifo_capture_batch */
+    CaptureFile *capture;
+    QemuMutex capture_lock;     /* innermost, never held with pgraph.lock */
+
     MemoryRegion *vram;
     MemoryRegion vram_pci;
     uint8_t *vram_ptr;
     MemoryRegion ramin;
     uint8_t *ramin_ptr;
+    DMACacheEntry dma_cache[NV2A_DMA_CACHE_SIZE];
+    uint64_t dma_cache_hits;
+    uint64_t dma_cache_misses;
+    unsigned int ramin_invalidations;
 
     MemoryRegion mmio;
     MemoryRegion block_mmio[NV_NUM_BLOCKS];
@@ -294,11 +659,41 @@ typedef struct NV2AState {
         uint32_t pending_interrupts;
         uint32_t enabled_interrupts;
         uint32_t regs[0x2000];
+        /*
+         * Lock order: the iothread lock, pfifo.lock, pgraph.lock. The
+         * puller takes pgraph.lock with pfifo.lock held and then drops
+         * pfifo.lock. Code holding pgraph.lock drops it before taking the
+         * iothread lock, and never takes pfifo.lock.
+         */
         QemuMutex lock;
         QemuThread puller_thread;
         QemuCond puller_cond;
         QemuThread pusher_thread;
         QemuCond pusher_cond;
+
+        /* with pfifo-direct the pusher bypasses CACHE1 and feeds this */
+        MethodRing ring;
+        unsigned int ring_full_waits;
+
+        /* with pfifo-replay-pusher, what the pusher reads in place of the
+         * guest's pushbuffer */
+        uint8_t *replay_pushbuffer;
+        hwaddr replay_pushbuffer_size;
+
+        /* per channel, handle and channel id are the key */
+        RAMHTCacheEntry ramht_cache[NV2A_RAMHT_CACHE_SIZE];
+        uint64_t ramht_cache_hits;
+        uint64_t ramht_cache_misses;
+
+        /* puller statistics */
+        uint64_t methods_pulled;
+        uint64_t method_runs;
+        uint64_t lock_handoffs;
+        int64_t rate_start_ns;
+        uint64_t rate_methods;
+        uint64_t rate_handoffs;
+        unsigned int methods_per_sec;
+        unsigned int handoffs_per_sec;
     } pfifo;
 
     struct {
@@ -0,0 +1,104 @@
+/*
+ * QEMU Geforce NV2A pusher to puller method ring
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_NV2A_METHOD_RING_H
+#define HW_NV2A_METHOD_RING_H
+
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+
+/* must be a power of two */
+#define NV2A_METHOD_RING_SIZE 4096
+
+typedef struct MethodRingEntry {
+    uint32_t method_entry;  /* in NV_PFIFO_CACHE1_METHOD format */
+    uint32_t parameter;
+} MethodRingEntry;
+
+/*
+ * Lock-free single producer, single consumer queue of methods. The pusher
+ * thread is the only one to push and the puller thread the only one to pop.
+ * The head and tail counters run freely and are masked on access. The
+ * pusher pushes while it holds pfifo.lock for the DMA registers it parses,
+ * the puller pops with pfifo.lock released; the ring needs neither.
+ *
+ * The events let either side sleep, each side resets its own event before
+ * checking the ring one last time and waiting on it.
+ */
+typedef struct MethodRing {
+    MethodRingEntry entries[NV2A_METHOD_RING_SIZE];
+    unsigned int head;      /* written by the producer */
+    unsigned int tail;      /* written by the consumer */
+    QemuEvent not_empty;
+    QemuEvent not_full;
+} MethodRing;
+
+static inline void method_ring_init(MethodRing *ring)
+{
+    ring->head = 0;
+    ring->tail = 0;
+    qemu_event_init(&ring->not_empty, false);
+    qemu_event_init(&ring->not_full, true);
+}
+
+static inline void method_ring_destroy(MethodRing *ring)
+{
+    qemu_event_destroy(&ring->not_empty);
+    qemu_event_destroy(&ring->not_full);
+}
+
+/* Number of methods waiting, exact from either side of the ring */
+static inline unsigned int method_ring_count(MethodRing *ring)
+{
+    return atomic_load_acquire(&ring->head) - atomic_load_acquire(&ring->tail);
+}
+
+static inline bool method_ring_full(MethodRing *ring)
+{
+    return method_ring_count(ring) == NV2A_METHOD_RING_SIZE;
+}
+
+/* Producer side, the caller must check method_ring_full first */
+static inline void method_ring_push(MethodRing *ring, uint32_t method_entry,
+                                    uint32_t parameter)
+{
+    unsigned int head = atomic_read(&ring->head);
+    MethodRingEntry *entry = &ring->entries[head & (NV2A_METHOD_RING_SIZE - 1)];
+
+    entry->method_entry = method_entry;
+    entry->parameter = parameter;
+    atomic_store_release(&ring->head, head + 1);
+}
+
+/* Consumer side, pops up to max methods at once and returns how many */
+static inline unsigned int method_ring_pop_batch(MethodRing *ring,
+                                                 MethodRingEntry *entries,
+                                                 unsigned int max)
+{
+    unsigned int tail = atomic_read(&ring->tail);
+    unsigned int count = MIN(atomic_load_acquire(&ring->head) - tail, max);
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        entries[i] = ring->entries[(tail + i) & (NV2A_METHOD_RING_SIZE - 1)];
+    }
+    atomic_store_release(&ring->tail, tail + count);
+
+    return count;
+}
+
+#endif
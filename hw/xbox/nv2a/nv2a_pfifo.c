@@ -19,17 +19,27 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 
-typedef struct RAMHTEntry {
-    uint32_t handle;
-    hwaddr instance;
-    enum FIFOEngine engine;
+/* Most methods pulled at once, larger than CACHE1 for the direct ring */
+#define PFIFO_PULL_BATCH_SIZE 1024
+
+/* A method pulled out of CACHE1, waiting to be handed to PGRAPH */
+typedef struct CacheEntry {
+    unsigned int method : 14;
+    unsigned int subchannel : 3;
     unsigned int channel_id : 5;
-    bool valid;
-} RAMHTEntry;
+    bool nonincreasing;
+} CacheEntry;
 
 static void pfifo_run_pusher(NV2AState *d);
 static uint32_t ramht_hash(NV2AState *d, uint32_t handle);
+static RAMHTEntry ramht_read(NV2AState *d, uint32_t handle);
 static RAMHTEntry ramht_lookup(NV2AState *d, uint32_t handle);
+static RAMHTEntry pfifo_resolve_handle(NV2AState *d, uint32_t handle);
+static void pfifo_print_stats(NV2AState *d, Monitor *mon);
+static void pfifo_capture_batch(NV2AState *d, const CacheEntry *entries,
+                                const uint32_t *parameters,
+                                unsigned int count);
+static void pfifo_replay(NV2AState *d);
 
 /* PFIFO - MMIO and DMA FIFO submission to PGRAPH and VPE */
 uint64_t pfifo_read(void *opaque, hwaddr addr, unsigned int size)
@@ -49,6 +59,27 @@ uint64_t pfifo_read(void *opaque, hwaddr addr, unsigned int size)
     case NV_PFIFO_RUNOUT_STATUS:
         r = NV_PFIFO_RUNOUT_STATUS_LOW_MARK; /* low mark empty */
         break;
+    case NV_PFIFO_CACHE1_STATUS:
+        r = d->pfifo.regs[addr];
+        if (d->pfifo_direct) {
+            /* CACHE1 is bypassed, report on the method ring instead */
+            r &= ~(NV_PFIFO_CACHE1_STATUS_LOW_MARK
+                   | NV_PFIFO_CACHE1_STATUS_HIGH_MARK);
+            if (method_ring_count(&d->pfifo.ring) == 0) {
+                r |= NV_PFIFO_CACHE1_STATUS_LOW_MARK;
+            } else if (method_ring_full(&d->pfifo.ring)) {
+                r |= NV_PFIFO_CACHE1_STATUS_HIGH_MARK;
+            }
+        }
+        break;
+    case NV_PFIFO_CACHE1_PUT:
+        r = d->pfifo.regs[addr];
+        if (d->pfifo_direct) {
+            unsigned int pending = MIN(method_ring_count(&d->pfifo.ring),
+                                       NV2A_CACHE1_SIZE - 1);
+            r = (d->pfifo.regs[NV_PFIFO_CACHE1_GET] + pending * 4) & 0x1fc;
+        }
+        break;
     default:
         r = d->pfifo.regs[addr];
         break;
@@ -77,6 +108,11 @@ void pfifo_write(void *opaque, hwaddr addr, uint64_t val, unsigned int size)
         d->pfifo.enabled_interrupts = val;
         update_irq(d);
         break;
+    case NV_PFIFO_RAMHT:
+        /* cached entries were hashed into the old table */
+        d->pfifo.regs[addr] = val;
+        memset(d->pfifo.ramht_cache, 0, sizeof(d->pfifo.ramht_cache));
+        break;
     default:
         d->pfifo.regs[addr] = val;
         break;
@@ -88,6 +124,65 @@ void pfifo_write(void *opaque, hwaddr addr, uint64_t val, unsigned int size)
     qemu_mutex_unlock(&d->pfifo.lock);
 }
 
+/* Hands a batch of pulled methods to PGRAPH, grouping consecutive methods
+ * into runs. Called with the PGRAPH lock held, returns the number of runs. */
+static unsigned int pfifo_dispatch(NV2AState *d, const CacheEntry *entries,
+                                   const uint32_t *parameters,
+                                   unsigned int count)
+{
+    unsigned int i = 0;
+    unsigned int runs = 0;
+
+    while (i < count) {
+        const CacheEntry *entry = &entries[i];
+        runs++;
+
+        if (entry->method == 0) {
+            pgraph_context_switch(d, entry->channel_id);
+            pgraph_wait_fifo_access(d);
+            pgraph_method(d, entry->subchannel, 0, parameters[i]);
+            i++;
+            continue;
+        }
+
+        unsigned int step = entry->nonincreasing ? 0 : 4;
+        unsigned int n = 1;
+        while (i + n < count
+               && entries[i + n].subchannel == entry->subchannel
+               && entries[i + n].nonincreasing == entry->nonincreasing
+               && entries[i + n].method == entry->method + n * step) {
+            n++;
+        }
+
+        pgraph_method_run(d, entry->subchannel, entry->method,
+                          !entry->nonincreasing, &parameters[i], n);
+        i += n;
+    }
+
+    return runs;
+}
+
+static void pfifo_update_rates(NV2AState *d, unsigned int methods)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    d->pfifo.methods_pulled += methods;
+    d->pfifo.lock_handoffs++;
+    d->pfifo.rate_methods += methods;
+    d->pfifo.rate_handoffs++;
+
+    int64_t elapsed = now - d->pfifo.rate_start_ns;
+    if (elapsed >= NANOSECONDS_PER_SECOND) {
+        d->pfifo.methods_per_sec =
+            d->pfifo.rate_methods * NANOSECONDS_PER_SECOND / elapsed;
+        d->pfifo.handoffs_per_sec =
+            d->pfifo.rate_handoffs * NANOSECONDS_PER_SECOND / elapsed;
+        d->pfifo.rate_methods = 0;
+        d->pfifo.rate_handoffs = 0;
+        d->pfifo.rate_start_ns = now;
+    }
+}
+
 static void pfifo_run_puller(NV2AState *d)
 {
     uint32_t *pull0 = &d->pfifo.regs[NV_PFIFO_CACHE1_PULL0];
@@ -98,109 +193,145 @@ static void pfifo_run_puller(NV2AState *d)
     uint32_t *get_reg = &d->pfifo.regs[NV_PFIFO_CACHE1_GET];
     uint32_t *put_reg = &d->pfifo.regs[NV_PFIFO_CACHE1_PUT];
 
-    // TODO
-    // CacheEntry working_cache[NV2A_CACHE1_SIZE];
-    // int working_cache_size = 0;
-    // pull everything into our own queue
-
-    // TODO think more about locking
+    CacheEntry working_cache[PFIFO_PULL_BATCH_SIZE];
+    uint32_t working_parameters[PFIFO_PULL_BATCH_SIZE];
+    MethodRingEntry ring_entries[PFIFO_PULL_BATCH_SIZE];
 
     while (true) {
-        if (!GET_MASK(*pull0, NV_PFIFO_CACHE1_PULL0_ACCESS)) return;
+        unsigned int working_cache_size = 0;
+        unsigned int ring_count = 0;
+
+        if (d->pfifo_direct
+            && GET_MASK(*pull0, NV_PFIFO_CACHE1_PULL0_ACCESS)) {
+            /* the ring needs no lock, only the RAMHT lookups below do */
+            qemu_mutex_unlock(&d->pfifo.lock);
+            ring_count = method_ring_pop_batch(&d->pfifo.ring, ring_entries,
+                                               PFIFO_PULL_BATCH_SIZE);
+            qemu_mutex_lock(&d->pfifo.lock);
+        }
 
-        /* empty cache1 */
-        if (*status & NV_PFIFO_CACHE1_STATUS_LOW_MARK) break;
+        nv2a_ramin_check_dirty(d);
 
-        uint32_t get = *get_reg;
-        uint32_t put = *put_reg;
+        /* Pull everything into our own queue, so the pusher can refill
+         * CACHE1 while PGRAPH works through it. Methods already popped from
+         * the ring are all resolved, even if pulling was turned off since. */
+        while ((d->pfifo_direct
+                || GET_MASK(*pull0, NV_PFIFO_CACHE1_PULL0_ACCESS))
+               && working_cache_size < PFIFO_PULL_BATCH_SIZE) {
+            uint32_t method_entry;
+            uint32_t parameter;
 
-        assert(get < 128*4 && (get % 4) == 0);
-        uint32_t method_entry = d->pfifo.regs[NV_PFIFO_CACHE1_METHOD + get*2];
-        uint32_t parameter = d->pfifo.regs[NV_PFIFO_CACHE1_DATA + get*2];
+            if (d->pfifo_direct) {
+                if (working_cache_size == ring_count) {
+                    break;
+                }
+                method_entry = ring_entries[working_cache_size].method_entry;
+                parameter = ring_entries[working_cache_size].parameter;
+            } else {
+                /* empty cache1 */
+                if (*status & NV_PFIFO_CACHE1_STATUS_LOW_MARK) break;
 
-        uint32_t new_get = (get+4) & 0x1fc;
-        *get_reg = new_get;
+                uint32_t get = *get_reg;
+                uint32_t put = *put_reg;
 
-        if (new_get == put) {
-            // set low mark
-            *status |= NV_PFIFO_CACHE1_STATUS_LOW_MARK;
-        }
-        if (*status & NV_PFIFO_CACHE1_STATUS_HIGH_MARK) {
-            // unset high mark
-            *status &= ~NV_PFIFO_CACHE1_STATUS_HIGH_MARK;
-            // signal pusher
-            qemu_cond_signal(&d->pfifo.pusher_cond);            
-        }
+                assert(get < 128*4 && (get % 4) == 0);
+                method_entry = d->pfifo.regs[NV_PFIFO_CACHE1_METHOD + get*2];
+                parameter = d->pfifo.regs[NV_PFIFO_CACHE1_DATA + get*2];
 
+                uint32_t new_get = (get+4) & 0x1fc;
+                *get_reg = new_get;
 
-        uint32_t method = method_entry & 0x1FFC;
-        uint32_t subchannel = GET_MASK(method_entry, NV_PFIFO_CACHE1_METHOD_SUBCHANNEL);
+                if (new_get == put) {
+                    // set low mark
+                    *status |= NV_PFIFO_CACHE1_STATUS_LOW_MARK;
+                }
+                if (*status & NV_PFIFO_CACHE1_STATUS_HIGH_MARK) {
+                    // unset high mark
+                    *status &= ~NV_PFIFO_CACHE1_STATUS_HIGH_MARK;
+                    // signal pusher
+                    qemu_cond_signal(&d->pfifo.pusher_cond);
+                }
+            }
 
-        // NV2A_DPRINTF("pull %d 0x%x 0x%x - subch %d\n", get/4, method_entry, parameter, subchannel);
+            uint32_t method = method_entry & 0x1FFC;
+            uint32_t subchannel = GET_MASK(method_entry, NV_PFIFO_CACHE1_METHOD_SUBCHANNEL);
 
-        if (method == 0) {
-            RAMHTEntry entry = ramht_lookup(d, parameter);
-            assert(entry.valid);
+            // NV2A_DPRINTF("pull %d 0x%x 0x%x - subch %d\n", get/4, method_entry, parameter, subchannel);
 
-            // assert(entry.channel_id == state->channel_id);
+            CacheEntry *entry = &working_cache[working_cache_size];
+            entry->method = method;
+            entry->subchannel = subchannel;
+            entry->nonincreasing = method_entry & NV_PFIFO_CACHE1_METHOD_TYPE;
+            entry->channel_id = 0;
 
-            assert(entry.engine == ENGINE_GRAPHICS);
+            if (method == 0) {
+                RAMHTEntry ramht_entry = pfifo_resolve_handle(d, parameter);
+                assert(ramht_entry.valid);
 
+                // assert(ramht_entry.channel_id == state->channel_id);
 
-            /* the engine is bound to the subchannel */
-            assert(subchannel < 8);
-            SET_MASK(*engine_reg, 3 << (4*subchannel), entry.engine);
-            SET_MASK(*pull1, NV_PFIFO_CACHE1_PULL1_ENGINE, entry.engine);
-            // NV2A_DPRINTF("engine_reg1 %d 0x%x\n", subchannel, *engine_reg);
+                assert(ramht_entry.engine == ENGINE_GRAPHICS);
 
 
-            // TODO: this is fucked
-            qemu_mutex_lock(&d->pgraph.lock);
-            //make pgraph busy
-            qemu_mutex_unlock(&d->pfifo.lock);
+                /* the engine is bound to the subchannel */
+                assert(subchannel < 8);
+                SET_MASK(*engine_reg, 3 << (4*subchannel), ramht_entry.engine);
+                SET_MASK(*pull1, NV_PFIFO_CACHE1_PULL1_ENGINE, ramht_entry.engine);
+                // NV2A_DPRINTF("engine_reg1 %d 0x%x\n", subchannel, *engine_reg);
 
-            pgraph_context_switch(d, entry.channel_id);
-            pgraph_wait_fifo_access(d);
-            pgraph_method(d, subchannel, 0, entry.instance);
+                entry->channel_id = ramht_entry.channel_id;
+                parameter = ramht_entry.instance;
+            } else if (method >= 0x100) {
+                // method passed to engine
 
-            // make pgraph not busy
-            qemu_mutex_unlock(&d->pgraph.lock);
-            qemu_mutex_lock(&d->pfifo.lock);
+                /* methods that take objects.
+                 * TODO: Check this range is correct for the nv2a */
+                if (method >= 0x180 && method < 0x200) {
+                    RAMHTEntry ramht_entry = pfifo_resolve_handle(d,
+                                                                  parameter);
+                    assert(ramht_entry.valid);
+                    // assert(ramht_entry.channel_id == state->channel_id);
+                    parameter = ramht_entry.instance;
+                }
 
-        } else if (method >= 0x100) {
-            // method passed to engine
-
-            /* methods that take objects.
-             * TODO: Check this range is correct for the nv2a */
-            if (method >= 0x180 && method < 0x200) {
-                //qemu_mutex_lock_iothread();
-                RAMHTEntry entry = ramht_lookup(d, parameter);
-                assert(entry.valid);
-                // assert(entry.channel_id == state->channel_id);
-                parameter = entry.instance;
-                //qemu_mutex_unlock_iothread();
+                enum FIFOEngine engine = GET_MASK(*engine_reg, 3 << (4*subchannel));
+                // NV2A_DPRINTF("engine_reg2 %d 0x%x\n", subchannel, *engine_reg);
+                assert(engine == ENGINE_GRAPHICS);
+                SET_MASK(*pull1, NV_PFIFO_CACHE1_PULL1_ENGINE, engine);
+            } else {
+                assert(false);
             }
 
-            enum FIFOEngine engine = GET_MASK(*engine_reg, 3 << (4*subchannel));
-            // NV2A_DPRINTF("engine_reg2 %d 0x%x\n", subchannel, *engine_reg);
-            assert(engine == ENGINE_GRAPHICS);
-            SET_MASK(*pull1, NV_PFIFO_CACHE1_PULL1_ENGINE, engine);
+            working_parameters[working_cache_size++] = parameter;
+        }
 
-            // TODO: this is fucked
-            qemu_mutex_lock(&d->pgraph.lock);
-            //make pgraph busy
-            qemu_mutex_unlock(&d->pfifo.lock);
+        if (working_cache_size == 0) {
+            return;
+        }
+        if (d->pfifo_direct) {
+            qemu_event_set(&d->pfifo.ring.not_full);
+        }
 
-            pgraph_wait_fifo_access(d);
-            pgraph_method(d, subchannel, method, parameter);
+        pfifo_update_rates(d, working_cache_size);
 
-            // make pgraph not busy
-            qemu_mutex_unlock(&d->pgraph.lock);
-            qemu_mutex_lock(&d->pfifo.lock);
-        } else {
-            assert(false);
+        if (d->capture) {
+            pfifo_capture_batch(d, working_cache, working_parameters,
+                                working_cache_size);
         }
 
+        qemu_mutex_lock(&d->pgraph.lock);
+        //make pgraph busy
+        qemu_mutex_unlock(&d->pfifo.lock);
+
+        unsigned int runs = pfifo_dispatch(d, working_cache,
+                                           working_parameters,
+                                           working_cache_size);
+
+        // make pgraph not busy
+        qemu_mutex_unlock(&d->pgraph.lock);
+        qemu_mutex_lock(&d->pfifo.lock);
+
+        d->pfifo.method_runs += runs;
     }
 }
 
@@ -208,12 +339,46 @@ static void* pfifo_puller_thread(void *arg)
 {
     NV2AState *d = (NV2AState *)arg;
 
-    glo_set_current(d->pgraph.gl_context);
+    if (!d->pgraph.renderer) {
+        glo_set_current(d->pgraph.gl_context);
+    }
+
+    if (d->replay_path) {
+        pfifo_replay(d);
+        return NULL;
+    }
 
     qemu_mutex_lock(&d->pfifo.lock);
     while (true) {
         pfifo_run_puller(d);
-        qemu_cond_wait(&d->pfifo.puller_cond, &d->pfifo.lock);
+
+        /* Out of work, so the guest may be about to look at what was
+         * rendered, or be polling for a report. Finish any surface downloads
+         * and pending reports before going to sleep. */
+        qemu_mutex_lock(&d->pgraph.lock);
+        if (d->pgraph.readbacks_pending > 0
+            || d->pgraph.zpass_reports_pending > 0) {
+            qemu_mutex_unlock(&d->pfifo.lock);
+            pgraph_readback_flush(d);
+            pgraph_zpass_report_flush(d);
+            qemu_mutex_unlock(&d->pgraph.lock);
+            qemu_mutex_lock(&d->pfifo.lock);
+            continue;
+        }
+        qemu_mutex_unlock(&d->pgraph.lock);
+
+        if (d->pfifo_direct && GET_MASK(d->pfifo.regs[NV_PFIFO_CACHE1_PULL0],
+                                        NV_PFIFO_CACHE1_PULL0_ACCESS)) {
+            /* sleep until the pusher puts something in the ring */
+            qemu_event_reset(&d->pfifo.ring.not_empty);
+            if (method_ring_count(&d->pfifo.ring) == 0 && !d->exiting) {
+                qemu_mutex_unlock(&d->pfifo.lock);
+                qemu_event_wait(&d->pfifo.ring.not_empty);
+                qemu_mutex_lock(&d->pfifo.lock);
+            }
+        } else {
+            qemu_cond_wait(&d->pfifo.puller_cond, &d->pfifo.lock);
+        }
 
         if (d->exiting) {
             break;
@@ -268,7 +433,16 @@ static void pfifo_run_pusher(NV2AState *d)
                  NV_PFIFO_CACHE1_DMA_INSTANCE_ADDRESS) << 4;
 
     hwaddr dma_len;
-    uint8_t *dma = nv_dma_map(d, dma_instance, &dma_len);
+    uint8_t *dma;
+    if (d->pfifo.replay_pushbuffer) {
+        /* replaying a capture, see pfifo_replay_push */
+        dma = d->pfifo.replay_pushbuffer;
+        dma_len = d->pfifo.replay_pushbuffer_size;
+    } else {
+        /* the DMA object cache belongs to the puller thread */
+        dma = nv_dma_map_object(d, nv_dma_decode(d, dma_instance), &dma_len);
+    }
+    unsigned int methods_pushed = 0;
 
     while (true) {
         uint32_t dma_get_v = *dma_get;
@@ -298,7 +472,14 @@ static void pfifo_run_pusher(NV2AState *d)
 
         if (method_count) {
             /* full */
-            if (*status & NV_PFIFO_CACHE1_STATUS_HIGH_MARK) return;
+            if (d->pfifo_direct) {
+                if (method_ring_full(&d->pfifo.ring)) {
+                    qemu_event_set(&d->pfifo.ring.not_empty);
+                    return;
+                }
+            } else if (*status & NV_PFIFO_CACHE1_STATUS_HIGH_MARK) {
+                return;
+            }
 
 
             /* data word of methods command */
@@ -315,21 +496,27 @@ static void pfifo_run_pusher(NV2AState *d)
 
             // NV2A_DPRINTF("push %d 0x%x 0x%x - subch %d\n", put/4, method_entry, word, method_subchannel);
 
-            assert(put < 128*4 && (put%4) == 0);
-            d->pfifo.regs[NV_PFIFO_CACHE1_METHOD + put*2] = method_entry;
-            d->pfifo.regs[NV_PFIFO_CACHE1_DATA + put*2] = word;
-
-            uint32_t new_put = (put+4) & 0x1fc;
-            *put_reg = new_put;
-            if (new_put == get) {
-                // set high mark
-                *status |= NV_PFIFO_CACHE1_STATUS_HIGH_MARK;
-            }
-            if (*status & NV_PFIFO_CACHE1_STATUS_LOW_MARK) {
-                // unset low mark
-                *status &= ~NV_PFIFO_CACHE1_STATUS_LOW_MARK;
-                // signal puller
-                qemu_cond_signal(&d->pfifo.puller_cond);
+            if (d->pfifo_direct) {
+                /* the puller is woken once the whole span is in */
+                method_ring_push(&d->pfifo.ring, method_entry, word);
+                methods_pushed++;
+            } else {
+                assert(put < 128*4 && (put%4) == 0);
+                d->pfifo.regs[NV_PFIFO_CACHE1_METHOD + put*2] = method_entry;
+                d->pfifo.regs[NV_PFIFO_CACHE1_DATA + put*2] = word;
+
+                uint32_t new_put = (put+4) & 0x1fc;
+                *put_reg = new_put;
+                if (new_put == get) {
+                    // set high mark
+                    *status |= NV_PFIFO_CACHE1_STATUS_HIGH_MARK;
+                }
+                if (*status & NV_PFIFO_CACHE1_STATUS_LOW_MARK) {
+                    // unset low mark
+                    *status &= ~NV_PFIFO_CACHE1_STATUS_LOW_MARK;
+                    // signal puller
+                    qemu_cond_signal(&d->pfifo.puller_cond);
+                }
             }
 
             if (method_type == NV_PFIFO_CACHE1_DMA_STATE_METHOD_TYPE_INC) {
@@ -420,6 +607,10 @@ static void pfifo_run_pusher(NV2AState *d)
         }
     }
 
+    if (methods_pushed > 0) {
+        qemu_event_set(&d->pfifo.ring.not_empty);
+    }
+
     // NV2A_DPRINTF("DMA pusher done: max 0x%" HWADDR_PRIx ", 0x%" HWADDR_PRIx " - 0x%" HWADDR_PRIx "\n",
     //      dma_len, control->dma_get, control->dma_put);
 
@@ -442,6 +633,19 @@ static void* pfifo_pusher_thread(void *arg)
     qemu_mutex_lock(&d->pfifo.lock);
     while (true) {
         pfifo_run_pusher(d);
+
+        if (d->pfifo_direct) {
+            /* stopped on a full ring, wait for the puller to make room */
+            qemu_event_reset(&d->pfifo.ring.not_full);
+            if (method_ring_full(&d->pfifo.ring) && !d->exiting) {
+                d->pfifo.ring_full_waits++;
+                qemu_mutex_unlock(&d->pfifo.lock);
+                qemu_event_wait(&d->pfifo.ring.not_full);
+                qemu_mutex_lock(&d->pfifo.lock);
+                continue;
+            }
+        }
+
         qemu_cond_wait(&d->pfifo.pusher_cond, &d->pfifo.lock);
 
         if (d->exiting) {
@@ -475,7 +679,7 @@ static uint32_t ramht_hash(NV2AState *d, uint32_t handle)
 }
 
 
-static RAMHTEntry ramht_lookup(NV2AState *d, uint32_t handle)
+static RAMHTEntry ramht_read(NV2AState *d, uint32_t handle)
 {
     hwaddr ramht_size =
         1 << (GET_MASK(d->pfifo.regs[NV_PFIFO_RAMHT], NV_PFIFO_RAMHT_SIZE)+12);
@@ -502,3 +706,528 @@ static RAMHTEntry ramht_lookup(NV2AState *d, uint32_t handle)
         .valid = entry_context & NV_RAMHT_STATUS,
     };
 }
+
+/* Resolves a handle for the channel in CACHE1 through the RAMHT cache */
+static RAMHTEntry ramht_lookup(NV2AState *d, uint32_t handle)
+{
+    unsigned int channel_id = GET_MASK(d->pfifo.regs[NV_PFIFO_CACHE1_PUSH1],
+                                       NV_PFIFO_CACHE1_PUSH1_CHID);
+    RAMHTCacheEntry *cached =
+        &d->pfifo.ramht_cache[(handle ^ (channel_id << 3))
+                              % NV2A_RAMHT_CACHE_SIZE];
+
+    if (cached->valid && cached->handle == handle
+        && cached->channel_id == channel_id) {
+        d->pfifo.ramht_cache_hits++;
+        return cached->entry;
+    }
+
+    cached->entry = ramht_read(d, handle);
+    cached->handle = handle;
+    cached->channel_id = channel_id;
+    cached->valid = true;
+    d->pfifo.ramht_cache_misses++;
+    return cached->entry;
+}
+
+/* Resolves an object handle pushed on the channel in CACHE1. Replayed
+ * captures were taken after the lookup and carry the instance instead. */
+static RAMHTEntry pfifo_resolve_handle(NV2AState *d, uint32_t handle)
+{
+    if (d->pfifo.replay_pushbuffer) {
+        return (RAMHTEntry){
+            .handle = handle,
+            .instance = handle,
+            .engine = ENGINE_GRAPHICS,
+            .channel_id = GET_MASK(d->pfifo.regs[NV_PFIFO_CACHE1_PUSH1],
+                                   NV_PFIFO_CACHE1_PUSH1_CHID),
+            .valid = true,
+        };
+    }
+
+    return ramht_lookup(d, handle);
+}
+
+static void pfifo_print_stats(NV2AState *d, Monitor *mon)
+{
+    monitor_printf(mon, "pfifo puller: %u methods/sec, %u lock handoffs/sec, "
+                        "%" PRIu64 " methods in %" PRIu64 " runs over %"
+                        PRIu64 " handoffs\n",
+                   d->pfifo.methods_per_sec, d->pfifo.handoffs_per_sec,
+                   d->pfifo.methods_pulled, d->pfifo.method_runs,
+                   d->pfifo.lock_handoffs);
+    if (d->pfifo_direct) {
+        monitor_printf(mon, "  direct: %u methods queued, %u waits on a "
+                            "full ring\n",
+                       method_ring_count(&d->pfifo.ring),
+                       d->pfifo.ring_full_waits);
+    }
+    monitor_printf(mon, "  ramht cache: %" PRIu64 " hits, %" PRIu64 " misses; "
+                        "dma object cache: %" PRIu64 " hits, %" PRIu64
+                        " misses; %u ramin invalidations\n",
+                   d->pfifo.ramht_cache_hits, d->pfifo.ramht_cache_misses,
+                   d->dma_cache_hits, d->dma_cache_misses,
+                   d->ramin_invalidations);
+}
+
+/* Writes out the VRAM and RAMIN pages written since the last call. Called
+ * with capture_lock held. */
+static void pfifo_capture_memory(NV2AState *d)
+{
+    /* clean areas are skipped this many pages at a time */
+    const hwaddr chunk = 64 * TARGET_PAGE_SIZE;
+    struct {
+        MemoryRegion *mr;
+        uint8_t *ptr;
+        uint32_t space;
+    } spaces[] = {
+        { d->vram, d->vram_ptr, CAPTURE_SPACE_VRAM },
+        { &d->ramin, d->ramin_ptr, CAPTURE_SPACE_RAMIN },
+    };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(spaces); i++) {
+        MemoryRegion *mr = spaces[i].mr;
+        hwaddr size = memory_region_size(mr);
+        DirtyBitmapSnapshot *snap = memory_region_snapshot_and_clear_dirty(
+            mr, 0, size, DIRTY_MEMORY_NV2A_CAPTURE);
+
+        hwaddr addr = 0;
+        while (addr < size) {
+            if (QEMU_IS_ALIGNED(addr, chunk) && addr + chunk <= size
+                && !memory_region_snapshot_get_dirty(mr, snap, addr, chunk)) {
+                addr += chunk;
+                continue;
+            }
+            if (!memory_region_snapshot_get_dirty(mr, snap, addr,
+                                                  TARGET_PAGE_SIZE)) {
+                addr += TARGET_PAGE_SIZE;
+                continue;
+            }
+
+            hwaddr start = addr;
+            while (addr < size
+                   && memory_region_snapshot_get_dirty(mr, snap, addr,
+                                                       TARGET_PAGE_SIZE)) {
+                addr += TARGET_PAGE_SIZE;
+            }
+            capture_write_memory(d->capture, spaces[i].space, start,
+                                 spaces[i].ptr + start, addr - start);
+        }
+
+        g_free(snap);
+    }
+}
+
+/* Records a batch of pulled methods, preceded by any memory they may use */
+static void pfifo_capture_batch(NV2AState *d, const CacheEntry *entries,
+                                const uint32_t *parameters,
+                                unsigned int count)
+{
+    CaptureMethod methods[PFIFO_PULL_BATCH_SIZE];
+    unsigned int i;
+
+    assert(count <= PFIFO_PULL_BATCH_SIZE);
+    for (i = 0; i < count; i++) {
+        methods[i] = (CaptureMethod){
+            .method = entries[i].method,
+            .subchannel = entries[i].subchannel,
+            .flags = entries[i].channel_id
+                     | (entries[i].nonincreasing
+                        ? CAPTURE_METHOD_NONINCREASING : 0),
+            .parameter = parameters[i],
+        };
+    }
+
+    qemu_mutex_lock(&d->capture_lock);
+    pfifo_capture_memory(d);
+    capture_write_methods(d->capture, methods, count);
+    qemu_mutex_unlock(&d->capture_lock);
+}
+
+/* Records a guest write to a PGRAPH register */
+static void pfifo_capture_register(NV2AState *d, hwaddr addr, uint32_t value)
+{
+    qemu_mutex_lock(&d->capture_lock);
+    pfifo_capture_memory(d);
+    capture_write_register(d->capture, addr, value);
+    qemu_mutex_unlock(&d->capture_lock);
+}
+
+typedef struct ReplayClassStats {
+    uint64_t methods;
+    int64_t time_ns;
+} ReplayClassStats;
+
+/* Feeds a methods record to PGRAPH, timing each run by object class */
+static void pfifo_replay_methods(NV2AState *d, const CaptureMethod *methods,
+                                 unsigned int count,
+                                 ReplayClassStats *class_stats)
+{
+    CacheEntry entries[PFIFO_PULL_BATCH_SIZE];
+    uint32_t parameters[PFIFO_PULL_BATCH_SIZE];
+    unsigned int i, start;
+
+    assert(count <= PFIFO_PULL_BATCH_SIZE);
+    for (i = 0; i < count; i++) {
+        entries[i] = (CacheEntry){
+            .method = methods[i].method,
+            .subchannel = methods[i].subchannel,
+            .channel_id = GET_MASK(methods[i].flags,
+                                   CAPTURE_METHOD_CHANNEL_ID),
+            .nonincreasing =
+                methods[i].flags & CAPTURE_METHOD_NONINCREASING,
+        };
+        parameters[i] = methods[i].parameter;
+    }
+
+    qemu_mutex_lock(&d->pgraph.lock);
+    for (start = 0; start < count; start = i) {
+        /* binding an object may change the class, keep it on its own */
+        i = start + 1;
+        while (i < count && entries[start].method != 0
+               && entries[i].method != 0
+               && entries[i].subchannel == entries[start].subchannel) {
+            i++;
+        }
+
+        uint32_t graphics_class = GET_MASK(
+            d->pgraph.regs[NV_PGRAPH_CTX_CACHE1
+                           + entries[start].subchannel * 4],
+            NV_PGRAPH_CTX_SWITCH1_GRCLASS);
+
+        int64_t t = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        pfifo_dispatch(d, &entries[start], &parameters[start], i - start);
+        t = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t;
+
+        class_stats[graphics_class].methods += i - start;
+        class_stats[graphics_class].time_ns += t;
+    }
+    qemu_mutex_unlock(&d->pgraph.lock);
+}
+
+/* Most pushbuffer words a methods record turns into, a header per method */
+#define PFIFO_REPLAY_PUSHBUFFER_SIZE (PFIFO_PULL_BATCH_SIZE * 2 * 4)
+
+/* Waits for the pusher to have gone through the replay pushbuffer and for
+ * the puller to have dispatched all of it. Called with the pfifo lock
+ * held. */
+static void pfifo_replay_push_drain(NV2AState *d)
+{
+    uint32_t *dma_get = &d->pfifo.regs[NV_PFIFO_CACHE1_DMA_GET];
+    uint32_t *dma_put = &d->pfifo.regs[NV_PFIFO_CACHE1_DMA_PUT];
+    uint32_t *status = &d->pfifo.regs[NV_PFIFO_CACHE1_STATUS];
+
+    while (!d->exiting) {
+        pfifo_run_puller(d);
+
+        if (d->pfifo_direct) {
+            qemu_event_reset(&d->pfifo.ring.not_empty);
+            if (method_ring_count(&d->pfifo.ring) > 0) {
+                continue;
+            }
+            if (*dma_get == *dma_put) {
+                break;
+            }
+            qemu_mutex_unlock(&d->pfifo.lock);
+            qemu_event_wait(&d->pfifo.ring.not_empty);
+            qemu_mutex_lock(&d->pfifo.lock);
+        } else {
+            if (!(*status & NV_PFIFO_CACHE1_STATUS_LOW_MARK)) {
+                continue;
+            }
+            if (*dma_get == *dma_put) {
+                break;
+            }
+            qemu_cond_wait(&d->pfifo.puller_cond, &d->pfifo.lock);
+        }
+    }
+}
+
+/* Writes a methods record back out as a pushbuffer and has the pusher
+ * thread decode it into CACHE1 or the method ring, the way the guest's
+ * pushbuffers go, pulling it on this thread. Returns the pushbuffer size
+ * in bytes. */
+static size_t pfifo_replay_push(NV2AState *d, const CaptureMethod *methods,
+                                unsigned int count)
+{
+    uint8_t *pb = d->pfifo.replay_pushbuffer;
+    unsigned int channel_id = 0;
+    unsigned int i, j, n;
+    size_t size = 0;
+
+    assert(count <= PFIFO_PULL_BATCH_SIZE);
+    for (i = 0; i < count; i += n) {
+        const CaptureMethod *m = &methods[i];
+        bool nonincreasing = m->flags & CAPTURE_METHOD_NONINCREASING;
+        unsigned int step = nonincreasing ? 0 : 4;
+
+        if (m->method == 0) {
+            /* a record only ever binds objects of one channel */
+            channel_id = GET_MASK(m->flags, CAPTURE_METHOD_CHANNEL_ID);
+        }
+
+        n = 1;
+        while (i + n < count && n < 0x7ff
+               && methods[i + n].subchannel == m->subchannel
+               && (methods[i + n].flags & CAPTURE_METHOD_NONINCREASING)
+                  == (m->flags & CAPTURE_METHOD_NONINCREASING)
+               && methods[i + n].method == m->method + n * step) {
+            n++;
+        }
+
+        stl_le_p(pb + size, (nonincreasing ? 0x40000000 : 0) | (n << 18)
+                            | (m->subchannel << 13) | m->method);
+        size += 4;
+        for (j = 0; j < n; j++) {
+            stl_le_p(pb + size, methods[i + j].parameter);
+            size += 4;
+        }
+    }
+    assert(size <= PFIFO_REPLAY_PUSHBUFFER_SIZE);
+
+    qemu_mutex_lock(&d->pfifo.lock);
+    uint32_t *regs = d->pfifo.regs;
+    regs[NV_PFIFO_MODE] |= 1 << channel_id;
+    SET_MASK(regs[NV_PFIFO_CACHE1_PUSH1], NV_PFIFO_CACHE1_PUSH1_CHID,
+             channel_id);
+    SET_MASK(regs[NV_PFIFO_CACHE1_PUSH1], NV_PFIFO_CACHE1_PUSH1_MODE,
+             NV_PFIFO_CACHE1_PUSH1_MODE_DMA);
+    regs[NV_PFIFO_CACHE1_PUSH0] |= NV_PFIFO_CACHE1_PUSH0_ACCESS;
+    regs[NV_PFIFO_CACHE1_PULL0] |= NV_PFIFO_CACHE1_PULL0_ACCESS;
+    regs[NV_PFIFO_CACHE1_DMA_PUSH] |= NV_PFIFO_CACHE1_DMA_PUSH_ACCESS;
+    regs[NV_PFIFO_CACHE1_DMA_PUSH] &= ~NV_PFIFO_CACHE1_DMA_PUSH_STATUS;
+    regs[NV_PFIFO_CACHE1_DMA_STATE] = 0;
+    regs[NV_PFIFO_CACHE1_DMA_SUBROUTINE] = 0;
+    regs[NV_PFIFO_CACHE1_DMA_GET] = 0;
+    regs[NV_PFIFO_CACHE1_DMA_PUT] = size;
+    qemu_cond_broadcast(&d->pfifo.pusher_cond);
+
+    pfifo_replay_push_drain(d);
+    qemu_mutex_unlock(&d->pfifo.lock);
+
+    return size;
+}
+
+/* Captures may come from anywhere, returns why a record can't be replayed
+ * or NULL if it can */
+static const char *pfifo_replay_check_record(NV2AState *d,
+                                             const CaptureRecord *record,
+                                             const void *payload)
+{
+    unsigned int i;
+
+    switch (record->type) {
+    case CAPTURE_RECORD_MEMORY: {
+        const CaptureMemory *memory = payload;
+        if (record->length < sizeof(*memory)) {
+            return "memory record too short";
+        }
+        uint64_t size;
+        if (memory->space == CAPTURE_SPACE_VRAM) {
+            size = memory_region_size(d->vram);
+        } else if (memory->space == CAPTURE_SPACE_RAMIN) {
+            size = memory_region_size(&d->ramin);
+        } else {
+            return "unknown memory space";
+        }
+        uint32_t length = record->length - sizeof(*memory);
+        if (memory->offset > size || length > size - memory->offset) {
+            return "memory out of bounds";
+        }
+        break;
+    }
+    case CAPTURE_RECORD_METHODS: {
+        const CaptureMethod *methods = payload;
+        unsigned int count = record->length / sizeof(CaptureMethod);
+        if (record->length % sizeof(CaptureMethod)) {
+            return "partial method";
+        }
+        if (count > PFIFO_PULL_BATCH_SIZE) {
+            return "too many methods";
+        }
+        for (i = 0; i < count; i++) {
+            if (methods[i].method & ~NV_PFIFO_CACHE1_METHOD_ADDRESS) {
+                return "bad method";
+            }
+            if (methods[i].subchannel >= NV2A_NUM_SUBCHANNELS) {
+                return "bad subchannel";
+            }
+        }
+        break;
+    }
+    case CAPTURE_RECORD_REGISTER: {
+        const CaptureRegister *reg = payload;
+        if (record->length != sizeof(*reg)) {
+            return "register record of the wrong size";
+        }
+        if (reg->addr >= ARRAY_SIZE(d->pgraph.regs) || reg->addr % 4) {
+            return "register out of bounds";
+        }
+        break;
+    }
+    default:
+        break;
+    }
+
+    return NULL;
+}
+
+/* Plays a capture back into PGRAPH as fast as possible and reports how
+ * long it took. Runs on the puller thread in place of the puller, the guest
+ * should be kept stopped (-S) so it does not touch the GPU meanwhile.
+ *
+ * With pfifo-replay-pusher the methods go through the pusher and CACHE1,
+ * or the method ring with pfifo-direct, rather than straight to PGRAPH, so
+ * the whole submission path is measured. Time per class is not split up
+ * then. */
+static void pfifo_replay(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+    ReplayClassStats class_stats[256] = { { 0 } };
+    CaptureHeader header;
+    CaptureRecord record;
+    const void *payload;
+    uint64_t methods = 0;
+    uint64_t pushbuffer_bytes = 0;
+    uint64_t records = 0;
+    bool failed = false;
+    int i;
+
+    CaptureFile *f = capture_file_open(d->replay_path, &header);
+    if (!f) {
+        qemu_system_shutdown_request(SHUTDOWN_CAUSE_HOST_ERROR);
+        return;
+    }
+    if (header.vram_size != memory_region_size(d->vram)
+        || header.ramin_size != memory_region_size(&d->ramin)) {
+        fprintf(stderr, "nv2a: capture %s was made with %u MiB of VRAM, "
+                        "this machine has %u MiB\n", d->replay_path,
+                header.vram_size >> 20,
+                (unsigned int)(memory_region_size(d->vram) >> 20));
+        capture_file_close(f);
+        qemu_system_shutdown_request(SHUTDOWN_CAUSE_HOST_ERROR);
+        return;
+    }
+
+    if (d->replay_pusher) {
+        qemu_mutex_lock(&d->pfifo.lock);
+        d->pfifo.replay_pushbuffer_size = PFIFO_REPLAY_PUSHBUFFER_SIZE;
+        d->pfifo.replay_pushbuffer = g_malloc(PFIFO_REPLAY_PUSHBUFFER_SIZE);
+        qemu_mutex_unlock(&d->pfifo.lock);
+    }
+
+    qemu_mutex_lock(&pg->lock);
+    pg->replaying = true;
+    unsigned int first_frame = pg->readback_frames;
+    PGRAPHGLCalls first_gl_calls = pg->gl_calls_total;
+    qemu_mutex_unlock(&pg->lock);
+
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    while (!d->exiting && (payload = capture_read_record(f, &record))) {
+        const char *error = pfifo_replay_check_record(d, &record, payload);
+        if (error) {
+            fprintf(stderr, "nv2a: capture %s: %s in record %" PRIu64
+                            ", stopping the replay\n",
+                    d->replay_path, error, records);
+            failed = true;
+            break;
+        }
+        records++;
+
+        switch (record.type) {
+        case CAPTURE_RECORD_MEMORY: {
+            const CaptureMemory *memory = payload;
+            uint32_t length = record.length - sizeof(*memory);
+            bool vram = memory->space == CAPTURE_SPACE_VRAM;
+            MemoryRegion *mr = vram ? d->vram : &d->ramin;
+            uint8_t *ptr = vram ? d->vram_ptr : d->ramin_ptr;
+
+            memcpy(ptr + memory->offset, memory + 1, length);
+            memory_region_set_dirty(mr, memory->offset, length);
+            break;
+        }
+        case CAPTURE_RECORD_METHODS: {
+            unsigned int count = record.length / sizeof(CaptureMethod);
+            if (d->replay_pusher) {
+                pushbuffer_bytes += pfifo_replay_push(d, payload, count);
+            } else {
+                nv2a_ramin_check_dirty(d);
+                pfifo_replay_methods(d, payload, count, class_stats);
+            }
+            methods += count;
+            break;
+        }
+        case CAPTURE_RECORD_REGISTER: {
+            const CaptureRegister *reg = payload;
+            qemu_mutex_lock_iothread();
+            pgraph_write(d, reg->addr, reg->value, 4);
+            qemu_mutex_unlock_iothread();
+            break;
+        }
+        default:
+            fprintf(stderr, "nv2a: unknown capture record type %u\n",
+                    record.type);
+            break;
+        }
+    }
+
+    if (failed || f->error) {
+        failed = true;
+        goto out;
+    }
+
+    /* make sure the GPU is done before stopping the clock */
+    if (!pg->renderer) {
+        glFinish();
+    }
+    int64_t elapsed = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+
+    qemu_mutex_lock(&pg->lock);
+    unsigned int frames = pg->readback_frames - first_frame;
+    PGRAPHGLCalls gl_calls = {
+        .draws = pg->gl_calls_total.draws - first_gl_calls.draws,
+        .uniforms = pg->gl_calls_total.uniforms - first_gl_calls.uniforms,
+        .uniform_buffer_uploads = pg->gl_calls_total.uniform_buffer_uploads
+                                  - first_gl_calls.uniform_buffer_uploads,
+    };
+    qemu_mutex_unlock(&pg->lock);
+
+    unsigned int n = MAX(frames, 1);
+    fprintf(stderr, "nv2a: replay: %u frames, %" PRIu64 " methods in "
+                    "%.3f s, %.2f frames/sec\n",
+            frames, methods, elapsed / 1e9,
+            frames * 1e9 / MAX(elapsed, 1));
+    if (d->replay_pusher) {
+        fprintf(stderr, "  through the pusher%s: %.1f MiB of pushbuffer, "
+                        "%.1f MiB/sec\n",
+                d->pfifo_direct ? " and method ring" : " and CACHE1",
+                pushbuffer_bytes / 1048576.0,
+                pushbuffer_bytes / 1048576.0 * 1e9 / MAX(elapsed, 1));
+    }
+    for (i = 0; i < ARRAY_SIZE(class_stats); i++) {
+        if (class_stats[i].methods) {
+            fprintf(stderr, "  class 0x%02x: %" PRIu64 " methods, %.3f ms "
+                            "(%.1f%%)\n",
+                    i, class_stats[i].methods, class_stats[i].time_ns / 1e6,
+                    100.0 * class_stats[i].time_ns / MAX(elapsed, 1));
+        }
+    }
+    fprintf(stderr, "  gl calls per frame: %.1f draws, %.1f uniforms, "
+                    "%.1f uniform buffer uploads\n",
+            (double)gl_calls.draws / n, (double)gl_calls.uniforms / n,
+            (double)gl_calls.uniform_buffer_uploads / n);
+
+out:
+    if (d->replay_pusher) {
+        qemu_mutex_lock(&d->pfifo.lock);
+        g_free(d->pfifo.replay_pushbuffer);
+        d->pfifo.replay_pushbuffer = NULL;
+        qemu_mutex_unlock(&d->pfifo.lock);
+    }
+
+    capture_file_close(f);
+    qemu_system_shutdown_request(failed ? SHUTDOWN_CAUSE_HOST_ERROR
+                                        : SHUTDOWN_CAUSE_HOST_QMP);
+}
@@ -243,6 +243,13 @@ static const ColorFormatInfo kelvin_color_format_map[66] = {
         {4, true, GL_RGBA8, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8}
 };
 
+/* Palette indices and YUY2 are uploaded as is for the pixel shader to look
+ * up or decode, see pgraph_texture_decoded_in_shader */
+static const ColorFormatInfo pgraph_palette_index_format =
+    {1, false, GL_R8, GL_RED, GL_UNSIGNED_BYTE};
+static const ColorFormatInfo pgraph_yuy2_format =
+    {2, true, GL_RG8, GL_RG, GL_UNSIGNED_BYTE};
+
 typedef struct SurfaceColorFormatInfo {
     unsigned int bytes_per_pixel;
     GLint gl_internal_format;
@@ -265,31 +272,84 @@ static const SurfaceColorFormatInfo kelvin_surface_color_format_map[] = {
 static void pgraph_method_log(unsigned int subchannel, unsigned int graphics_class, unsigned int method, uint32_t parameter);
 static void pgraph_allocate_inline_buffer_vertices(PGRAPHState *pg, unsigned int attr);
 static void pgraph_finish_inline_buffer_vertex(PGRAPHState *pg);
+
+static void pgraph_upload_constant_bank(PGRAPHState *pg, GLuint gl_buffer, const uint32_t (*constants)[4], bool *dirty, unsigned int count);
 static void pgraph_shader_update_constants(PGRAPHState *pg, ShaderBinding *binding, bool binding_changed, bool vertex_program, bool fixed_function);
+static void pgraph_get_psh_state(PGRAPHState *pg, PshState *psh);
 static void pgraph_bind_shaders(PGRAPHState *pg);
 static bool pgraph_framebuffer_dirty(PGRAPHState *pg);
 static bool pgraph_color_write_enabled(PGRAPHState *pg);
 static bool pgraph_zeta_write_enabled(PGRAPHState *pg);
 static void pgraph_set_surface_dirty(PGRAPHState *pg, bool color, bool zeta);
+static void pgraph_readback_issue(NV2AState *d, const SurfaceKey *key, unsigned int bytes_per_pixel, GLenum gl_format, GLenum gl_type);
+static void pgraph_readback_flush_range(NV2AState *d, hwaddr addr, hwaddr size);
+static void pgraph_readback_flush(NV2AState *d);
+static void pgraph_zpass_query_begin(PGRAPHState *pg);
+static void pgraph_zpass_queries_release(PGRAPHState *pg, const GLuint *gl_queries, unsigned int count);
+static ZpassReport *pgraph_zpass_report_oldest(PGRAPHState *pg);
+static void pgraph_zpass_report_write(NV2AState *d, const ZpassReport *r, bool write_result);
+static void pgraph_zpass_report_complete(NV2AState *d, ZpassReport *r);
+static void pgraph_zpass_report_poll(NV2AState *d);
+static void pgraph_zpass_report_flush(NV2AState *d);
+static void pgraph_zpass_report_issue(NV2AState *d, hwaddr offset);
+static void pgraph_zpass_report_clear(PGRAPHState *pg);
+static uint64_t ptimer_get_clock(NV2AState *d);
+static SurfaceBinding *pgraph_surface_get(PGRAPHState *pg, const SurfaceKey *key, unsigned int bytes_per_pixel, GLenum gl_internal_format, GLenum gl_format, GLenum gl_type);
+static void pgraph_surface_destroy(PGRAPHState *pg, SurfaceBinding *binding);
+static void pgraph_surface_invalidate_range(PGRAPHState *pg, hwaddr addr, hwaddr size, const SurfaceKey *except);
+static TextureBinding *pgraph_surface_get_texture(NV2AState *d, hwaddr addr, const TextureShape *s);
+static void pgraph_surface_bump_generation(PGRAPHState *pg, SurfaceBinding *binding);
+static SurfaceBinding *pgraph_surface_find_rect(NV2AState *d, hwaddr addr, unsigned int pitch, unsigned int bytes_per_pixel, unsigned int *x, unsigned int *y, unsigned int width, unsigned int height);
+static void pgraph_surface_blit_dirty(NV2AState *d, SurfaceBinding *surface);
+static void pgraph_image_blit_rows(uint8_t *dest, unsigned int dest_pitch, const uint8_t *source, unsigned int source_pitch, unsigned int row_length, unsigned int height);
+static void pgraph_image_blit(NV2AState *d);
 static void pgraph_update_surface_part(NV2AState *d, bool upload, bool color);
 static void pgraph_update_surface(NV2AState *d, bool upload, bool color_write, bool zeta_write);
 static void pgraph_bind_textures(NV2AState *d);
+static void pgraph_print_stats(PGRAPHState *pg, Monitor *mon);
 static void pgraph_apply_anti_aliasing_factor(PGRAPHState *pg, unsigned int *width, unsigned int *height);
 static void pgraph_get_surface_dimensions(PGRAPHState *pg, unsigned int *width, unsigned int *height);
+static void pgraph_upload_memory_range(NV2AState *d, hwaddr addr, hwaddr size);
 static void pgraph_update_memory_buffer(NV2AState *d, hwaddr addr, hwaddr size, bool f);
+static bool pgraph_stream_upload(PGRAPHState *pg, GLenum target, const void *data, size_t length, GLintptr *offset);
+static void pgraph_convert_vertex_attribute(const VertexAttribute *attribute, const uint8_t *data, unsigned int stride, unsigned int num_elements, uint8_t *out);
+static VertexConversion *pgraph_get_vertex_conversion(NV2AState *d, const VertexAttribute *attribute, const uint8_t *data, unsigned int num_elements);
+static void pgraph_vertex_conversion_destroy(PGRAPHState *pg, VertexConversion *conversion);
+static guint vertex_conversion_hash(gconstpointer key);
+static gboolean vertex_conversion_equal(gconstpointer a, gconstpointer b);
 static void pgraph_bind_vertex_attributes(NV2AState *d, unsigned int num_elements, bool inline_data, unsigned int inline_stride);
+static unsigned int pgraph_layout_inline_array(PGRAPHState *pg);
 static unsigned int pgraph_bind_inline_array(NV2AState *d);
+static VshProgramEntry *pgraph_get_vsh_program(PGRAPHState *pg);
+static void pgraph_vsh_program_destroy(PGRAPHState *pg, VshProgramEntry *entry);
+static guint vsh_program_hash(gconstpointer key);
+static gboolean vsh_program_equal(gconstpointer a, gconstpointer b);
+static void pgraph_get_attribute_source(NV2AState *d, unsigned int index, bool inline_array, unsigned int inline_stride, VertexAttributeSource *src);
+static void pgraph_read_attribute(const VertexAttributeSource *src, unsigned int index, float out[4]);
+static void pgraph_run_vertex_program(const VshProgram *program, const float (*constants)[4], const VertexAttributeSource *src, unsigned int first, unsigned int count, float (*outputs)[VSH_OUTPUTS][4]);
+static void pgraph_draw_vertex_program_cpu(NV2AState *d);
 static float convert_f16_to_float(uint16_t f16);
 static float convert_f24_to_float(uint32_t f24);
 static uint8_t cliptobyte(int x);
 static void convert_yuy2_to_rgb(const uint8_t *line, unsigned int ix, uint8_t *r, uint8_t *g, uint8_t* b);
-static uint8_t* convert_texture_data(const TextureShape s, const uint8_t *data, const uint8_t *palette_data, unsigned int width, unsigned int height, unsigned int depth, unsigned int row_pitch, unsigned int slice_pitch);
-static void upload_gl_texture(GLenum gl_target, const TextureShape s, const uint8_t *texture_data, const uint8_t *palette_data);
-static TextureBinding* generate_texture(const TextureShape s, const uint8_t *texture_data, const uint8_t *palette_data);
+static size_t pgraph_texture_plan(const TextureShape *s, GLenum gl_target, const uint8_t *texture_data, enum TextureConversion conversion, TextureUpload *uploads, unsigned int *num_uploads, TextureDecodeSlice *slices, unsigned int *num_slices);
+static TextureBinding* generate_texture(PGRAPHState *pg, const TextureShape s, const uint8_t *texture_data, const uint8_t *palette_data);
 static void texture_binding_destroy(gpointer data);
+static bool pgraph_texture_decoded_in_shader(unsigned int color_format, bool cubemap, unsigned int dimensionality);
+static ColorFormatInfo pgraph_texture_upload_format(const TextureShape *s);
+static void pgraph_bind_palette(PGRAPHState *pg, int stage, const uint8_t *palette_data, size_t palette_length);
 static struct lru_node *texture_cache_entry_init(struct lru_node *obj, void *key);
 static struct lru_node *texture_cache_entry_deinit(struct lru_node *obj);
 static int texture_cache_entry_compare(struct lru_node *obj, void *key);
+static void vram_range_index_init(VramRangeIndex *index, hwaddr size);
+static void vram_range_index_destroy(VramRangeIndex *index);
+static void vram_range_update(VramRangeIndex *index, VramRange *range,
+                              hwaddr start, size_t length, bool *dirty);
+static void vram_range_remove(VramRange *range);
+static bool pgraph_cache_test_and_clear_dirty(NV2AState *d,
+                                              const uint8_t *data,
+                                              size_t length);
+static uint64_t texture_content_hash(const TextureKey *key);
 static guint shader_hash(gconstpointer key);
 static gboolean shader_equal(gconstpointer a, gconstpointer b);
 static unsigned int kelvin_map_stencil_op(uint32_t parameter);
@@ -297,6 +357,7 @@ static unsigned int kelvin_map_polygon_mode(uint32_t parameter);
 static unsigned int kelvin_map_texgen(uint32_t parameter, unsigned int channel);
 static uint64_t fnv_hash(const uint8_t *data, size_t len);
 static uint64_t fast_hash(const uint8_t *data, size_t len, unsigned int samples);
+static void pfifo_capture_register(NV2AState *d, hwaddr addr, uint32_t value);
 
 /* PGRAPH - accelerated 2d/3d drawing engine */
 uint64_t pgraph_read(void *opaque, hwaddr addr, unsigned int size)
@@ -330,6 +391,10 @@ void pgraph_write(void *opaque, hwaddr addr, uint64_t val, unsigned int size)
 
     reg_log_write(NV_PGRAPH, addr, val);
 
+    if (d->capture) {
+        pfifo_capture_register(d, addr, val);
+    }
+
     qemu_mutex_lock(&d->pgraph.lock);
 
     switch (addr) {
@@ -393,6 +458,21 @@ void pgraph_write(void *opaque, hwaddr addr, uint64_t val, unsigned int size)
     qemu_mutex_unlock(&d->pgraph.lock);
 }
 
+/* Makes the object bound to subchannel current, returning its class */
+static uint32_t pgraph_switch_subchannel(PGRAPHState *pg,
+                                         unsigned int subchannel)
+{
+    // is this right?
+    pg->regs[NV_PGRAPH_CTX_SWITCH1] = pg->regs[NV_PGRAPH_CTX_CACHE1 + subchannel * 4];
+    pg->regs[NV_PGRAPH_CTX_SWITCH2] = pg->regs[NV_PGRAPH_CTX_CACHE2 + subchannel * 4];
+    pg->regs[NV_PGRAPH_CTX_SWITCH3] = pg->regs[NV_PGRAPH_CTX_CACHE3 + subchannel * 4];
+    pg->regs[NV_PGRAPH_CTX_SWITCH4] = pg->regs[NV_PGRAPH_CTX_CACHE4 + subchannel * 4];
+    pg->regs[NV_PGRAPH_CTX_SWITCH5] = pg->regs[NV_PGRAPH_CTX_CACHE5 + subchannel * 4];
+
+    return GET_MASK(pg->regs[NV_PGRAPH_CTX_SWITCH1],
+                    NV_PGRAPH_CTX_SWITCH1_GRCLASS);
+}
+
 static void pgraph_method(NV2AState *d,
                    unsigned int subchannel,
                    unsigned int method,
@@ -432,15 +512,7 @@ static void pgraph_method(NV2AState *d,
         pg->regs[NV_PGRAPH_CTX_CACHE5 + subchannel * 4] = ctx_5;
     }
 
-    // is this right?
-    pg->regs[NV_PGRAPH_CTX_SWITCH1] = pg->regs[NV_PGRAPH_CTX_CACHE1 + subchannel * 4];
-    pg->regs[NV_PGRAPH_CTX_SWITCH2] = pg->regs[NV_PGRAPH_CTX_CACHE2 + subchannel * 4];
-    pg->regs[NV_PGRAPH_CTX_SWITCH3] = pg->regs[NV_PGRAPH_CTX_CACHE3 + subchannel * 4];
-    pg->regs[NV_PGRAPH_CTX_SWITCH4] = pg->regs[NV_PGRAPH_CTX_CACHE4 + subchannel * 4];
-    pg->regs[NV_PGRAPH_CTX_SWITCH5] = pg->regs[NV_PGRAPH_CTX_CACHE5 + subchannel * 4];
-
-    uint32_t graphics_class = GET_MASK(pg->regs[NV_PGRAPH_CTX_SWITCH1],
-                                       NV_PGRAPH_CTX_SWITCH1_GRCLASS);
+    uint32_t graphics_class = pgraph_switch_subchannel(pg, subchannel);
 
     // NV2A_DPRINTF("graphics_class %d 0x%x\n", subchannel, graphics_class);
     pgraph_method_log(subchannel, graphics_class, method, parameter);
@@ -510,60 +582,8 @@ static void pgraph_method(NV2AState *d,
 
         /* I guess this kicks it off? */
         if (image_blit->operation == NV09F_SET_OPERATION_SRCCOPY) {
-
             NV2A_GL_DPRINTF(true, "NV09F_SET_OPERATION_SRCCOPY");
-
-            ContextSurfaces2DState *context_surfaces = context_surfaces_2d;
-            assert(context_surfaces->object_instance
-                    == image_blit->context_surfaces);
-
-            unsigned int bytes_per_pixel;
-            switch (context_surfaces->color_format) {
-            case NV062_SET_COLOR_FORMAT_LE_Y8:
-                bytes_per_pixel = 1;
-                break;
-            case NV062_SET_COLOR_FORMAT_LE_R5G6B5:
-                bytes_per_pixel = 2;
-                break;
-            case NV062_SET_COLOR_FORMAT_LE_A8R8G8B8:
-                bytes_per_pixel = 4;
-                break;
-            default:
-                fprintf(stderr, "Unknown blit surface format: 0x%x\n", context_surfaces->color_format);
-                assert(false);
-                break;
-            }
-
-            hwaddr source_dma_len, dest_dma_len;
-            uint8_t *source, *dest;
-
-            source = (uint8_t*)nv_dma_map(d, context_surfaces->dma_image_source,
-                                          &source_dma_len);
-            assert(context_surfaces->source_offset < source_dma_len);
-            source += context_surfaces->source_offset;
-
-            dest = (uint8_t*)nv_dma_map(d, context_surfaces->dma_image_dest,
-                                        &dest_dma_len);
-            assert(context_surfaces->dest_offset < dest_dma_len);
-            dest += context_surfaces->dest_offset;
-
-            NV2A_DPRINTF("  - 0x%tx -> 0x%tx\n", source - d->vram_ptr,
-                                                 dest - d->vram_ptr);
-
-            int y;
-            for (y=0; y<image_blit->height; y++) {
-                uint8_t *source_row = source
-                    + (image_blit->in_y + y) * context_surfaces->source_pitch
-                    + image_blit->in_x * bytes_per_pixel;
-
-                uint8_t *dest_row = dest
-                    + (image_blit->out_y + y) * context_surfaces->dest_pitch
-                    + image_blit->out_x * bytes_per_pixel;
-
-                memmove(dest_row, source_row,
-                        image_blit->width * bytes_per_pixel);
-            }
-
+            pgraph_image_blit(d);
         } else {
             assert(false);
         }
@@ -584,9 +604,12 @@ static void pgraph_method(NV2AState *d,
          * of the parameter. It's possible a debug register enables this,
          * but nothing obvious sticks out. Weird.
          */
-        if (parameter != 0) {
+        if (parameter != 0 && !pg->replaying) {
             assert(!(pg->pending_interrupts & NV_PGRAPH_INTR_ERROR));
 
+            /* the guest may look at rendered surfaces from the handler */
+            pgraph_readback_flush(d);
+
             SET_MASK(pg->regs[NV_PGRAPH_TRAPPED_ADDR],
                 NV_PGRAPH_TRAPPED_ADDR_CHID, channel_id);
             SET_MASK(pg->regs[NV_PGRAPH_TRAPPED_ADDR],
@@ -611,6 +634,8 @@ static void pgraph_method(NV2AState *d,
 
     case NV097_WAIT_FOR_IDLE:
         pgraph_update_surface(d, false, true, true);
+        pgraph_readback_flush(d);
+        pgraph_zpass_report_flush(d);
         break;
 
 
@@ -646,8 +671,32 @@ static void pgraph_method(NV2AState *d,
     }
     case NV097_FLIP_STALL:
         pgraph_update_surface(d, false, true, true);
-
-        while (true) {
+        pgraph_readback_flush(d);
+        pgraph_zpass_report_poll(d);
+
+        pg->readback_frames++;
+        pg->readback_stall_last_frame_ns = pg->readback_stall_frame_ns;
+        pg->readback_stall_max_frame_ns = MAX(pg->readback_stall_max_frame_ns,
+                                              pg->readback_stall_frame_ns);
+        pg->readback_stall_total_ns += pg->readback_stall_frame_ns;
+        pg->readback_stall_frame_ns = 0;
+
+        pg->vertex_upload_last_frame_bytes = pg->vertex_upload_frame_bytes;
+        pg->vertex_stream_last_frame_bytes = pg->vertex_stream_frame_bytes;
+        pg->vertex_upload_max_frame_bytes =
+            MAX(pg->vertex_upload_max_frame_bytes,
+                pg->vertex_upload_frame_bytes + pg->vertex_stream_frame_bytes);
+        pg->vertex_upload_frame_bytes = 0;
+        pg->vertex_stream_frame_bytes = 0;
+
+        pg->gl_calls_last_frame = pg->gl_calls;
+        pg->gl_calls_total.draws += pg->gl_calls.draws;
+        pg->gl_calls_total.uniforms += pg->gl_calls.uniforms;
+        pg->gl_calls_total.uniform_buffer_uploads +=
+            pg->gl_calls.uniform_buffer_uploads;
+        memset(&pg->gl_calls, 0, sizeof(pg->gl_calls));
+
+        while (!pg->replaying) {
             NV2A_DPRINTF("flip stall read: %d, write: %d, modulo: %d\n",
                 GET_MASK(pg->regs[NV_PGRAPH_SURFACE], NV_PGRAPH_SURFACE_READ_3D),
                 GET_MASK(pg->regs[NV_PGRAPH_SURFACE], NV_PGRAPH_SURFACE_WRITE_3D),
@@ -737,21 +786,16 @@ static void pgraph_method(NV2AState *d,
             GET_MASK(parameter, NV097_SET_SURFACE_PITCH_COLOR);
         pg->surface_zeta.pitch =
             GET_MASK(parameter, NV097_SET_SURFACE_PITCH_ZETA);
-
-        pg->surface_color.buffer_dirty = true;
-        pg->surface_zeta.buffer_dirty = true;
         break;
     case NV097_SET_SURFACE_COLOR_OFFSET:
         pgraph_update_surface(d, false, true, true);
 
         pg->surface_color.offset = parameter;
-        pg->surface_color.buffer_dirty = true;
         break;
     case NV097_SET_SURFACE_ZETA_OFFSET:
         pgraph_update_surface(d, false, true, true);
 
         pg->surface_zeta.offset = parameter;
-        pg->surface_zeta.buffer_dirty = true;
         break;
 
     case NV097_SET_COMBINER_ALPHA_ICW ...
@@ -1588,13 +1632,10 @@ static void pgraph_method(NV2AState *d,
             break;
         }
 
-        if (vertex_attribute->needs_conversion) {
-            vertex_attribute->converted_elements = 0;
-        } else {
-            if (vertex_attribute->converted_buffer) {
-                g_free(vertex_attribute->converted_buffer);
-                vertex_attribute->converted_buffer = NULL;
-            }
+        if (!vertex_attribute->needs_conversion) {
+            g_free(vertex_attribute->converted_buffer);
+            vertex_attribute->converted_buffer = NULL;
+            vertex_attribute->converted_buffer_size = 0;
         }
 
         break;
@@ -1610,8 +1651,6 @@ static void pgraph_method(NV2AState *d,
         pg->vertex_attributes[slot].offset =
             parameter & 0x7fffffff;
 
-        pg->vertex_attributes[slot].converted_elements = 0;
-
         break;
 
     case NV097_SET_LOGIC_OP_ENABLE:
@@ -1628,12 +1667,7 @@ static void pgraph_method(NV2AState *d,
         /* FIXME: Does this have a value in parameter? Also does this (also?) modify
          *        the report memory block?
          */
-        if (pg->gl_zpass_pixel_count_query_count) {
-            glDeleteQueries(pg->gl_zpass_pixel_count_query_count,
-                            pg->gl_zpass_pixel_count_queries);
-            pg->gl_zpass_pixel_count_query_count = 0;
-        }
-        pg->zpass_pixel_count_result = 0;
+        pgraph_zpass_report_clear(pg);
         break;
 
     case NV097_SET_ZPASS_PIXEL_COUNT_ENABLE:
@@ -1650,35 +1684,7 @@ static void pgraph_method(NV2AState *d,
         assert(type == NV097_GET_REPORT_TYPE_ZPASS_PIXEL_CNT);
         hwaddr offset = GET_MASK(parameter, NV097_GET_REPORT_OFFSET);
 
-        uint64_t timestamp = 0x0011223344556677; /* FIXME: Update timestamp?! */
-        uint32_t done = 0;
-
-        /* FIXME: Multisampling affects this (both: OGL and Xbox GPU),
-         *        not sure if CLEARs also count
-         */
-        /* FIXME: What about clipping regions etc? */
-        for(i = 0; i < pg->gl_zpass_pixel_count_query_count; i++) {
-            GLuint gl_query_result;
-            glGetQueryObjectuiv(pg->gl_zpass_pixel_count_queries[i],
-                                GL_QUERY_RESULT,
-                                &gl_query_result);
-            pg->zpass_pixel_count_result += gl_query_result;
-        }
-        if (pg->gl_zpass_pixel_count_query_count) {
-            glDeleteQueries(pg->gl_zpass_pixel_count_query_count,
-                            pg->gl_zpass_pixel_count_queries);
-        }
-        pg->gl_zpass_pixel_count_query_count = 0;
-
-        hwaddr report_dma_len;
-        uint8_t *report_data = (uint8_t*)nv_dma_map(d, pg->dma_report,
-                                                    &report_dma_len);
-        assert(offset < report_dma_len);
-        report_data += offset;
-
-        stq_le_p((uint64_t*)&report_data[0], timestamp);
-        stl_le_p((uint32_t*)&report_data[8], pg->zpass_pixel_count_result);
-        stl_le_p((uint32_t*)&report_data[12], done);
+        pgraph_zpass_report_issue(d, offset);
 
         break;
     }
@@ -1696,11 +1702,45 @@ static void pgraph_method(NV2AState *d,
         bool stencil_test = pg->regs[NV_PGRAPH_CONTROL_1]
                                 & NV_PGRAPH_CONTROL_1_STENCIL_TEST_ENABLE;
 
+        if (pg->renderer) {
+            if (parameter == NV097_SET_BEGIN_END_OP_END) {
+                pg->renderer->draw(d);
+            } else {
+                assert(parameter <= NV097_SET_BEGIN_END_OP_POLYGON);
+                pg->primitive_mode = parameter;
+                pg->inline_elements_length = 0;
+                pg->inline_array_length = 0;
+                pg->inline_buffer_length = 0;
+                pg->draw_arrays_length = 0;
+                pg->draw_arrays_max_count = 0;
+            }
+            break;
+        }
+
         if (parameter == NV097_SET_BEGIN_END_OP_END) {
 
-            assert(pg->shader_binding);
+            if (!pg->shader_binding) {
+                /* Program is still being compiled in the background */
+                assert(pg->shader_skip_draws);
+                pg->shader_compiler.draws_skipped++;
+
+                for (i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+                    pg->vertex_attributes[i].inline_buffer_populated = false;
+                }
+                if (pg->zpass_pixel_count_enable) {
+                    glEndQuery(GL_SAMPLES_PASSED);
+                }
+
+                NV2A_GL_DGROUP_END();
+                break;
+            }
+
+            if (pg->vsh_cpu_program) {
 
-            if (pg->draw_arrays_length) {
+                NV2A_GL_DPRINTF(false, "Vertex Program on CPU");
+
+                pgraph_draw_vertex_program_cpu(d);
+            } else if (pg->draw_arrays_length) {
 
                 NV2A_GL_DPRINTF(false, "Draw Arrays");
 
@@ -1714,6 +1754,7 @@ static void pgraph_method(NV2AState *d,
                                   pg->gl_draw_arrays_start,
                                   pg->gl_draw_arrays_count,
                                   pg->draw_arrays_length);
+                pg->gl_calls.draws++;
             } else if (pg->inline_buffer_length) {
 
                 NV2A_GL_DPRINTF(false, "Inline Buffer");
@@ -1725,21 +1766,25 @@ static void pgraph_method(NV2AState *d,
                 for (i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
                     VertexAttribute *attribute = &pg->vertex_attributes[i];
 
-                    if (attribute->inline_buffer) {
-
-                        glBindBuffer(GL_ARRAY_BUFFER,
-                                     attribute->gl_inline_buffer);
-                        glBufferData(GL_ARRAY_BUFFER,
-                                     pg->inline_buffer_length
-                                        * sizeof(float) * 4,
-                                     attribute->inline_buffer,
-                                     GL_DYNAMIC_DRAW);
+                    if (attribute->inline_buffer_populated) {
+                        size_t length = pg->inline_buffer_length
+                                            * sizeof(float) * 4;
+                        GLintptr offset = 0;
+                        if (!pgraph_stream_upload(pg, GL_ARRAY_BUFFER,
+                                                  attribute->inline_buffer,
+                                                  length, &offset)) {
+                            glBindBuffer(GL_ARRAY_BUFFER,
+                                         attribute->gl_inline_buffer);
+                            glBufferData(GL_ARRAY_BUFFER, length,
+                                         attribute->inline_buffer,
+                                         GL_DYNAMIC_DRAW);
+                        }
 
                         /* Clear buffer for next batch */
-                        g_free(attribute->inline_buffer);
-                        attribute->inline_buffer = NULL;
+                        attribute->inline_buffer_populated = false;
 
-                        glVertexAttribPointer(i, 4, GL_FLOAT, GL_FALSE, 0, 0);
+                        glVertexAttribPointer(i, 4, GL_FLOAT, GL_FALSE, 0,
+                                              (void *)offset);
                         glEnableVertexAttribArray(i);
                     } else {
                         glDisableVertexAttribArray(i);
@@ -1751,6 +1796,7 @@ static void pgraph_method(NV2AState *d,
 
                 glDrawArrays(pg->shader_binding->gl_primitive_mode,
                              0, pg->inline_buffer_length);
+                pg->gl_calls.draws++;
             } else if (pg->inline_array_length) {
 
                 NV2A_GL_DPRINTF(false, "Inline Array");
@@ -1762,6 +1808,7 @@ static void pgraph_method(NV2AState *d,
                 unsigned int index_count = pgraph_bind_inline_array(d);
                 glDrawArrays(pg->shader_binding->gl_primitive_mode,
                              0, index_count);
+                pg->gl_calls.draws++;
             } else if (pg->inline_elements_length) {
 
                 NV2A_GL_DPRINTF(false, "Inline Elements");
@@ -1779,22 +1826,31 @@ static void pgraph_method(NV2AState *d,
 
                 pgraph_bind_vertex_attributes(d, max_element+1, false, 0);
 
-                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pg->gl_element_buffer);
-                glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                             pg->inline_elements_length*4,
-                             pg->inline_elements,
-                             GL_DYNAMIC_DRAW);
+                GLintptr offset = 0;
+                if (!pgraph_stream_upload(pg, GL_ELEMENT_ARRAY_BUFFER,
+                                          pg->inline_elements,
+                                          pg->inline_elements_length*4,
+                                          &offset)) {
+                    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,
+                                 pg->gl_element_buffer);
+                    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                                 pg->inline_elements_length*4,
+                                 pg->inline_elements,
+                                 GL_DYNAMIC_DRAW);
+                }
 
                 glDrawRangeElements(pg->shader_binding->gl_primitive_mode,
                                     min_element, max_element,
                                     pg->inline_elements_length,
                                     GL_UNSIGNED_INT,
-                                    (void*)0);
+                                    (void*)offset);
+                pg->gl_calls.draws++;
 
             } else {
                 NV2A_GL_DPRINTF(true, "EMPTY NV097_SET_BEGIN_END");
                 assert(false);
             }
+            vertex_stream_end_draw(&pg->vertex_stream);
 
             /* End of visibility testing */
             if (pg->zpass_pixel_count_enable) {
@@ -1968,15 +2024,7 @@ static void pgraph_method(NV2AState *d,
 
             /* Visibility testing */
             if (pg->zpass_pixel_count_enable) {
-                GLuint gl_query;
-                glGenQueries(1, &gl_query);
-                pg->gl_zpass_pixel_count_query_count++;
-                pg->gl_zpass_pixel_count_queries = (GLuint*)g_realloc(
-                    pg->gl_zpass_pixel_count_queries,
-                    sizeof(GLuint) * pg->gl_zpass_pixel_count_query_count);
-                pg->gl_zpass_pixel_count_queries[
-                    pg->gl_zpass_pixel_count_query_count - 1] = gl_query;
-                glBeginQuery(GL_SAMPLES_PASSED, gl_query);
+                pgraph_zpass_query_begin(pg);
             }
 
         }
@@ -2219,6 +2267,7 @@ static void pgraph_method(NV2AState *d,
     case NV097_BACK_END_WRITE_SEMAPHORE_RELEASE: {
 
         pgraph_update_surface(d, false, true, true);
+        pgraph_readback_flush(d);
 
         //qemu_mutex_unlock(&d->pgraph.lock);
         //qemu_mutex_lock_iothread();
@@ -2247,6 +2296,11 @@ static void pgraph_method(NV2AState *d,
         break;
 
     case NV097_CLEAR_SURFACE: {
+        if (pg->renderer) {
+            pg->renderer->clear_surface(d, parameter);
+            break;
+        }
+
         NV2A_DPRINTF("---------PRE CLEAR ------\n");
         GLbitfield gl_mask = 0;
 
@@ -2512,7 +2566,12 @@ static void pgraph_context_switch(NV2AState *d, unsigned int channel_id)
     unsigned pgraph_channel_id = GET_MASK(d->pgraph.regs[NV_PGRAPH_CTX_USER], NV_PGRAPH_CTX_USER_CHID);
 
     bool valid = channel_valid && pgraph_channel_id == channel_id;
-    if (!valid) {
+    if (!valid && d->pgraph.replaying) {
+        /* do what the guest's context switch handler would have done */
+        SET_MASK(d->pgraph.regs[NV_PGRAPH_CTX_USER],
+                 NV_PGRAPH_CTX_USER_CHID, channel_id);
+        d->pgraph.regs[NV_PGRAPH_CTX_CONTROL] |= NV_PGRAPH_CTX_CONTROL_CHID;
+    } else if (!valid) {
         SET_MASK(d->pgraph.regs[NV_PGRAPH_TRAPPED_ADDR],
                  NV_PGRAPH_TRAPPED_ADDR_CHID, channel_id);
 
@@ -2538,11 +2597,113 @@ static void pgraph_context_switch(NV2AState *d, unsigned int channel_id)
 }
 
 static void pgraph_wait_fifo_access(NV2AState *d) {
+    if (d->pgraph.replaying) {
+        return;
+    }
     while (!(d->pgraph.regs[NV_PGRAPH_FIFO] & NV_PGRAPH_FIFO_ACCESS)) {
         qemu_cond_wait(&d->pgraph.fifo_access_cond, &d->pgraph.lock);
     }
 }
 
+/* Handles the start of a run of kelvin methods that only fill in state
+ * arrays without side effects, returning how many parameters were
+ * consumed or 0 if the method has to go through pgraph_method */
+static unsigned int pgraph_kelvin_method_burst(PGRAPHState *pg,
+                                               unsigned int subchannel,
+                                               unsigned int method,
+                                               bool increment,
+                                               const uint32_t *parameters,
+                                               unsigned int count)
+{
+    unsigned int i, n;
+
+    if (count < 2) {
+        return 0;
+    }
+
+    if (increment
+        && method >= NV097_SET_TRANSFORM_CONSTANT
+        && method <= NV097_SET_TRANSFORM_CONSTANT + 0x7c) {
+        unsigned int slot = (method - NV097_SET_TRANSFORM_CONSTANT) / 4;
+        int const_load = GET_MASK(pg->regs[NV_PGRAPH_CHEOPS_OFFSET],
+                                  NV_PGRAPH_CHEOPS_OFFSET_CONST_LD_PTR);
+
+        n = MIN(count, 32 - slot);
+        for (i = 0; i < n; i++, slot++) {
+            pgraph_method_log(subchannel, NV_KELVIN_PRIMITIVE,
+                              method + i * 4, parameters[i]);
+
+            assert(const_load < NV2A_VERTEXSHADER_CONSTANTS);
+            pg->vsh_constants_dirty[const_load] |=
+                (parameters[i] != pg->vsh_constants[const_load][slot%4]);
+            pg->vsh_constants[const_load][slot%4] = parameters[i];
+            if (slot % 4 == 3) {
+                const_load++;
+            }
+        }
+
+        SET_MASK(pg->regs[NV_PGRAPH_CHEOPS_OFFSET],
+                 NV_PGRAPH_CHEOPS_OFFSET_CONST_LD_PTR, const_load);
+        return n;
+    }
+
+    if (!increment && method == NV097_INLINE_ARRAY) {
+        for (i = 0; i < count; i++) {
+            pgraph_method_log(subchannel, NV_KELVIN_PRIMITIVE,
+                              method, parameters[i]);
+        }
+
+        assert(pg->inline_array_length + count <= NV2A_MAX_BATCH_LENGTH);
+        memcpy(&pg->inline_array[pg->inline_array_length], parameters,
+               count * sizeof(parameters[0]));
+        pg->inline_array_length += count;
+        return count;
+    }
+
+    return 0;
+}
+
+/* Executes a run of methods pulled from CACHE1, all on the same subchannel
+ * and either increasing from method or all to method */
+static void pgraph_method_run(NV2AState *d,
+                              unsigned int subchannel,
+                              unsigned int method,
+                              bool increment,
+                              const uint32_t *parameters,
+                              unsigned int count)
+{
+    PGRAPHState *pg = &d->pgraph;
+    unsigned int i = 0;
+
+    assert(subchannel < 8);
+
+    while (i < count) {
+        pgraph_wait_fifo_access(d);
+
+        unsigned int n = 0;
+        uint32_t graphics_class = GET_MASK(
+            pg->regs[NV_PGRAPH_CTX_CACHE1 + subchannel * 4],
+            NV_PGRAPH_CTX_SWITCH1_GRCLASS);
+        if (graphics_class == NV_KELVIN_PRIMITIVE) {
+            n = pgraph_kelvin_method_burst(pg, subchannel, method, increment,
+                                           &parameters[i], count - i);
+        }
+
+        if (n > 0) {
+            pgraph_switch_subchannel(pg, subchannel);
+            pg->methods_burst += n;
+        } else {
+            pgraph_method(d, subchannel, method, parameters[i]);
+            n = 1;
+        }
+
+        i += n;
+        if (increment) {
+            method += n * 4;
+        }
+    }
+}
+
 // static const char* nv2a_method_names[] = {};
 
 static void pgraph_method_log(unsigned int subchannel,
@@ -2593,13 +2754,17 @@ static void pgraph_allocate_inline_buffer_vertices(PGRAPHState *pg,
     int i;
     VertexAttribute *attribute = &pg->vertex_attributes[attr];
 
-    if (attribute->inline_buffer || pg->inline_buffer_length == 0) {
+    if (attribute->inline_buffer_populated || pg->inline_buffer_length == 0) {
         return;
     }
 
+    if (!attribute->inline_buffer) {
+        attribute->inline_buffer = (float*)g_malloc(NV2A_MAX_BATCH_LENGTH
+                                                      * sizeof(float) * 4);
+    }
+    attribute->inline_buffer_populated = true;
+
     /* Now upload the previous attribute value */
-    attribute->inline_buffer = (float*)g_malloc(NV2A_MAX_BATCH_LENGTH
-                                                  * sizeof(float) * 4);
     for (i = 0; i < pg->inline_buffer_length; i++) {
         memcpy(&attribute->inline_buffer[i * 4],
                attribute->inline_value,
@@ -2615,7 +2780,7 @@ static void pgraph_finish_inline_buffer_vertex(PGRAPHState *pg)
 
     for (i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
         VertexAttribute *attribute = &pg->vertex_attributes[i];
-        if (attribute->inline_buffer) {
+        if (attribute->inline_buffer_populated) {
             memcpy(&attribute->inline_buffer[
                       pg->inline_buffer_length * 4],
                    attribute->inline_value,
@@ -2626,17 +2791,12 @@ static void pgraph_finish_inline_buffer_vertex(PGRAPHState *pg)
     pg->inline_buffer_length++;
 }
 
-static void pgraph_init(NV2AState *d)
+static void pgraph_init_gl(NV2AState *d)
 {
     int i;
 
     PGRAPHState *pg = &d->pgraph;
 
-    qemu_mutex_init(&pg->lock);
-    qemu_cond_init(&pg->interrupt_cond);
-    qemu_cond_init(&pg->fifo_access_cond);
-    qemu_cond_init(&pg->flip_3d);
-
     /* fire up opengl */
 
     pg->gl_context = glo_context_create();
@@ -2660,24 +2820,45 @@ static void pgraph_init(NV2AState *d)
     glBindFramebuffer(GL_FRAMEBUFFER, pg->gl_framebuffer);
 
     /* need a valid framebuffer to start with */
-    glGenTextures(1, &pg->gl_color_buffer);
-    glBindTexture(GL_TEXTURE_2D, pg->gl_color_buffer);
+    glGenTextures(1, &pg->gl_default_color_buffer);
+    glBindTexture(GL_TEXTURE_2D, pg->gl_default_color_buffer);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 640, 480,
                  0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
     glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                           GL_TEXTURE_2D, pg->gl_color_buffer, 0);
+                           GL_TEXTURE_2D, pg->gl_default_color_buffer, 0);
 
     assert(glCheckFramebufferStatus(GL_FRAMEBUFFER)
             == GL_FRAMEBUFFER_COMPLETE);
 
+    glGenFramebuffers(2, pg->gl_blit_framebuffers);
+
     //glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );
 
+    texture_decoder_init(&pg->texture_decoder, d->texture_threads);
+    glGenBuffers(NV2A_TEXTURE_STAGING_BUFFERS, pg->gl_texture_staging);
+
+    /* the longest palette, shorter ones leave the rest as it was */
+    glGenTextures(NV2A_MAX_TEXTURES, pg->gl_palette_textures);
+    for (i = 0; i < NV2A_MAX_TEXTURES; i++) {
+        glBindTexture(GL_TEXTURE_2D, pg->gl_palette_textures[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 256, 1, 0,
+                     GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        pg->palette_valid[i] = false;
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    vram_range_index_init(&pg->vram_ranges, memory_region_size(d->vram));
+
     // Initialize texture cache
-    const size_t texture_cache_size = 512;
+    const size_t texture_cache_size = 4096;
     lru_init(&pg->texture_cache,
         &texture_cache_entry_init,
         &texture_cache_entry_deinit,
-        &texture_cache_entry_compare);
+        &texture_cache_entry_compare,
+        (size_t)d->texture_cache_mb * 1024 * 1024);
     pg->texture_cache_entries = malloc(texture_cache_size * sizeof(struct TextureKey));
     assert(pg->texture_cache_entries != NULL);
     for (i = 0; i < texture_cache_size; i++) {
@@ -2685,6 +2866,18 @@ static void pgraph_init(NV2AState *d)
     }
 
     pg->shader_cache = g_hash_table_new(shader_hash, shader_equal);
+    if (d->shader_cache_path && *d->shader_cache_path != '\x00') {
+        pg->shader_disk_cache = shader_disk_cache_open(d->shader_cache_path);
+    }
+
+    /* skipping draws only makes sense if something else does the compiling */
+    pg->shader_skip_draws = d->shader_skip_draws;
+    unsigned int shader_threads = d->shader_threads;
+    if (pg->shader_skip_draws && shader_threads == 0) {
+        shader_threads = 1;
+    }
+    shader_compiler_init(&pg->shader_compiler, pg->gl_context,
+                         shader_threads, pg->shader_disk_cache);
 
 
     for (i=0; i<NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
@@ -2701,42 +2894,342 @@ static void pgraph_init(NV2AState *d)
                  NULL,
                  GL_DYNAMIC_DRAW);
 
+    vertex_stream_init(&pg->vertex_stream);
+
+    pg->vertex_conversion_cache = g_hash_table_new(vertex_conversion_hash,
+                                                   vertex_conversion_equal);
+    QTAILQ_INIT(&pg->vertex_conversions);
+
+    pg->vsh_cpu_mode = VSH_CPU_OFF;
+    if (d->vsh_cpu_name && !strcmp(d->vsh_cpu_name, "on")) {
+        pg->vsh_cpu_mode = VSH_CPU_ON;
+    } else if (d->vsh_cpu_name && !strcmp(d->vsh_cpu_name, "auto")) {
+        pg->vsh_cpu_mode = VSH_CPU_AUTO;
+    } else if (d->vsh_cpu_name && strcmp(d->vsh_cpu_name, "off")) {
+        fprintf(stderr, "nv2a: unknown vsh-cpu mode %s, using GL\n",
+                d->vsh_cpu_name);
+    }
+    pg->vsh_program_cache = g_hash_table_new(vsh_program_hash,
+                                             vsh_program_equal);
+    QTAILQ_INIT(&pg->vsh_programs);
+    glGenBuffers(1, &pg->gl_vsh_output_buffer);
+
     glGenVertexArrays(1, &pg->gl_vertex_array);
     glBindVertexArray(pg->gl_vertex_array);
 
+    /* the lighting bank is uploaded as one block starting at ltctxa */
+    QEMU_BUILD_BUG_ON(offsetof(PGRAPHState, ltc1)
+                      != offsetof(PGRAPHState, ltctxa)
+                         + (NV2A_LTCTXA_COUNT + NV2A_LTCTXB_COUNT) * 16);
+    QEMU_BUILD_BUG_ON(offsetof(PGRAPHState, ltc1_dirty)
+                      != offsetof(PGRAPHState, ltctxa_dirty)
+                         + NV2A_LTCTXA_COUNT + NV2A_LTCTXB_COUNT);
+
+    glGenBuffers(1, &pg->gl_vsh_constant_buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, pg->gl_vsh_constant_buffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(pg->vsh_constants),
+                 pg->vsh_constants, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, NV2A_VSH_CONSTANTS_BINDING,
+                     pg->gl_vsh_constant_buffer);
+
+    glGenBuffers(1, &pg->gl_lighting_constant_buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, pg->gl_lighting_constant_buffer);
+    glBufferData(GL_UNIFORM_BUFFER, NV2A_LIGHTING_CONSTANTS * 16,
+                 pg->ltctxa, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, NV2A_LIGHTING_CONSTANTS_BINDING,
+                     pg->gl_lighting_constant_buffer);
+
     assert(glGetError() == GL_NO_ERROR);
 
     glo_set_current(NULL);
 }
 
+static void pgraph_init(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    qemu_mutex_init(&pg->lock);
+    qemu_cond_init(&pg->interrupt_cond);
+    qemu_cond_init(&pg->fifo_access_cond);
+    qemu_cond_init(&pg->flip_3d);
+
+    QTAILQ_INIT(&pg->surfaces);
+
+    pg->zpass_report_mode = ZPASS_REPORT_DEFERRED;
+    if (d->zpass_report_name && !strcmp(d->zpass_report_name, "sync")) {
+        pg->zpass_report_mode = ZPASS_REPORT_SYNC;
+    } else if (d->zpass_report_name
+               && !strcmp(d->zpass_report_name, "latency")) {
+        pg->zpass_report_mode = ZPASS_REPORT_LATENCY;
+    } else if (d->zpass_report_name
+               && strcmp(d->zpass_report_name, "deferred")) {
+        fprintf(stderr, "nv2a: unknown zpass-reports mode %s, "
+                        "using deferred\n", d->zpass_report_name);
+    }
+
+    /* the renderer draws straight into guest memory, so there is no GL
+     * context to create and the machine can run headless */
+    if (pg->renderer) {
+        pg->renderer->init(d);
+        return;
+    }
+
+    pgraph_init_gl(d);
+}
+
 static void pgraph_destroy(PGRAPHState *pg)
 {
+    int i;
+
+    if (pg->renderer) {
+        pg->renderer->destroy(pg);
+    }
+
     qemu_mutex_destroy(&pg->lock);
     qemu_cond_destroy(&pg->interrupt_cond);
     qemu_cond_destroy(&pg->fifo_access_cond);
     qemu_cond_destroy(&pg->flip_3d);
 
+    if (pg->renderer) {
+        return;
+    }
+
     glo_set_current(pg->gl_context);
 
-    if (pg->gl_color_buffer) {
-        glDeleteTextures(1, &pg->gl_color_buffer);
-    }
-    if (pg->gl_zeta_buffer) {
-        glDeleteTextures(1, &pg->gl_zeta_buffer);
+    while (!QTAILQ_EMPTY(&pg->surfaces)) {
+        pgraph_surface_destroy(pg, QTAILQ_FIRST(&pg->surfaces));
     }
+    glDeleteTextures(1, &pg->gl_default_color_buffer);
+    glDeleteFramebuffers(2, pg->gl_blit_framebuffers);
     glDeleteFramebuffers(1, &pg->gl_framebuffer);
 
+    vertex_stream_destroy(&pg->vertex_stream);
+    glDeleteBuffers(1, &pg->gl_vsh_constant_buffer);
+    glDeleteBuffers(1, &pg->gl_lighting_constant_buffer);
+    while (!QTAILQ_EMPTY(&pg->vertex_conversions)) {
+        pgraph_vertex_conversion_destroy(pg,
+                                         QTAILQ_FIRST(&pg->vertex_conversions));
+    }
+    g_hash_table_destroy(pg->vertex_conversion_cache);
+    while (!QTAILQ_EMPTY(&pg->vsh_programs)) {
+        pgraph_vsh_program_destroy(pg, QTAILQ_FIRST(&pg->vsh_programs));
+    }
+    g_hash_table_destroy(pg->vsh_program_cache);
+    glDeleteBuffers(1, &pg->gl_vsh_output_buffer);
+    g_free(pg->vsh_outputs);
+    pg->vsh_outputs = NULL;
+    for (i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        VertexAttribute *attribute = &pg->vertex_attributes[i];
+        g_free(attribute->inline_buffer);
+        attribute->inline_buffer = NULL;
+        g_free(attribute->converted_buffer);
+        attribute->converted_buffer = NULL;
+    }
+
+    for (i = 0; i < NV2A_SURFACE_READBACKS; i++) {
+        SurfaceReadback *r = &pg->readbacks[i];
+        if (r->fence) {
+            glDeleteSync(r->fence);
+        }
+        if (r->gl_buffer) {
+            glDeleteBuffers(1, &r->gl_buffer);
+        }
+    }
+
+    for (i = 0; i < NV2A_ZPASS_REPORTS; i++) {
+        ZpassReport *r = &pg->zpass_reports[i];
+        pgraph_zpass_queries_release(pg, r->gl_queries, r->query_count);
+        g_free(r->gl_queries);
+    }
+    pgraph_zpass_queries_release(pg, pg->gl_zpass_pixel_count_queries,
+                                 pg->gl_zpass_pixel_count_query_count);
+    g_free(pg->gl_zpass_pixel_count_queries);
+    if (pg->zpass_query_pool_count) {
+        glDeleteQueries(pg->zpass_query_pool_count, pg->gl_zpass_query_pool);
+    }
+    g_free(pg->gl_zpass_query_pool);
+
     // TODO: clear out shader cached
 
     // Clear out texture cache
-    lru_flush(&pg->texture_cache);
+    lru_destroy(&pg->texture_cache);
     free(pg->texture_cache_entries);
+    vram_range_index_destroy(&pg->vram_ranges);
+    glDeleteBuffers(NV2A_TEXTURE_STAGING_BUFFERS, pg->gl_texture_staging);
+    glDeleteTextures(NV2A_MAX_TEXTURES, pg->gl_palette_textures);
+    texture_decoder_destroy(&pg->texture_decoder);
+
+    shader_compiler_destroy(&pg->shader_compiler);
+    if (pg->shader_disk_cache) {
+        shader_disk_cache_close(pg->shader_disk_cache);
+        pg->shader_disk_cache = NULL;
+    }
 
     glo_set_current(NULL);
 
     glo_context_destroy(pg->gl_context);
 }
 
+static void pgraph_print_stats(PGRAPHState *pg, Monitor *mon)
+{
+    struct lru *tc = &pg->texture_cache;
+    struct {
+        unsigned int count;
+        size_t size;
+    } formats[ARRAY_SIZE(kelvin_color_format_map)] = { { 0 } };
+    struct lru_node *node;
+    int i;
+
+    /* the caches and the shader compiler are only set up for GL */
+    if (pg->renderer) {
+        monitor_printf(mon, "methods: %" PRIu64 " handled in bursts\n",
+                       pg->methods_burst);
+        pg->renderer->print_stats(pg, mon);
+        return;
+    }
+
+    monitor_printf(mon, "texture cache: %zu entries, %zu KiB (budget %zu KiB), "
+                        "%zu hits, %zu misses, %zu collisions, %zu evictions\n",
+                   tc->num_active, tc->size / 1024, tc->max_size / 1024,
+                   tc->num_hit, tc->num_miss, tc->num_collisions,
+                   tc->num_evicted);
+    monitor_printf(mon, "  %u content hashes skipped, %u reuploads, "
+                        "%u palette uploads\n",
+                   pg->texture_hashes_skipped, pg->texture_reuploads,
+                   pg->palette_uploads);
+    monitor_printf(mon, "  %u textures generated, %" PRId64 " us average "
+                        "and %" PRId64 " us max until first use, %u decode "
+                        "threads, %" PRIu64 " slices, %" PRIu64 " KiB "
+                        "decoded\n",
+                   pg->textures_generated,
+                   pg->texture_generate_total_ns / 1000
+                       / MAX(pg->textures_generated, 1),
+                   pg->texture_generate_max_ns / 1000,
+                   pg->texture_decoder.pool.num_threads,
+                   pg->texture_decoder.slices_decoded,
+                   pg->texture_decoder.bytes_decoded / 1024);
+
+    for (node = tc->active_head; node != NULL; node = node->next) {
+        TextureKey *key = container_of(node, TextureKey, node);
+        assert(key->state.color_format < ARRAY_SIZE(formats));
+        formats[key->state.color_format].count++;
+        formats[key->state.color_format].size += node->size;
+    }
+    for (i = 0; i < ARRAY_SIZE(formats); i++) {
+        if (formats[i].count) {
+            monitor_printf(mon, "  format 0x%02x: %u entries, %zu KiB\n",
+                           i, formats[i].count, formats[i].size / 1024);
+        }
+    }
+
+    monitor_printf(mon, "surface cache: %u surfaces, %u hits, %u misses, "
+                        "%u uploads, %u texture copies\n",
+                   pg->num_surfaces, pg->surface_hits, pg->surface_misses,
+                   pg->surface_uploads, pg->surface_texture_copies);
+    monitor_printf(mon, "image blit: %u on the GPU, %u patched into a "
+                        "surface, %u in VRAM only, %u read from a surface\n",
+                   pg->image_blits_gpu, pg->image_blits_uploaded,
+                   pg->image_blits_cpu, pg->image_blits_read);
+    monitor_printf(mon, "surface readback: %u issued, %u stalled, %u pending, "
+                        "stall per frame %" PRId64 " us last, %" PRId64
+                        " us max, %" PRId64 " us average\n",
+                   pg->readbacks_issued, pg->readbacks_stalled,
+                   pg->readbacks_pending,
+                   pg->readback_stall_last_frame_ns / 1000,
+                   pg->readback_stall_max_frame_ns / 1000,
+                   pg->readback_stall_total_ns / 1000
+                       / MAX(pg->readback_frames, 1));
+
+    monitor_printf(mon, "zpass reports: %u written, %u stalled, %u pending, "
+                        "%u queries created, %u pooled\n",
+                   pg->zpass_reports_written, pg->zpass_reports_stalled,
+                   pg->zpass_reports_pending, pg->zpass_queries_created,
+                   pg->zpass_query_pool_count);
+
+    VertexStream *vs = &pg->vertex_stream;
+    monitor_printf(mon, "vertex upload: last frame %" PRIu64 " KiB from VRAM, "
+                        "%" PRIu64 " KiB streamed, max frame %" PRIu64 " KiB, "
+                        "%u VRAM ranges\n",
+                   pg->vertex_upload_last_frame_bytes / 1024,
+                   pg->vertex_stream_last_frame_bytes / 1024,
+                   pg->vertex_upload_max_frame_bytes / 1024,
+                   pg->vertex_upload_ranges);
+    monitor_printf(mon, "vertex stream: %s, %" PRIu64 " KiB total, "
+                        "%u wraps, %u stalls, %u overflows\n",
+                   vs->persistent ? "persistent" : "orphaning",
+                   vs->bytes_streamed / 1024,
+                   vs->wraps, vs->stalls, vs->overflows);
+
+    monitor_printf(mon, "vertex conversion: %u arrays, %u hits, %u misses, "
+                        "%" PRIu64 " elements converted\n",
+                   pg->num_vertex_conversions, pg->vertex_conversion_hits,
+                   pg->vertex_conversion_misses,
+                   pg->vertex_elements_converted);
+
+    monitor_printf(mon, "vertex programs on CPU: %u decoded, %" PRIu64
+                        " draws, %" PRIu64 " vertices, %u draws dropped\n",
+                   pg->num_vsh_programs, pg->vsh_cpu_draws,
+                   pg->vsh_cpu_vertices, pg->vsh_cpu_draws_dropped);
+
+    monitor_printf(mon, "methods: %" PRIu64 " handled in bursts\n",
+                   pg->methods_burst);
+
+    monitor_printf(mon, "gl calls last frame: %u draws, %u uniforms, "
+                        "%u uniform buffer uploads\n",
+                   pg->gl_calls_last_frame.draws,
+                   pg->gl_calls_last_frame.uniforms,
+                   pg->gl_calls_last_frame.uniform_buffer_uploads);
+
+    monitor_printf(mon, "shader cache: %u programs\n",
+                   g_hash_table_size(pg->shader_cache));
+    if (pg->shader_disk_cache) {
+        ShaderDiskCache *dc = pg->shader_disk_cache;
+        qemu_mutex_lock(&dc->lock);
+        monitor_printf(mon, "shader disk cache: %u hits, %u misses, "
+                            "%u rejected\n",
+                       dc->hits, dc->misses, dc->rejected);
+        qemu_mutex_unlock(&dc->lock);
+    }
+
+    ShaderCompiler *sc = &pg->shader_compiler;
+    qemu_mutex_lock(&sc->lock);
+    monitor_printf(mon, "shader compiler: %u programs, %" PRId64 " us average, "
+                        "%" PRId64 " us max, %u draws skipped\n",
+                   sc->programs_compiled,
+                   sc->compile_time_total_ns / 1000
+                       / MAX(sc->programs_compiled, 1),
+                   sc->compile_time_max_ns / 1000,
+                   sc->draws_skipped);
+    qemu_mutex_unlock(&sc->lock);
+}
+
+/* Sends the dirty part of a bank of vec4 constants to its uniform buffer in
+ * one go, from the first dirty constant to the last */
+static void pgraph_upload_constant_bank(PGRAPHState *pg, GLuint gl_buffer,
+                                        const uint32_t (*constants)[4],
+                                        bool *dirty, unsigned int count)
+{
+    unsigned int i, first = count, last = 0;
+
+    for (i = 0; i < count; i++) {
+        if (dirty[i]) {
+            first = MIN(first, i);
+            last = i;
+            dirty[i] = false;
+        }
+    }
+    if (first == count) {
+        return;
+    }
+
+    glBindBuffer(GL_UNIFORM_BUFFER, gl_buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER,
+                    first * sizeof(constants[0]),
+                    (last - first + 1) * sizeof(constants[0]),
+                    constants[first]);
+    pg->gl_calls.uniform_buffer_uploads++;
+}
+
 static void pgraph_shader_update_constants(PGRAPHState *pg,
                                            ShaderBinding *binding,
                                            bool binding_changed,
@@ -2767,6 +3260,7 @@ static void pgraph_shader_update_constants(PGRAPHState *pg,
                 value[3] = (float) ((constant[j] >> 24) & 0xFF) / 255.0f;
 
                 glUniform4fv(loc, 1, value);
+                pg->gl_calls.uniforms++;
             }
         }
     }
@@ -2774,6 +3268,7 @@ static void pgraph_shader_update_constants(PGRAPHState *pg,
         float alpha_ref = GET_MASK(pg->regs[NV_PGRAPH_CONTROL_0],
                                    NV_PGRAPH_CONTROL_0_ALPHAREF) / 255.0;
         glUniform1f(binding->alpha_ref_loc, alpha_ref);
+        pg->gl_calls.uniforms++;
     }
 
 
@@ -2782,21 +3277,40 @@ static void pgraph_shader_update_constants(PGRAPHState *pg,
         // char name[32];
         GLint loc;
 
+        loc = binding->palette_max_lod_loc[i];
+        if (loc != -1) {
+            uint32_t ctl_0 = pg->regs[NV_PGRAPH_TEXCTL0_0 + i*4];
+            uint32_t fmt = pg->regs[NV_PGRAPH_TEXFMT0 + i*4];
+            int levels = MIN(GET_MASK(fmt, NV_PGRAPH_TEXFMT0_MIPMAP_LEVELS),
+                             GET_MASK(ctl_0,
+                                      NV_PGRAPH_TEXCTL0_0_MAX_LOD_CLAMP) + 1);
+            levels = MIN(levels,
+                         MAX(GET_MASK(fmt, NV_PGRAPH_TEXFMT0_BASE_SIZE_U),
+                             GET_MASK(fmt, NV_PGRAPH_TEXFMT0_BASE_SIZE_V)) + 1);
+            /* relative to GL_TEXTURE_BASE_LEVEL like textureLod */
+            glUniform1i(loc, MAX(levels - 1 - (int)GET_MASK(ctl_0,
+                                    NV_PGRAPH_TEXCTL0_0_MIN_LOD_CLAMP), 0));
+            pg->gl_calls.uniforms++;
+        }
+
         /* Bump luminance only during stages 1 - 3 */
         if (i > 0) {
             loc = binding->bump_mat_loc[i];
             if (loc != -1) {
                 glUniformMatrix2fv(loc, 1, GL_FALSE, pg->bump_env_matrix[i - 1]);
+                pg->gl_calls.uniforms++;
             }
             loc = binding->bump_scale_loc[i];
             if (loc != -1) {
                 glUniform1f(loc, *(float*)&pg->regs[
                                 NV_PGRAPH_BUMPSCALE1 + (i - 1) * 4]);
+                pg->gl_calls.uniforms++;
             }
             loc = binding->bump_offset_loc[i];
             if (loc != -1) {
                 glUniform1f(loc, *(float*)&pg->regs[
                             NV_PGRAPH_BUMPOFFSET1 + (i - 1) * 4]);
+                pg->gl_calls.uniforms++;
             }
         }
 
@@ -2809,14 +3323,17 @@ static void pgraph_shader_update_constants(PGRAPHState *pg,
                     GET_MASK(fog_color, NV_PGRAPH_FOGCOLOR_GREEN) / 255.0,
                     GET_MASK(fog_color, NV_PGRAPH_FOGCOLOR_BLUE) / 255.0,
                     GET_MASK(fog_color, NV_PGRAPH_FOGCOLOR_ALPHA) / 255.0);
+        pg->gl_calls.uniforms++;
     }
     if (binding->fog_param_loc[0] != -1) {
         glUniform1f(binding->fog_param_loc[0],
                     *(float*)&pg->regs[NV_PGRAPH_FOGPARAM0]);
+        pg->gl_calls.uniforms++;
     }
     if (binding->fog_param_loc[1] != -1) {
         glUniform1f(binding->fog_param_loc[1],
                     *(float*)&pg->regs[NV_PGRAPH_FOGPARAM1]);
+        pg->gl_calls.uniforms++;
     }
 
 
@@ -2824,52 +3341,28 @@ static void pgraph_shader_update_constants(PGRAPHState *pg,
     float zclip_min = *(float*)&pg->regs[NV_PGRAPH_ZCLIPMIN];
 
     if (fixed_function) {
-        /* update lighting constants */
-        struct {
-            uint32_t* v;
-            bool* dirty;
-            GLint* locs;
-            size_t len;
-        } lighting_arrays[] = {
-            {&pg->ltctxa[0][0], &pg->ltctxa_dirty[0], binding->ltctxa_loc, NV2A_LTCTXA_COUNT},
-            {&pg->ltctxb[0][0], &pg->ltctxb_dirty[0], binding->ltctxb_loc, NV2A_LTCTXB_COUNT},
-            {&pg->ltc1[0][0], &pg->ltc1_dirty[0], binding->ltc1_loc, NV2A_LTC1_COUNT},
-        };
-
-        for (i=0; i<ARRAY_SIZE(lighting_arrays); i++) {
-            uint32_t *lighting_v = lighting_arrays[i].v;
-            bool *lighting_dirty = lighting_arrays[i].dirty;
-            GLint *lighting_locs = lighting_arrays[i].locs;
-            size_t lighting_len = lighting_arrays[i].len;
-            for (j=0; j<lighting_len; j++) {
-                if (!lighting_dirty[j] && !binding_changed) continue;
-                GLint loc = lighting_locs[j];
-                if (loc != -1) {
-                    glUniform4fv(loc, 1, (const GLfloat*)&lighting_v[j*4]);
-                }
-                lighting_dirty[j] = false;
-            }
-        }
-
-
         for (i = 0; i < NV2A_MAX_LIGHTS; i++) {
             GLint loc;
             loc = binding->light_infinite_half_vector_loc[i];
             if (loc != -1) {
                 glUniform3fv(loc, 1, pg->light_infinite_half_vector[i]);
+                pg->gl_calls.uniforms++;
             }
             loc = binding->light_infinite_direction_loc[i];
             if (loc != -1) {
                 glUniform3fv(loc, 1, pg->light_infinite_direction[i]);
+                pg->gl_calls.uniforms++;
             }
 
             loc = binding->light_local_position_loc[i];
             if (loc != -1) {
                 glUniform3fv(loc, 1, pg->light_local_position[i]);
+                pg->gl_calls.uniforms++;
             }
             loc = binding->light_local_attenuation_loc[i];
             if (loc != -1) {
                 glUniform3fv(loc, 1, pg->light_local_attenuation[i]);
+                pg->gl_calls.uniforms++;
             }
         }
 
@@ -2896,81 +3389,170 @@ static void pgraph_shader_update_constants(PGRAPHState *pg,
         if (binding->inv_viewport_loc != -1) {
             glUniformMatrix4fv(binding->inv_viewport_loc,
                                1, GL_FALSE, &invViewport[0]);
+            pg->gl_calls.uniforms++;
         }
 
     }
 
-    /* update vertex program constants */
-    for (i=0; i<NV2A_VERTEXSHADER_CONSTANTS; i++) {
-        if (!pg->vsh_constants_dirty[i] && !binding_changed) continue;
-
-        GLint loc = binding->vsh_constant_loc[i];
-        //assert(loc != -1);
-        if (loc != -1) {
-            glUniform4fv(loc, 1, (const GLfloat*)pg->vsh_constants[i]);
-        }
-        pg->vsh_constants_dirty[i] = false;
-    }
+    /* Vertex program and lighting constants live in uniform buffers shared
+     * by every program, so they are only sent when they change */
+    pgraph_upload_constant_bank(pg, pg->gl_vsh_constant_buffer,
+                                pg->vsh_constants, pg->vsh_constants_dirty,
+                                NV2A_VERTEXSHADER_CONSTANTS);
+    pgraph_upload_constant_bank(pg, pg->gl_lighting_constant_buffer,
+                                pg->ltctxa, pg->ltctxa_dirty,
+                                NV2A_LIGHTING_CONSTANTS);
 
     if (binding->surface_size_loc != -1) {
         glUniform2f(binding->surface_size_loc, pg->surface_shape.clip_width,
                     pg->surface_shape.clip_height);
+        pg->gl_calls.uniforms++;
     }
 
     if (binding->clip_range_loc != -1) {
         glUniform2f(binding->clip_range_loc, zclip_min, zclip_max);
+        pg->gl_calls.uniforms++;
     }
 }
 
-static void pgraph_bind_shaders(PGRAPHState *pg)
+/* The register combiner part of the shader state */
+static void pgraph_get_psh_state(PGRAPHState *pg, PshState *psh)
 {
     int i, j;
 
-    bool vertex_program = GET_MASK(pg->regs[NV_PGRAPH_CSV0_D],
-                                   NV_PGRAPH_CSV0_D_MODE) == 2;
+    memset(psh, 0, sizeof(*psh));
 
-    bool fixed_function = GET_MASK(pg->regs[NV_PGRAPH_CSV0_D],
-                                   NV_PGRAPH_CSV0_D_MODE) == 0;
+    /* register combier stuff */
+    psh->window_clip_exclusive = pg->regs[NV_PGRAPH_SETUPRASTER]
+                                   & NV_PGRAPH_SETUPRASTER_WINDOWCLIPTYPE;
+    psh->combiner_control = pg->regs[NV_PGRAPH_COMBINECTL];
+    psh->shader_stage_program = pg->regs[NV_PGRAPH_SHADERPROG];
+    psh->other_stage_input = pg->regs[NV_PGRAPH_SHADERCTL];
+    psh->final_inputs_0 = pg->regs[NV_PGRAPH_COMBINESPECFOG0];
+    psh->final_inputs_1 = pg->regs[NV_PGRAPH_COMBINESPECFOG1];
 
-    int program_start = GET_MASK(pg->regs[NV_PGRAPH_CSV0_C],
-                                 NV_PGRAPH_CSV0_C_CHEOPS_PROGRAM_START);
+    psh->alpha_test = pg->regs[NV_PGRAPH_CONTROL_0]
+                        & NV_PGRAPH_CONTROL_0_ALPHATESTENABLE;
+    psh->alpha_func = (enum PshAlphaFunc)GET_MASK(pg->regs[NV_PGRAPH_CONTROL_0],
+                                                  NV_PGRAPH_CONTROL_0_ALPHAFUNC);
 
-    NV2A_GL_DGROUP_BEGIN("%s (VP: %s FFP: %s)", __func__,
-                         vertex_program ? "yes" : "no",
-                         fixed_function ? "yes" : "no");
+    /* Window clip
+     *
+     * Optimization note: very quickly check to ignore any repeated or zero-size
+     * clipping regions. Note that if region number 7 is valid, but the rest are
+     * not, we will still add all of them. Clip regions seem to be typically
+     * front-loaded (meaning the first one or two regions are populated, and the
+     * following are zeroed-out), so let's avoid adding any more complicated
+     * masking or copying logic here for now unless we discover a valid case.
+     */
+    psh->window_clip_count = 0;
+    uint32_t last_x = 0, last_y = 0;
 
-    ShaderBinding* old_binding = pg->shader_binding;
+    for (i = 0; i < 8; i++) {
+        const uint32_t x = pg->regs[NV_PGRAPH_WINDOWCLIPX0 + i * 4];
+        const uint32_t y = pg->regs[NV_PGRAPH_WINDOWCLIPY0 + i * 4];
+        const uint32_t x_min = GET_MASK(x, NV_PGRAPH_WINDOWCLIPX0_XMIN);
+        const uint32_t x_max = GET_MASK(x, NV_PGRAPH_WINDOWCLIPX0_XMAX);
+        const uint32_t y_min = GET_MASK(y, NV_PGRAPH_WINDOWCLIPY0_YMIN);
+        const uint32_t y_max = GET_MASK(y, NV_PGRAPH_WINDOWCLIPY0_YMAX);
 
-    ShaderState state = {
-        .psh = (PshState){
-            /* register combier stuff */
-            .window_clip_exclusive = pg->regs[NV_PGRAPH_SETUPRASTER]
-                                       & NV_PGRAPH_SETUPRASTER_WINDOWCLIPTYPE,
-            .combiner_control = pg->regs[NV_PGRAPH_COMBINECTL],
-            .shader_stage_program = pg->regs[NV_PGRAPH_SHADERPROG],
-            .other_stage_input = pg->regs[NV_PGRAPH_SHADERCTL],
-            .final_inputs_0 = pg->regs[NV_PGRAPH_COMBINESPECFOG0],
-            .final_inputs_1 = pg->regs[NV_PGRAPH_COMBINESPECFOG1],
-
-            .alpha_test = pg->regs[NV_PGRAPH_CONTROL_0]
-                            & NV_PGRAPH_CONTROL_0_ALPHATESTENABLE,
-            .alpha_func = (enum PshAlphaFunc)GET_MASK(pg->regs[NV_PGRAPH_CONTROL_0],
-                                   NV_PGRAPH_CONTROL_0_ALPHAFUNC),
-        },
+        /* Check for zero width or height clipping region */
+        if ((x_min == x_max) || (y_min == y_max)) {
+            continue;
+        }
 
-        /* fixed function stuff */
-        .skinning = (enum VshSkinning)GET_MASK(pg->regs[NV_PGRAPH_CSV0_D],
-                                               NV_PGRAPH_CSV0_D_SKIN),
-        .lighting = GET_MASK(pg->regs[NV_PGRAPH_CSV0_C],
-                             NV_PGRAPH_CSV0_C_LIGHTING),
-        .normalization = pg->regs[NV_PGRAPH_CSV0_C]
-                           & NV_PGRAPH_CSV0_C_NORMALIZATION_ENABLE,
+        /* Check for in-order duplicate regions */
+        if ((x == last_x) && (y == last_y)) {
+            continue;
+        }
 
-        .fixed_function = fixed_function,
+        NV2A_DPRINTF("Clipping Region %d: min=(%d, %d) max=(%d, %d)\n",
+            i, x_min, y_min, x_max, y_max);
 
-        /* vertex program stuff */
-        .vertex_program = vertex_program,
-        .z_perspective = pg->regs[NV_PGRAPH_CONTROL_0]
+        psh->window_clip_count = i + 1;
+        last_x = x;
+        last_y = y;
+    }
+
+    /* Copy content of enabled combiner stages */
+    int num_stages = pg->regs[NV_PGRAPH_COMBINECTL] & 0xFF;
+    for (i = 0; i < num_stages; i++) {
+        psh->rgb_inputs[i] = pg->regs[NV_PGRAPH_COMBINECOLORI0 + i * 4];
+        psh->rgb_outputs[i] = pg->regs[NV_PGRAPH_COMBINECOLORO0 + i * 4];
+        psh->alpha_inputs[i] = pg->regs[NV_PGRAPH_COMBINEALPHAI0 + i * 4];
+        psh->alpha_outputs[i] = pg->regs[NV_PGRAPH_COMBINEALPHAO0 + i * 4];
+        //constant_0[i] = pg->regs[NV_PGRAPH_COMBINEFACTOR0 + i * 4];
+        //constant_1[i] = pg->regs[NV_PGRAPH_COMBINEFACTOR1 + i * 4];
+    }
+
+    for (i = 0; i < 4; i++) {
+        psh->rect_tex[i] = false;
+        bool enabled = pg->regs[NV_PGRAPH_TEXCTL0_0 + i*4]
+                         & NV_PGRAPH_TEXCTL0_0_ENABLE;
+        unsigned int color_format =
+            GET_MASK(pg->regs[NV_PGRAPH_TEXFMT0 + i*4],
+                     NV_PGRAPH_TEXFMT0_COLOR);
+
+        if (enabled && kelvin_color_format_map[color_format].linear) {
+            psh->rect_tex[i] = true;
+        }
+
+        uint32_t fmt = pg->regs[NV_PGRAPH_TEXFMT0 + i*4];
+        if (enabled && pgraph_texture_decoded_in_shader(
+                color_format, GET_MASK(fmt, NV_PGRAPH_TEXFMT0_CUBEMAPENABLE),
+                GET_MASK(fmt, NV_PGRAPH_TEXFMT0_DIMENSIONALITY))) {
+            unsigned int mag_filter =
+                GET_MASK(pg->regs[NV_PGRAPH_TEXFILTER0 + i*4],
+                         NV_PGRAPH_TEXFILTER0_MAG);
+            psh->palette_tex[i] = color_format
+                == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8;
+            psh->yuv_tex[i] = !psh->palette_tex[i];
+            psh->lookup_linear[i] =
+                pgraph_texture_mag_filter_map[mag_filter] == GL_LINEAR;
+        }
+
+        for (j = 0; j < 4; j++) {
+            psh->compare_mode[i][j] =
+                (pg->regs[NV_PGRAPH_SHADERCLIPMODE] >> (4 * i + j)) & 1;
+        }
+        psh->alphakill[i] = pg->regs[NV_PGRAPH_TEXCTL0_0 + i*4]
+                               & NV_PGRAPH_TEXCTL0_0_ALPHAKILLEN;
+    }
+}
+
+static void pgraph_bind_shaders(PGRAPHState *pg)
+{
+    int i, j;
+
+    bool vertex_program = GET_MASK(pg->regs[NV_PGRAPH_CSV0_D],
+                                   NV_PGRAPH_CSV0_D_MODE) == 2;
+
+    bool fixed_function = GET_MASK(pg->regs[NV_PGRAPH_CSV0_D],
+                                   NV_PGRAPH_CSV0_D_MODE) == 0;
+
+    int program_start = GET_MASK(pg->regs[NV_PGRAPH_CSV0_C],
+                                 NV_PGRAPH_CSV0_C_CHEOPS_PROGRAM_START);
+
+    NV2A_GL_DGROUP_BEGIN("%s (VP: %s FFP: %s)", __func__,
+                         vertex_program ? "yes" : "no",
+                         fixed_function ? "yes" : "no");
+
+    ShaderBinding* old_binding = pg->shader_binding;
+
+    ShaderState state = {
+        /* fixed function stuff */
+        .skinning = (enum VshSkinning)GET_MASK(pg->regs[NV_PGRAPH_CSV0_D],
+                                               NV_PGRAPH_CSV0_D_SKIN),
+        .lighting = GET_MASK(pg->regs[NV_PGRAPH_CSV0_C],
+                             NV_PGRAPH_CSV0_C_LIGHTING),
+        .normalization = pg->regs[NV_PGRAPH_CSV0_C]
+                           & NV_PGRAPH_CSV0_C_NORMALIZATION_ENABLE,
+
+        .fixed_function = fixed_function,
+
+        /* vertex program stuff */
+        .vertex_program = vertex_program,
+        .z_perspective = pg->regs[NV_PGRAPH_CONTROL_0]
                             & NV_PGRAPH_CONTROL_0_Z_PERSPECTIVE_ENABLE,
 
         /* geometry shader stuff */
@@ -2984,7 +3566,19 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
     state.program_length = 0;
     memset(state.program_data, 0, sizeof(state.program_data));
 
-    if (vertex_program) {
+    /* every program run on the CPU shares the passthrough shader */
+    pg->vsh_cpu_program = NULL;
+    if (vertex_program && pg->vsh_cpu_mode != VSH_CPU_OFF) {
+        VshProgramEntry *entry = pgraph_get_vsh_program(pg);
+        if (entry->program && (pg->vsh_cpu_mode == VSH_CPU_ON
+                               || entry->draws < NV2A_VSH_CPU_AUTO_DRAWS)) {
+            pg->vsh_cpu_program = entry->program;
+            state.program_passthrough = true;
+        }
+        entry->draws++;
+    }
+
+    if (vertex_program && !state.program_passthrough) {
         // copy in vertex program tokens
         for (i = program_start; i < NV2A_MAX_TRANSFORM_PROGRAM_LENGTH; i++) {
             uint32_t *cur_token = (uint32_t*)&pg->program_data[i];
@@ -3041,87 +3635,20 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
         }
     }
 
-    /* Window clip
-     *
-     * Optimization note: very quickly check to ignore any repeated or zero-size
-     * clipping regions. Note that if region number 7 is valid, but the rest are
-     * not, we will still add all of them. Clip regions seem to be typically
-     * front-loaded (meaning the first one or two regions are populated, and the
-     * following are zeroed-out), so let's avoid adding any more complicated
-     * masking or copying logic here for now unless we discover a valid case.
-     */
+    pgraph_get_psh_state(pg, &state.psh);
     assert(!state.psh.window_clip_exclusive); /* FIXME: Untested */
-    state.psh.window_clip_count = 0;
-    uint32_t last_x = 0, last_y = 0;
-
-    for (i = 0; i < 8; i++) {
-        const uint32_t x = pg->regs[NV_PGRAPH_WINDOWCLIPX0 + i * 4];
-        const uint32_t y = pg->regs[NV_PGRAPH_WINDOWCLIPY0 + i * 4];
-        const uint32_t x_min = GET_MASK(x, NV_PGRAPH_WINDOWCLIPX0_XMIN);
-        const uint32_t x_max = GET_MASK(x, NV_PGRAPH_WINDOWCLIPX0_XMAX);
-        const uint32_t y_min = GET_MASK(y, NV_PGRAPH_WINDOWCLIPY0_YMIN);
-        const uint32_t y_max = GET_MASK(y, NV_PGRAPH_WINDOWCLIPY0_YMAX);
-
-        /* Check for zero width or height clipping region */
-        if ((x_min == x_max) || (y_min == y_max)) {
-            continue;
-        }
-
-        /* Check for in-order duplicate regions */
-        if ((x == last_x) && (y == last_y)) {
-            continue;
-        }
-
-        NV2A_DPRINTF("Clipping Region %d: min=(%d, %d) max=(%d, %d)\n",
-            i, x_min, y_min, x_max, y_max);
-
-        state.psh.window_clip_count = i + 1;
-        last_x = x;
-        last_y = y;
-    }
-
-    /* FIXME: We should memset(state, 0x00, sizeof(state)) instead */
-    memset(state.psh.rgb_inputs, 0, sizeof(state.psh.rgb_inputs));
-    memset(state.psh.rgb_outputs, 0, sizeof(state.psh.rgb_outputs));
-    memset(state.psh.alpha_inputs, 0, sizeof(state.psh.alpha_inputs));
-    memset(state.psh.alpha_outputs, 0, sizeof(state.psh.alpha_outputs));
-
-    /* Copy content of enabled combiner stages */
-    int num_stages = pg->regs[NV_PGRAPH_COMBINECTL] & 0xFF;
-    for (i = 0; i < num_stages; i++) {
-        state.psh.rgb_inputs[i] = pg->regs[NV_PGRAPH_COMBINECOLORI0 + i * 4];
-        state.psh.rgb_outputs[i] = pg->regs[NV_PGRAPH_COMBINECOLORO0 + i * 4];
-        state.psh.alpha_inputs[i] = pg->regs[NV_PGRAPH_COMBINEALPHAI0 + i * 4];
-        state.psh.alpha_outputs[i] = pg->regs[NV_PGRAPH_COMBINEALPHAO0 + i * 4];
-        //constant_0[i] = pg->regs[NV_PGRAPH_COMBINEFACTOR0 + i * 4];
-        //constant_1[i] = pg->regs[NV_PGRAPH_COMBINEFACTOR1 + i * 4];
-    }
-
-    for (i = 0; i < 4; i++) {
-        state.psh.rect_tex[i] = false;
-        bool enabled = pg->regs[NV_PGRAPH_TEXCTL0_0 + i*4]
-                         & NV_PGRAPH_TEXCTL0_0_ENABLE;
-        unsigned int color_format =
-            GET_MASK(pg->regs[NV_PGRAPH_TEXFMT0 + i*4],
-                     NV_PGRAPH_TEXFMT0_COLOR);
-
-        if (enabled && kelvin_color_format_map[color_format].linear) {
-            state.psh.rect_tex[i] = true;
-        }
-
-        for (j = 0; j < 4; j++) {
-            state.psh.compare_mode[i][j] =
-                (pg->regs[NV_PGRAPH_SHADERCLIPMODE] >> (4 * i + j)) & 1;
-        }
-        state.psh.alphakill[i] = pg->regs[NV_PGRAPH_TEXCTL0_0 + i*4]
-                               & NV_PGRAPH_TEXCTL0_0_ALPHAKILLEN;
-    }
 
     ShaderBinding* cached_shader = (ShaderBinding*)g_hash_table_lookup(pg->shader_cache, &state);
     if (cached_shader) {
         pg->shader_binding = cached_shader;
     } else {
-        pg->shader_binding = generate_shaders(state);
+        pg->shader_binding = shader_compiler_get(&pg->shader_compiler, &state,
+                                                 !pg->shader_skip_draws);
+        if (!pg->shader_binding) {
+            /* still compiling, the draw will be dropped */
+            NV2A_GL_DGROUP_END();
+            return;
+        }
 
         /* cache it */
         ShaderState *cache_state = (ShaderState *)g_malloc(sizeof(*cache_state));
@@ -3159,6 +3686,7 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
 
         glUniform4i(pg->shader_binding->clip_region_loc[i],
                     x_min, y_min, x_max + 1, y_max + 1);
+        pg->gl_calls.uniforms++;
     }
 
     pgraph_shader_update_constants(pg, pg->shader_binding, binding_changed,
@@ -3204,6 +3732,846 @@ static void pgraph_set_surface_dirty(PGRAPHState *pg, bool color, bool zeta)
     zeta = zeta && pgraph_zeta_write_enabled(pg);
     pg->surface_color.draw_dirty |= color;
     pg->surface_zeta.draw_dirty |= zeta;
+
+    if (color && pg->color_binding) {
+        pgraph_surface_bump_generation(pg, pg->color_binding);
+    }
+    if (zeta && pg->zeta_binding) {
+        pg->zeta_binding->generation++;
+    }
+}
+
+static void pgraph_surface_bump_generation(PGRAPHState *pg,
+                                           SurfaceBinding *binding)
+{
+    binding->generation++;
+
+    /* textures sampling the old contents have to be copied again */
+    int i;
+    for (i = 0; i < NV2A_MAX_TEXTURES; i++) {
+        if (binding->texture
+            && pg->texture_binding[i] == binding->texture) {
+            pg->texture_dirty[i] = true;
+        }
+    }
+}
+
+static void pgraph_surface_destroy(PGRAPHState *pg, SurfaceBinding *binding)
+{
+    assert(binding != pg->color_binding && binding != pg->zeta_binding);
+
+    QTAILQ_REMOVE(&pg->surfaces, binding, entry);
+    pg->num_surfaces--;
+
+    glDeleteTextures(1, &binding->gl_buffer);
+    if (binding->texture) {
+        texture_binding_destroy(binding->texture);
+    }
+    g_free(binding);
+}
+
+/* Finds the cached surface for key, creating an empty one that still needs
+ * to be uploaded if there is none */
+static SurfaceBinding *pgraph_surface_get(PGRAPHState *pg,
+                                          const SurfaceKey *key,
+                                          unsigned int bytes_per_pixel,
+                                          GLenum gl_internal_format,
+                                          GLenum gl_format, GLenum gl_type)
+{
+    SurfaceBinding *binding;
+
+    QTAILQ_FOREACH(binding, &pg->surfaces, entry) {
+        if (memcmp(&binding->key, key, sizeof(SurfaceKey)) == 0) {
+            QTAILQ_REMOVE(&pg->surfaces, binding, entry);
+            QTAILQ_INSERT_HEAD(&pg->surfaces, binding, entry);
+            pg->surface_hits++;
+            return binding;
+        }
+    }
+
+    /* evict the least recently used surfaces that are not bound */
+    SurfaceBinding *next;
+    QTAILQ_FOREACH_REVERSE_SAFE(binding, &pg->surfaces, SurfaceBindingHead,
+                                entry, next) {
+        if (pg->num_surfaces < NV2A_SURFACE_CACHE_SIZE) {
+            break;
+        }
+        if (binding != pg->color_binding && binding != pg->zeta_binding) {
+            pgraph_surface_destroy(pg, binding);
+        }
+    }
+
+    binding = g_new0(SurfaceBinding, 1);
+    binding->key = *key;
+    binding->bytes_per_pixel = bytes_per_pixel;
+    binding->gl_format = gl_format;
+    binding->gl_type = gl_type;
+    binding->upload_pending = true;
+
+    glGenTextures(1, &binding->gl_buffer);
+    glBindTexture(GL_TEXTURE_2D, binding->gl_buffer);
+    glTexImage2D(GL_TEXTURE_2D, 0, gl_internal_format,
+                 key->width, key->height, 0,
+                 gl_format, gl_type, NULL);
+
+    NV2A_GL_DLABEL(GL_TEXTURE, binding->gl_buffer,
+                   "%s surface 0x%" HWADDR_PRIx ", format: 0x%x%s, "
+                   "width: %d, height: %d",
+                   key->color ? "color" : "zeta", key->vram_addr,
+                   key->format, key->swizzle ? " (SZ)" : "",
+                   key->width, key->height);
+
+    QTAILQ_INSERT_HEAD(&pg->surfaces, binding, entry);
+    pg->num_surfaces++;
+    pg->surface_misses++;
+
+    return binding;
+}
+
+/* Flags cached surfaces overlapping addr..addr+size as needing an upload,
+ * other than the one matching except */
+static void pgraph_surface_invalidate_range(PGRAPHState *pg, hwaddr addr,
+                                            hwaddr size,
+                                            const SurfaceKey *except)
+{
+    SurfaceBinding *binding;
+
+    QTAILQ_FOREACH(binding, &pg->surfaces, entry) {
+        const SurfaceKey *key = &binding->key;
+        if (except && memcmp(key, except, sizeof(SurfaceKey)) == 0) {
+            continue;
+        }
+        if (key->vram_addr < addr + size
+            && key->vram_addr + key->pitch * key->height > addr) {
+            binding->upload_pending = true;
+        }
+    }
+}
+
+/* Looks for a color surface that can stand in for the texture at addr. The
+ * surface is stored bottom up, so it is flipped into a texture of its own
+ * on the GPU, which is kept around until the surface is drawn to again. */
+static TextureBinding *pgraph_surface_get_texture(NV2AState *d, hwaddr addr,
+                                                  const TextureShape *s)
+{
+    PGRAPHState *pg = &d->pgraph;
+    ColorFormatInfo f = kelvin_color_format_map[s->color_format];
+
+    if (s->cubemap || s->dimensionality != 2 || s->levels != 1
+        || f.gl_format == 0
+        || f.gl_swizzle_mask[0] != 0 || f.gl_swizzle_mask[1] != 0
+        || f.gl_swizzle_mask[2] != 0 || f.gl_swizzle_mask[3] != 0) {
+        return NULL;
+    }
+
+    SurfaceBinding *surface;
+    QTAILQ_FOREACH(surface, &pg->surfaces, entry) {
+        const SurfaceKey *key = &surface->key;
+        if (key->vram_addr != addr || !key->color || surface->upload_pending
+            || key->swizzle == f.linear
+            || key->width != s->width || key->height != s->height
+            || (f.linear && key->pitch != s->pitch)
+            || surface->bytes_per_pixel != f.bytes_per_pixel
+            || surface->gl_format != f.gl_format
+            || surface->gl_type != f.gl_type) {
+            continue;
+        }
+        break;
+    }
+    if (!surface) {
+        return NULL;
+    }
+
+    /* the cpu may have written to it since the last draw */
+    if (memory_region_get_dirty(d->vram, addr,
+                                surface->key.pitch * surface->key.height,
+                                DIRTY_MEMORY_NV2A)) {
+        return NULL;
+    }
+
+    if (surface->texture && surface->texture_format == s->color_format
+        && surface->texture_generation == surface->generation) {
+        return surface->texture;
+    }
+
+    if (surface->texture) {
+        texture_binding_destroy(surface->texture);
+    }
+
+    GLenum gl_target = f.linear ? GL_TEXTURE_RECTANGLE : GL_TEXTURE_2D;
+    unsigned int width = s->width, height = s->height;
+    TextureBinding *texture = g_new0(TextureBinding, 1);
+    texture->gl_target = gl_target;
+    texture->refcnt = 1;
+    glGenTextures(1, &texture->gl_texture);
+    glBindTexture(gl_target, texture->gl_texture);
+    glTexImage2D(gl_target, 0, f.gl_internal_format, width, height, 0,
+                 f.gl_format, f.gl_type, NULL);
+    if (!f.linear) {
+        glTexParameteri(gl_target, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(gl_target, GL_TEXTURE_MAX_LEVEL, 0);
+    }
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, pg->gl_blit_framebuffers[0]);
+    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, surface->gl_buffer, 0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, pg->gl_blit_framebuffers[1]);
+    glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           gl_target, texture->gl_texture, 0);
+    glBlitFramebuffer(0, 0, width, height,
+                      0, height, width, 0,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, pg->gl_framebuffer);
+
+    surface->texture = texture;
+    surface->texture_format = s->color_format;
+    surface->texture_generation = surface->generation;
+    pg->surface_texture_copies++;
+
+    return texture;
+}
+
+/* Finds a cached color surface holding the current contents of the
+ * width x height rectangle at x, y of the 2D surface at addr. The
+ * rectangle's position within the surface is returned in x, y. */
+static SurfaceBinding *pgraph_surface_find_rect(NV2AState *d, hwaddr addr,
+                                                unsigned int pitch,
+                                                unsigned int bytes_per_pixel,
+                                                unsigned int *x,
+                                                unsigned int *y,
+                                                unsigned int width,
+                                                unsigned int height)
+{
+    PGRAPHState *pg = &d->pgraph;
+    SurfaceBinding *surface;
+
+    QTAILQ_FOREACH(surface, &pg->surfaces, entry) {
+        const SurfaceKey *key = &surface->key;
+        if (!key->color || key->swizzle || surface->upload_pending
+            || key->pitch != pitch
+            || surface->bytes_per_pixel != bytes_per_pixel
+            || addr < key->vram_addr
+            || addr >= key->vram_addr + key->pitch * key->height) {
+            continue;
+        }
+        hwaddr offset = addr - key->vram_addr;
+        if ((offset % pitch) % bytes_per_pixel != 0) {
+            continue;
+        }
+        unsigned int sx = *x + (offset % pitch) / bytes_per_pixel;
+        unsigned int sy = *y + offset / pitch;
+        if (sx + width > key->width || sy + height > key->height) {
+            continue;
+        }
+        /* the cpu may have written to it since the last draw */
+        if (memory_region_get_dirty(d->vram, key->vram_addr,
+                                    key->pitch * key->height,
+                                    DIRTY_MEMORY_NV2A)) {
+            return NULL;
+        }
+        *x = sx;
+        *y = sy;
+        return surface;
+    }
+
+    return NULL;
+}
+
+/* Marks the GL contents of surface as newer than VRAM after a blit */
+static void pgraph_surface_blit_dirty(NV2AState *d, SurfaceBinding *surface)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    pgraph_surface_bump_generation(pg, surface);
+
+    if (surface == pg->color_binding) {
+        /* downloaded along with the draws */
+        pg->surface_color.draw_dirty = true;
+        return;
+    }
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, pg->gl_blit_framebuffers[0]);
+    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, surface->gl_buffer, 0);
+    pgraph_readback_issue(d, &surface->key, surface->bytes_per_pixel,
+                          surface->gl_format, surface->gl_type);
+    glBindFramebuffer(GL_FRAMEBUFFER, pg->gl_framebuffer);
+}
+
+/* Copies rows in VRAM, as a single move when they are contiguous */
+static void pgraph_image_blit_rows(uint8_t *dest, unsigned int dest_pitch,
+                                   const uint8_t *source,
+                                   unsigned int source_pitch,
+                                   unsigned int row_length,
+                                   unsigned int height)
+{
+    if (dest_pitch == source_pitch && row_length == dest_pitch) {
+        memmove(dest, source, (size_t)row_length * height);
+        return;
+    }
+
+    unsigned int y;
+    if (dest > source && dest < source + (size_t)source_pitch * height) {
+        /* overlapping, copy bottom up */
+        for (y = height; y-- > 0; ) {
+            memmove(dest + y * dest_pitch, source + y * source_pitch,
+                    row_length);
+        }
+    } else {
+        for (y = 0; y < height; y++) {
+            memmove(dest + y * dest_pitch, source + y * source_pitch,
+                    row_length);
+        }
+    }
+}
+
+/* NV09F SRCCOPY. Stays on the GPU when both sides are cached surfaces,
+ * otherwise VRAM is copied and a cached destination is patched with the
+ * result instead of being uploaded again as a whole. */
+static void pgraph_image_blit(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+    ContextSurfaces2DState *context_surfaces = &pg->context_surfaces_2d;
+    ImageBlitState *image_blit = &pg->image_blit;
+
+    assert(context_surfaces->object_instance
+            == image_blit->context_surfaces);
+
+    unsigned int bytes_per_pixel;
+    switch (context_surfaces->color_format) {
+    case NV062_SET_COLOR_FORMAT_LE_Y8:
+        bytes_per_pixel = 1;
+        break;
+    case NV062_SET_COLOR_FORMAT_LE_R5G6B5:
+        bytes_per_pixel = 2;
+        break;
+    case NV062_SET_COLOR_FORMAT_LE_A8R8G8B8:
+        bytes_per_pixel = 4;
+        break;
+    default:
+        fprintf(stderr, "Unknown blit surface format: 0x%x\n", context_surfaces->color_format);
+        assert(false);
+        break;
+    }
+
+    hwaddr source_dma_len, dest_dma_len;
+    uint8_t *source, *dest;
+
+    source = (uint8_t*)nv_dma_map(d, context_surfaces->dma_image_source,
+                                  &source_dma_len);
+    assert(context_surfaces->source_offset < source_dma_len);
+    source += context_surfaces->source_offset;
+
+    dest = (uint8_t*)nv_dma_map(d, context_surfaces->dma_image_dest,
+                                &dest_dma_len);
+    assert(context_surfaces->dest_offset < dest_dma_len);
+    dest += context_surfaces->dest_offset;
+
+    NV2A_DPRINTF("  - 0x%tx -> 0x%tx\n", source - d->vram_ptr,
+                                         dest - d->vram_ptr);
+
+    unsigned int width = image_blit->width, height = image_blit->height;
+    unsigned int row_length = width * bytes_per_pixel;
+    hwaddr source_addr = source - d->vram_ptr
+                         + image_blit->in_y * context_surfaces->source_pitch;
+    hwaddr source_size = height * context_surfaces->source_pitch;
+    hwaddr dest_addr = dest - d->vram_ptr
+                       + image_blit->out_y * context_surfaces->dest_pitch;
+    hwaddr dest_size = height * context_surfaces->dest_pitch;
+
+    if (width == 0 || height == 0) {
+        return;
+    }
+
+    unsigned int sx = image_blit->in_x, sy = image_blit->in_y;
+    unsigned int dx = image_blit->out_x, dy = image_blit->out_y;
+    SurfaceBinding *source_surface = NULL, *dest_surface = NULL;
+    if (!pg->renderer) {
+        source_surface = pgraph_surface_find_rect(d, source - d->vram_ptr,
+                                                  context_surfaces->source_pitch,
+                                                  bytes_per_pixel, &sx, &sy,
+                                                  width, height);
+        dest_surface = pgraph_surface_find_rect(d, dest - d->vram_ptr,
+                                                context_surfaces->dest_pitch,
+                                                bytes_per_pixel, &dx, &dy,
+                                                width, height);
+    }
+
+    if (source_surface && dest_surface
+        && source_surface->gl_format == dest_surface->gl_format
+        && source_surface->gl_type == dest_surface->gl_type
+        && (source_surface != dest_surface
+            || sx + width <= dx || dx + width <= sx
+            || sy + height <= dy || dy + height <= sy)) {
+        /* surfaces are stored bottom up */
+        unsigned int source_height = source_surface->key.height;
+        unsigned int dest_height = dest_surface->key.height;
+
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, pg->gl_blit_framebuffers[0]);
+        glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, source_surface->gl_buffer, 0);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, pg->gl_blit_framebuffers[1]);
+        glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, dest_surface->gl_buffer, 0);
+        glBlitFramebuffer(sx, source_height - sy - height,
+                          sx + width, source_height - sy,
+                          dx, dest_height - dy - height,
+                          dx + width, dest_height - dy,
+                          GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, pg->gl_framebuffer);
+
+        /* VRAM catches up through a readback of the destination, other
+         * surfaces overlapping it get invalidated once that lands */
+        pgraph_surface_blit_dirty(d, dest_surface);
+        pg->image_blits_gpu++;
+        return;
+    }
+
+    pgraph_readback_flush_range(d, source_addr, source_size);
+    pgraph_readback_flush_range(d, dest_addr, dest_size);
+
+    const uint8_t *source_rows = source
+        + image_blit->in_y * context_surfaces->source_pitch
+        + image_blit->in_x * bytes_per_pixel;
+    unsigned int source_rows_pitch = context_surfaces->source_pitch;
+    uint8_t *read_buf = NULL;
+    if (source_surface && source_surface == pg->color_binding
+        && pg->surface_color.draw_dirty) {
+        /* VRAM is behind the render target, read back just the
+         * rectangle rather than the whole surface */
+        unsigned int source_height = source_surface->key.height;
+        uint8_t *pixels = (uint8_t*)g_malloc(row_length * height);
+        int pa;
+        glGetIntegerv(GL_PACK_ALIGNMENT, &pa);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, pg->gl_blit_framebuffers[0]);
+        glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, source_surface->gl_buffer, 0);
+        glReadPixels(sx, source_height - sy - height, width, height,
+                     source_surface->gl_format, source_surface->gl_type,
+                     pixels);
+        glBindFramebuffer(GL_FRAMEBUFFER, pg->gl_framebuffer);
+        glPixelStorei(GL_PACK_ALIGNMENT, pa);
+
+        /* GL rows are bottom up */
+        read_buf = (uint8_t*)g_malloc(row_length * height);
+        unsigned int irow;
+        for (irow = 0; irow < height; irow++) {
+            memcpy(&read_buf[row_length * irow],
+                   &pixels[row_length * (height - irow - 1)], row_length);
+        }
+        g_free(pixels);
+        source_rows = read_buf;
+        source_rows_pitch = row_length;
+        pg->image_blits_read++;
+    }
+
+    pgraph_image_blit_rows(
+        dest + image_blit->out_y * context_surfaces->dest_pitch
+             + image_blit->out_x * bytes_per_pixel,
+        context_surfaces->dest_pitch,
+        source_rows, source_rows_pitch,
+        row_length, height);
+    g_free(read_buf);
+
+    memory_region_set_client_dirty(d->vram, dest_addr, dest_size,
+                                   DIRTY_MEMORY_NV2A_TEX);
+
+    if (dest_surface) {
+        /* VRAM and the surface both get the new rows, so the surface
+         * doesn't need a full upload */
+        unsigned int dest_height = dest_surface->key.height;
+        uint8_t *flipped_buf = (uint8_t*)g_malloc(row_length * height);
+        unsigned int irow;
+        for (irow = 0; irow < height; irow++) {
+            memcpy(&flipped_buf[row_length * (height - irow - 1)],
+                   dest + (image_blit->out_y + irow)
+                              * context_surfaces->dest_pitch
+                        + image_blit->out_x * bytes_per_pixel,
+                   row_length);
+        }
+        glBindTexture(GL_TEXTURE_2D, dest_surface->gl_buffer);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, dx, dest_height - dy - height,
+                        width, height,
+                        dest_surface->gl_format, dest_surface->gl_type,
+                        flipped_buf);
+        g_free(flipped_buf);
+
+        pgraph_surface_bump_generation(pg, dest_surface);
+        pgraph_surface_invalidate_range(pg, dest_addr, dest_size,
+                                        &dest_surface->key);
+        pg->image_blits_uploaded++;
+    } else {
+        pgraph_surface_invalidate_range(pg, dest_addr, dest_size, NULL);
+        pg->image_blits_cpu++;
+    }
+}
+
+/* Copies a finished readback into VRAM, waiting for the GPU if needed */
+static void pgraph_readback_complete(NV2AState *d, SurfaceReadback *r)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    assert(r->pending);
+
+    if (glClientWaitSync(r->fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+        int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        GLenum result = glClientWaitSync(r->fence,
+                                         GL_SYNC_FLUSH_COMMANDS_BIT,
+                                         GL_TIMEOUT_IGNORED);
+        assert(result != GL_WAIT_FAILED);
+        pg->readback_stall_frame_ns +=
+            qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+        pg->readbacks_stalled++;
+    }
+    glDeleteSync(r->fence);
+    r->fence = 0;
+    r->pending = false;
+    pg->readbacks_pending--;
+
+    const SurfaceKey *key = &r->key;
+    unsigned int row_length = key->width * r->bytes_per_pixel;
+    size_t size = key->pitch * key->height;
+    uint8_t *data = d->vram_ptr + key->vram_addr;
+    uint8_t *buf = data;
+    if (key->swizzle) {
+        buf = (uint8_t*)g_malloc(size);
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, r->gl_buffer);
+    const uint8_t *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                                             row_length * key->height,
+                                             GL_MAP_READ_BIT);
+    assert(pixels != NULL);
+
+    /* GL rows are bottom up */
+    unsigned int irow;
+    for (irow = 0; irow < key->height; irow++) {
+        memcpy(&buf[key->pitch * irow],
+               &pixels[row_length * (key->height - irow - 1)],
+               row_length);
+    }
+
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    if (key->swizzle) {
+        swizzle_rect(buf, key->width, key->height, data, key->pitch,
+                     r->bytes_per_pixel);
+        g_free(buf);
+    }
+
+    memory_region_set_client_dirty(d->vram, key->vram_addr, size,
+                                   DIRTY_MEMORY_VGA);
+    memory_region_set_client_dirty(d->vram, key->vram_addr, size,
+                                   DIRTY_MEMORY_NV2A_TEX);
+
+    /* other cached surfaces aliasing this memory are now out of date */
+    pgraph_surface_invalidate_range(pg, key->vram_addr, size, key);
+
+    if (key->color) {
+        pgraph_update_memory_buffer(d, key->vram_addr, size, true);
+    }
+}
+
+static SurfaceReadback *pgraph_readback_oldest(PGRAPHState *pg)
+{
+    unsigned int i = (pg->readback_head + NV2A_SURFACE_READBACKS
+                      - pg->readbacks_pending) % NV2A_SURFACE_READBACKS;
+    return &pg->readbacks[i];
+}
+
+/* Retires readbacks the GPU has already finished with, in order */
+static void pgraph_readback_poll(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    while (pg->readbacks_pending > 0) {
+        SurfaceReadback *r = pgraph_readback_oldest(pg);
+        if (glClientWaitSync(r->fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+            break;
+        }
+        pgraph_readback_complete(d, r);
+    }
+}
+
+/* Makes sure VRAM in addr..addr+size is up to date. Older readbacks are
+ * completed first so that overlapping downloads land in order. */
+static void pgraph_readback_flush_range(NV2AState *d, hwaddr addr,
+                                        hwaddr size)
+{
+    PGRAPHState *pg = &d->pgraph;
+    unsigned int i, n = 0;
+
+    for (i = 0; i < pg->readbacks_pending; i++) {
+        SurfaceReadback *r = &pg->readbacks[
+            (pg->readback_head + NV2A_SURFACE_READBACKS
+             - pg->readbacks_pending + i) % NV2A_SURFACE_READBACKS];
+        if (r->key.vram_addr < addr + size
+            && r->key.vram_addr + r->key.pitch * r->key.height > addr) {
+            n = i + 1;
+        }
+    }
+
+    while (n--) {
+        pgraph_readback_complete(d, pgraph_readback_oldest(pg));
+    }
+}
+
+static void pgraph_readback_flush(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    while (pg->readbacks_pending > 0) {
+        pgraph_readback_complete(d, pgraph_readback_oldest(pg));
+    }
+}
+
+/* Reads the currently bound framebuffer into the next free pixel pack
+ * buffer. VRAM is left alone until the readback is completed. */
+static void pgraph_readback_issue(NV2AState *d, const SurfaceKey *key,
+                                  unsigned int bytes_per_pixel,
+                                  GLenum gl_format, GLenum gl_type)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    pgraph_readback_poll(d);
+
+    SurfaceReadback *r = &pg->readbacks[pg->readback_head];
+    if (r->pending) {
+        /* ring is full */
+        assert(r == pgraph_readback_oldest(pg));
+        pgraph_readback_complete(d, r);
+    }
+
+    r->key = *key;
+    r->bytes_per_pixel = bytes_per_pixel;
+
+    unsigned int width = key->width, height = key->height;
+    size_t size = width * height * bytes_per_pixel;
+    if (!r->gl_buffer) {
+        glGenBuffers(1, &r->gl_buffer);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, r->gl_buffer);
+    if (size > r->buffer_size) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+        r->buffer_size = size;
+    }
+
+    int rl, pa;
+    glGetIntegerv(GL_PACK_ROW_LENGTH, &rl);
+    glGetIntegerv(GL_PACK_ALIGNMENT, &pa);
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+    glReadPixels(0, 0, width, height, gl_format, gl_type, NULL);
+
+    glPixelStorei(GL_PACK_ROW_LENGTH, rl);
+    glPixelStorei(GL_PACK_ALIGNMENT, pa);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    r->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+
+    r->pending = true;
+    pg->readbacks_pending++;
+    pg->readbacks_issued++;
+    pg->readback_head = (pg->readback_head + 1) % NV2A_SURFACE_READBACKS;
+}
+
+/* Starts an occlusion query for the draw, reusing a finished query object
+ * when there is one */
+static void pgraph_zpass_query_begin(PGRAPHState *pg)
+{
+    GLuint gl_query;
+
+    if (pg->zpass_query_pool_count > 0) {
+        gl_query = pg->gl_zpass_query_pool[--pg->zpass_query_pool_count];
+    } else {
+        glGenQueries(1, &gl_query);
+        pg->zpass_queries_created++;
+    }
+
+    if (pg->gl_zpass_pixel_count_query_count
+            == pg->gl_zpass_pixel_count_queries_size) {
+        pg->gl_zpass_pixel_count_queries_size =
+            MAX(16, pg->gl_zpass_pixel_count_queries_size * 2);
+        pg->gl_zpass_pixel_count_queries = g_renew(GLuint,
+            pg->gl_zpass_pixel_count_queries,
+            pg->gl_zpass_pixel_count_queries_size);
+    }
+    pg->gl_zpass_pixel_count_queries[
+        pg->gl_zpass_pixel_count_query_count++] = gl_query;
+
+    glBeginQuery(GL_SAMPLES_PASSED, gl_query);
+}
+
+static void pgraph_zpass_queries_release(PGRAPHState *pg,
+                                         const GLuint *gl_queries,
+                                         unsigned int count)
+{
+    if (pg->zpass_query_pool_count + count > pg->zpass_query_pool_size) {
+        pg->zpass_query_pool_size =
+            MAX(pg->zpass_query_pool_count + count,
+                pg->zpass_query_pool_size * 2);
+        pg->gl_zpass_query_pool = g_renew(GLuint, pg->gl_zpass_query_pool,
+                                          pg->zpass_query_pool_size);
+    }
+    memcpy(&pg->gl_zpass_query_pool[pg->zpass_query_pool_count],
+           gl_queries, count * sizeof(GLuint));
+    pg->zpass_query_pool_count += count;
+}
+
+static ZpassReport *pgraph_zpass_report_oldest(PGRAPHState *pg)
+{
+    assert(pg->zpass_reports_pending > 0);
+    return &pg->zpass_reports[(pg->zpass_report_head + NV2A_ZPASS_REPORTS
+                               - pg->zpass_reports_pending)
+                              % NV2A_ZPASS_REPORTS];
+}
+
+static void pgraph_zpass_report_write(NV2AState *d, const ZpassReport *r,
+                                      bool write_result)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    hwaddr report_dma_len;
+    uint8_t *report_data = (uint8_t*)nv_dma_map(d, r->dma_report,
+                                                &report_dma_len);
+    assert(r->offset < report_dma_len);
+    report_data += r->offset;
+
+    stq_le_p((uint64_t*)&report_data[0], r->timestamp);
+    if (write_result) {
+        stl_le_p((uint32_t*)&report_data[8], pg->zpass_pixel_count_result);
+    }
+    stl_le_p((uint32_t*)&report_data[12], 0);
+}
+
+/* Adds up the queries of the oldest report, waiting for them if needed,
+ * and writes the count out */
+static void pgraph_zpass_report_complete(NV2AState *d, ZpassReport *r)
+{
+    PGRAPHState *pg = &d->pgraph;
+    unsigned int i;
+
+    assert(r == pgraph_zpass_report_oldest(pg));
+
+    if (r->clear) {
+        pg->zpass_pixel_count_result = 0;
+    }
+
+    /* FIXME: Multisampling affects this (both: OGL and Xbox GPU),
+     *        not sure if CLEARs also count
+     */
+    /* FIXME: What about clipping regions etc? */
+    for (i = 0; i < r->query_count; i++) {
+        GLuint gl_query_result;
+        glGetQueryObjectuiv(r->gl_queries[i], GL_QUERY_RESULT,
+                            &gl_query_result);
+        pg->zpass_pixel_count_result += gl_query_result;
+    }
+    pgraph_zpass_queries_release(pg, r->gl_queries, r->query_count);
+    r->query_count = 0;
+
+    pgraph_zpass_report_write(d, r, true);
+    pg->zpass_reports_written++;
+
+    r->pending = false;
+    pg->zpass_reports_pending--;
+}
+
+/* Completes the reports whose queries are done, without waiting */
+static void pgraph_zpass_report_poll(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    while (pg->zpass_reports_pending > 0) {
+        ZpassReport *r = pgraph_zpass_report_oldest(pg);
+        unsigned int i;
+        for (i = 0; i < r->query_count; i++) {
+            GLuint available;
+            glGetQueryObjectuiv(r->gl_queries[i], GL_QUERY_RESULT_AVAILABLE,
+                                &available);
+            if (!available) {
+                return;
+            }
+        }
+        pgraph_zpass_report_complete(d, r);
+    }
+}
+
+static void pgraph_zpass_report_flush(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    pgraph_zpass_report_poll(d);
+    while (pg->zpass_reports_pending > 0) {
+        pg->zpass_reports_stalled++;
+        pgraph_zpass_report_complete(d, pgraph_zpass_report_oldest(pg));
+    }
+}
+
+/* Queues a report of the queries issued since the last one */
+static void pgraph_zpass_report_issue(NV2AState *d, hwaddr offset)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    pgraph_zpass_report_poll(d);
+
+    ZpassReport *r = &pg->zpass_reports[pg->zpass_report_head];
+    if (r->pending) {
+        /* ring is full */
+        pg->zpass_reports_stalled++;
+        pgraph_zpass_report_complete(d, r);
+    }
+
+    /* hand the current query list to the report, and take its old
+     * (empty) one in exchange */
+    GLuint *gl_queries = r->gl_queries;
+    unsigned int queries_size = r->queries_size;
+    r->gl_queries = pg->gl_zpass_pixel_count_queries;
+    r->queries_size = pg->gl_zpass_pixel_count_queries_size;
+    r->query_count = pg->gl_zpass_pixel_count_query_count;
+    pg->gl_zpass_pixel_count_queries = gl_queries;
+    pg->gl_zpass_pixel_count_queries_size = queries_size;
+    pg->gl_zpass_pixel_count_query_count = 0;
+
+    r->clear = pg->zpass_pixel_count_clear;
+    pg->zpass_pixel_count_clear = false;
+    r->dma_report = pg->dma_report;
+    r->offset = offset;
+    /* PTIMER_TIME_1:PTIMER_TIME_0 at the time the report was requested,
+     * the timer doesn't run until its ratio has been programmed */
+    r->timestamp = d->ptimer.numerator ? ptimer_get_clock(d) << 5 : 0;
+
+    r->pending = true;
+    pg->zpass_reports_pending++;
+    pg->zpass_report_head = (pg->zpass_report_head + 1) % NV2A_ZPASS_REPORTS;
+
+    if (pg->zpass_report_mode == ZPASS_REPORT_SYNC) {
+        pgraph_zpass_report_flush(d);
+    } else if (pg->zpass_report_mode == ZPASS_REPORT_LATENCY) {
+        /* keep whatever count the report memory already has */
+        pgraph_zpass_report_write(d, r, false);
+        pgraph_zpass_report_poll(d);
+    } else {
+        pgraph_zpass_report_poll(d);
+    }
+}
+
+/* Drops the queries since the last report, later reports count from 0 */
+static void pgraph_zpass_report_clear(PGRAPHState *pg)
+{
+    pgraph_zpass_queries_release(pg, pg->gl_zpass_pixel_count_queries,
+                                 pg->gl_zpass_pixel_count_query_count);
+    pg->gl_zpass_pixel_count_query_count = 0;
+
+    if (pg->zpass_reports_pending > 0) {
+        pg->zpass_pixel_count_clear = true;
+    } else {
+        pg->zpass_pixel_count_result = 0;
+    }
 }
 
 static void pgraph_update_surface_part(NV2AState *d, bool upload, bool color) {
@@ -3215,14 +4583,14 @@ static void pgraph_update_surface_part(NV2AState *d, bool upload, bool color) {
 
     Surface *surface;
     hwaddr dma_address;
-    GLuint *gl_buffer;
+    SurfaceBinding **binding_ptr;
     unsigned int bytes_per_pixel;
     GLenum gl_internal_format, gl_format, gl_type, gl_attachment;
 
     if (color) {
         surface = &pg->surface_color;
         dma_address = pg->dma_color;
-        gl_buffer = &pg->gl_color_buffer;
+        binding_ptr = &pg->color_binding;
 
         assert(pg->surface_shape.color_format != 0);
         assert(pg->surface_shape.color_format
@@ -3244,7 +4612,7 @@ static void pgraph_update_surface_part(NV2AState *d, bool upload, bool color) {
     } else {
         surface = &pg->surface_zeta;
         dma_address = pg->dma_zeta;
-        gl_buffer = &pg->gl_zeta_buffer;
+        binding_ptr = &pg->zeta_binding;
 
         assert(pg->surface_shape.zeta_format != 0);
         switch (pg->surface_shape.zeta_format) {
@@ -3298,129 +4666,134 @@ static void pgraph_update_surface_part(NV2AState *d, bool upload, bool color) {
 
     bool swizzle = (pg->surface_type == NV097_SET_SURFACE_FORMAT_TYPE_SWIZZLE);
 
-    uint8_t *buf = data + surface->offset;
-    if (swizzle) {
-        buf = (uint8_t*)g_malloc(height * surface->pitch);
-    }
-
-    bool dirty = surface->buffer_dirty;
-    if (color) {
-        // dirty |= 1;
-        dirty |= memory_region_test_and_clear_dirty(d->vram,
-                                               dma.address + surface->offset,
-                                               surface->pitch * height,
-                                               DIRTY_MEMORY_NV2A);
-    }
-    if (upload && dirty) {
-        /* surface modified (or moved) by the cpu.
-         * copy it into the opengl renderbuffer */
-        assert(!surface->draw_dirty);
-
-        assert(surface->pitch % bytes_per_pixel == 0);
-
-        if (swizzle) {
-            unswizzle_rect(data + surface->offset,
-                           width, height,
-                           buf,
-                           surface->pitch,
-                           bytes_per_pixel);
-        }
+    SurfaceKey key;
+    memset(&key, 0, sizeof(key));
+    key.vram_addr = dma.address + surface->offset;
+    key.pitch = surface->pitch;
+    key.color = color;
+    key.swizzle = swizzle;
+    key.format = color ? pg->surface_shape.color_format
+                       : (pg->surface_shape.zeta_format
+                            | pg->surface_shape.z_format << 8);
+    key.width = width;
+    key.height = height;
+
+    hwaddr size = surface->pitch * height;
+
+    if (upload) {
+        pgraph_readback_flush_range(d, key.vram_addr, size);
+
+        SurfaceBinding *binding = *binding_ptr;
+        if (!binding || memcmp(&binding->key, &key, sizeof(key)) != 0) {
+            binding = pgraph_surface_get(pg, &key, bytes_per_pixel,
+                                         gl_internal_format, gl_format,
+                                         gl_type);
+
+            if (!color) {
+                /* need to clear the depth_stencil and depth attachment for zeta */
+                glFramebufferTexture2D(GL_FRAMEBUFFER,
+                                       GL_DEPTH_ATTACHMENT,
+                                       GL_TEXTURE_2D,
+                                       0, 0);
+                glFramebufferTexture2D(GL_FRAMEBUFFER,
+                                       GL_DEPTH_STENCIL_ATTACHMENT,
+                                       GL_TEXTURE_2D,
+                                       0, 0);
+            }
 
-        if (!color) {
-            /* need to clear the depth_stencil and depth attachment for zeta */
-            glFramebufferTexture2D(GL_FRAMEBUFFER,
-                                   GL_DEPTH_ATTACHMENT,
-                                   GL_TEXTURE_2D,
-                                   0, 0);
             glFramebufferTexture2D(GL_FRAMEBUFFER,
-                                   GL_DEPTH_STENCIL_ATTACHMENT,
+                                   gl_attachment,
                                    GL_TEXTURE_2D,
-                                   0, 0);
-        }
+                                   binding->gl_buffer, 0);
 
-        glFramebufferTexture2D(GL_FRAMEBUFFER,
-                               gl_attachment,
-                               GL_TEXTURE_2D,
-                               0, 0);
+            assert(glCheckFramebufferStatus(GL_FRAMEBUFFER)
+                == GL_FRAMEBUFFER_COMPLETE);
 
-        if (*gl_buffer) {
-            glDeleteTextures(1, gl_buffer);
-            *gl_buffer = 0;
-        }
+            *binding_ptr = binding;
 
-        glGenTextures(1, gl_buffer);
-        glBindTexture(GL_TEXTURE_2D, *gl_buffer);
+            /* color surfaces are checked for cpu writes below anyway */
+            if (!color && memory_region_test_and_clear_dirty(d->vram,
+                                                             key.vram_addr,
+                                                             size,
+                                                             DIRTY_MEMORY_NV2A)) {
+                pgraph_surface_invalidate_range(pg, key.vram_addr, size,
+                                                NULL);
+            }
+        }
 
-        /* This is VRAM so we can't do this inplace! */
-        uint8_t *flipped_buf = (uint8_t*)g_malloc(width * height * bytes_per_pixel);
-        unsigned int irow;
-        for (irow = 0; irow < height; irow++) {
-            memcpy(&flipped_buf[width * (height - irow - 1)
-                                     * bytes_per_pixel],
-                   &buf[surface->pitch * irow],
-                   width * bytes_per_pixel);
+        if (color && memory_region_test_and_clear_dirty(d->vram,
+                                                        key.vram_addr,
+                                                        size,
+                                                        DIRTY_MEMORY_NV2A)) {
+            pgraph_surface_invalidate_range(pg, key.vram_addr, size, NULL);
         }
 
-        glTexImage2D(GL_TEXTURE_2D, 0, gl_internal_format,
-                     width, height, 0,
-                     gl_format, gl_type,
-                     flipped_buf);
+        if (binding->upload_pending) {
+            /* surface modified by the cpu (or never uploaded).
+             * copy it into the opengl renderbuffer */
+            assert(!surface->draw_dirty);
+
+            assert(surface->pitch % bytes_per_pixel == 0);
+
+            uint8_t *buf = data + surface->offset;
+            if (swizzle) {
+                buf = (uint8_t*)g_malloc(height * surface->pitch);
+                unswizzle_rect(data + surface->offset,
+                               width, height,
+                               buf,
+                               surface->pitch,
+                               bytes_per_pixel);
+            }
 
-        g_free(flipped_buf);
+            /* This is VRAM so we can't do this inplace! */
+            uint8_t *flipped_buf = (uint8_t*)g_malloc(width * height * bytes_per_pixel);
+            unsigned int irow;
+            for (irow = 0; irow < height; irow++) {
+                memcpy(&flipped_buf[width * (height - irow - 1)
+                                         * bytes_per_pixel],
+                       &buf[surface->pitch * irow],
+                       width * bytes_per_pixel);
+            }
 
-        glFramebufferTexture2D(GL_FRAMEBUFFER,
-                               gl_attachment,
-                               GL_TEXTURE_2D,
-                               *gl_buffer, 0);
+            glBindTexture(GL_TEXTURE_2D, binding->gl_buffer);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0,
+                            width, height,
+                            gl_format, gl_type,
+                            flipped_buf);
 
-        assert(glCheckFramebufferStatus(GL_FRAMEBUFFER)
-            == GL_FRAMEBUFFER_COMPLETE);
+            g_free(flipped_buf);
+            if (swizzle) {
+                g_free(buf);
+            }
 
-        if (color) {
-            pgraph_update_memory_buffer(d, dma.address + surface->offset,
-                                        surface->pitch * height, true);
-        }
-        surface->buffer_dirty = false;
+            if (color) {
+                pgraph_update_memory_buffer(d, key.vram_addr, size, true);
+            }
 
-        NV2A_GL_DPRINTF(true, "upload_surface %s 0x%" HWADDR_PRIx " - 0x%" HWADDR_PRIx ", "
-                      "(0x%" HWADDR_PRIx " - 0x%" HWADDR_PRIx ", "
-                        "%d %d, %d %d, %d)",
-            color ? "color" : "zeta",
-            dma.address, dma.address + dma.limit,
-            dma.address + surface->offset,
-            dma.address + surface->pitch * height,
-            pg->surface_shape.clip_x, pg->surface_shape.clip_y,
-            pg->surface_shape.clip_width,
-            pg->surface_shape.clip_height,
-            surface->pitch);
+            binding->upload_pending = false;
+            binding->generation++;
+            pg->surface_uploads++;
+
+            NV2A_GL_DPRINTF(true, "upload_surface %s 0x%" HWADDR_PRIx " - 0x%" HWADDR_PRIx ", "
+                          "(0x%" HWADDR_PRIx " - 0x%" HWADDR_PRIx ", "
+                            "%d %d, %d %d, %d)",
+                color ? "color" : "zeta",
+                dma.address, dma.address + dma.limit,
+                dma.address + surface->offset,
+                dma.address + surface->pitch * height,
+                pg->surface_shape.clip_x, pg->surface_shape.clip_y,
+                pg->surface_shape.clip_width,
+                pg->surface_shape.clip_height,
+                surface->pitch);
+        }
     }
 
     if (!upload && surface->draw_dirty) {
-        /* read the opengl framebuffer into the surface */
-        glo_readpixels(gl_format, gl_type,
-                       bytes_per_pixel, surface->pitch,
-                       width, height,
-                       buf);
+        /* read the opengl framebuffer into the surface, the copy into
+         * vram happens once the guest can notice it */
+        pgraph_readback_issue(d, &key, bytes_per_pixel, gl_format, gl_type);
         assert(glGetError() == GL_NO_ERROR);
 
-        if (swizzle) {
-            swizzle_rect(buf,
-                         width, height,
-                         data + surface->offset,
-                         surface->pitch,
-                         bytes_per_pixel);
-        }
-
-        memory_region_set_client_dirty(d->vram,
-                                       dma.address + surface->offset,
-                                       surface->pitch * height,
-                                       DIRTY_MEMORY_VGA);
-
-        if (color) {
-            pgraph_update_memory_buffer(d, dma.address + surface->offset,
-                                        surface->pitch * height, true);
-        }
-
         surface->draw_dirty = false;
         surface->write_enabled_cache = false;
 
@@ -3435,10 +4808,6 @@ static void pgraph_update_surface_part(NV2AState *d, bool upload, bool color) {
             pg->surface_shape.clip_width, pg->surface_shape.clip_height,
             surface->pitch);
     }
-
-    if (swizzle) {
-        g_free(buf);
-    }
 }
 
 static void pgraph_update_surface(NV2AState *d, bool upload,
@@ -3449,6 +4818,11 @@ static void pgraph_update_surface(NV2AState *d, bool upload,
     pg->surface_shape.z_format = GET_MASK(pg->regs[NV_PGRAPH_SETUPRASTER],
                                           NV_PGRAPH_SETUPRASTER_Z_FORMAT);
 
+    /* surfaces are drawn in place in guest memory */
+    if (pg->renderer) {
+        return;
+    }
+
     /* FIXME: Does this apply to CLEARs too? */
     color_write = color_write && pgraph_color_write_enabled(pg);
     zeta_write = zeta_write && pgraph_zeta_write_enabled(pg);
@@ -3457,19 +4831,11 @@ static void pgraph_update_surface(NV2AState *d, bool upload,
         assert(!pg->surface_color.draw_dirty);
         assert(!pg->surface_zeta.draw_dirty);
 
-        pg->surface_color.buffer_dirty = true;
-        pg->surface_zeta.buffer_dirty = true;
-
+        /* the surfaces stay in the cache, only unbind them */
         glFramebufferTexture2D(GL_FRAMEBUFFER,
                                GL_COLOR_ATTACHMENT0,
                                GL_TEXTURE_2D,
                                0, 0);
-
-        if (pg->gl_color_buffer) {
-            glDeleteTextures(1, &pg->gl_color_buffer);
-            pg->gl_color_buffer = 0;
-        }
-
         glFramebufferTexture2D(GL_FRAMEBUFFER,
                                GL_DEPTH_ATTACHMENT,
                                GL_TEXTURE_2D,
@@ -3478,11 +4844,8 @@ static void pgraph_update_surface(NV2AState *d, bool upload,
                                GL_DEPTH_STENCIL_ATTACHMENT,
                                GL_TEXTURE_2D,
                                0, 0);
-
-        if (pg->gl_zeta_buffer) {
-            glDeleteTextures(1, &pg->gl_zeta_buffer);
-            pg->gl_zeta_buffer = 0;
-        }
+        pg->color_binding = NULL;
+        pg->zeta_binding = NULL;
 
         memcpy(&pg->last_surface_shape, &pg->surface_shape,
                sizeof(SurfaceShape));
@@ -3617,6 +4980,12 @@ static void pgraph_bind_textures(NV2AState *d)
             abort();
         }
 
+        bool decoded_in_shader =
+            pgraph_texture_decoded_in_shader(color_format, cubemap,
+                                             dimensionality);
+        bool palette_in_shader = decoded_in_shader
+            && color_format == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8;
+
         unsigned int width, height, depth;
         if (f.linear) {
             assert(dimensionality == 2);
@@ -3750,30 +5119,98 @@ static void pgraph_bind_textures(NV2AState *d)
             .pitch = pitch,
         };
 
+        /* Render targets still resident on the GPU are sampled directly */
+        TextureBinding *binding =
+            pgraph_surface_get_texture(d, texture_data - d->vram_ptr, &state);
+        if (binding) {
+            binding->refcnt++;
+        } else {
 #ifdef USE_TEXTURE_CACHE
-        uint64_t texture_hash = fast_hash(texture_data, length, 5003)
-                              ^ fnv_hash(palette_data, palette_length);
+            /* palettes looked up by the shader are no part of the entry */
+            TextureKey key = {
+                .state = state,
+                .texture_data = texture_data,
+                .palette_data = palette_in_shader ? NULL : palette_data,
+                .length = length,
+                .palette_length = palette_in_shader ? 0 : palette_length * 4,
+            };
 
-        TextureKey key = {
-            .state = state,
-            .texture_data = texture_data,
-            .palette_data = palette_data,
-        };
+            /* Entries are found by location and shape, the texture contents
+             * are only hashed again if the guest wrote to them since the
+             * last bind */
+            uint64_t location[] = {
+                texture_data - d->vram_ptr, key.length,
+                palette_data - d->vram_ptr, key.palette_length,
+            };
+            if (palette_in_shader) {
+                location[2] = 0;
+            }
+            uint64_t key_hash =
+                fnv_hash((const uint8_t *)&state, sizeof(state))
+                ^ fnv_hash((const uint8_t *)location, sizeof(location));
+
+            pgraph_readback_flush_range(d, location[0], key.length);
+            pgraph_readback_flush_range(d, location[2], key.palette_length);
+            pgraph_cache_test_and_clear_dirty(d, key.texture_data, key.length);
+            pgraph_cache_test_and_clear_dirty(d, key.palette_data,
+                                              key.palette_length);
+
+            size_t num_miss = pg->texture_cache.num_miss;
+            struct lru_node *found = lru_lookup(&pg->texture_cache,
+                                                key_hash, &key);
+            TextureKey *key_out = container_of(found, struct TextureKey, node);
+            assert(key_out != NULL);
+
+            if (pg->texture_cache.num_miss != num_miss) {
+                /* fresh entry, contents hashed by the init callback */
+                key_out->binding = generate_texture(pg, state, texture_data,
+                                                    palette_data);
+                vram_range_update(&pg->vram_ranges, &key_out->texture_range,
+                                  location[0], key.length, &key_out->dirty);
+                vram_range_update(&pg->vram_ranges, &key_out->palette_range,
+                                  location[2], key.palette_length,
+                                  &key_out->dirty);
+            } else if (key_out->dirty) {
+                uint64_t content_hash = texture_content_hash(key_out);
+                if (content_hash != key_out->content_hash) {
+                    NV2A_DPRINTF("texture 0x%tx modified, reuploading\n",
+                                 texture_data - d->vram_ptr);
+                    texture_binding_destroy(key_out->binding);
+                    key_out->binding = generate_texture(pg, state,
+                                                        texture_data,
+                                                        palette_data);
+                    key_out->content_hash = content_hash;
+                    pg->texture_reuploads++;
+                }
+            } else {
+                pg->texture_hashes_skipped++;
+            }
+            key_out->dirty = false;
 
-        struct lru_node *found = lru_lookup(&pg->texture_cache, texture_hash, &key);
-        TextureKey *key_out = container_of(found, struct TextureKey, node);
-        assert((key_out != NULL) && (key_out->binding != NULL));
-        TextureBinding *binding = key_out->binding;
-        binding->refcnt++;
+            binding = key_out->binding;
+            binding->refcnt++;
 #else
-        TextureBinding *binding = generate_texture(state,
-                                                   texture_data, palette_data);
+            binding = generate_texture(pg, state, texture_data, palette_data);
 #endif
+        }
+
+        if (palette_in_shader) {
+            pgraph_readback_flush_range(d, palette_data - d->vram_ptr,
+                                        palette_length * 4);
+            pgraph_bind_palette(pg, i, palette_data, palette_length * 4);
+            glActiveTexture(GL_TEXTURE0 + i);
+        }
 
         glBindTexture(binding->gl_target, binding->gl_texture);
 
 
-        if (f.linear) {
+        if (decoded_in_shader) {
+            /* filtered by the shader, which needs the texels as they are */
+            min_filter = state.levels > 1
+                ? NV_PGRAPH_TEXFILTER0_MIN_BOX_NEARESTLOD
+                : NV_PGRAPH_TEXFILTER0_MIN_BOX_LOD0;
+            mag_filter = NV_PGRAPH_TEXFILTER0_MAG_BOX_LOD0;
+        } else if (f.linear) {
             /* somtimes games try to set mipmap min filters on linear textures.
              * this could indicate a bug... */
             switch (min_filter) {
@@ -3864,6 +5301,16 @@ static void pgraph_get_surface_dimensions(PGRAPHState *pg,
     }
 }
 
+/* Sends addr..addr+size from VRAM to the GL copy of it */
+static void pgraph_upload_memory_range(NV2AState *d, hwaddr addr, hwaddr size)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    glBufferSubData(GL_ARRAY_BUFFER, addr, size, d->vram_ptr + addr);
+    pg->vertex_upload_frame_bytes += size;
+    pg->vertex_upload_ranges++;
+}
+
 static void pgraph_update_memory_buffer(NV2AState *d, hwaddr addr, hwaddr size,
                                         bool f)
 {
@@ -3872,12 +5319,146 @@ static void pgraph_update_memory_buffer(NV2AState *d, hwaddr addr, hwaddr size,
     hwaddr end = TARGET_PAGE_ALIGN(addr + size);
     addr &= TARGET_PAGE_MASK;
     assert(end < memory_region_size(d->vram));
-    if (f || memory_region_test_and_clear_dirty(d->vram,
-                                                addr,
-                                                end - addr,
-                                                DIRTY_MEMORY_NV2A)) {
-        glBufferSubData(GL_ARRAY_BUFFER, addr, end - addr, d->vram_ptr + addr);
+    if (f) {
+        pgraph_upload_memory_range(d, addr, end - addr);
+        return;
+    }
+
+    pgraph_readback_flush_range(d, addr, end - addr);
+    if (!memory_region_get_dirty(d->vram, addr, end - addr,
+                                 DIRTY_MEMORY_NV2A)) {
+        return;
+    }
+
+    /* Only send the pages that were written, coalescing neighbouring ones.
+     * A page dirtied after it was looked at is simply left for next time. */
+    hwaddr page, start = 0;
+    bool in_range = false;
+    for (page = addr; page <= end; page += TARGET_PAGE_SIZE) {
+        bool dirty = page < end
+            && memory_region_get_dirty(d->vram, page, TARGET_PAGE_SIZE,
+                                       DIRTY_MEMORY_NV2A);
+        if (dirty && !in_range) {
+            start = page;
+            in_range = true;
+        } else if (!dirty && in_range) {
+            memory_region_reset_dirty(d->vram, start, page - start,
+                                      DIRTY_MEMORY_NV2A);
+            /* surfaces share these dirty bits */
+            pgraph_surface_invalidate_range(&d->pgraph, start, page - start,
+                                            NULL);
+            pgraph_upload_memory_range(d, start, page - start);
+            in_range = false;
+        }
+    }
+}
+
+static void pgraph_convert_vertex_attribute(const VertexAttribute *attribute,
+                                            const uint8_t *data,
+                                            unsigned int stride,
+                                            unsigned int num_elements,
+                                            uint8_t *out)
+{
+    switch (attribute->format) {
+    case NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_CMP:
+        convert_cmp_to_float(data, stride, attribute->count, num_elements,
+                             (float *)out);
+        break;
+    default:
+        assert(false);
+        break;
+    }
+}
+
+static void pgraph_vertex_conversion_destroy(PGRAPHState *pg,
+                                             VertexConversion *conversion)
+{
+    g_hash_table_remove(pg->vertex_conversion_cache, &conversion->key);
+    QTAILQ_REMOVE(&pg->vertex_conversions, conversion, entry);
+    pg->num_vertex_conversions--;
+    vram_range_remove(&conversion->range);
+
+    glDeleteBuffers(1, &conversion->gl_buffer);
+    g_free(conversion->data);
+    g_free(conversion);
+}
+
+/* Returns the converted copy of a VRAM vertex array with at least
+ * num_elements elements. Arrays are only converted again if their pages
+ * were written, or to add elements past the ones converted so far. */
+static VertexConversion *pgraph_get_vertex_conversion(
+    NV2AState *d, const VertexAttribute *attribute, const uint8_t *data,
+    unsigned int num_elements)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    VertexConversionKey key;
+    memset(&key, 0, sizeof(key));
+    key.addr = data - d->vram_ptr;
+    key.stride = attribute->stride;
+    key.format = attribute->format;
+    key.count = attribute->count;
+
+    size_t length = num_elements * attribute->stride;
+    pgraph_readback_flush_range(d, key.addr, length);
+    pgraph_cache_test_and_clear_dirty(d, data, length);
+
+    VertexConversion *conversion =
+        g_hash_table_lookup(pg->vertex_conversion_cache, &key);
+    if (conversion) {
+        QTAILQ_REMOVE(&pg->vertex_conversions, conversion, entry);
+    } else {
+        if (pg->num_vertex_conversions >= NV2A_VERTEX_CONVERSION_CACHE_SIZE) {
+            pgraph_vertex_conversion_destroy(pg,
+                QTAILQ_LAST(&pg->vertex_conversions, VertexConversionHead));
+        }
+        conversion = g_new0(VertexConversion, 1);
+        conversion->key = key;
+        glGenBuffers(1, &conversion->gl_buffer);
+        g_hash_table_insert(pg->vertex_conversion_cache, &conversion->key,
+                            conversion);
+        pg->num_vertex_conversions++;
+    }
+    QTAILQ_INSERT_HEAD(&pg->vertex_conversions, conversion, entry);
+
+    unsigned int first = conversion->dirty ? 0 : conversion->elements;
+    if (first >= num_elements) {
+        pg->vertex_conversion_hits++;
+        return conversion;
+    }
+    pg->vertex_conversion_misses++;
+
+    unsigned int out_stride = attribute->converted_size
+                                * attribute->converted_count;
+    bool grow = num_elements > conversion->capacity;
+    if (grow) {
+        conversion->capacity = num_elements;
+        conversion->data = g_realloc(conversion->data,
+                                     num_elements * out_stride);
+    }
+
+    pgraph_convert_vertex_attribute(attribute,
+                                    data + first * attribute->stride,
+                                    attribute->stride, num_elements - first,
+                                    conversion->data + first * out_stride);
+    pg->vertex_elements_converted += num_elements - first;
+
+    glBindBuffer(GL_ARRAY_BUFFER, conversion->gl_buffer);
+    if (grow) {
+        glBufferData(GL_ARRAY_BUFFER, num_elements * out_stride,
+                     conversion->data, GL_STATIC_DRAW);
+    } else {
+        glBufferSubData(GL_ARRAY_BUFFER, first * out_stride,
+                        (num_elements - first) * out_stride,
+                        conversion->data + first * out_stride);
     }
+
+    conversion->elements = num_elements;
+    conversion->dirty = false;
+    vram_range_update(&pg->vram_ranges, &conversion->range, key.addr,
+                      num_elements * attribute->stride, &conversion->dirty);
+
+    return conversion;
 }
 
 static void pgraph_bind_vertex_attributes(NV2AState *d,
@@ -3885,7 +5466,7 @@ static void pgraph_bind_vertex_attributes(NV2AState *d,
                                           bool inline_data,
                                           unsigned int inline_stride)
 {
-    int i, j;
+    int i;
     PGRAPHState *pg = &d->pgraph;
 
     if (inline_data) {
@@ -3924,114 +5505,457 @@ static void pgraph_bind_vertex_attributes(NV2AState *d,
                 unsigned int out_stride = attribute->converted_size
                                         * attribute->converted_count;
 
-                if (num_elements > attribute->converted_elements) {
-                    attribute->converted_buffer = (uint8_t*)g_realloc(
-                        attribute->converted_buffer,
-                        num_elements * out_stride);
+                GLintptr offset = 0;
+                if (inline_data) {
+                    /* inline arrays are different for every draw */
+                    size_t length = num_elements * out_stride;
+                    if (length > attribute->converted_buffer_size) {
+                        attribute->converted_buffer = (uint8_t*)g_realloc(
+                            attribute->converted_buffer, length);
+                        attribute->converted_buffer_size = length;
+                    }
+                    pgraph_convert_vertex_attribute(attribute, data, in_stride,
+                        num_elements, attribute->converted_buffer);
+                    pg->vertex_elements_converted += num_elements;
+
+                    if (!pgraph_stream_upload(pg, GL_ARRAY_BUFFER,
+                                              attribute->converted_buffer,
+                                              length, &offset)) {
+                        glBindBuffer(GL_ARRAY_BUFFER,
+                                     attribute->gl_converted_buffer);
+                        glBufferData(GL_ARRAY_BUFFER, length,
+                                     attribute->converted_buffer,
+                                     GL_DYNAMIC_DRAW);
+                    }
+                } else {
+                    VertexConversion *conversion =
+                        pgraph_get_vertex_conversion(d, attribute, data,
+                                                     num_elements);
+                    glBindBuffer(GL_ARRAY_BUFFER, conversion->gl_buffer);
                 }
 
-                for (j=attribute->converted_elements; j<num_elements; j++) {
-                    uint8_t *in = data + j * in_stride;
-                    uint8_t *out = attribute->converted_buffer + j * out_stride;
-
-                    switch (attribute->format) {
-                    case NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_CMP: {
-                        uint32_t p = ldl_le_p((uint32_t*)in);
-                        float *xyz = (float*)out;
-                        xyz[0] = ((int32_t)(((p >>  0) & 0x7FF) << 21) >> 21)
-                                                                      / 1023.0f;
-                        xyz[1] = ((int32_t)(((p >> 11) & 0x7FF) << 21) >> 21)
-                                                                      / 1023.0f;
-                        xyz[2] = ((int32_t)(((p >> 22) & 0x3FF) << 22) >> 22)
-                                                                       / 511.0f;
-                        break;
-                    }
-                    default:
-                        assert(false);
-                        break;
-                    }
-                }
+                glVertexAttribPointer(i,
+                    attribute->converted_count,
+                    attribute->gl_type,
+                    attribute->gl_normalize,
+                    out_stride,
+                    (void*)offset);
+            } else if (inline_data) {
+                glBindBuffer(GL_ARRAY_BUFFER, pg->gl_inline_array_source);
+                glVertexAttribPointer(i,
+                                      attribute->gl_count,
+                                      attribute->gl_type,
+                                      attribute->gl_normalize,
+                                      inline_stride,
+                                      (void*)(pg->inline_array_source_offset
+                                          + attribute->inline_array_offset));
+            } else {
+                hwaddr addr = data - d->vram_ptr;
+                pgraph_update_memory_buffer(d, addr,
+                                            num_elements * attribute->stride,
+                                            false);
+                glVertexAttribPointer(i,
+                    attribute->gl_count,
+                    attribute->gl_type,
+                    attribute->gl_normalize,
+                    attribute->stride,
+                    (void*)(uint64_t)addr);
+            }
+            glEnableVertexAttribArray(i);
+        } else {
+            glDisableVertexAttribArray(i);
+
+            glVertexAttrib4fv(i, attribute->inline_value);
+        }
+    }
+    NV2A_GL_DGROUP_END();
+}
+
+static bool pgraph_stream_upload(PGRAPHState *pg, GLenum target,
+                                 const void *data, size_t length,
+                                 GLintptr *offset)
+{
+    if (!vertex_stream_upload(&pg->vertex_stream, target, data, length,
+                              offset)) {
+        return false;
+    }
+    pg->vertex_stream_frame_bytes += length;
+    return true;
+}
+
+/* Assigns the attribute offsets in a vertex, returns the vertex size */
+static unsigned int pgraph_layout_inline_array(PGRAPHState *pg)
+{
+    int i;
+
+    unsigned int offset = 0;
+    for (i=0; i<NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        VertexAttribute *attribute = &pg->vertex_attributes[i];
+        if (attribute->count) {
+            attribute->inline_array_offset = offset;
+
+            NV2A_DPRINTF("bind inline attribute %d size=%d, count=%d\n",
+                i, attribute->size, attribute->count);
+            offset += attribute->size * attribute->count;
+            assert(offset % 4 == 0);
+        }
+    }
+
+    return offset;
+}
+
+static unsigned int pgraph_bind_inline_array(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    unsigned int vertex_size = pgraph_layout_inline_array(pg);
+
+    unsigned int index_count = pg->inline_array_length*4 / vertex_size;
+
+    NV2A_DPRINTF("draw inline array %d, %d\n", vertex_size, index_count);
+
+    pg->gl_inline_array_source = pg->vertex_stream.gl_buffer;
+    if (!pgraph_stream_upload(pg, GL_ARRAY_BUFFER, pg->inline_array,
+                              pg->inline_array_length*4,
+                              &pg->inline_array_source_offset)) {
+        pg->gl_inline_array_source = pg->gl_inline_array_buffer;
+        pg->inline_array_source_offset = 0;
+        glBindBuffer(GL_ARRAY_BUFFER, pg->gl_inline_array_buffer);
+        glBufferData(GL_ARRAY_BUFFER, pg->inline_array_length*4,
+                     pg->inline_array, GL_DYNAMIC_DRAW);
+    }
+
+    pgraph_bind_vertex_attributes(d, index_count, true, vertex_size);
+
+    return index_count;
+}
+
+/* Looks up the decoded copy of the current vertex program, decoding it on
+ * first use */
+static VshProgramEntry *pgraph_get_vsh_program(PGRAPHState *pg)
+{
+    int program_start = GET_MASK(pg->regs[NV_PGRAPH_CSV0_C],
+                                 NV_PGRAPH_CSV0_C_CHEOPS_PROGRAM_START);
+    VshProgramEntry *key = g_new0(VshProgramEntry, 1);
+    int i;
+
+    for (i = program_start; i < NV2A_MAX_TRANSFORM_PROGRAM_LENGTH; i++) {
+        memcpy(key->tokens[key->length++], pg->program_data[i],
+               VSH_TOKEN_SIZE * sizeof(uint32_t));
+        if (vsh_get_field(pg->program_data[i], FLD_FINAL)) {
+            break;
+        }
+    }
+
+    VshProgramEntry *entry = g_hash_table_lookup(pg->vsh_program_cache, key);
+    if (entry) {
+        g_free(key);
+        QTAILQ_REMOVE(&pg->vsh_programs, entry, entry);
+    } else {
+        if (pg->num_vsh_programs >= NV2A_VSH_PROGRAM_CACHE_SIZE) {
+            pgraph_vsh_program_destroy(pg,
+                QTAILQ_LAST(&pg->vsh_programs, VshProgramHead));
+        }
+        entry = key;
+        entry->program = vsh_program_new(&entry->tokens[0][0],
+                                         entry->length);
+        g_hash_table_insert(pg->vsh_program_cache, entry, entry);
+        pg->num_vsh_programs++;
+    }
+    QTAILQ_INSERT_HEAD(&pg->vsh_programs, entry, entry);
+
+    return entry;
+}
+
+static void pgraph_vsh_program_destroy(PGRAPHState *pg,
+                                       VshProgramEntry *entry)
+{
+    g_hash_table_remove(pg->vsh_program_cache, entry);
+    QTAILQ_REMOVE(&pg->vsh_programs, entry, entry);
+    pg->num_vsh_programs--;
+
+    if (entry->program) {
+        vsh_program_free(entry->program);
+    }
+    g_free(entry);
+}
+
+static void pgraph_get_attribute_source(NV2AState *d, unsigned int index,
+                                        bool inline_array,
+                                        unsigned int inline_stride,
+                                        VertexAttributeSource *src)
+{
+    PGRAPHState *pg = &d->pgraph;
+    VertexAttribute *attribute = &pg->vertex_attributes[index];
+
+    memset(src, 0, sizeof(*src));
+    src->value = attribute->inline_value;
+
+    if (pg->inline_buffer_length) {
+        if (attribute->inline_buffer_populated) {
+            src->data = (const uint8_t *)attribute->inline_buffer;
+            src->end = src->data
+                       + pg->inline_buffer_length * 4 * sizeof(float);
+            src->stride = 4 * sizeof(float);
+            src->format = NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_F;
+            src->count = 4;
+            src->size = 4;
+        }
+        return;
+    }
+
+    if (!attribute->count) {
+        return;
+    }
+
+    src->format = attribute->format;
+    src->count = attribute->count;
+    src->size = attribute->size;
+
+    if (inline_array) {
+        src->data = (const uint8_t *)pg->inline_array
+                    + attribute->inline_array_offset;
+        src->end = (const uint8_t *)pg->inline_array
+                   + pg->inline_array_length * 4;
+        src->stride = inline_stride;
+    } else {
+        hwaddr dma_len;
+        uint8_t *data = nv_dma_map(d, attribute->dma_select
+                                          ? pg->dma_vertex_b
+                                          : pg->dma_vertex_a,
+                                   &dma_len);
+        hwaddr vram_left = d->vram_ptr + memory_region_size(d->vram) - data;
+        hwaddr end = MIN(dma_len + 1, vram_left);
+        if (attribute->offset >= end) {
+            src->data = NULL;
+            return;
+        }
+        src->data = data + attribute->offset;
+        src->end = data + end;
+        src->stride = attribute->stride;
+    }
+}
+
+/* Reads one vertex like GL would, missing components are (0, 0, 0, 1) */
+static void pgraph_read_attribute(const VertexAttributeSource *src,
+                                  unsigned int index, float out[4])
+{
+    int i;
+
+    if (!src->data) {
+        memcpy(out, src->value, 4 * sizeof(float));
+        return;
+    }
+
+    out[0] = out[1] = out[2] = 0.0f;
+    out[3] = 1.0f;
+
+    const uint8_t *p = src->data + (size_t)index * src->stride;
+    if (p + src->size * src->count > src->end) {
+        return;
+    }
+
+    switch (src->format) {
+    case NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_UB_D3D:
+        out[0] = p[2] / 255.0f;
+        out[1] = p[1] / 255.0f;
+        out[2] = p[0] / 255.0f;
+        out[3] = p[3] / 255.0f;
+        break;
+    case NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_UB_OGL:
+        for (i = 0; i < MIN(src->count, 4); i++) {
+            out[i] = p[i] / 255.0f;
+        }
+        break;
+    case NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_S1:
+        for (i = 0; i < MIN(src->count, 4); i++) {
+            out[i] = MAX((int16_t)lduw_le_p(p + i * 2) / 32767.0f, -1.0f);
+        }
+        break;
+    case NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_F:
+        for (i = 0; i < MIN(src->count, 4); i++) {
+            uint32_t v = ldl_le_p(p + i * 4);
+            memcpy(&out[i], &v, sizeof(float));
+        }
+        break;
+    case NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_S32K:
+        for (i = 0; i < MIN(src->count, 4); i++) {
+            out[i] = (int16_t)lduw_le_p(p + i * 2);
+        }
+        break;
+    case NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_CMP:
+        convert_cmp_to_float(p, src->stride, 1, 1, out);
+        break;
+    default:
+        assert(false);
+        break;
+    }
+}
+
+/* Runs a vertex program over vertices first..first+count-1, the attributes
+ * are gathered VSH_BATCH_SIZE vertices at a time */
+static void pgraph_run_vertex_program(const VshProgram *program,
+                                      const float (*constants)[4],
+                                      const VertexAttributeSource *src,
+                                      unsigned int first, unsigned int count,
+                                      float (*outputs)[VSH_OUTPUTS][4])
+{
+    uint16_t inputs_read = vsh_program_inputs(program);
+    VshLanes inputs[VSH_INPUTS][4];
+    VshLanes results[VSH_OUTPUTS][4];
+    unsigned int base, lane;
+    int i, j;
+
+    memset(inputs, 0, sizeof(inputs));
 
+    for (base = 0; base < count; base += VSH_BATCH_SIZE) {
+        unsigned int lanes = MIN(count - base, VSH_BATCH_SIZE);
 
-                glBindBuffer(GL_ARRAY_BUFFER, attribute->gl_converted_buffer);
-                if (num_elements != attribute->converted_elements) {
-                    glBufferData(GL_ARRAY_BUFFER,
-                                 num_elements * out_stride,
-                                 attribute->converted_buffer,
-                                 GL_DYNAMIC_DRAW);
-                    attribute->converted_elements = num_elements;
+        for (i = 0; i < VSH_INPUTS; i++) {
+            if (!(inputs_read & (1 << i))) {
+                continue;
+            }
+            for (lane = 0; lane < lanes; lane++) {
+                float v[4];
+                pgraph_read_attribute(&src[i], first + base + lane, v);
+                for (j = 0; j < 4; j++) {
+                    inputs[i][j][lane] = v[j];
                 }
+            }
+        }
 
+        vsh_program_run(program, constants,
+                        (const VshLanes (*)[4])inputs, results);
 
-                glVertexAttribPointer(i,
-                    attribute->converted_count,
-                    attribute->gl_type,
-                    attribute->gl_normalize,
-                    out_stride,
-                    0);
-            } else if (inline_data) {
-                glBindBuffer(GL_ARRAY_BUFFER, pg->gl_inline_array_buffer);
-                glVertexAttribPointer(i,
-                                      attribute->gl_count,
-                                      attribute->gl_type,
-                                      attribute->gl_normalize,
-                                      inline_stride,
-                                      (void*)(uintptr_t)attribute->inline_array_offset);
-            } else {
-                hwaddr addr = data - d->vram_ptr;
-                pgraph_update_memory_buffer(d, addr,
-                                            num_elements * attribute->stride,
-                                            false);
-                glVertexAttribPointer(i,
-                    attribute->gl_count,
-                    attribute->gl_type,
-                    attribute->gl_normalize,
-                    attribute->stride,
-                    (void*)(uint64_t)addr);
+        for (lane = 0; lane < lanes; lane++) {
+            for (i = 0; i < VSH_OUTPUTS; i++) {
+                for (j = 0; j < 4; j++) {
+                    outputs[base + lane][i][j] = results[i][j][lane];
+                }
             }
-            glEnableVertexAttribArray(i);
-        } else {
-            glDisableVertexAttribArray(i);
-
-            glVertexAttrib4fv(i, attribute->inline_value);
         }
     }
-    NV2A_GL_DGROUP_END();
 }
 
-static unsigned int pgraph_bind_inline_array(NV2AState *d)
+/* Draws with the vertex program run on the CPU, the passthrough shader
+ * reads output i from attribute i */
+static void pgraph_draw_vertex_program_cpu(NV2AState *d)
 {
-    int i;
-
     PGRAPHState *pg = &d->pgraph;
+    VertexAttributeSource src[NV2A_VERTEXSHADER_ATTRIBUTES];
+    GLenum mode = pg->shader_binding->gl_primitive_mode;
+    unsigned int first = 0, count = 0;
+    unsigned int i;
+
+    bool inline_array = !pg->inline_buffer_length && pg->inline_array_length;
+    unsigned int inline_stride = 0;
+    if (inline_array) {
+        inline_stride = pgraph_layout_inline_array(pg);
+    }
 
-    unsigned int offset = 0;
-    for (i=0; i<NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
-        VertexAttribute *attribute = &pg->vertex_attributes[i];
-        if (attribute->count) {
-            attribute->inline_array_offset = offset;
-
-            NV2A_DPRINTF("bind inline attribute %d size=%d, count=%d\n",
-                i, attribute->size, attribute->count);
-            offset += attribute->size * attribute->count;
-            assert(offset % 4 == 0);
+    uint32_t min_element = (uint32_t)-1, max_element = 0;
+    if (pg->draw_arrays_length) {
+        unsigned int end = 0;
+        first = (unsigned int)-1;
+        for (i = 0; i < pg->draw_arrays_length; i++) {
+            first = MIN(first, pg->gl_draw_arrays_start[i]);
+            end = MAX(end, pg->gl_draw_arrays_start[i]
+                               + pg->gl_draw_arrays_count[i]);
         }
+        count = end - first;
+    } else if (pg->inline_buffer_length) {
+        count = pg->inline_buffer_length;
+    } else if (inline_array) {
+        count = inline_stride ? pg->inline_array_length * 4 / inline_stride
+                              : 0;
+    } else if (pg->inline_elements_length) {
+        for (i = 0; i < pg->inline_elements_length; i++) {
+            max_element = MAX(pg->inline_elements[i], max_element);
+            min_element = MIN(pg->inline_elements[i], min_element);
+        }
+        first = min_element;
+        count = max_element - min_element + 1;
     }
 
-    unsigned int vertex_size = offset;
-
-
-    unsigned int index_count = pg->inline_array_length*4 / vertex_size;
+    if (count == 0 || count > NV2A_VSH_CPU_MAX_VERTICES) {
+        pg->vsh_cpu_draws_dropped++;
+        goto done;
+    }
 
-    NV2A_DPRINTF("draw inline array %d, %d\n", vertex_size, index_count);
+    for (i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        pgraph_get_attribute_source(d, i, inline_array, inline_stride,
+                                    &src[i]);
+        if (src[i].data && !inline_array && !pg->inline_buffer_length) {
+            /* the CPU reads VRAM, which may still be waiting for a
+             * surface download */
+            pgraph_readback_flush_range(d,
+                src[i].data - d->vram_ptr + (hwaddr)first * src[i].stride,
+                (hwaddr)count * src[i].stride);
+        }
+    }
 
-    glBindBuffer(GL_ARRAY_BUFFER, pg->gl_inline_array_buffer);
-    glBufferData(GL_ARRAY_BUFFER, pg->inline_array_length*4, pg->inline_array,
-                 GL_DYNAMIC_DRAW);
+    if (count > pg->vsh_outputs_size) {
+        pg->vsh_outputs_size = MAX(count, pg->vsh_outputs_size * 2);
+        pg->vsh_outputs = g_realloc(pg->vsh_outputs,
+            pg->vsh_outputs_size * sizeof(pg->vsh_outputs[0]));
+    }
+    pgraph_run_vertex_program(pg->vsh_cpu_program,
+                              (const float (*)[4])pg->vsh_constants,
+                              src, first, count, pg->vsh_outputs);
+    pg->vsh_cpu_vertices += count;
+    pg->vsh_cpu_draws++;
+
+    size_t stride = sizeof(pg->vsh_outputs[0]);
+    size_t length = count * stride;
+    GLintptr offset = 0;
+    if (!pgraph_stream_upload(pg, GL_ARRAY_BUFFER, pg->vsh_outputs, length,
+                              &offset)) {
+        glBindBuffer(GL_ARRAY_BUFFER, pg->gl_vsh_output_buffer);
+        glBufferData(GL_ARRAY_BUFFER, length, pg->vsh_outputs,
+                     GL_STREAM_DRAW);
+    }
+    for (i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        if (i < VSH_OUTPUTS) {
+            glVertexAttribPointer(i, 4, GL_FLOAT, GL_FALSE, stride,
+                                  (void *)(offset + i * 4 * sizeof(float)));
+            glEnableVertexAttribArray(i);
+        } else {
+            glDisableVertexAttribArray(i);
+        }
+    }
 
-    pgraph_bind_vertex_attributes(d, index_count, true, vertex_size);
+    if (pg->draw_arrays_length) {
+        GLint starts[ARRAY_SIZE(pg->gl_draw_arrays_start)];
+        for (i = 0; i < pg->draw_arrays_length; i++) {
+            starts[i] = pg->gl_draw_arrays_start[i] - first;
+        }
+        glMultiDrawArrays(mode, starts, pg->gl_draw_arrays_count,
+                          pg->draw_arrays_length);
+    } else if (pg->inline_elements_length) {
+        GLintptr element_offset = 0;
+        if (!pgraph_stream_upload(pg, GL_ELEMENT_ARRAY_BUFFER,
+                                  pg->inline_elements,
+                                  pg->inline_elements_length * 4,
+                                  &element_offset)) {
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pg->gl_element_buffer);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                         pg->inline_elements_length * 4,
+                         pg->inline_elements, GL_DYNAMIC_DRAW);
+        }
+        glDrawRangeElementsBaseVertex(mode, min_element, max_element,
+                                      pg->inline_elements_length,
+                                      GL_UNSIGNED_INT,
+                                      (void *)element_offset,
+                                      -(GLint)min_element);
+    } else {
+        glDrawArrays(mode, 0, count);
+    }
+    pg->gl_calls.draws++;
 
-    return index_count;
+done:
+    for (i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        pg->vertex_attributes[i].inline_buffer_populated = false;
+    }
 }
 
 /* 16 bit to [0.0, F16_MAX = 511.9375] */
@@ -4071,212 +5995,200 @@ static void convert_yuy2_to_rgb(const uint8_t *line, unsigned int ix,
     *b = cliptobyte((298 * c + 516 * d + 128) >> 8);
 }
 
-static uint8_t* convert_texture_data(const TextureShape s,
-                                     const uint8_t *data,
-                                     const uint8_t *palette_data,
-                                     unsigned int width,
-                                     unsigned int height,
-                                     unsigned int depth,
-                                     unsigned int row_pitch,
-                                     unsigned int slice_pitch)
+static TextureDecodeSlice *pgraph_texture_plan_slice(
+    TextureDecodeSlice *slices, unsigned int *num_slices)
 {
-    if (s.color_format == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8) {
-        assert(depth == 1); /* FIXME */
-        uint8_t* converted_data = (uint8_t*)g_malloc(width * height * 4);
-        int x, y;
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                uint8_t index = data[y * row_pitch + x];
-                uint32_t color = *(uint32_t*)(palette_data + index * 4);
-                *(uint32_t*)(converted_data + y * width * 4 + x * 4) = color;
-            }
-        }
-        return converted_data;
-    } else if (s.color_format
-                   == NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_CR8YB8CB8YA8) {
-        assert(depth == 1); /* FIXME */
-        uint8_t* converted_data = (uint8_t*)g_malloc(width * height * 4);
-        int x, y;
-        for (y = 0; y < height; y++) {
-            const uint8_t* line = &data[y * s.width * 2];
-            for (x = 0; x < width; x++) {
-                uint8_t* pixel = &converted_data[(y * s.width + x) * 4];
-                /* FIXME: Actually needs uyvy? */
-                convert_yuy2_to_rgb(line, x, &pixel[0], &pixel[1], &pixel[2]);
-                pixel[3] = 255;
-          }
-        }
-        return converted_data;
-    } else if (s.color_format
-                   == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R6G5B5) {
-        assert(depth == 1); /* FIXME */
-        uint8_t *converted_data = (uint8_t*)g_malloc(width * height * 3);
-        int x, y;
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                uint16_t rgb655 = *(uint16_t*)(data + y * row_pitch + x * 2);
-                int8_t *pixel = (int8_t*)&converted_data[(y * width + x) * 3];
-                /* Maps 5 bit G and B signed value range to 8 bit
-                 * signed values. R is probably unsigned.
-                 */
-                rgb655 ^= (1 << 9) | (1 << 4);
-                pixel[0] = ((rgb655 & 0xFC00) >> 10) * 0x7F / 0x3F;
-                pixel[1] = ((rgb655 & 0x03E0) >> 5) * 0xFF / 0x1F - 0x80;
-                pixel[2] = (rgb655 & 0x001F) * 0xFF / 0x1F - 0x80;
-            }
-        }
-        return converted_data;
-    } else {
-        return NULL;
-    }
+    /* the caller's array is on the stack, check before writing */
+    assert(*num_slices < NV2A_TEXTURE_MAX_SLICES);
+    TextureDecodeSlice *slice = &slices[(*num_slices)++];
+    memset(slice, 0, sizeof(*slice));
+    return slice;
 }
 
-static void upload_gl_texture(GLenum gl_target,
-                              const TextureShape s,
-                              const uint8_t *texture_data,
-                              const uint8_t *palette_data)
+/* Lays out the faces and levels of a texture in the staging buffer and
+ * splits the decoding work into slices. Returns the staging size. */
+static size_t pgraph_texture_plan(const TextureShape *s, GLenum gl_target,
+                                  const uint8_t *texture_data,
+                                  enum TextureConversion conversion,
+                                  TextureUpload *uploads,
+                                  unsigned int *num_uploads,
+                                  TextureDecodeSlice *slices,
+                                  unsigned int *num_slices)
 {
-    ColorFormatInfo f = kelvin_color_format_map[s.color_format];
-
-    switch(gl_target) {
-    case GL_TEXTURE_1D:
-        assert(false);
-        break;
-    case GL_TEXTURE_RECTANGLE: {
-        /* Can't handle strides unaligned to pixels */
-        assert(s.pitch % f.bytes_per_pixel == 0);
-        glPixelStorei(GL_UNPACK_ROW_LENGTH,
-                      s.pitch / f.bytes_per_pixel);
+    ColorFormatInfo f = pgraph_texture_upload_format(s);
+    size_t offset = 0;
+    unsigned int face, faces = 1;
+    size_t face_length = 0;
+    int level;
 
-        uint8_t *converted = convert_texture_data(s, texture_data,
-                                                  palette_data,
-                                                  s.width, s.height, 1,
-                                                  s.pitch, 0);
+    /* there is one upload per face and level */
+    QEMU_BUILD_BUG_ON(6 * (NV_PGRAPH_TEXFMT0_MIPMAP_LEVELS >> 16)
+                      > NV2A_TEXTURE_MAX_SLICES);
 
-        glTexImage2D(gl_target, 0, f.gl_internal_format,
-                     s.width, s.height, 0,
-                     f.gl_format, f.gl_type,
-                     converted ? converted : texture_data);
+    *num_uploads = 0;
+    *num_slices = 0;
 
-        if (converted) {
-          g_free(converted);
+    if (gl_target == GL_TEXTURE_CUBE_MAP) {
+        unsigned int w = s->width, h = s->height;
+        for (level = 0; level < s->levels; level++) {
+            /* FIXME: This is wrong for compressed textures and textures with 1x? non-square mipmaps */
+            face_length += w * h * f.bytes_per_pixel;
+            w /= 2;
+            h /= 2;
         }
-
-        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-        break;
+        faces = 6;
     }
-    case GL_TEXTURE_2D:
-    case GL_TEXTURE_CUBE_MAP_POSITIVE_X:
-    case GL_TEXTURE_CUBE_MAP_NEGATIVE_X:
-    case GL_TEXTURE_CUBE_MAP_POSITIVE_Y:
-    case GL_TEXTURE_CUBE_MAP_NEGATIVE_Y:
-    case GL_TEXTURE_CUBE_MAP_POSITIVE_Z:
-    case GL_TEXTURE_CUBE_MAP_NEGATIVE_Z: {
 
-        unsigned int width = s.width, height = s.height;
+    for (face = 0; face < faces; face++) {
+        const uint8_t *data = texture_data + face * face_length;
+        GLenum face_target = gl_target == GL_TEXTURE_CUBE_MAP
+                                 ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face
+                                 : gl_target;
 
-        int level;
-        for (level = 0; level < s.levels; level++) {
-            if (f.gl_format == 0) { /* compressed */
-
-                width = MAX(width, 4); height = MAX(height, 4);
+        switch (gl_target) {
+        case GL_TEXTURE_1D:
+            assert(false);
+            break;
+        case GL_TEXTURE_RECTANGLE: {
+            /* Can't handle strides unaligned to pixels */
+            assert(s->pitch % f.bytes_per_pixel == 0);
+
+            size_t out_row = texture_decode_size(conversion,
+                                                 f.bytes_per_pixel,
+                                                 s->width, 1, 1);
+            unsigned int band = MAX(NV2A_TEXTURE_DECODE_BAND,
+                                    DIV_ROUND_UP(s->height,
+                                                 NV2A_TEXTURE_MAX_SLICES));
+            unsigned int y;
+            for (y = 0; y < s->height; y += band) {
+                TextureDecodeSlice *slice =
+                    pgraph_texture_plan_slice(slices, num_slices);
+                slice->src = data + y * s->pitch;
+                slice->dst = (uint8_t *)(offset + y * out_row);
+                slice->width = s->width;
+                slice->height = MIN(band, s->height - y);
+                slice->depth = 1;
+                slice->bytes_per_pixel = f.bytes_per_pixel;
+                slice->src_pitch = s->pitch;
+            }
+            uploads[(*num_uploads)++] = (TextureUpload) {
+                .gl_target = face_target,
+                .width = s->width,
+                .height = s->height,
+                .depth = 1,
+                .offset = offset,
+            };
+            offset += out_row * s->height;
+            break;
+        }
+        case GL_TEXTURE_2D:
+        case GL_TEXTURE_CUBE_MAP: {
+            unsigned int width = s->width, height = s->height;
 
-                unsigned int block_size;
-                if (f.gl_internal_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
-                    block_size = 8;
-                } else {
-                    block_size = 16;
-                }
+            for (level = 0; level < s->levels; level++) {
+                TextureDecodeSlice *slice =
+                    pgraph_texture_plan_slice(slices, num_slices);
+                slice->dst = (uint8_t *)offset;
+                slice->src = data;
+                slice->depth = 1;
+                slice->bytes_per_pixel = f.bytes_per_pixel;
 
-                glCompressedTexImage2D(gl_target, level, f.gl_internal_format,
-                                       width, height, 0,
-                                       width/4 * height/4 * block_size,
-                                       texture_data);
+                TextureUpload *upload = &uploads[(*num_uploads)++];
+                upload->gl_target = face_target;
+                upload->level = level;
+                upload->depth = 1;
+                upload->offset = offset;
 
-                texture_data += width/4 * height/4 * block_size;
-            } else {
+                if (f.gl_format == 0) { /* compressed */
 
-                width = MAX(width, 1); height = MAX(height, 1);
+                    width = MAX(width, 4); height = MAX(height, 4);
 
-                unsigned int pitch = width * f.bytes_per_pixel;
-                uint8_t *unswizzled = (uint8_t*)g_malloc(height * pitch);
-                unswizzle_rect(texture_data, width, height,
-                               unswizzled, pitch, f.bytes_per_pixel);
+                    unsigned int block_size;
+                    if (f.gl_internal_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
+                        block_size = 8;
+                    } else {
+                        block_size = 16;
+                    }
 
-                uint8_t *converted = convert_texture_data(s, unswizzled,
-                                                          palette_data,
-                                                          width, height, 1,
-                                                          pitch, 0);
+                    size_t size = width/4 * height/4 * block_size;
+                    slice->compressed_size = size;
+                    upload->compressed_size = size;
+                    data += size;
+                    offset += size;
+                } else {
 
-                glTexImage2D(gl_target, level, f.gl_internal_format,
-                             width, height, 0,
-                             f.gl_format, f.gl_type,
-                             converted ? converted : unswizzled);
+                    width = MAX(width, 1); height = MAX(height, 1);
 
-                if (converted) {
-                    g_free(converted);
+                    slice->swizzled = true;
+                    data += width * height * f.bytes_per_pixel;
+                    offset += texture_decode_size(conversion,
+                                                  f.bytes_per_pixel,
+                                                  width, height, 1);
                 }
-                g_free(unswizzled);
+                slice->width = width;
+                slice->height = height;
+                upload->width = width;
+                upload->height = height;
 
-                texture_data += width * height * f.bytes_per_pixel;
+                width /= 2;
+                height /= 2;
             }
-
-            width /= 2;
-            height /= 2;
+            break;
         }
-
-        break;
-    }
-    case GL_TEXTURE_3D: {
-
-        unsigned int width = s.width, height = s.height, depth = s.depth;
-
-        assert(f.gl_format != 0); /* FIXME: compressed not supported yet */
-        assert(f.linear == false);
-
-        int level;
-        for (level = 0; level < s.levels; level++) {
-
-            unsigned int row_pitch = width * f.bytes_per_pixel;
-            unsigned int slice_pitch = row_pitch * height;
-            uint8_t *unswizzled = (uint8_t*)g_malloc(slice_pitch * depth);
-            unswizzle_box(texture_data, width, height, depth, unswizzled,
-                           row_pitch, slice_pitch, f.bytes_per_pixel);
-
-            uint8_t *converted = convert_texture_data(s, unswizzled,
-                                                      palette_data,
-                                                      width, height, depth,
-                                                      row_pitch, slice_pitch);
-
-            glTexImage3D(gl_target, level, f.gl_internal_format,
-                         width, height, depth, 0,
-                         f.gl_format, f.gl_type,
-                         converted ? converted : unswizzled);
-
-            if (converted) {
-                g_free(converted);
+        case GL_TEXTURE_3D: {
+            unsigned int width = s->width, height = s->height;
+            unsigned int depth = s->depth;
+
+            assert(f.gl_format != 0); /* FIXME: compressed not supported yet */
+            assert(f.linear == false);
+
+            for (level = 0; level < s->levels; level++) {
+                TextureDecodeSlice *slice =
+                    pgraph_texture_plan_slice(slices, num_slices);
+                slice->src = data;
+                slice->dst = (uint8_t *)offset;
+                slice->width = width;
+                slice->height = height;
+                slice->depth = depth;
+                slice->bytes_per_pixel = f.bytes_per_pixel;
+                slice->swizzled = true;
+
+                uploads[(*num_uploads)++] = (TextureUpload) {
+                    .gl_target = face_target,
+                    .level = level,
+                    .width = width,
+                    .height = height,
+                    .depth = depth,
+                    .offset = offset,
+                };
+
+                data += width * height * depth * f.bytes_per_pixel;
+                offset += texture_decode_size(conversion, f.bytes_per_pixel,
+                                              width, height, depth);
+
+                width /= 2;
+                height /= 2;
+                depth /= 2;
             }
-            g_free(unswizzled);
-
-            texture_data += width * height * depth * f.bytes_per_pixel;
-
-            width /= 2;
-            height /= 2;
-            depth /= 2;
+            break;
+        }
+        default:
+            assert(false);
+            break;
         }
-        break;
-    }
-    default:
-        assert(false);
-        break;
     }
+
+    return offset;
 }
 
-static TextureBinding* generate_texture(const TextureShape s,
+static TextureBinding* generate_texture(PGRAPHState *pg,
+                                        const TextureShape s,
                                         const uint8_t *texture_data,
                                         const uint8_t *palette_data)
 {
-    ColorFormatInfo f = kelvin_color_format_map[s.color_format];
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    ColorFormatInfo f = pgraph_texture_upload_format(&s);
+    unsigned int i;
 
     /* Create a new opengl texture */
     GLuint gl_texture;
@@ -4319,33 +6231,82 @@ static TextureBinding* generate_texture(const TextureShape s,
                    s.dimensionality, s.cubemap ? " (Cubemap)" : "",
                    s.width, s.height, s.depth);
 
-    if (gl_target == GL_TEXTURE_CUBE_MAP) {
-
-        size_t length = 0;
-        unsigned int w = s.width, h = s.height;
-        int level;
-        for (level = 0; level < s.levels; level++) {
-            /* FIXME: This is wrong for compressed textures and textures with 1x? non-square mipmaps */
-            length += w * h * f.bytes_per_pixel;
-            w /= 2;
-            h /= 2;
+    enum TextureConversion conversion;
+    switch (s.color_format) {
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8:
+        if (pgraph_texture_decoded_in_shader(s.color_format, s.cubemap,
+                                             s.dimensionality)) {
+            conversion = TEXTURE_CONVERT_NONE;
+            break;
         }
+        conversion = TEXTURE_CONVERT_PALETTE;
+        break;
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_CR8YB8CB8YA8:
+        /* decoded by the pixel shader */
+        conversion = TEXTURE_CONVERT_NONE;
+        break;
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R6G5B5:
+        conversion = TEXTURE_CONVERT_R6G5B5;
+        break;
+    default:
+        conversion = TEXTURE_CONVERT_NONE;
+        break;
+    }
 
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_POSITIVE_X,
-                          s, texture_data + 0 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_NEGATIVE_X,
-                          s, texture_data + 1 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_POSITIVE_Y,
-                          s, texture_data + 2 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_NEGATIVE_Y,
-                          s, texture_data + 3 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_POSITIVE_Z,
-                          s, texture_data + 4 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_NEGATIVE_Z,
-                          s, texture_data + 5 * length, palette_data);
-    } else {
-        upload_gl_texture(gl_target, s, texture_data, palette_data);
+    TextureUpload uploads[NV2A_TEXTURE_MAX_SLICES];
+    TextureDecodeSlice slices[NV2A_TEXTURE_MAX_SLICES];
+    unsigned int num_uploads, num_slices;
+    size_t staging_size = pgraph_texture_plan(&s, gl_target, texture_data,
+                                              conversion,
+                                              uploads, &num_uploads,
+                                              slices, &num_slices);
+
+    /* decode straight into a pixel unpack buffer, the buffers are used in
+     * turn so that the GPU can still be reading the previous ones */
+    unsigned int staging = pg->texture_staging_head;
+    pg->texture_staging_head = (staging + 1) % NV2A_TEXTURE_STAGING_BUFFERS;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pg->gl_texture_staging[staging]);
+    if (staging_size > pg->texture_staging_size[staging]) {
+        pg->texture_staging_size[staging] = staging_size;
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, staging_size, NULL,
+                     GL_STREAM_DRAW);
+    }
+    uint8_t *mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+                                       staging_size,
+                                       GL_MAP_WRITE_BIT
+                                       | GL_MAP_INVALIDATE_BUFFER_BIT);
+    assert(mapped != NULL);
+    for (i = 0; i < num_slices; i++) {
+        slices[i].dst = mapped + (uintptr_t)slices[i].dst;
+    }
+
+    texture_decoder_run(&pg->texture_decoder, conversion, palette_data,
+                        slices, num_slices);
+
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    int ua;
+    glGetIntegerv(GL_UNPACK_ALIGNMENT, &ua);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (i = 0; i < num_uploads; i++) {
+        const TextureUpload *u = &uploads[i];
+        if (u->compressed_size) {
+            glCompressedTexImage2D(u->gl_target, u->level,
+                                   f.gl_internal_format,
+                                   u->width, u->height, 0,
+                                   u->compressed_size, (void *)u->offset);
+        } else if (u->gl_target == GL_TEXTURE_3D) {
+            glTexImage3D(u->gl_target, u->level, f.gl_internal_format,
+                         u->width, u->height, u->depth, 0,
+                         f.gl_format, f.gl_type, (void *)u->offset);
+        } else {
+            glTexImage2D(u->gl_target, u->level, f.gl_internal_format,
+                         u->width, u->height, 0,
+                         f.gl_format, f.gl_type, (void *)u->offset);
+        }
     }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, ua);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
     /* Linear textures don't support mipmapping */
     if (!f.linear) {
@@ -4365,6 +6326,14 @@ static TextureBinding* generate_texture(const TextureShape s,
     ret->gl_target = gl_target;
     ret->gl_texture = gl_texture;
     ret->refcnt = 1;
+
+    /* time until the texture can be drawn with, the upload itself may
+     * still be in flight */
+    int64_t elapsed = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    pg->textures_generated++;
+    pg->texture_generate_total_ns += elapsed;
+    pg->texture_generate_max_ns = MAX(pg->texture_generate_max_ns, elapsed);
+
     return ret;
 }
 
@@ -4379,22 +6348,106 @@ static void texture_binding_destroy(gpointer data)
     }
 }
 
+/* Palette lookups of 2D textures and YUY2 decoding are left to the pixel
+ * shader, so a new palette doesn't mean new texels. Cube maps and 3D
+ * textures are still expanded through the palette on upload. */
+static bool pgraph_texture_decoded_in_shader(unsigned int color_format,
+                                             bool cubemap,
+                                             unsigned int dimensionality)
+{
+    switch (color_format) {
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8:
+        return !cubemap && dimensionality == 2;
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_CR8YB8CB8YA8:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* The format the texture data is uploaded in, after any conversion */
+static ColorFormatInfo pgraph_texture_upload_format(const TextureShape *s)
+{
+    if (pgraph_texture_decoded_in_shader(s->color_format, s->cubemap,
+                                         s->dimensionality)) {
+        if (s->color_format == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8) {
+            return pgraph_palette_index_format;
+        }
+        return pgraph_yuy2_format;
+    }
+    return kelvin_color_format_map[s->color_format];
+}
+
+/* Binds the palette the pixel shader looks up the indices of a stage in,
+ * uploading it only if it changed since it was last bound there */
+static void pgraph_bind_palette(PGRAPHState *pg, int stage,
+                                const uint8_t *palette_data,
+                                size_t palette_length)
+{
+    uint64_t hash = fnv_hash(palette_data, palette_length);
+
+    glActiveTexture(GL_TEXTURE0 + NV2A_PALETTE_TEXTURE_UNIT(stage));
+    glBindTexture(GL_TEXTURE_2D, pg->gl_palette_textures[stage]);
+    if (pg->palette_valid[stage] && pg->palette_hash[stage] == hash) {
+        return;
+    }
+
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, palette_length / 4, 1,
+                    GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, palette_data);
+    pg->palette_hash[stage] = hash;
+    pg->palette_valid[stage] = true;
+    pg->palette_uploads++;
+}
+
 /* functions for texture LRU cache */
+
+/* Rough size of the GL texture, for the texture cache byte budget */
+static size_t texture_get_host_size(const TextureShape *s, size_t length)
+{
+    if (pgraph_texture_decoded_in_shader(s->color_format, s->cubemap,
+                                         s->dimensionality)) {
+        return length;
+    }
+
+    switch (s->color_format) {
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8:
+        /* expanded through the palette */
+        return length * 4;
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R6G5B5:
+        return length * 3 / 2;
+    default:
+        return length;
+    }
+}
+
 static struct lru_node *texture_cache_entry_init(struct lru_node *obj, void *key)
 {
     struct TextureKey *k_out = container_of(obj, struct TextureKey, node);
     struct TextureKey *k_in = (struct TextureKey *)key;
-    memcpy(k_out, k_in, sizeof(struct TextureKey));
-    k_out->binding = generate_texture(k_in->state,
-                                      k_in->texture_data,
-                                      k_in->palette_data);
+    k_out->state = k_in->state;
+    k_out->texture_data = k_in->texture_data;
+    k_out->palette_data = k_in->palette_data;
+    k_out->length = k_in->length;
+    k_out->palette_length = k_in->palette_length;
+    k_out->content_hash = texture_content_hash(k_in);
+    k_out->dirty = false;
+    /* indexed by pgraph_bind_textures, which has the index */
+    k_out->texture_range.index = NULL;
+    k_out->palette_range.index = NULL;
+    /* generated by pgraph_bind_textures, which has the decoder */
+    k_out->binding = NULL;
+    obj->size = texture_get_host_size(&k_in->state, k_in->length);
     return obj;
 }
 
 static struct lru_node *texture_cache_entry_deinit(struct lru_node *obj)
 {
     struct TextureKey *a = container_of(obj, struct TextureKey, node);
-    texture_binding_destroy(a->binding);
+    vram_range_remove(&a->texture_range);
+    vram_range_remove(&a->palette_range);
+    if (a->binding) {
+        texture_binding_destroy(a->binding);
+    }
     return obj;
 }
 
@@ -4402,7 +6455,153 @@ static int texture_cache_entry_compare(struct lru_node *obj, void *key)
 {
     struct TextureKey *a = container_of(obj, struct TextureKey, node);
     struct TextureKey *b = (struct TextureKey *)key;
-    return memcmp(&a->state, &b->state, sizeof(a->state));
+    return a->texture_data != b->texture_data
+        || a->palette_data != b->palette_data
+        || a->length != b->length
+        || a->palette_length != b->palette_length
+        || memcmp(&a->state, &b->state, sizeof(a->state));
+}
+
+static uint64_t texture_content_hash(const TextureKey *key)
+{
+    return fast_hash(key->texture_data, key->length, 5003)
+         ^ fnv_hash(key->palette_data, key->palette_length);
+}
+
+static void vram_range_index_init(VramRangeIndex *index, hwaddr size)
+{
+    index->num_blocks = DIV_ROUND_UP(size, 1 << NV2A_VRAM_RANGE_BLOCK_SHIFT);
+    index->blocks = g_new0(GPtrArray *, index->num_blocks);
+}
+
+static void vram_range_index_destroy(VramRangeIndex *index)
+{
+    unsigned int i;
+
+    for (i = 0; i < index->num_blocks; i++) {
+        if (index->blocks[i]) {
+            g_ptr_array_free(index->blocks[i], TRUE);
+        }
+    }
+    g_free(index->blocks);
+    index->blocks = NULL;
+}
+
+/* The blocks start..end touches, clamped to the ones in VRAM. Returns false
+ * if there are none. */
+static bool vram_range_blocks(const VramRangeIndex *index,
+                              hwaddr start, hwaddr end,
+                              unsigned int *first, unsigned int *last)
+{
+    if (start >= end) {
+        return false;
+    }
+    *first = start >> NV2A_VRAM_RANGE_BLOCK_SHIFT;
+    *last = MIN((end - 1) >> NV2A_VRAM_RANGE_BLOCK_SHIFT,
+                index->num_blocks - 1);
+    return *first <= *last;
+}
+
+static void vram_range_remove(VramRange *range)
+{
+    VramRangeIndex *index = range->index;
+    unsigned int first, last, i;
+
+    if (index == NULL) {
+        return;
+    }
+    if (vram_range_blocks(index, range->start, range->end, &first, &last)) {
+        for (i = first; i <= last; i++) {
+            g_ptr_array_remove_fast(index->blocks[i], range);
+        }
+    }
+    range->index = NULL;
+}
+
+/* Indexes range as covering start..start+length, moving it if it was
+ * indexed somewhere else. *dirty is set when the guest writes to it. */
+static void vram_range_update(VramRangeIndex *index, VramRange *range,
+                              hwaddr start, size_t length, bool *dirty)
+{
+    unsigned int first, last, i;
+
+    if (range->index == index && range->start == start
+        && range->end == start + length) {
+        return;
+    }
+
+    vram_range_remove(range);
+    range->start = start;
+    range->end = start + length;
+    range->dirty = dirty;
+    range->index = index;
+    if (!vram_range_blocks(index, range->start, range->end, &first, &last)) {
+        return;
+    }
+    for (i = first; i <= last; i++) {
+        if (index->blocks[i] == NULL) {
+            index->blocks[i] = g_ptr_array_new();
+        }
+        g_ptr_array_add(index->blocks[i], range);
+    }
+}
+
+/* Flags every indexed range overlapping start..end. Ranges spanning several
+ * blocks are visited once for each, which only sets their flag again. */
+static void vram_range_index_flag(VramRangeIndex *index,
+                                  hwaddr start, hwaddr end)
+{
+    unsigned int first, last, i, j;
+
+    if (!vram_range_blocks(index, start, end, &first, &last)) {
+        return;
+    }
+    for (i = first; i <= last; i++) {
+        GPtrArray *block = index->blocks[i];
+        if (block == NULL) {
+            continue;
+        }
+        for (j = 0; j < block->len; j++) {
+            VramRange *range = g_ptr_array_index(block, j);
+            if (range->start < end && range->end > start) {
+                *range->dirty = true;
+            }
+        }
+    }
+}
+
+/* Tests and clears the DIRTY_MEMORY_NV2A_TEX bits for the pages spanning
+ * data..data+length. As the bits are shared by every texture cache entry and
+ * converted vertex array, any other one on those pages is flagged for
+ * checking on its next use. */
+static bool pgraph_cache_test_and_clear_dirty(NV2AState *d,
+                                              const uint8_t *data,
+                                              size_t length)
+{
+    if (data == NULL || length == 0) {
+        return false;
+    }
+
+    hwaddr start = (data - d->vram_ptr) & TARGET_PAGE_MASK;
+    hwaddr end = TARGET_PAGE_ALIGN((data - d->vram_ptr) + length);
+
+    if (!memory_region_test_and_clear_dirty(d->vram, start, end - start,
+                                            DIRTY_MEMORY_NV2A_TEX)) {
+        return false;
+    }
+
+    vram_range_index_flag(&d->pgraph.vram_ranges, start, end);
+    return true;
+}
+
+/* hash and equality for the vertex conversion cache */
+static guint vertex_conversion_hash(gconstpointer key)
+{
+    return fnv_hash((const uint8_t *)key, sizeof(VertexConversionKey));
+}
+static gboolean vertex_conversion_equal(gconstpointer a, gconstpointer b)
+{
+    return memcmp(a, b, sizeof(VertexConversionKey)) == 0;
 }
 
 /* hash and equality for shader cache hash table */
@@ -4416,6 +6615,22 @@ static gboolean shader_equal(gconstpointer a, gconstpointer b)
     return memcmp(as, bs, sizeof(ShaderState)) == 0;
 }
 
+/* hash and equality for the decoded vertex programs, only the tokens up to
+ * the final one count */
+static guint vsh_program_hash(gconstpointer key)
+{
+    const VshProgramEntry *entry = key;
+    return fnv_hash((const uint8_t *)entry->tokens,
+                    entry->length * sizeof(entry->tokens[0]));
+}
+static gboolean vsh_program_equal(gconstpointer a, gconstpointer b)
+{
+    const VshProgramEntry *ae = a, *be = b;
+    return ae->length == be->length
+        && memcmp(ae->tokens, be->tokens,
+                  ae->length * sizeof(ae->tokens[0])) == 0;
+}
+
 static unsigned int kelvin_map_stencil_op(uint32_t parameter)
 {
     unsigned int op;
@@ -0,0 +1,2049 @@
+/*
+ * QEMU Geforce NV2A implementation
+ * Software renderer, draws Kelvin primitives without GL
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Everything is read from and written to guest memory directly, so there
+ * are no surfaces or textures to keep in sync. The fixed function vertex
+ * pipeline follows the shaders the GL path generates for it, draws that
+ * need something not done here are skipped and counted.
+ */
+
+/* Varyings passed from the vertex stage to the combiners */
+#define SOFT_VARYING_D0   0
+#define SOFT_VARYING_D1   1
+#define SOFT_VARYING_FOG  2
+#define SOFT_VARYING_T0   3
+#define SOFT_NUM_VARYINGS 7
+
+/* Triangles are clipped to a guard band around the surface in window
+ * coordinates, and to a plane just in front of the eye */
+#define SOFT_GUARD_BAND 32768.0f
+#define SOFT_CLIP_MIN_W (1.0f / 1048576.0f)
+#define SOFT_CLIP_PLANES 5
+#define SOFT_CLIP_MAX_VERTICES (3 + SOFT_CLIP_PLANES)
+
+#define SOFT_TEXTURE_CACHE_SIZE 32
+#define SOFT_TEXTURE_MAX_SIZE 4096
+
+/* Largest range of elements transformed for one indexed draw */
+#define SOFT_MAX_ELEMENT_RANGE (1 << 20)
+
+typedef struct SoftClipVertex {
+    float pos[4];
+    SoftVec4 varyings[SOFT_NUM_VARYINGS];
+} SoftClipVertex;
+
+/* Level 0 of a texture, decoded to A8R8G8B8 */
+typedef struct SoftTexture {
+    QTAILQ_ENTRY(SoftTexture) entry;
+    hwaddr addr, palette_addr;
+    size_t length, palette_length;
+    unsigned int color_format;
+    unsigned int width, height, pitch;
+    /* guest memory changed since it was decoded */
+    bool dirty;
+    uint32_t *data;
+} SoftTexture;
+
+typedef struct SoftSampler {
+    const SoftTexture *texture; /* NULL when the stage is disabled */
+    bool rect;
+    bool linear;
+    unsigned int addru, addrv;
+    float border[4];
+} SoftSampler;
+
+/* A swizzled surface is drawn to a linear copy, then swizzled back */
+typedef struct SoftSwizzledSurface {
+    uint8_t *guest; /* NULL when the surface is not swizzled */
+    uint8_t *linear;
+    size_t linear_size;
+    unsigned int width, height, pitch, bytes_per_pixel;
+} SoftSwizzledSurface;
+
+typedef struct SoftRenderer {
+    SoftRaster raster;
+
+    /* color and zeta */
+    SoftSwizzledSurface swizzled[2];
+
+    SoftClipVertex *vertices;
+    unsigned int vertices_size;
+
+    /* the current vertex program, NULL for fixed function */
+    const VshProgram *program;
+    float (*program_outputs)[VSH_OUTPUTS][4];
+    unsigned int program_outputs_size;
+
+    /* decoded textures, most recently used first */
+    QTAILQ_HEAD(SoftTextureHead, SoftTexture) textures;
+    unsigned int num_textures;
+    SoftSampler samplers[NV2A_MAX_TEXTURES];
+
+    PshState psh_state;
+    PshProgram *psh_program;
+    bool psh_valid;
+    PshEnvironment psh_env;
+
+    float composite[4][4];
+    float texture_matrix[NV2A_MAX_TEXTURES][4][4];
+
+    /* fixed function vertex state, loaded for each draw */
+    float modelview[4][4][4];
+    float inv_modelview[4][4][4];
+    unsigned int skin_count;
+    bool skin_mix;
+    bool normalize;
+    bool lighting;
+    unsigned int light[NV2A_MAX_LIGHTS];
+    unsigned int texgen[NV2A_MAX_TEXTURES][4];
+    float texgen_plane[NV2A_MAX_TEXTURES][4][4];
+    bool fog;
+    unsigned int fog_mode, foggen;
+    float fog_param[2];
+    float fog_plane[4];
+    /* something needs the vertex in eye space */
+    bool eye_space;
+    float zbias, zfactor;
+    bool poffset;
+
+    uint64_t draws;
+    uint64_t draws_skipped;
+    const char *skip_reason;
+    uint64_t clears;
+    uint64_t clears_skipped;
+    uint64_t vertices_transformed;
+    uint64_t triangles_clipped;
+    uint64_t texture_decodes;
+} SoftRenderer;
+
+static float soft_reg_float(uint32_t v)
+{
+    float f;
+    memcpy(&f, &v, sizeof(f));
+    return f;
+}
+
+static void soft_unpack_argb(uint32_t c, float out[4])
+{
+    out[0] = ((c >> 16) & 0xFF) / 255.0f;
+    out[1] = ((c >> 8) & 0xFF) / 255.0f;
+    out[2] = (c & 0xFF) / 255.0f;
+    out[3] = (c >> 24) / 255.0f;
+}
+
+static void soft_load_matrix(PGRAPHState *pg, unsigned int slot,
+                             float m[4][4])
+{
+    int i, j;
+
+    /* row i gives the i-th component, like v * mat4(c[slot], ...) */
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < 4; j++) {
+            m[i][j] = soft_reg_float(pg->vsh_constants[slot + i][j]);
+        }
+    }
+}
+
+static void soft_transform_vec4(const float m[4][4], const float in[4],
+                                float out[4])
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        out[i] = in[0] * m[i][0] + in[1] * m[i][1]
+                 + in[2] * m[i][2] + in[3] * m[i][3];
+    }
+}
+
+/* Texture cache */
+
+static bool soft_texture_test_dirty(NV2AState *d, SoftRenderer *s,
+                                    hwaddr addr, size_t length)
+{
+    hwaddr start = addr & TARGET_PAGE_MASK;
+    hwaddr end = TARGET_PAGE_ALIGN(addr + length);
+    SoftTexture *t;
+
+    if (length == 0 || !memory_region_test_and_clear_dirty(
+                            d->vram, start, end - start,
+                            DIRTY_MEMORY_NV2A_TEX)) {
+        return false;
+    }
+
+    /* the dirty bits are gone, tell every other user of the pages */
+    QTAILQ_FOREACH(t, &s->textures, entry) {
+        if ((t->addr < end && t->addr + t->length > start)
+            || (t->palette_addr < end
+                && t->palette_addr + t->palette_length > start)) {
+            t->dirty = true;
+        }
+    }
+    return true;
+}
+
+static uint32_t soft_decode_texel(unsigned int color_format,
+                                  const uint8_t *row, unsigned int x,
+                                  const uint8_t *palette,
+                                  unsigned int palette_length)
+{
+    uint32_t v;
+    uint8_t r, g, b;
+
+    switch (color_format) {
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_Y8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_Y8:
+        v = row[x];
+        return 0xFF000000 | (v << 16) | (v << 8) | v;
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_AY8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_AY8:
+        v = row[x];
+        return (v << 24) | (v << 16) | (v << 8) | v;
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A8:
+        return ((uint32_t)row[x] << 24) | 0x00FFFFFF;
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8Y8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A8Y8:
+        v = row[x * 2];
+        return ((uint32_t)row[x * 2 + 1] << 24) | (v << 16) | (v << 8) | v;
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A1R5G5B5:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A1R5G5B5:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_X1R5G5B5:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_X1R5G5B5: {
+        v = lduw_le_p(row + x * 2);
+        bool alpha = (color_format == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A1R5G5B5
+            || color_format == NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A1R5G5B5)
+            ? (v & 0x8000) : true;
+        r = ((v >> 10) & 0x1F) * 255 / 31;
+        g = ((v >> 5) & 0x1F) * 255 / 31;
+        b = (v & 0x1F) * 255 / 31;
+        return (alpha ? 0xFF000000 : 0) | (r << 16) | (g << 8) | b;
+    }
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A4R4G4B4:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A4R4G4B4:
+        v = lduw_le_p(row + x * 2);
+        return ((v >> 12) * 0x11u << 24) | (((v >> 8) & 0xF) * 0x11u << 16)
+               | (((v >> 4) & 0xF) * 0x11u << 8) | ((v & 0xF) * 0x11u);
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R5G6B5:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_R5G6B5:
+        v = lduw_le_p(row + x * 2);
+        r = ((v >> 11) & 0x1F) * 255 / 31;
+        g = ((v >> 5) & 0x3F) * 255 / 63;
+        b = (v & 0x1F) * 255 / 31;
+        return 0xFF000000 | (r << 16) | (g << 8) | b;
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8R8G8B8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A8R8G8B8:
+        return ldl_le_p(row + x * 4);
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_X8R8G8B8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_X8R8G8B8:
+        return ldl_le_p(row + x * 4) | 0xFF000000;
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8B8G8R8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A8B8G8R8:
+        v = ldl_le_p(row + x * 4);
+        return (v & 0xFF00FF00) | ((v >> 16) & 0xFF) | ((v & 0xFF) << 16);
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R8G8B8A8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_R8G8B8A8:
+        v = ldl_le_p(row + x * 4);
+        return (v >> 8) | (v << 24);
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_B8G8R8A8:
+        return bswap32(ldl_le_p(row + x * 4));
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8:
+        if (row[x] >= palette_length) {
+            return 0;
+        }
+        return ldl_le_p(palette + row[x] * 4);
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_CR8YB8CB8YA8:
+        convert_yuy2_to_rgb(row, x, &r, &g, &b);
+        return 0xFF000000 | (r << 16) | (g << 8) | b;
+    default:
+        assert(false);
+        return 0;
+    }
+}
+
+static bool soft_texture_format_supported(unsigned int color_format)
+{
+    switch (color_format) {
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_Y8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_Y8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_AY8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_AY8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8Y8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A8Y8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A1R5G5B5:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A1R5G5B5:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_X1R5G5B5:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_X1R5G5B5:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A4R4G4B4:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A4R4G4B4:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R5G6B5:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_R5G6B5:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8R8G8B8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A8R8G8B8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_X8R8G8B8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_X8R8G8B8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8B8G8R8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A8B8G8R8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R8G8B8A8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_R8G8B8A8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_B8G8R8A8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_CR8YB8CB8YA8:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void soft_texture_decode(NV2AState *d, SoftTexture *t)
+{
+    const ColorFormatInfo *f = &kelvin_color_format_map[t->color_format];
+    const uint8_t *data = d->vram_ptr + t->addr;
+    const uint8_t *palette = d->vram_ptr + t->palette_addr;
+    uint8_t *unswizzled = NULL;
+    unsigned int pitch = t->pitch;
+    unsigned int x, y;
+
+    if (!f->linear) {
+        pitch = t->width * f->bytes_per_pixel;
+        unswizzled = g_malloc(t->height * pitch);
+        unswizzle_rect(data, t->width, t->height, unswizzled, pitch,
+                       f->bytes_per_pixel);
+        data = unswizzled;
+    }
+
+    for (y = 0; y < t->height; y++) {
+        const uint8_t *row = data + y * pitch;
+        uint32_t *out = t->data + y * t->width;
+        for (x = 0; x < t->width; x++) {
+            out[x] = soft_decode_texel(t->color_format, row, x, palette,
+                                       t->palette_length / 4);
+        }
+    }
+
+    g_free(unswizzled);
+}
+
+/* Looks up level 0 of a texture stage, decoding it if it changed */
+static const char *soft_bind_texture(NV2AState *d, SoftRenderer *s,
+                                     unsigned int stage)
+{
+    PGRAPHState *pg = &d->pgraph;
+    SoftSampler *sampler = &s->samplers[stage];
+
+    uint32_t ctl_0 = pg->regs[NV_PGRAPH_TEXCTL0_0 + stage * 4];
+    uint32_t ctl_1 = pg->regs[NV_PGRAPH_TEXCTL1_0 + stage * 4];
+    uint32_t fmt = pg->regs[NV_PGRAPH_TEXFMT0 + stage * 4];
+    uint32_t filter = pg->regs[NV_PGRAPH_TEXFILTER0 + stage * 4];
+    uint32_t address = pg->regs[NV_PGRAPH_TEXADDRESS0 + stage * 4];
+    uint32_t palette = pg->regs[NV_PGRAPH_TEXPALETTE0 + stage * 4];
+    uint32_t rect = pg->regs[NV_PGRAPH_TEXIMAGERECT0 + stage * 4];
+
+    sampler->texture = NULL;
+    if (!GET_MASK(ctl_0, NV_PGRAPH_TEXCTL0_0_ENABLE)) {
+        return NULL;
+    }
+
+    unsigned int color_format = GET_MASK(fmt, NV_PGRAPH_TEXFMT0_COLOR);
+    if (color_format >= ARRAY_SIZE(kelvin_color_format_map)
+        || !soft_texture_format_supported(color_format)) {
+        return "texture format";
+    }
+    if (GET_MASK(fmt, NV_PGRAPH_TEXFMT0_CUBEMAPENABLE)
+        || GET_MASK(fmt, NV_PGRAPH_TEXFMT0_DIMENSIONALITY) != 2) {
+        return "texture dimensionality";
+    }
+    if (filter & (NV_PGRAPH_TEXFILTER0_ASIGNED | NV_PGRAPH_TEXFILTER0_RSIGNED
+                  | NV_PGRAPH_TEXFILTER0_GSIGNED
+                  | NV_PGRAPH_TEXFILTER0_BSIGNED)) {
+        return "signed texture";
+    }
+
+    const ColorFormatInfo *f = &kelvin_color_format_map[color_format];
+    unsigned int width, height, pitch;
+    size_t length;
+    if (f->linear) {
+        width = GET_MASK(rect, NV_PGRAPH_TEXIMAGERECT0_WIDTH);
+        height = GET_MASK(rect, NV_PGRAPH_TEXIMAGERECT0_HEIGHT);
+        pitch = GET_MASK(ctl_1, NV_PGRAPH_TEXCTL1_0_IMAGE_PITCH);
+        if (pitch < width * f->bytes_per_pixel) {
+            return "texture pitch";
+        }
+        length = (size_t)height * pitch;
+    } else {
+        width = 1 << GET_MASK(fmt, NV_PGRAPH_TEXFMT0_BASE_SIZE_U);
+        height = 1 << GET_MASK(fmt, NV_PGRAPH_TEXFMT0_BASE_SIZE_V);
+        pitch = width * f->bytes_per_pixel;
+        length = (size_t)height * pitch;
+    }
+    if (width == 0 || height == 0
+        || width > SOFT_TEXTURE_MAX_SIZE || height > SOFT_TEXTURE_MAX_SIZE) {
+        return "texture size";
+    }
+
+    hwaddr dma_len;
+    uint8_t *texture_data = nv_dma_map(d,
+        GET_MASK(fmt, NV_PGRAPH_TEXFMT0_CONTEXT_DMA) ? pg->dma_b : pg->dma_a,
+        &dma_len);
+    hwaddr offset = pg->regs[NV_PGRAPH_TEXOFFSET0 + stage * 4];
+    hwaddr addr = texture_data - d->vram_ptr + offset;
+
+    hwaddr palette_addr = 0;
+    size_t palette_length = 0;
+    if (color_format == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8) {
+        hwaddr palette_dma_len;
+        uint8_t *palette_data = nv_dma_map(d,
+            GET_MASK(palette, NV_PGRAPH_TEXPALETTE0_CONTEXT_DMA)
+                ? pg->dma_b : pg->dma_a,
+            &palette_dma_len);
+        palette_addr = palette_data - d->vram_ptr
+                       + (palette & NV_PGRAPH_TEXPALETTE0_OFFSET);
+        palette_length = (256 >> GET_MASK(palette,
+                                          NV_PGRAPH_TEXPALETTE0_LENGTH)) * 4;
+    }
+
+    hwaddr vram_size = memory_region_size(d->vram);
+    if (offset + length > dma_len + 1 || addr + length > vram_size
+        || palette_addr + palette_length > vram_size) {
+        return "texture out of bounds";
+    }
+
+    /* dirty pages only show up once, so look at both ranges before
+     * deciding anything */
+    soft_texture_test_dirty(d, s, addr, length);
+    soft_texture_test_dirty(d, s, palette_addr, palette_length);
+
+    SoftTexture *t;
+    QTAILQ_FOREACH(t, &s->textures, entry) {
+        if (t->addr == addr && t->length == length
+            && t->palette_addr == palette_addr
+            && t->palette_length == palette_length
+            && t->color_format == color_format
+            && t->width == width && t->height == height
+            && t->pitch == pitch) {
+            break;
+        }
+    }
+
+    if (t) {
+        QTAILQ_REMOVE(&s->textures, t, entry);
+    } else {
+        if (s->num_textures == SOFT_TEXTURE_CACHE_SIZE) {
+            t = QTAILQ_LAST(&s->textures, SoftTextureHead);
+            QTAILQ_REMOVE(&s->textures, t, entry);
+            g_free(t->data);
+        } else {
+            t = g_new0(SoftTexture, 1);
+            s->num_textures++;
+        }
+        t->addr = addr;
+        t->length = length;
+        t->palette_addr = palette_addr;
+        t->palette_length = palette_length;
+        t->color_format = color_format;
+        t->width = width;
+        t->height = height;
+        t->pitch = pitch;
+        t->data = g_new(uint32_t, width * height);
+        t->dirty = true;
+    }
+    QTAILQ_INSERT_HEAD(&s->textures, t, entry);
+
+    if (t->dirty) {
+        soft_texture_decode(d, t);
+        t->dirty = false;
+        s->texture_decodes++;
+    }
+
+    unsigned int mag_filter = GET_MASK(filter, NV_PGRAPH_TEXFILTER0_MAG);
+    sampler->texture = t;
+    sampler->rect = f->linear;
+    sampler->linear = mag_filter != 1;
+    sampler->addru = GET_MASK(address, NV_PGRAPH_TEXADDRESS0_ADDRU);
+    sampler->addrv = GET_MASK(address, NV_PGRAPH_TEXADDRESS0_ADDRV);
+    soft_unpack_argb(pg->regs[NV_PGRAPH_BORDERCOLOR0 + stage * 4],
+                     sampler->border);
+    return NULL;
+}
+
+/* Texture sampling, called from the raster threads */
+
+static bool soft_address(unsigned int mode, int x, int size, int *out)
+{
+    switch (mode) {
+    case NV_PGRAPH_TEXADDRESS0_ADDRU_MIRROR:
+        x %= 2 * size;
+        if (x < 0) {
+            x += 2 * size;
+        }
+        *out = (x < size) ? x : 2 * size - 1 - x;
+        return true;
+    case NV_PGRAPH_TEXADDRESS0_ADDRU_CLAMP_TO_EDGE:
+    case NV_PGRAPH_TEXADDRESS0_ADDRU_CLAMP_OGL:
+        *out = MIN(MAX(x, 0), size - 1);
+        return true;
+    case NV_PGRAPH_TEXADDRESS0_ADDRU_BORDER:
+        *out = x;
+        return x >= 0 && x < size;
+    case NV_PGRAPH_TEXADDRESS0_ADDRU_WRAP:
+    default:
+        x %= size;
+        *out = (x < 0) ? x + size : x;
+        return true;
+    }
+}
+
+static void soft_texel(const SoftSampler *sampler, int x, int y,
+                       float color[4])
+{
+    const SoftTexture *t = sampler->texture;
+
+    if (!soft_address(sampler->addru, x, t->width, &x)
+        || !soft_address(sampler->addrv, y, t->height, &y)) {
+        memcpy(color, sampler->border, sizeof(sampler->border));
+        return;
+    }
+    soft_unpack_argb(t->data[y * t->width + x], color);
+}
+
+static float soft_texcoord(float c)
+{
+    /* keeps the conversion to int defined, NaNs end up at 0 */
+    if (!(c > -1048576.0f)) {
+        return (c < 0.0f) ? -1048576.0f : 0.0f;
+    }
+    return MIN(c, 1048576.0f);
+}
+
+static void soft_sample(const void *opaque, int stage, float s, float t,
+                        float color[4])
+{
+    const SoftRenderer *r = opaque;
+    const SoftSampler *sampler = &r->samplers[stage];
+    const SoftTexture *tex = sampler->texture;
+    int i;
+
+    if (!tex) {
+        color[0] = color[1] = color[2] = 0.0f;
+        color[3] = 1.0f;
+        return;
+    }
+
+    float u = soft_texcoord(sampler->rect ? s : s * tex->width);
+    float v = soft_texcoord(sampler->rect ? t : t * tex->height);
+
+    if (!sampler->linear) {
+        soft_texel(sampler, (int)floorf(u), (int)floorf(v), color);
+        return;
+    }
+
+    u -= 0.5f;
+    v -= 0.5f;
+    float fu = floorf(u), fv = floorf(v);
+    float a = u - fu, b = v - fv;
+    int x = (int)fu, y = (int)fv;
+    float c00[4], c10[4], c01[4], c11[4];
+    soft_texel(sampler, x, y, c00);
+    soft_texel(sampler, x + 1, y, c10);
+    soft_texel(sampler, x, y + 1, c01);
+    soft_texel(sampler, x + 1, y + 1, c11);
+    for (i = 0; i < 4; i++) {
+        float top = c00[i] + (c10[i] - c00[i]) * a;
+        float bottom = c01[i] + (c11[i] - c01[i]) * a;
+        color[i] = top + (bottom - top) * b;
+    }
+}
+
+static bool soft_shade(const void *opaque, const SoftVec4 *varyings,
+                       SoftVec4 *color)
+{
+    const SoftRenderer *s = opaque;
+    PshFragment fragment;
+    float out[4];
+    int i, j;
+
+    for (j = 0; j < 4; j++) {
+        fragment.v0[j] = varyings[SOFT_VARYING_D0][j];
+        fragment.v1[j] = varyings[SOFT_VARYING_D1][j];
+        for (i = 0; i < NV2A_MAX_TEXTURES; i++) {
+            fragment.texcoord[i][j] = varyings[SOFT_VARYING_T0 + i][j];
+        }
+    }
+    fragment.fog = varyings[SOFT_VARYING_FOG][0];
+
+    if (!psh_program_run(s->psh_program, &s->psh_env, &fragment, out)) {
+        return false;
+    }
+    for (j = 0; j < 4; j++) {
+        (*color)[j] = out[j];
+    }
+    return true;
+}
+
+/* State checks and setup */
+
+static const char *soft_check_state(PGRAPHState *pg)
+{
+    uint32_t csv0_c = pg->regs[NV_PGRAPH_CSV0_C];
+    uint32_t csv0_d = pg->regs[NV_PGRAPH_CSV0_D];
+    uint32_t setup = pg->regs[NV_PGRAPH_SETUPRASTER];
+    int i;
+
+    bool fog = pg->regs[NV_PGRAPH_CONTROL_3] & NV_PGRAPH_CONTROL_3_FOGENABLE;
+    if (fog) {
+        switch (GET_MASK(pg->regs[NV_PGRAPH_CONTROL_3],
+                         NV_PGRAPH_CONTROL_3_FOG_MODE)) {
+        case NV_PGRAPH_CONTROL_3_FOG_MODE_LINEAR:
+        case NV_PGRAPH_CONTROL_3_FOG_MODE_EXP:
+        case NV_PGRAPH_CONTROL_3_FOG_MODE_EXP2:
+        case NV_PGRAPH_CONTROL_3_FOG_MODE_LINEAR_ABS:
+        case NV_PGRAPH_CONTROL_3_FOG_MODE_EXP_ABS:
+        case NV_PGRAPH_CONTROL_3_FOG_MODE_EXP2_ABS:
+            break;
+        default:
+            return "fog mode";
+        }
+    }
+
+    if (GET_MASK(csv0_d, NV_PGRAPH_CSV0_D_MODE) == 2) {
+        /* programs that decode are run on the CPU */
+        if (!pgraph_get_vsh_program(pg)->program) {
+            return "vertex program";
+        }
+        return NULL;
+    } else if (GET_MASK(csv0_d, NV_PGRAPH_CSV0_D_MODE) != 0) {
+        return "vertex program";
+    }
+    if (fog && GET_MASK(csv0_d, NV_PGRAPH_CSV0_D_FOGGENMODE)
+                   > NV_PGRAPH_CSV0_D_FOGGENMODE_FOG_X) {
+        return "fog mode";
+    }
+    if (GET_MASK(csv0_d, NV_PGRAPH_CSV0_D_SKIN) > SKINNING_4WEIGHTS4MATRICES) {
+        return "skinning";
+    }
+    if (GET_MASK(csv0_c, NV_PGRAPH_CSV0_C_LIGHTING)) {
+        for (i = 0; i < NV2A_MAX_LIGHTS; i++) {
+            if (GET_MASK(csv0_d, NV_PGRAPH_CSV0_D_LIGHT0 << (i * 2))
+                    == NV_PGRAPH_CSV0_D_LIGHT0_SPOT) {
+                return "spot light";
+            }
+        }
+    }
+    if (pg->regs[NV_PGRAPH_CONTROL_0]
+            & NV_PGRAPH_CONTROL_0_Z_PERSPECTIVE_ENABLE) {
+        return "w-buffer";
+    }
+    if (pg->regs[NV_PGRAPH_CONTROL_1]
+            & NV_PGRAPH_CONTROL_1_STENCIL_TEST_ENABLE) {
+        uint32_t control_2 = pg->regs[NV_PGRAPH_CONTROL_2];
+        uint32_t ops[] = {
+            GET_MASK(control_2, NV_PGRAPH_CONTROL_2_STENCIL_OP_FAIL),
+            GET_MASK(control_2, NV_PGRAPH_CONTROL_2_STENCIL_OP_ZFAIL),
+            GET_MASK(control_2, NV_PGRAPH_CONTROL_2_STENCIL_OP_ZPASS),
+        };
+        for (i = 0; i < ARRAY_SIZE(ops); i++) {
+            if (ops[i] < NV_PGRAPH_CONTROL_2_STENCIL_OP_V_KEEP
+                || ops[i] > NV_PGRAPH_CONTROL_2_STENCIL_OP_V_DECR) {
+                return "stencil op";
+            }
+        }
+        if (GET_MASK(pg->regs[NV_PGRAPH_CONTROL_1],
+                     NV_PGRAPH_CONTROL_1_STENCIL_FUNC)
+                > NV_PGRAPH_CONTROL_1_STENCIL_FUNC_ALWAYS) {
+            return "stencil function";
+        }
+    }
+    if (pg->regs[NV_PGRAPH_BLEND] & NV_PGRAPH_BLEND_LOGICOP_ENABLE) {
+        return "logic op";
+    }
+    if (pg->primitive_mode == NV097_SET_BEGIN_END_OP_END) {
+        return "primitive mode";
+    }
+    if (pg->primitive_mode >= NV097_SET_BEGIN_END_OP_TRIANGLES
+        && (GET_MASK(setup, NV_PGRAPH_SETUPRASTER_FRONTFACEMODE)
+                != POLY_MODE_FILL
+            || GET_MASK(setup, NV_PGRAPH_SETUPRASTER_BACKFACEMODE)
+                   != POLY_MODE_FILL)) {
+        return "polygon mode";
+    }
+    if (pg->surface_shape.anti_aliasing) {
+        return "anti-aliasing";
+    }
+    if (pg->surface_shape.z_format) {
+        return "float depth";
+    }
+    for (i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        const VertexAttribute *attribute = &pg->vertex_attributes[i];
+        if (attribute->count
+            && attribute->format == NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_CMP
+            && attribute->count != 1) {
+            return "vertex format";
+        }
+    }
+    return NULL;
+}
+
+static uint8_t *soft_unswizzle_surface(SoftSwizzledSurface *surface,
+                                       uint8_t *guest, unsigned int width,
+                                       unsigned int height, unsigned int pitch,
+                                       unsigned int bytes_per_pixel)
+{
+    size_t size = (size_t)pitch * height;
+
+    if (size > surface->linear_size) {
+        g_free(surface->linear);
+        surface->linear = g_malloc(size);
+        surface->linear_size = size;
+    }
+    surface->guest = guest;
+    surface->width = width;
+    surface->height = height;
+    surface->pitch = pitch;
+    surface->bytes_per_pixel = bytes_per_pixel;
+    unswizzle_rect(guest, width, height, surface->linear, pitch,
+                   bytes_per_pixel);
+    return surface->linear;
+}
+
+static const char *soft_get_target(NV2AState *d, SoftTarget *target,
+                                   bool color, bool zeta)
+{
+    PGRAPHState *pg = &d->pgraph;
+    SoftRenderer *s = pg->renderer_opaque;
+    SurfaceShape *shape = &pg->surface_shape;
+    hwaddr vram_size = memory_region_size(d->vram);
+    bool swizzle = pg->surface_type == NV097_SET_SURFACE_FORMAT_TYPE_SWIZZLE;
+
+    memset(target, 0, sizeof(*target));
+    target->clip_x = shape->clip_x;
+    target->clip_y = shape->clip_y;
+    target->clip_width = shape->clip_width;
+    target->clip_height = shape->clip_height;
+    s->swizzled[0].guest = NULL;
+    s->swizzled[1].guest = NULL;
+
+    unsigned int rows = shape->clip_y + shape->clip_height;
+    unsigned int columns = shape->clip_x + shape->clip_width;
+    if (swizzle) {
+        /* the whole surface is unswizzled, only what lies in it is drawn */
+        unsigned int width = 1 << shape->log_width;
+        unsigned int height = 1 << shape->log_height;
+        target->clip_width = (shape->clip_x < width)
+            ? MIN(shape->clip_width, width - shape->clip_x) : 0;
+        target->clip_height = (shape->clip_y < height)
+            ? MIN(shape->clip_height, height - shape->clip_y) : 0;
+        rows = height;
+        columns = width;
+    }
+
+    if (color && shape->color_format) {
+        unsigned int bytes_per_pixel;
+        switch (shape->color_format) {
+        case NV097_SET_SURFACE_FORMAT_COLOR_LE_R5G6B5:
+            target->color_format = SOFT_COLOR_R5G6B5;
+            bytes_per_pixel = 2;
+            break;
+        case NV097_SET_SURFACE_FORMAT_COLOR_LE_X8R8G8B8_Z8R8G8B8:
+            target->color_format = SOFT_COLOR_Z8R8G8B8;
+            bytes_per_pixel = 4;
+            break;
+        case NV097_SET_SURFACE_FORMAT_COLOR_LE_X8R8G8B8_O8R8G8B8:
+            target->color_format = SOFT_COLOR_O8R8G8B8;
+            bytes_per_pixel = 4;
+            break;
+        case NV097_SET_SURFACE_FORMAT_COLOR_LE_A8R8G8B8:
+            target->color_format = SOFT_COLOR_A8R8G8B8;
+            bytes_per_pixel = 4;
+            break;
+        default:
+            return "color surface format";
+        }
+
+        DMAObject dma = nv_dma_load(d, pg->dma_color);
+        hwaddr dma_len;
+        uint8_t *data = nv_dma_map(d, pg->dma_color, &dma_len);
+        hwaddr length = (hwaddr)pg->surface_color.pitch * rows;
+        if (dma.dma_class != NV_DMA_IN_MEMORY_CLASS
+            || pg->surface_color.pitch < columns * bytes_per_pixel
+            || pg->surface_color.offset + length > dma_len + 1
+            || data - d->vram_ptr + pg->surface_color.offset + length
+                   > vram_size) {
+            return "color surface out of bounds";
+        }
+        target->color = data + pg->surface_color.offset;
+        target->color_pitch = pg->surface_color.pitch;
+        if (swizzle) {
+            target->color = soft_unswizzle_surface(&s->swizzled[0],
+                                                   target->color, columns,
+                                                   rows, target->color_pitch,
+                                                   bytes_per_pixel);
+        }
+    }
+
+    if (zeta && shape->zeta_format) {
+        unsigned int bytes_per_pixel;
+        switch (shape->zeta_format) {
+        case NV097_SET_SURFACE_FORMAT_ZETA_Z16:
+            target->zeta_format = SOFT_ZETA_Z16;
+            bytes_per_pixel = 2;
+            break;
+        case NV097_SET_SURFACE_FORMAT_ZETA_Z24S8:
+            target->zeta_format = SOFT_ZETA_Z24S8;
+            bytes_per_pixel = 4;
+            break;
+        default:
+            return "zeta surface format";
+        }
+
+        DMAObject dma = nv_dma_load(d, pg->dma_zeta);
+        hwaddr dma_len;
+        uint8_t *data = nv_dma_map(d, pg->dma_zeta, &dma_len);
+        hwaddr length = (hwaddr)pg->surface_zeta.pitch * rows;
+        if (dma.dma_class != NV_DMA_IN_MEMORY_CLASS
+            || pg->surface_zeta.pitch < columns * bytes_per_pixel
+            || pg->surface_zeta.offset + length > dma_len + 1
+            || data - d->vram_ptr + pg->surface_zeta.offset + length
+                   > vram_size) {
+            return "zeta surface out of bounds";
+        }
+        target->zeta = data + pg->surface_zeta.offset;
+        target->zeta_pitch = pg->surface_zeta.pitch;
+        if (swizzle) {
+            target->zeta = soft_unswizzle_surface(&s->swizzled[1],
+                                                  target->zeta, columns,
+                                                  rows, target->zeta_pitch,
+                                                  bytes_per_pixel);
+        }
+    }
+
+    return NULL;
+}
+
+/* Narrows the target to the window clip, only a single inclusive region
+ * can be done this way */
+static const char *soft_apply_window_clip(PGRAPHState *pg,
+                                          SoftTarget *target)
+{
+    bool found = false;
+    uint32_t clip_x = 0, clip_y = 0;
+    int i;
+
+    if (pg->regs[NV_PGRAPH_SETUPRASTER]
+            & NV_PGRAPH_SETUPRASTER_WINDOWCLIPTYPE) {
+        return "exclusive window clip";
+    }
+
+    for (i = 0; i < 8; i++) {
+        uint32_t x = pg->regs[NV_PGRAPH_WINDOWCLIPX0 + i * 4];
+        uint32_t y = pg->regs[NV_PGRAPH_WINDOWCLIPY0 + i * 4];
+
+        /* same rules for skipping regions as pgraph_get_psh_state */
+        if (GET_MASK(x, NV_PGRAPH_WINDOWCLIPX0_XMIN)
+                == GET_MASK(x, NV_PGRAPH_WINDOWCLIPX0_XMAX)
+            || GET_MASK(y, NV_PGRAPH_WINDOWCLIPY0_YMIN)
+                == GET_MASK(y, NV_PGRAPH_WINDOWCLIPY0_YMAX)) {
+            continue;
+        }
+        if (found && (x != clip_x || y != clip_y)) {
+            return "window clip regions";
+        }
+        found = true;
+        clip_x = x;
+        clip_y = y;
+    }
+    if (!found) {
+        return NULL;
+    }
+
+    unsigned int x0 = MAX(target->clip_x,
+                          GET_MASK(clip_x, NV_PGRAPH_WINDOWCLIPX0_XMIN));
+    unsigned int x1 = MIN(target->clip_x + target->clip_width,
+                          GET_MASK(clip_x, NV_PGRAPH_WINDOWCLIPX0_XMAX) + 1);
+    unsigned int y0 = MAX(target->clip_y,
+                          GET_MASK(clip_y, NV_PGRAPH_WINDOWCLIPY0_YMIN));
+    unsigned int y1 = MIN(target->clip_y + target->clip_height,
+                          GET_MASK(clip_y, NV_PGRAPH_WINDOWCLIPY0_YMAX) + 1);
+    target->clip_x = x0;
+    target->clip_y = y0;
+    target->clip_width = (x1 > x0) ? x1 - x0 : 0;
+    target->clip_height = (y1 > y0) ? y1 - y0 : 0;
+    return NULL;
+}
+
+/* Returns false if every primitive is culled */
+static bool soft_get_raster_state(PGRAPHState *pg, SoftRasterState *state)
+{
+    uint32_t control_0 = pg->regs[NV_PGRAPH_CONTROL_0];
+    uint32_t control_1 = pg->regs[NV_PGRAPH_CONTROL_1];
+    uint32_t control_2 = pg->regs[NV_PGRAPH_CONTROL_2];
+    uint32_t setup = pg->regs[NV_PGRAPH_SETUPRASTER];
+    uint32_t blend = pg->regs[NV_PGRAPH_BLEND];
+
+    memset(state, 0, sizeof(*state));
+
+    /* points and lines are drawn as quads but never culled */
+    state->cull = SOFT_CULL_NONE;
+    if ((setup & NV_PGRAPH_SETUPRASTER_CULLENABLE)
+        && pg->primitive_mode >= NV097_SET_BEGIN_END_OP_TRIANGLES) {
+        /* window coordinates point down, GL ones up, so clockwise on
+         * screen is clockwise for GL as well */
+        bool front_ccw = setup & NV_PGRAPH_SETUPRASTER_FRONTFACE;
+        switch (GET_MASK(setup, NV_PGRAPH_SETUPRASTER_CULLCTRL)) {
+        case NV_PGRAPH_SETUPRASTER_CULLCTRL_FRONT:
+            state->cull = front_ccw ? SOFT_CULL_CCW : SOFT_CULL_CW;
+            break;
+        case NV_PGRAPH_SETUPRASTER_CULLCTRL_BACK:
+            state->cull = front_ccw ? SOFT_CULL_CW : SOFT_CULL_CCW;
+            break;
+        case NV_PGRAPH_SETUPRASTER_CULLCTRL_FRONT_AND_BACK:
+            return false;
+        default:
+            break;
+        }
+    }
+
+    /* like GL, depth is only written with the test enabled */
+    state->depth_test = control_0 & NV_PGRAPH_CONTROL_0_ZENABLE;
+    state->depth_write = state->depth_test
+                         && (control_0 & NV_PGRAPH_CONTROL_0_ZWRITEENABLE);
+    state->depth_func = GET_MASK(control_0, NV_PGRAPH_CONTROL_0_ZFUNC);
+    state->depth_min = soft_reg_float(pg->regs[NV_PGRAPH_ZCLIPMIN]);
+    state->depth_max = soft_reg_float(pg->regs[NV_PGRAPH_ZCLIPMAX]);
+
+    /* as with GL, the write mask applies but not STENCIL_WRITE_ENABLE */
+    state->stencil_test = control_1 & NV_PGRAPH_CONTROL_1_STENCIL_TEST_ENABLE;
+    if (state->stencil_test) {
+        state->stencil_func = GET_MASK(control_1,
+                                       NV_PGRAPH_CONTROL_1_STENCIL_FUNC);
+        state->stencil_ref = GET_MASK(control_1,
+                                      NV_PGRAPH_CONTROL_1_STENCIL_REF);
+        state->stencil_read_mask =
+            GET_MASK(control_1, NV_PGRAPH_CONTROL_1_STENCIL_MASK_READ);
+        state->stencil_write_mask =
+            GET_MASK(control_1, NV_PGRAPH_CONTROL_1_STENCIL_MASK_WRITE);
+        state->stencil_fail = GET_MASK(control_2,
+                                       NV_PGRAPH_CONTROL_2_STENCIL_OP_FAIL);
+        state->stencil_zfail = GET_MASK(control_2,
+                                        NV_PGRAPH_CONTROL_2_STENCIL_OP_ZFAIL);
+        state->stencil_zpass = GET_MASK(control_2,
+                                        NV_PGRAPH_CONTROL_2_STENCIL_OP_ZPASS);
+    }
+
+    state->color_mask =
+        ((control_0 & NV_PGRAPH_CONTROL_0_RED_WRITE_ENABLE)
+             ? SOFT_MASK_RED : 0)
+        | ((control_0 & NV_PGRAPH_CONTROL_0_GREEN_WRITE_ENABLE)
+             ? SOFT_MASK_GREEN : 0)
+        | ((control_0 & NV_PGRAPH_CONTROL_0_BLUE_WRITE_ENABLE)
+             ? SOFT_MASK_BLUE : 0)
+        | ((control_0 & NV_PGRAPH_CONTROL_0_ALPHA_WRITE_ENABLE)
+             ? SOFT_MASK_ALPHA : 0);
+
+    state->blend = blend & NV_PGRAPH_BLEND_EN;
+    if (state->blend) {
+        float blend_color[4];
+        state->blend_src = GET_MASK(blend, NV_PGRAPH_BLEND_SFACTOR);
+        state->blend_dst = GET_MASK(blend, NV_PGRAPH_BLEND_DFACTOR);
+        state->blend_equation = GET_MASK(blend, NV_PGRAPH_BLEND_EQN);
+        soft_unpack_argb(pg->regs[NV_PGRAPH_BLENDCOLOR], blend_color);
+        state->blend_color = (SoftVec4){ blend_color[0], blend_color[1],
+                                         blend_color[2], blend_color[3] };
+    }
+
+    state->num_varyings = SOFT_NUM_VARYINGS;
+    state->shade = soft_shade;
+    return true;
+}
+
+static const char *soft_check_blend(const SoftRasterState *state)
+{
+    if (!state->blend) {
+        return NULL;
+    }
+    if (state->blend_src == 11 || state->blend_src > 15
+        || state->blend_dst == 11 || state->blend_dst > 15
+        || state->blend_equation >= ARRAY_SIZE(pgraph_blend_equation_map)) {
+        return "blend function";
+    }
+    return NULL;
+}
+
+static const char *soft_setup_shading(NV2AState *d, SoftRenderer *s)
+{
+    PGRAPHState *pg = &d->pgraph;
+    PshState psh;
+    const char *reason;
+    int i;
+
+    pgraph_get_psh_state(pg, &psh);
+    if (!s->psh_valid || memcmp(&psh, &s->psh_state, sizeof(psh))) {
+        if (s->psh_program) {
+            psh_program_free(s->psh_program);
+        }
+        s->psh_program = psh_program_new(&psh);
+        s->psh_state = psh;
+        s->psh_valid = true;
+    }
+    if (!s->psh_program) {
+        return "texture mode";
+    }
+
+    PshEnvironment *env = &s->psh_env;
+    for (i = 0; i < 9; i++) {
+        uint32_t c0 = (i == 8) ? pg->regs[NV_PGRAPH_SPECFOGFACTOR0]
+                               : pg->regs[NV_PGRAPH_COMBINEFACTOR0 + i * 4];
+        uint32_t c1 = (i == 8) ? pg->regs[NV_PGRAPH_SPECFOGFACTOR1]
+                               : pg->regs[NV_PGRAPH_COMBINEFACTOR1 + i * 4];
+        soft_unpack_argb(c0, env->c0[i]);
+        soft_unpack_argb(c1, env->c1[i]);
+    }
+    float fog_color[4];
+    soft_unpack_argb(pg->regs[NV_PGRAPH_FOGCOLOR], fog_color);
+    memcpy(env->fog_color, fog_color, sizeof(env->fog_color));
+    env->alpha_ref = GET_MASK(pg->regs[NV_PGRAPH_CONTROL_0],
+                              NV_PGRAPH_CONTROL_0_ALPHAREF) / 255.0f;
+
+    for (i = 0; i < NV2A_MAX_TEXTURES; i++) {
+        reason = soft_bind_texture(d, s, i);
+        if (reason) {
+            return reason;
+        }
+    }
+    return NULL;
+}
+
+/* Vertices */
+
+static void soft_load_vertex_state(PGRAPHState *pg, SoftRenderer *s)
+{
+    static const unsigned int texture_slots[] = {
+        NV_IGRAPH_XF_XFCTX_T0MAT, NV_IGRAPH_XF_XFCTX_T1MAT,
+        NV_IGRAPH_XF_XFCTX_T2MAT, NV_IGRAPH_XF_XFCTX_T3MAT,
+    };
+    static const unsigned int texgen_slots[] = {
+        NV_IGRAPH_XF_XFCTX_TG0MAT, NV_IGRAPH_XF_XFCTX_TG1MAT,
+        NV_IGRAPH_XF_XFCTX_TG2MAT, NV_IGRAPH_XF_XFCTX_TG3MAT,
+    };
+    static const unsigned int modelview_slots[] = {
+        NV_IGRAPH_XF_XFCTX_MMAT0, NV_IGRAPH_XF_XFCTX_MMAT1,
+        NV_IGRAPH_XF_XFCTX_MMAT2, NV_IGRAPH_XF_XFCTX_MMAT3,
+    };
+    static const unsigned int inv_modelview_slots[] = {
+        NV_IGRAPH_XF_XFCTX_IMMAT0, NV_IGRAPH_XF_XFCTX_IMMAT1,
+        NV_IGRAPH_XF_XFCTX_IMMAT2, NV_IGRAPH_XF_XFCTX_IMMAT3,
+    };
+    uint32_t csv0_c = pg->regs[NV_PGRAPH_CSV0_C];
+    uint32_t csv0_d = pg->regs[NV_PGRAPH_CSV0_D];
+    int i, j;
+
+    soft_load_matrix(pg, NV_IGRAPH_XF_XFCTX_CMAT0, s->composite);
+    for (i = 0; i < 4; i++) {
+        soft_load_matrix(pg, modelview_slots[i], s->modelview[i]);
+        soft_load_matrix(pg, inv_modelview_slots[i], s->inv_modelview[i]);
+    }
+
+    switch (GET_MASK(csv0_d, NV_PGRAPH_CSV0_D_SKIN)) {
+    case SKINNING_1WEIGHTS:
+        s->skin_mix = true; s->skin_count = 2; break;
+    case SKINNING_2WEIGHTS2MATRICES:
+        s->skin_mix = false; s->skin_count = 2; break;
+    case SKINNING_2WEIGHTS:
+        s->skin_mix = true; s->skin_count = 3; break;
+    case SKINNING_3WEIGHTS3MATRICES:
+        s->skin_mix = false; s->skin_count = 3; break;
+    case SKINNING_3WEIGHTS:
+        s->skin_mix = true; s->skin_count = 4; break;
+    case SKINNING_4WEIGHTS4MATRICES:
+        s->skin_mix = false; s->skin_count = 4; break;
+    default:
+        s->skin_mix = false; s->skin_count = 0; break;
+    }
+    s->normalize = csv0_c & NV_PGRAPH_CSV0_C_NORMALIZATION_ENABLE;
+
+    s->lighting = GET_MASK(csv0_c, NV_PGRAPH_CSV0_C_LIGHTING);
+    for (i = 0; i < NV2A_MAX_LIGHTS; i++) {
+        s->light[i] = s->lighting
+            ? GET_MASK(csv0_d, NV_PGRAPH_CSV0_D_LIGHT0 << (i * 2))
+            : NV_PGRAPH_CSV0_D_LIGHT0_OFF;
+    }
+
+    bool texgen = false;
+    for (i = 0; i < NV2A_MAX_TEXTURES; i++) {
+        unsigned int reg = (i < 2) ? NV_PGRAPH_CSV1_A : NV_PGRAPH_CSV1_B;
+        unsigned int masks[] = {
+            (i % 2) ? NV_PGRAPH_CSV1_A_T1_S : NV_PGRAPH_CSV1_A_T0_S,
+            (i % 2) ? NV_PGRAPH_CSV1_A_T1_T : NV_PGRAPH_CSV1_A_T0_T,
+            (i % 2) ? NV_PGRAPH_CSV1_A_T1_R : NV_PGRAPH_CSV1_A_T0_R,
+            (i % 2) ? NV_PGRAPH_CSV1_A_T1_Q : NV_PGRAPH_CSV1_A_T0_Q
+        };
+        for (j = 0; j < 4; j++) {
+            s->texgen[i][j] = GET_MASK(pg->regs[reg], masks[j]);
+            texgen |= s->texgen[i][j] != TEXGEN_DISABLE;
+        }
+        /* the planes are stored S, T, Q, R */
+        for (j = 0; j < 4; j++) {
+            static const unsigned int plane_rows[] = { 0, 1, 3, 2 };
+            unsigned int k;
+            for (k = 0; k < 4; k++) {
+                s->texgen_plane[i][j][k] = soft_reg_float(
+                    pg->vsh_constants[texgen_slots[i] + plane_rows[j]][k]);
+            }
+        }
+        soft_load_matrix(pg, texture_slots[i], s->texture_matrix[i]);
+    }
+
+    s->fog = pg->regs[NV_PGRAPH_CONTROL_3] & NV_PGRAPH_CONTROL_3_FOGENABLE;
+    s->fog_mode = GET_MASK(pg->regs[NV_PGRAPH_CONTROL_3],
+                           NV_PGRAPH_CONTROL_3_FOG_MODE);
+    s->foggen = GET_MASK(csv0_d, NV_PGRAPH_CSV0_D_FOGGENMODE);
+    s->fog_param[0] = soft_reg_float(pg->regs[NV_PGRAPH_FOGPARAM0]);
+    s->fog_param[1] = soft_reg_float(pg->regs[NV_PGRAPH_FOGPARAM1]);
+    for (i = 0; i < 4; i++) {
+        s->fog_plane[i] = soft_reg_float(
+            pg->vsh_constants[NV_IGRAPH_XF_XFCTX_FOG][i]);
+    }
+
+    s->eye_space = s->skin_count || s->lighting || s->fog || texgen;
+}
+
+static float soft_ltctx(const uint32_t (*bank)[4], unsigned int slot,
+                        unsigned int i)
+{
+    return soft_reg_float(bank[slot][i]);
+}
+
+static float soft_dot3(const float a[3], const float b[3])
+{
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static void soft_normalize3(float v[3])
+{
+    float length = sqrtf(soft_dot3(v, v));
+    int i;
+
+    if (length > 0.0f) {
+        for (i = 0; i < 3; i++) {
+            v[i] /= length;
+        }
+    }
+}
+
+/* Blends the position and normal through the modelview matrices, with the
+ * last weight making the sum one in the mixed modes */
+static void soft_skin_vertex(const SoftRenderer *s, const float position[4],
+                             const float normal[3], const float weight[4],
+                             float eye[4], float eye_normal[3])
+{
+    float n[4] = { normal[0], normal[1], normal[2], 0.0f };
+    float p[4], q[4];
+    unsigned int i, j;
+
+    if (!s->skin_count) {
+        soft_transform_vec4(s->modelview[0], position, eye);
+        soft_transform_vec4(s->inv_modelview[0], n, q);
+        memcpy(eye_normal, q, 3 * sizeof(float));
+        return;
+    }
+
+    float remaining = 1.0f;
+    memset(eye, 0, 4 * sizeof(float));
+    memset(eye_normal, 0, 3 * sizeof(float));
+    for (i = 0; i < s->skin_count; i++) {
+        float w = weight[i];
+        if (s->skin_mix) {
+            w = (i + 1 < s->skin_count) ? weight[i] : remaining;
+            remaining -= w;
+        }
+        soft_transform_vec4(s->modelview[i], position, p);
+        soft_transform_vec4(s->inv_modelview[i], n, q);
+        for (j = 0; j < 4; j++) {
+            eye[j] += p[j] * w;
+        }
+        for (j = 0; j < 3; j++) {
+            eye_normal[j] += q[j] * w;
+        }
+    }
+}
+
+/* The specular exponent is a placeholder, the same one the GL path uses */
+static void soft_light_vertex(const PGRAPHState *pg, const SoftRenderer *s,
+                              const float eye[4], const float normal[3],
+                              const float diffuse[4], const float specular[4],
+                              float d0[4], float d1[4])
+{
+    float eye_pos[3];
+    unsigned int i, j;
+
+    for (j = 0; j < 3; j++) {
+        d0[j] = soft_ltctx(pg->ltctxa, NV_IGRAPH_XF_LTCTXA_FR_AMB, j);
+        d1[j] = 0.0f;
+        eye_pos[j] = soft_reg_float(
+                         pg->vsh_constants[NV_IGRAPH_XF_XFCTX_EYEP][j])
+                     / soft_reg_float(
+                         pg->vsh_constants[NV_IGRAPH_XF_XFCTX_EYEP][3]);
+    }
+    d0[3] = diffuse[3];
+    d1[3] = specular[3];
+
+    for (i = 0; i < NV2A_MAX_LIGHTS; i++) {
+        float attenuation, n_dot_vp, n_dot_hv;
+
+        if (s->light[i] == NV_PGRAPH_CSV0_D_LIGHT0_INFINITE) {
+            float direction[3];
+            memcpy(direction, pg->light_infinite_direction[i],
+                   sizeof(direction));
+            soft_normalize3(direction);
+            attenuation = 1.0f;
+            n_dot_vp = MAX(soft_dot3(normal, direction), 0.0f);
+            n_dot_hv = MAX(soft_dot3(normal,
+                               pg->light_infinite_half_vector[i]), 0.0f);
+        } else if (s->light[i] == NV_PGRAPH_CSV0_D_LIGHT0_LOCAL) {
+            const float *k = pg->light_local_attenuation[i];
+            float vp[3], half[3];
+            for (j = 0; j < 3; j++) {
+                vp[j] = pg->light_local_position[i][j] - eye[j] / eye[3];
+            }
+            float distance = sqrtf(soft_dot3(vp, vp));
+            soft_normalize3(vp);
+            attenuation = 1.0f / (k[0] + k[1] * distance
+                                  + k[2] * distance * distance);
+            for (j = 0; j < 3; j++) {
+                half[j] = vp[j] + eye_pos[j];
+            }
+            soft_normalize3(half);
+            n_dot_vp = MAX(soft_dot3(normal, vp), 0.0f);
+            n_dot_hv = MAX(soft_dot3(normal, half), 0.0f);
+        } else {
+            continue;
+        }
+
+        float pf = (n_dot_vp == 0.0f) ? 0.0f : powf(n_dot_hv, 0.001f);
+        for (j = 0; j < 3; j++) {
+            unsigned int base = i * 6;
+            d0[j] += soft_ltctx(pg->ltctxb, NV_IGRAPH_XF_LTCTXB_L0_AMB + base,
+                                j) * attenuation;
+            d0[j] += diffuse[j]
+                     * soft_ltctx(pg->ltctxb,
+                                  NV_IGRAPH_XF_LTCTXB_L0_DIF + base, j)
+                     * attenuation * n_dot_vp;
+            d1[j] += specular[j]
+                     * soft_ltctx(pg->ltctxb,
+                                  NV_IGRAPH_XF_LTCTXB_L0_SPC + base, j)
+                     * pf;
+        }
+    }
+}
+
+static float soft_fog_factor(const SoftRenderer *s, float distance)
+{
+    float factor;
+
+    switch (s->fog_mode) {
+    case NV_PGRAPH_CONTROL_3_FOG_MODE_LINEAR:
+    case NV_PGRAPH_CONTROL_3_FOG_MODE_LINEAR_ABS:
+        factor = s->fog_param[0] + distance * s->fog_param[1] - 1.0f;
+        break;
+    case NV_PGRAPH_CONTROL_3_FOG_MODE_EXP:
+    case NV_PGRAPH_CONTROL_3_FOG_MODE_EXP_ABS:
+        factor = s->fog_param[0]
+                 + exp2f(distance * s->fog_param[1] * 16.0f) - 1.5f;
+        break;
+    case NV_PGRAPH_CONTROL_3_FOG_MODE_EXP2:
+    case NV_PGRAPH_CONTROL_3_FOG_MODE_EXP2_ABS:
+        factor = s->fog_param[0]
+                 + exp2f(-distance * distance * s->fog_param[1]
+                         * s->fog_param[1] * 32.0f) - 1.5f;
+        break;
+    default:
+        assert(false);
+        return 1.0f;
+    }
+
+    switch (s->fog_mode) {
+    case NV_PGRAPH_CONTROL_3_FOG_MODE_LINEAR_ABS:
+    case NV_PGRAPH_CONTROL_3_FOG_MODE_EXP_ABS:
+    case NV_PGRAPH_CONTROL_3_FOG_MODE_EXP2_ABS:
+        return fabsf(factor);
+    default:
+        return factor;
+    }
+}
+
+static float soft_fog_distance(const SoftRenderer *s, const float eye[4],
+                               const float specular[4], float fog_coord)
+{
+    float distance;
+
+    switch (s->foggen) {
+    case NV_PGRAPH_CSV0_D_FOGGENMODE_SPEC_ALPHA:
+        return MIN(MAX(specular[3], 0.0f), 1.0f);
+    case NV_PGRAPH_CSV0_D_FOGGENMODE_RADIAL:
+        return sqrtf(soft_dot3(eye, eye));
+    case NV_PGRAPH_CSV0_D_FOGGENMODE_PLANAR:
+    case NV_PGRAPH_CSV0_D_FOGGENMODE_ABS_PLANAR:
+        distance = soft_dot3(s->fog_plane, eye) + s->fog_plane[3];
+        if (s->foggen == NV_PGRAPH_CSV0_D_FOGGENMODE_ABS_PLANAR) {
+            distance = fabsf(distance);
+        }
+        return distance;
+    case NV_PGRAPH_CSV0_D_FOGGENMODE_FOG_X:
+        return fog_coord;
+    default:
+        assert(false);
+        return 0.0f;
+    }
+}
+
+static float soft_texgen(unsigned int mode, unsigned int component,
+                         const float plane[4], const float position[4],
+                         const float eye[4], const float normal[3],
+                         const float texcoord[4])
+{
+    float u[3], r[3];
+    int i;
+
+    switch (mode) {
+    case TEXGEN_DISABLE:
+        return texcoord[component];
+    case TEXGEN_EYE_LINEAR:
+        return soft_dot3(plane, eye) + plane[3] * eye[3];
+    case TEXGEN_OBJECT_LINEAR:
+        return soft_dot3(plane, position) + plane[3] * position[3];
+    case TEXGEN_NORMAL_MAP:
+        return component < 3 ? normal[component] : texcoord[component];
+    case TEXGEN_SPHERE_MAP:
+    case TEXGEN_REFLECTION_MAP:
+        if (component >= 3) {
+            return texcoord[component];
+        }
+        /* r = reflect(normalize(eye), normal) */
+        memcpy(u, eye, sizeof(u));
+        soft_normalize3(u);
+        float d = 2.0f * soft_dot3(normal, u);
+        for (i = 0; i < 3; i++) {
+            r[i] = u[i] - d * normal[i];
+        }
+        if (mode == TEXGEN_REFLECTION_MAP) {
+            return r[component];
+        }
+        float m[3] = { r[0], r[1], r[2] + 1.0f };
+        return r[component] / (2.0f * sqrtf(soft_dot3(m, m))) + 0.5f;
+    default:
+        return texcoord[component];
+    }
+}
+
+/* The program outputs screen space xyz with w in oPos.w, undo the divide
+ * so clipping sees the same vertex the GL path does */
+static void soft_run_vertex_program(NV2AState *d, SoftRenderer *s,
+                                    const VertexAttributeSource *src,
+                                    unsigned int first, unsigned int count)
+{
+    PGRAPHState *pg = &d->pgraph;
+    unsigned int i, j;
+
+    if (count > s->program_outputs_size) {
+        s->program_outputs_size = MAX(count, s->program_outputs_size * 2);
+        s->program_outputs = g_realloc(s->program_outputs,
+            s->program_outputs_size * sizeof(s->program_outputs[0]));
+    }
+    pgraph_run_vertex_program(s->program,
+                              (const float (*)[4])pg->vsh_constants,
+                              src, first, count, s->program_outputs);
+
+    for (i = 0; i < count; i++) {
+        SoftClipVertex *v = &s->vertices[i];
+        const float (*out)[4] = (const float (*)[4])s->program_outputs[i];
+        float w = out[VSH_OUTPUT_POS][3];
+
+        if (w == 0.0f || isinf(w)) {
+            w = 1.0f;
+        }
+        v->pos[0] = out[VSH_OUTPUT_POS][0] * w;
+        v->pos[1] = out[VSH_OUTPUT_POS][1] * w;
+        v->pos[2] = out[VSH_OUTPUT_POS][2] * w;
+        v->pos[3] = w;
+
+        for (j = 0; j < 4; j++) {
+            v->varyings[SOFT_VARYING_D0][j] =
+                MIN(MAX(out[VSH_OUTPUT_D0][j], 0.0f), 1.0f);
+            v->varyings[SOFT_VARYING_D1][j] =
+                MIN(MAX(out[VSH_OUTPUT_D1][j], 0.0f), 1.0f);
+        }
+        /* the program's fog output is the distance */
+        float fog = s->fog ? soft_fog_factor(s, out[VSH_OUTPUT_FOG][0])
+                           : 1.0f;
+        v->varyings[SOFT_VARYING_FOG] = (SoftVec4){ fog, fog, fog, fog };
+        for (j = 0; j < NV2A_MAX_TEXTURES; j++) {
+            const float *t = out[VSH_OUTPUT_T0 + j];
+            v->varyings[SOFT_VARYING_T0 + j] =
+                (SoftVec4){ t[0], t[1], t[2], t[3] };
+        }
+    }
+    s->vertices_transformed += count;
+}
+
+static void soft_transform_vertices(NV2AState *d, SoftRenderer *s,
+                                    const VertexAttributeSource *src,
+                                    unsigned int first, unsigned int count)
+{
+    PGRAPHState *pg = &d->pgraph;
+    unsigned int i, j;
+
+    if (count > s->vertices_size) {
+        s->vertices_size = MAX(count, s->vertices_size * 2);
+        s->vertices = g_renew(SoftClipVertex, s->vertices, s->vertices_size);
+    }
+
+    if (s->program) {
+        soft_run_vertex_program(d, s, src, first, count);
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        SoftClipVertex *v = &s->vertices[i];
+        unsigned int index = first + i;
+        float position[4], diffuse[4], specular[4], in[4], out[4];
+        float eye[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+        float normal[3] = { 0.0f, 0.0f, 0.0f };
+        float d0[4], d1[4];
+
+        pgraph_read_attribute(&src[NV2A_VERTEX_ATTR_POSITION], index,
+                              position);
+        pgraph_read_attribute(&src[NV2A_VERTEX_ATTR_DIFFUSE], index, diffuse);
+        pgraph_read_attribute(&src[NV2A_VERTEX_ATTR_SPECULAR], index,
+                              specular);
+
+        if (s->eye_space) {
+            float weight[4];
+            pgraph_read_attribute(&src[NV2A_VERTEX_ATTR_NORMAL], index, in);
+            pgraph_read_attribute(&src[NV2A_VERTEX_ATTR_WEIGHT], index,
+                                  weight);
+            soft_skin_vertex(s, position, in, weight, eye, normal);
+            if (s->normalize) {
+                soft_normalize3(normal);
+            }
+        }
+
+        /* without skinning the composite matrix includes modelview */
+        soft_transform_vec4(s->composite, s->skin_count ? eye : position,
+                            v->pos);
+
+        if (s->lighting) {
+            soft_light_vertex(pg, s, eye, normal, diffuse, specular, d0, d1);
+        } else {
+            memcpy(d0, diffuse, sizeof(d0));
+            memcpy(d1, specular, sizeof(d1));
+        }
+        for (j = 0; j < 4; j++) {
+            v->varyings[SOFT_VARYING_D0][j] = MIN(MAX(d0[j], 0.0f), 1.0f);
+            v->varyings[SOFT_VARYING_D1][j] = MIN(MAX(d1[j], 0.0f), 1.0f);
+        }
+
+        /* with fog disabled the shaders pass a fog factor of 1 */
+        float fog = 1.0f;
+        if (s->fog) {
+            pgraph_read_attribute(&src[NV2A_VERTEX_ATTR_FOG], index, in);
+            fog = soft_fog_factor(s, soft_fog_distance(s, eye, specular,
+                                                       in[0]));
+        }
+        v->varyings[SOFT_VARYING_FOG] = (SoftVec4){ fog, fog, fog, fog };
+
+        for (j = 0; j < NV2A_MAX_TEXTURES; j++) {
+            unsigned int k;
+            pgraph_read_attribute(&src[NV2A_VERTEX_ATTR_TEXTURE0 + j],
+                                  index, in);
+            for (k = 0; k < 4; k++) {
+                out[k] = soft_texgen(s->texgen[j][k], k,
+                                     s->texgen_plane[j][k], position, eye,
+                                     normal, in);
+            }
+            if (pg->texture_matrix_enable[j]) {
+                memcpy(in, out, sizeof(in));
+                soft_transform_vec4(s->texture_matrix[j], in, out);
+            }
+            v->varyings[SOFT_VARYING_T0 + j] =
+                (SoftVec4){ out[0], out[1], out[2], out[3] };
+        }
+    }
+    s->vertices_transformed += count;
+}
+
+/* Triangles */
+
+static float soft_clip_distance(const SoftClipVertex *v, int plane)
+{
+    switch (plane) {
+    case 0: return v->pos[3] - SOFT_CLIP_MIN_W;
+    case 1: return SOFT_GUARD_BAND * v->pos[3] - v->pos[0];
+    case 2: return SOFT_GUARD_BAND * v->pos[3] + v->pos[0];
+    case 3: return SOFT_GUARD_BAND * v->pos[3] - v->pos[1];
+    default: return SOFT_GUARD_BAND * v->pos[3] + v->pos[1];
+    }
+}
+
+static void soft_lerp_vertex(const SoftClipVertex *a, const SoftClipVertex *b,
+                             float t, SoftClipVertex *out)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        out->pos[i] = a->pos[i] + (b->pos[i] - a->pos[i]) * t;
+    }
+    for (i = 0; i < SOFT_NUM_VARYINGS; i++) {
+        out->varyings[i] = a->varyings[i]
+                           + (b->varyings[i] - a->varyings[i]) * t;
+    }
+}
+
+static void soft_project_vertex(const SoftClipVertex *in, SoftVertex *out)
+{
+    float inv_w = 1.0f / in->pos[3];
+
+    out->x = in->pos[0] * inv_w;
+    out->y = in->pos[1] * inv_w;
+    out->z = in->pos[2] * inv_w;
+    out->inv_w = inv_w;
+    memcpy(out->varyings, in->varyings, sizeof(in->varyings));
+}
+
+static void soft_polygon_offset(const SoftRenderer *s, SoftVertex *v[3])
+{
+    float dx1 = v[1]->x - v[0]->x, dy1 = v[1]->y - v[0]->y;
+    float dx2 = v[2]->x - v[0]->x, dy2 = v[2]->y - v[0]->y;
+    float area = dx1 * dy2 - dx2 * dy1;
+    float slope = 0.0f;
+    int i;
+
+    if (area != 0.0f) {
+        float dz1 = v[1]->z - v[0]->z, dz2 = v[2]->z - v[0]->z;
+        float dzdx = (dz1 * dy2 - dz2 * dy1) / area;
+        float dzdy = (dz2 * dx1 - dz1 * dx2) / area;
+        slope = MAX(fabsf(dzdx), fabsf(dzdy));
+    }
+    /* the bias is in depth buffer units already */
+    for (i = 0; i < 3; i++) {
+        v[i]->z += s->zfactor * slope + s->zbias;
+    }
+}
+
+static void soft_triangle(SoftRenderer *s, unsigned int i0, unsigned int i1,
+                          unsigned int i2)
+{
+    SoftClipVertex buffers[2][SOFT_CLIP_MAX_VERTICES];
+    SoftClipVertex *in = buffers[0], *out = buffers[1];
+    unsigned int n = 3;
+    unsigned int i, k;
+    int plane;
+    bool clipped = false;
+
+    in[0] = s->vertices[i0];
+    in[1] = s->vertices[i1];
+    in[2] = s->vertices[i2];
+
+    for (plane = 0; plane < SOFT_CLIP_PLANES; plane++) {
+        float dist[SOFT_CLIP_MAX_VERTICES];
+        bool all_inside = true;
+        for (i = 0; i < n; i++) {
+            dist[i] = soft_clip_distance(&in[i], plane);
+            all_inside &= dist[i] >= 0.0f;
+        }
+        if (all_inside) {
+            continue;
+        }
+
+        unsigned int m = 0;
+        for (i = 0; i < n; i++) {
+            unsigned int j = (i + 1) % n;
+            if (dist[i] >= 0.0f) {
+                out[m++] = in[i];
+            }
+            if ((dist[i] >= 0.0f) != (dist[j] >= 0.0f)) {
+                soft_lerp_vertex(&in[i], &in[j],
+                                 dist[i] / (dist[i] - dist[j]), &out[m++]);
+            }
+        }
+        SoftClipVertex *tmp = in;
+        in = out;
+        out = tmp;
+        n = m;
+        clipped = true;
+        if (n < 3) {
+            break;
+        }
+    }
+    if (clipped) {
+        s->triangles_clipped++;
+    }
+    if (n < 3) {
+        return;
+    }
+
+    SoftVertex projected[SOFT_CLIP_MAX_VERTICES];
+    for (i = 0; i < n; i++) {
+        soft_project_vertex(&in[i], &projected[i]);
+    }
+    for (k = 1; k + 1 < n; k++) {
+        SoftVertex v0 = projected[0], v1 = projected[k], v2 = projected[k + 1];
+        if (s->poffset) {
+            SoftVertex *v[3] = { &v0, &v1, &v2 };
+            soft_polygon_offset(s, v);
+        }
+        soft_raster_triangle(&s->raster, &v0, &v1, &v2);
+    }
+}
+
+/* Points and lines */
+
+/* Draws the quad from a to b widened by half a pixel on each side along
+ * the minor axis, which covers the same pixels as GL's diamond rule for
+ * a one pixel wide line but for the ends */
+static void soft_quad(SoftRenderer *s, const SoftVertex *a,
+                      const SoftVertex *b, float dx, float dy)
+{
+    SoftVertex v[4] = { *a, *b, *b, *a };
+
+    v[0].x -= dx;
+    v[0].y -= dy;
+    v[1].x -= dx;
+    v[1].y -= dy;
+    v[2].x += dx;
+    v[2].y += dy;
+    v[3].x += dx;
+    v[3].y += dy;
+    soft_raster_triangle(&s->raster, &v[0], &v[1], &v[2]);
+    soft_raster_triangle(&s->raster, &v[0], &v[2], &v[3]);
+}
+
+/* Points are one pixel squares, dropped whole if their centre is clipped
+ * as in GL */
+static void soft_point(SoftRenderer *s, unsigned int i0)
+{
+    const SoftClipVertex *in = &s->vertices[i0];
+    SoftVertex v, a, b;
+    int plane;
+
+    for (plane = 0; plane < SOFT_CLIP_PLANES; plane++) {
+        if (soft_clip_distance(in, plane) < 0.0f) {
+            return;
+        }
+    }
+    soft_project_vertex(in, &v);
+    a = v;
+    b = v;
+    a.x -= 0.5f;
+    b.x += 0.5f;
+    soft_quad(s, &a, &b, 0.0f, 0.5f);
+}
+
+static void soft_line(SoftRenderer *s, unsigned int i0, unsigned int i1)
+{
+    const SoftClipVertex *in[2] = { &s->vertices[i0], &s->vertices[i1] };
+    SoftClipVertex clipped[2];
+    SoftVertex a, b;
+    float t0 = 0.0f, t1 = 1.0f;
+    int plane;
+
+    for (plane = 0; plane < SOFT_CLIP_PLANES; plane++) {
+        float d0 = soft_clip_distance(in[0], plane);
+        float d1 = soft_clip_distance(in[1], plane);
+        if (d0 < 0.0f && d1 < 0.0f) {
+            return;
+        }
+        if (d0 < 0.0f) {
+            t0 = MAX(t0, d0 / (d0 - d1));
+        } else if (d1 < 0.0f) {
+            t1 = MIN(t1, d0 / (d0 - d1));
+        }
+    }
+    if (t0 >= t1) {
+        return;
+    }
+    if (t0 > 0.0f || t1 < 1.0f) {
+        s->triangles_clipped++;
+    }
+
+    soft_lerp_vertex(in[0], in[1], t0, &clipped[0]);
+    soft_lerp_vertex(in[0], in[1], t1, &clipped[1]);
+    soft_project_vertex(&clipped[0], &a);
+    soft_project_vertex(&clipped[1], &b);
+    if (fabsf(b.x - a.x) >= fabsf(b.y - a.y)) {
+        soft_quad(s, &a, &b, 0.0f, 0.5f);
+    } else {
+        soft_quad(s, &a, &b, 0.5f, 0.0f);
+    }
+}
+
+/* Assembles primitives from vertices s->vertices[indices[i] - base] */
+static void soft_assemble(SoftRenderer *s, unsigned int primitive_mode,
+                          const uint32_t *indices, unsigned int base,
+                          unsigned int count)
+{
+    unsigned int i;
+
+#define SOFT_INDEX(i) (indices ? indices[i] - base : (i))
+
+    switch (primitive_mode) {
+    case NV097_SET_BEGIN_END_OP_POINTS:
+        for (i = 0; i < count; i++) {
+            soft_point(s, SOFT_INDEX(i));
+        }
+        break;
+    case NV097_SET_BEGIN_END_OP_LINES:
+        for (i = 0; i + 1 < count; i += 2) {
+            soft_line(s, SOFT_INDEX(i), SOFT_INDEX(i + 1));
+        }
+        break;
+    case NV097_SET_BEGIN_END_OP_LINE_LOOP:
+    case NV097_SET_BEGIN_END_OP_LINE_STRIP:
+        for (i = 0; i + 1 < count; i++) {
+            soft_line(s, SOFT_INDEX(i), SOFT_INDEX(i + 1));
+        }
+        if (primitive_mode == NV097_SET_BEGIN_END_OP_LINE_LOOP && count > 2) {
+            soft_line(s, SOFT_INDEX(count - 1), SOFT_INDEX(0));
+        }
+        break;
+    case NV097_SET_BEGIN_END_OP_TRIANGLES:
+        for (i = 0; i + 2 < count; i += 3) {
+            soft_triangle(s, SOFT_INDEX(i), SOFT_INDEX(i + 1),
+                          SOFT_INDEX(i + 2));
+        }
+        break;
+    case NV097_SET_BEGIN_END_OP_TRIANGLE_STRIP:
+        for (i = 0; i + 2 < count; i++) {
+            if (i % 2) {
+                soft_triangle(s, SOFT_INDEX(i + 1), SOFT_INDEX(i),
+                              SOFT_INDEX(i + 2));
+            } else {
+                soft_triangle(s, SOFT_INDEX(i), SOFT_INDEX(i + 1),
+                              SOFT_INDEX(i + 2));
+            }
+        }
+        break;
+    case NV097_SET_BEGIN_END_OP_TRIANGLE_FAN:
+    case NV097_SET_BEGIN_END_OP_POLYGON:
+        for (i = 1; i + 1 < count; i++) {
+            soft_triangle(s, SOFT_INDEX(0), SOFT_INDEX(i), SOFT_INDEX(i + 1));
+        }
+        break;
+    case NV097_SET_BEGIN_END_OP_QUADS:
+        for (i = 0; i + 3 < count; i += 4) {
+            soft_triangle(s, SOFT_INDEX(i), SOFT_INDEX(i + 1),
+                          SOFT_INDEX(i + 2));
+            soft_triangle(s, SOFT_INDEX(i), SOFT_INDEX(i + 2),
+                          SOFT_INDEX(i + 3));
+        }
+        break;
+    case NV097_SET_BEGIN_END_OP_QUAD_STRIP:
+        for (i = 0; i + 3 < count; i += 2) {
+            soft_triangle(s, SOFT_INDEX(i), SOFT_INDEX(i + 1),
+                          SOFT_INDEX(i + 3));
+            soft_triangle(s, SOFT_INDEX(i), SOFT_INDEX(i + 3),
+                          SOFT_INDEX(i + 2));
+        }
+        break;
+    default:
+        assert(false);
+        break;
+    }
+
+#undef SOFT_INDEX
+}
+
+/* Swizzles any linear copies back and marks what was drawn to dirty */
+static void soft_finish_target(NV2AState *d, SoftRenderer *s,
+                               const SoftTarget *target)
+{
+    uint8_t *data[] = { target->color, target->zeta };
+    unsigned int pitch[] = { target->color_pitch, target->zeta_pitch };
+    bool drawn = target->clip_width && target->clip_height;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(s->swizzled); i++) {
+        SoftSwizzledSurface *surface = &s->swizzled[i];
+        if (surface->guest) {
+            if (drawn) {
+                swizzle_rect(surface->linear, surface->width, surface->height,
+                             surface->guest, surface->pitch,
+                             surface->bytes_per_pixel);
+                memory_region_set_dirty(d->vram,
+                    surface->guest - d->vram_ptr,
+                    (hwaddr)surface->pitch * surface->height);
+            }
+            surface->guest = NULL;
+        } else if (data[i] && drawn) {
+            memory_region_set_dirty(d->vram,
+                data[i] - d->vram_ptr + (hwaddr)target->clip_y * pitch[i],
+                (hwaddr)target->clip_height * pitch[i]);
+        }
+    }
+}
+
+/* PGRAPHRenderer */
+
+static void soft_renderer_init(NV2AState *d)
+{
+    SoftRenderer *s = g_new0(SoftRenderer, 1);
+
+    soft_raster_init(&s->raster, d->renderer_threads);
+    QTAILQ_INIT(&s->textures);
+    s->psh_env.sample = soft_sample;
+    s->psh_env.sample_opaque = s;
+
+    d->pgraph.renderer_opaque = s;
+}
+
+static void soft_renderer_destroy(PGRAPHState *pg)
+{
+    SoftRenderer *s = pg->renderer_opaque;
+
+    soft_raster_destroy(&s->raster);
+    while (!QTAILQ_EMPTY(&s->textures)) {
+        SoftTexture *t = QTAILQ_FIRST(&s->textures);
+        QTAILQ_REMOVE(&s->textures, t, entry);
+        g_free(t->data);
+        g_free(t);
+    }
+    if (s->psh_program) {
+        psh_program_free(s->psh_program);
+    }
+    g_free(s->swizzled[0].linear);
+    g_free(s->swizzled[1].linear);
+    g_free(s->vertices);
+    g_free(s->program_outputs);
+    g_free(s);
+    pg->renderer_opaque = NULL;
+}
+
+static void soft_renderer_draw(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+    SoftRenderer *s = pg->renderer_opaque;
+    VertexAttributeSource src[NV2A_VERTEXSHADER_ATTRIBUTES];
+    SoftRasterState state;
+    SoftTarget target;
+    const char *reason;
+    unsigned int i;
+
+    s->draws++;
+
+    bool visible = soft_get_raster_state(pg, &state);
+    reason = soft_check_state(pg);
+    if (!reason) {
+        reason = soft_check_blend(&state);
+    }
+    if (!reason) {
+        reason = soft_get_target(d, &target, state.color_mask != 0,
+                                 state.depth_test || state.stencil_test);
+    }
+    if (!reason) {
+        reason = soft_apply_window_clip(pg, &target);
+    }
+    if (!reason && visible) {
+        reason = soft_setup_shading(d, s);
+    }
+    if (reason) {
+        NV2A_DPRINTF("soft renderer skipping draw: %s\n", reason);
+        s->draws_skipped++;
+        s->skip_reason = reason;
+        goto done;
+    }
+    if (!visible || !target.clip_width || !target.clip_height) {
+        goto done;
+    }
+    if (!target.color) {
+        state.color_mask = 0;
+    }
+    /* without a stencil buffer the test always passes, as in GL */
+    if (!target.zeta || target.zeta_format != SOFT_ZETA_Z24S8) {
+        state.stencil_test = false;
+    }
+    state.shade_opaque = s;
+
+    s->program = NULL;
+    if (GET_MASK(pg->regs[NV_PGRAPH_CSV0_D], NV_PGRAPH_CSV0_D_MODE) == 2) {
+        s->program = pgraph_get_vsh_program(pg)->program;
+    }
+
+    soft_load_vertex_state(pg, s);
+    s->poffset = pg->regs[NV_PGRAPH_SETUPRASTER]
+                     & NV_PGRAPH_SETUPRASTER_POFFSETFILLENABLE;
+    s->zfactor = soft_reg_float(pg->regs[NV_PGRAPH_ZOFFSETFACTOR]);
+    s->zbias = soft_reg_float(pg->regs[NV_PGRAPH_ZOFFSETBIAS]);
+
+    unsigned int inline_stride = 0;
+    if (pg->inline_array_length) {
+        inline_stride = pgraph_layout_inline_array(pg);
+    }
+    for (i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        pgraph_get_attribute_source(d, i, pg->inline_array_length != 0,
+                                    inline_stride, &src[i]);
+    }
+
+    soft_raster_begin(&s->raster, &target, &state);
+
+    if (pg->draw_arrays_length) {
+        for (i = 0; i < pg->draw_arrays_length; i++) {
+            soft_transform_vertices(d, s, src, pg->gl_draw_arrays_start[i],
+                                    pg->gl_draw_arrays_count[i]);
+            soft_assemble(s, pg->primitive_mode, NULL, 0,
+                          pg->gl_draw_arrays_count[i]);
+        }
+    } else if (pg->inline_buffer_length) {
+        soft_transform_vertices(d, s, src, 0, pg->inline_buffer_length);
+        soft_assemble(s, pg->primitive_mode, NULL, 0,
+                      pg->inline_buffer_length);
+    } else if (pg->inline_array_length) {
+        unsigned int count = inline_stride
+                                 ? pg->inline_array_length * 4 / inline_stride
+                                 : 0;
+        soft_transform_vertices(d, s, src, 0, count);
+        soft_assemble(s, pg->primitive_mode, NULL, 0, count);
+    } else if (pg->inline_elements_length) {
+        uint32_t min_element = (uint32_t)-1, max_element = 0;
+        for (i = 0; i < pg->inline_elements_length; i++) {
+            min_element = MIN(pg->inline_elements[i], min_element);
+            max_element = MAX(pg->inline_elements[i], max_element);
+        }
+        if (max_element - min_element >= SOFT_MAX_ELEMENT_RANGE) {
+            s->draws_skipped++;
+            s->skip_reason = "element range";
+        } else {
+            soft_transform_vertices(d, s, src, min_element,
+                                    max_element - min_element + 1);
+            soft_assemble(s, pg->primitive_mode, pg->inline_elements,
+                          min_element, pg->inline_elements_length);
+        }
+    }
+
+    soft_raster_end(&s->raster);
+    soft_finish_target(d, s, &target);
+
+    if (pg->zpass_pixel_count_enable) {
+        pg->zpass_pixel_count_result += s->raster.samples_passed;
+    }
+
+done:
+    for (i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        pg->vertex_attributes[i].inline_buffer_populated = false;
+    }
+}
+
+static void soft_renderer_clear_surface(NV2AState *d, uint32_t parameter)
+{
+    PGRAPHState *pg = &d->pgraph;
+    SoftRenderer *s = pg->renderer_opaque;
+    SoftTarget target;
+    const char *reason;
+
+    bool write_color = parameter & NV097_CLEAR_SURFACE_COLOR;
+    bool write_zeta =
+        parameter & (NV097_CLEAR_SURFACE_Z | NV097_CLEAR_SURFACE_STENCIL);
+
+    s->clears++;
+
+    reason = soft_get_target(d, &target, write_color, write_zeta);
+    if (!reason && write_zeta && pg->surface_shape.z_format) {
+        reason = "float depth";
+    }
+    if (reason) {
+        NV2A_DPRINTF("soft renderer skipping clear: %s\n", reason);
+        s->clears_skipped++;
+        s->skip_reason = reason;
+        return;
+    }
+
+    uint32_t color_value = pg->regs[NV_PGRAPH_COLORCLEARVALUE];
+    uint32_t color_bits = 0;
+    if (target.color_format == SOFT_COLOR_R5G6B5) {
+        color_bits = ((parameter & NV097_CLEAR_SURFACE_R) ? 0xF800 : 0)
+                     | ((parameter & NV097_CLEAR_SURFACE_G) ? 0x07E0 : 0)
+                     | ((parameter & NV097_CLEAR_SURFACE_B) ? 0x001F : 0);
+    } else {
+        color_bits = ((parameter & NV097_CLEAR_SURFACE_A) ? 0xFF000000 : 0)
+                     | ((parameter & NV097_CLEAR_SURFACE_R) ? 0x00FF0000 : 0)
+                     | ((parameter & NV097_CLEAR_SURFACE_G) ? 0x0000FF00 : 0)
+                     | ((parameter & NV097_CLEAR_SURFACE_B) ? 0x000000FF : 0);
+        /* same as drawing, the X byte is written with a fixed value */
+        if (target.color_format == SOFT_COLOR_Z8R8G8B8) {
+            color_value &= 0x00FFFFFF;
+        } else if (target.color_format == SOFT_COLOR_O8R8G8B8) {
+            color_value |= 0xFF000000;
+        }
+    }
+
+    uint32_t zeta_value = pg->regs[NV_PGRAPH_ZSTENCILCLEARVALUE];
+    uint32_t zeta_bits = 0;
+    if (target.zeta_format == SOFT_ZETA_Z16) {
+        zeta_bits = (parameter & NV097_CLEAR_SURFACE_Z) ? 0xFFFF : 0;
+    } else {
+        zeta_bits = ((parameter & NV097_CLEAR_SURFACE_Z) ? 0xFFFFFF00 : 0)
+                    | ((parameter & NV097_CLEAR_SURFACE_STENCIL) ? 0xFF : 0);
+    }
+
+    unsigned int xmin = GET_MASK(pg->regs[NV_PGRAPH_CLEARRECTX],
+                                 NV_PGRAPH_CLEARRECTX_XMIN);
+    unsigned int xmax = GET_MASK(pg->regs[NV_PGRAPH_CLEARRECTX],
+                                 NV_PGRAPH_CLEARRECTX_XMAX);
+    unsigned int ymin = GET_MASK(pg->regs[NV_PGRAPH_CLEARRECTY],
+                                 NV_PGRAPH_CLEARRECTY_YMIN);
+    unsigned int ymax = GET_MASK(pg->regs[NV_PGRAPH_CLEARRECTY],
+                                 NV_PGRAPH_CLEARRECTY_YMAX);
+    if (xmax < xmin || ymax < ymin) {
+        return;
+    }
+
+    /* FIXME: Respect window clip, the GL path doesn't either */
+    soft_raster_clear(&target, xmin, ymin, xmax - xmin + 1, ymax - ymin + 1,
+                      color_bits != 0, color_value, color_bits,
+                      zeta_bits != 0, zeta_value, zeta_bits);
+    soft_finish_target(d, s, &target);
+}
+
+static void soft_renderer_print_stats(PGRAPHState *pg, Monitor *mon)
+{
+    SoftRenderer *s = pg->renderer_opaque;
+    SoftRaster *r = &s->raster;
+
+    monitor_printf(mon, "soft renderer: %u threads, %" PRIu64 " draws, "
+                        "%" PRIu64 " clears, %" PRIu64 " draws and %" PRIu64
+                        " clears skipped (last for %s)\n",
+                   r->pool.num_threads + 1, s->draws, s->clears,
+                   s->draws_skipped, s->clears_skipped,
+                   s->skip_reason ? s->skip_reason : "nothing");
+    monitor_printf(mon, "  %" PRIu64 " vertices, %" PRIu64 " triangles binned,"
+                        " %" PRIu64 " culled, %" PRIu64 " clipped\n",
+                   s->vertices_transformed, r->triangles_binned,
+                   r->triangles_culled, s->triangles_clipped);
+    monitor_printf(mon, "  %" PRIu64 " tiles, %" PRIu64 " fragments shaded, "
+                        "%u textures cached, %" PRIu64 " decodes\n",
+                   r->tiles_rasterized, r->fragments_shaded,
+                   s->num_textures, s->texture_decodes);
+}
+
+static const PGRAPHRenderer pgraph_soft_renderer = {
+    .name = "soft",
+    .init = soft_renderer_init,
+    .destroy = soft_renderer_destroy,
+    .draw = soft_renderer_draw,
+    .clear_surface = soft_renderer_clear_surface,
+    .print_stats = soft_renderer_print_stats,
+};
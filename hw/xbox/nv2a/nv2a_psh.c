@@ -514,6 +514,87 @@ static void add_final_stage_code(struct PixelShader *ps, struct FCInputInfo fina
 
 
 
+/* Index textures are point sampled, so lookups through the palette are
+ * filtered here. The mip level is picked like GL would for a single level
+ * lookup. */
+static const char *psh_palette_lookup =
+"vec4 paletteTexel(sampler2D pal, float index) {\n"
+"    return texelFetch(pal, ivec2(int(index * 255.0 + 0.5), 0), 0);\n"
+"}\n"
+"vec4 paletteNearest(sampler2D tex, sampler2D pal, int maxLod, vec2 uv) {\n"
+"    return paletteTexel(pal, texture(tex, uv).r);\n"
+"}\n"
+"vec4 paletteLinear(sampler2D tex, sampler2D pal, int maxLod, vec2 uv) {\n"
+"    vec2 size = vec2(textureSize(tex, 0));\n"
+"    vec2 dx = dFdx(uv * size);\n"
+"    vec2 dy = dFdy(uv * size);\n"
+"    float lod = 0.5 * log2(max(dot(dx, dx), dot(dy, dy)));\n"
+"    int level = clamp(int(floor(lod + 0.5)), 0, maxLod);\n"
+"    size = vec2(textureSize(tex, level));\n"
+"    vec2 p = uv * size - 0.5;\n"
+"    vec2 f = fract(p);\n"
+"    vec2 base = (floor(p) + 0.5) / size;\n"
+"    float l = float(level);\n"
+"    vec4 c00 = paletteTexel(pal, textureLodOffset(tex, base, l, ivec2(0, 0)).r);\n"
+"    vec4 c10 = paletteTexel(pal, textureLodOffset(tex, base, l, ivec2(1, 0)).r);\n"
+"    vec4 c01 = paletteTexel(pal, textureLodOffset(tex, base, l, ivec2(0, 1)).r);\n"
+"    vec4 c11 = paletteTexel(pal, textureLodOffset(tex, base, l, ivec2(1, 1)).r);\n"
+"    return mix(mix(c00, c10, f.x), mix(c01, c11, f.x), f.y);\n"
+"}\n";
+
+/* YUY2 is uploaded two channels wide, Y in red and U or V in green for
+ * even and odd texels. Same coefficients as convert_yuy2_to_rgb. */
+static const char *psh_yuv_lookup =
+"vec4 yuvTexel(sampler2DRect tex, ivec2 p) {\n"
+"    ivec2 size = textureSize(tex);\n"
+"    p = clamp(p, ivec2(0), size - 1);\n"
+"    int x = p.x - p.x % 2;\n"
+"    float y = texelFetch(tex, p).r - 16.0 / 255.0;\n"
+"    float u = texelFetch(tex, ivec2(x, p.y)).g - 128.0 / 255.0;\n"
+"    float v = texelFetch(tex, ivec2(min(x + 1, size.x - 1), p.y)).g\n"
+"                  - 128.0 / 255.0;\n"
+"    float c = 298.0 / 256.0 * y;\n"
+"    vec3 rgb = vec3(c + 409.0 / 256.0 * v,\n"
+"                    c - 100.0 / 256.0 * u - 208.0 / 256.0 * v,\n"
+"                    c + 516.0 / 256.0 * u);\n"
+"    return vec4(clamp(rgb, 0.0, 1.0), 1.0);\n"
+"}\n"
+"vec4 yuvNearest(sampler2DRect tex, vec2 uv) {\n"
+"    return yuvTexel(tex, ivec2(floor(uv)));\n"
+"}\n"
+"vec4 yuvLinear(sampler2DRect tex, vec2 uv) {\n"
+"    vec2 p = uv - 0.5;\n"
+"    ivec2 i = ivec2(floor(p));\n"
+"    vec2 f = fract(p);\n"
+"    return mix(mix(yuvTexel(tex, i), yuvTexel(tex, i + ivec2(1, 0)), f.x),\n"
+"               mix(yuvTexel(tex, i + ivec2(0, 1)),\n"
+"                   yuvTexel(tex, i + ivec2(1, 1)), f.x),\n"
+"               f.y);\n"
+"}\n";
+
+/* Samples stage i at uv if its texture is looked up through the palette or
+ * decoded from YUY2 by the shader, returns false for any other texture */
+static bool psh_append_decoded_lookup(struct PixelShader *ps,
+                                      QString *preflight, QString *vars,
+                                      int i, const char *uv)
+{
+    const char *filter = ps->state.lookup_linear[i] ? "Linear" : "Nearest";
+
+    if (ps->state.palette_tex[i]) {
+        qstring_append_fmt(preflight, "uniform sampler2D palSamp%d;\n", i);
+        qstring_append_fmt(preflight, "uniform int palMaxLod%d;\n", i);
+        qstring_append_fmt(vars, "vec4 t%d = palette%s(texSamp%d, palSamp%d, "
+                                 "palMaxLod%d, %s);\n",
+                           i, filter, i, i, i, uv);
+    } else if (ps->state.yuv_tex[i]) {
+        qstring_append_fmt(vars, "vec4 t%d = yuv%s(texSamp%d, %s);\n",
+                           i, filter, i, uv);
+    } else {
+        return false;
+    }
+    return true;
+}
+
 static QString* psh_convert(struct PixelShader *ps)
 {
     int i;
@@ -527,6 +608,19 @@ static QString* psh_convert(struct PixelShader *ps)
     qstring_append(preflight, "\n");
     qstring_append(preflight, "uniform vec4 fogColor;\n");
 
+    for (i = 0; i < 4; i++) {
+        if (ps->state.palette_tex[i]) {
+            qstring_append(preflight, psh_palette_lookup);
+            break;
+        }
+    }
+    for (i = 0; i < 4; i++) {
+        if (ps->state.yuv_tex[i]) {
+            qstring_append(preflight, psh_yuv_lookup);
+            break;
+        }
+    }
+
     /* Window Clipping */
     QString *clip = qstring_new();
     if (ps->state.window_clip_count != 0) {
@@ -583,6 +677,7 @@ static QString* psh_convert(struct PixelShader *ps)
     for (i = 0; i < 4; i++) {
 
         const char *sampler_type = NULL;
+        char uv[64];
 
         switch (ps->tex_modes[i]) {
         case PS_TEXTUREMODES_NONE:
@@ -595,8 +690,11 @@ static QString* psh_convert(struct PixelShader *ps)
             } else {
                 sampler_type = "sampler2D";
             }
-            qstring_append_fmt(vars, "vec4 t%d = textureProj(texSamp%d, pT%d.xyw);\n",
-                               i, i, i);
+            snprintf(uv, sizeof(uv), "pT%d.xy / pT%d.w", i, i);
+            if (!psh_append_decoded_lookup(ps, preflight, vars, i, uv)) {
+                qstring_append_fmt(vars, "vec4 t%d = textureProj(texSamp%d, pT%d.xyw);\n",
+                                   i, i, i);
+            }
             break;
         case PS_TEXTUREMODES_PROJECT3D:
             sampler_type = "sampler3D";
@@ -627,8 +725,13 @@ static QString* psh_convert(struct PixelShader *ps)
             sampler_type = "sampler2D";
             qstring_append_fmt(preflight, "uniform mat2 bumpMat%d;\n", i);
             /* FIXME: Do bumpMat swizzle on CPU before upload */
-            qstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, pT%d.xy + t%d.rg * mat2(bumpMat%d[0].xy,bumpMat%d[1].yx));\n",
-                               i, i, i, ps->input_tex[i], i, i);
+            snprintf(uv, sizeof(uv),
+                     "pT%d.xy + t%d.rg * mat2(bumpMat%d[0].xy,bumpMat%d[1].yx)",
+                     i, ps->input_tex[i], i, i);
+            if (!psh_append_decoded_lookup(ps, preflight, vars, i, uv)) {
+                qstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, %s);\n",
+                                   i, i, uv);
+            }
             break;
         case PS_TEXTUREMODES_BUMPENVMAP_LUM:
             qstring_append_fmt(preflight, "uniform float bumpScale%d;\n", i);
@@ -641,8 +744,13 @@ static QString* psh_convert(struct PixelShader *ps)
             sampler_type = "sampler2D";
             qstring_append_fmt(preflight, "uniform mat2 bumpMat%d;\n", i);
             /* FIXME: Do bumpMat swizzle on CPU before upload */
-            qstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, pT%d.xy + t%d.rg * mat2(bumpMat%d[0].xy,bumpMat%d[1].yx));\n",
-                               i, i, i, ps->input_tex[i], i, i);
+            snprintf(uv, sizeof(uv),
+                     "pT%d.xy + t%d.rg * mat2(bumpMat%d[0].xy,bumpMat%d[1].yx)",
+                     i, ps->input_tex[i], i, i);
+            if (!psh_append_decoded_lookup(ps, preflight, vars, i, uv)) {
+                qstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, %s);\n",
+                                   i, i, uv);
+            }
             break;
         case PS_TEXTUREMODES_BRDF:
             qstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_BRDF */\n",
@@ -682,14 +790,20 @@ static QString* psh_convert(struct PixelShader *ps)
         case PS_TEXTUREMODES_DPNDNT_AR:
             assert(!ps->state.rect_tex[i]);
             sampler_type = "sampler2D";
-            qstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, t%d.ar);\n",
-                               i, i, ps->input_tex[i]);
+            snprintf(uv, sizeof(uv), "t%d.ar", ps->input_tex[i]);
+            if (!psh_append_decoded_lookup(ps, preflight, vars, i, uv)) {
+                qstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, %s);\n",
+                                   i, i, uv);
+            }
             break;
         case PS_TEXTUREMODES_DPNDNT_GB:
             assert(!ps->state.rect_tex[i]);
             sampler_type = "sampler2D";
-            qstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, t%d.gb);\n",
-                               i, i, ps->input_tex[i]);
+            snprintf(uv, sizeof(uv), "t%d.gb", ps->input_tex[i]);
+            if (!psh_append_decoded_lookup(ps, preflight, vars, i, uv)) {
+                qstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, %s);\n",
+                                   i, i, uv);
+            }
             break;
         case PS_TEXTUREMODES_DOTPRODUCT:
             qstring_append_fmt(vars, "vec4 t%d = vec4(dot(pT%d.xyz, t%d.rgb));\n",
@@ -815,52 +929,399 @@ static void parse_combiner_output(uint32_t value, struct OutputInfo *out)
     out->cd_alphablue = flags & 0x40;
 }
 
-QString *psh_translate(const PshState state)
+static void psh_parse(struct PixelShader *ps, const PshState *state)
 {
     int i;
+
+    ps->state = *state;
+
+    ps->num_stages = state->combiner_control & 0xFF;
+    ps->flags = state->combiner_control >> 8;
+    for (i = 0; i < 4; i++) {
+        ps->tex_modes[i] = (state->shader_stage_program >> (i * 5)) & 0x1F;
+    }
+
+    ps->input_tex[0] = -1;
+    ps->input_tex[1] = 0;
+    ps->input_tex[2] = (state->other_stage_input >> 16) & 0xF;
+    ps->input_tex[3] = (state->other_stage_input >> 20) & 0xF;
+    for (i = 0; i < ps->num_stages; i++) {
+        parse_combiner_inputs(state->rgb_inputs[i],
+            &ps->stage[i].rgb_input.a, &ps->stage[i].rgb_input.b,
+            &ps->stage[i].rgb_input.c, &ps->stage[i].rgb_input.d);
+        parse_combiner_inputs(state->alpha_inputs[i],
+            &ps->stage[i].alpha_input.a, &ps->stage[i].alpha_input.b,
+            &ps->stage[i].alpha_input.c, &ps->stage[i].alpha_input.d);
+
+        parse_combiner_output(state->rgb_outputs[i], &ps->stage[i].rgb_output);
+        parse_combiner_output(state->alpha_outputs[i], &ps->stage[i].alpha_output);
+    }
+
+    struct InputInfo blank;
+    ps->final_input.enabled = state->final_inputs_0 || state->final_inputs_1;
+    if (ps->final_input.enabled) {
+        parse_combiner_inputs(state->final_inputs_0,
+                              &ps->final_input.a, &ps->final_input.b,
+                              &ps->final_input.c, &ps->final_input.d);
+        parse_combiner_inputs(state->final_inputs_1,
+                              &ps->final_input.e, &ps->final_input.f,
+                              &ps->final_input.g, &blank);
+        int flags = state->final_inputs_1 & 0xFF;
+        ps->final_input.clamp_sum = flags & PS_FINALCOMBINERSETTING_CLAMP_SUM;
+        ps->final_input.inv_v1 = flags & PS_FINALCOMBINERSETTING_COMPLEMENT_V1;
+        ps->final_input.inv_r0 = flags & PS_FINALCOMBINERSETTING_COMPLEMENT_R0;
+    }
+}
+
+QString *psh_translate(const PshState state)
+{
     struct PixelShader ps;
     memset(&ps, 0, sizeof(ps));
 
-    ps.state = state;
+    psh_parse(&ps, &state);
+    return psh_convert(&ps);
+}
+
+
+/*
+ * Native execution of the combiners. Registers are indexed by PS_REGISTER
+ * and hold RGBA. Unlike the GLSL, each stage reads all of its inputs before
+ * any of its outputs are written, which is what the hardware does.
+ */
+
+struct PshProgram {
+    struct PixelShader ps;
+};
+
+typedef float PshReg[4];
+
+PshProgram *psh_program_new(const PshState *state)
+{
+    PshProgram *program = g_new0(PshProgram, 1);
+    int i;
+
+    psh_parse(&program->ps, state);
 
-    ps.num_stages = state.combiner_control & 0xFF;
-    ps.flags = state.combiner_control >> 8;
     for (i = 0; i < 4; i++) {
-        ps.tex_modes[i] = (state.shader_stage_program >> (i * 5)) & 0x1F;
+        switch (program->ps.tex_modes[i]) {
+        case PS_TEXTUREMODES_NONE:
+        case PS_TEXTUREMODES_PROJECT2D:
+        case PS_TEXTUREMODES_PASSTHRU:
+        case PS_TEXTUREMODES_CLIPPLANE:
+            break;
+        case PS_TEXTUREMODES_DPNDNT_AR:
+        case PS_TEXTUREMODES_DPNDNT_GB:
+        case PS_TEXTUREMODES_DOTPRODUCT:
+            /* these read an earlier stage */
+            if (i > 0 && program->ps.input_tex[i] < i) {
+                break;
+            }
+            /* fallthrough */
+        default:
+            g_free(program);
+            return NULL;
+        }
     }
 
-    ps.input_tex[0] = -1;
-    ps.input_tex[1] = 0;
-    ps.input_tex[2] = (state.other_stage_input >> 16) & 0xF;
-    ps.input_tex[3] = (state.other_stage_input >> 20) & 0xF;
-    for (i = 0; i < ps.num_stages; i++) {
-        parse_combiner_inputs(state.rgb_inputs[i],
-            &ps.stage[i].rgb_input.a, &ps.stage[i].rgb_input.b,
-            &ps.stage[i].rgb_input.c, &ps.stage[i].rgb_input.d);
-        parse_combiner_inputs(state.alpha_inputs[i],
-            &ps.stage[i].alpha_input.a, &ps.stage[i].alpha_input.b,
-            &ps.stage[i].alpha_input.c, &ps.stage[i].alpha_input.d);
+    return program;
+}
+
+void psh_program_free(PshProgram *program)
+{
+    g_free(program);
+}
+
+static float psh_clampf(float x, float lo, float hi)
+{
+    return x < lo ? lo : (x > hi ? hi : x);
+}
 
-        parse_combiner_output(state.rgb_outputs[i], &ps.stage[i].rgb_output);
-        parse_combiner_output(state.alpha_outputs[i], &ps.stage[i].alpha_output);
+static float psh_map_input(float x, int mod)
+{
+    switch (mod) {
+    case PS_INPUTMAPPING_UNSIGNED_IDENTITY:
+        return MAX(x, 0.0f);
+    case PS_INPUTMAPPING_UNSIGNED_INVERT:
+        return 1.0f - psh_clampf(x, 0.0f, 1.0f);
+    case PS_INPUTMAPPING_EXPAND_NORMAL:
+        return 2.0f * MAX(x, 0.0f) - 1.0f;
+    case PS_INPUTMAPPING_EXPAND_NEGATE:
+        return -2.0f * MAX(x, 0.0f) + 1.0f;
+    case PS_INPUTMAPPING_HALFBIAS_NORMAL:
+        return MAX(x, 0.0f) - 0.5f;
+    case PS_INPUTMAPPING_HALFBIAS_NEGATE:
+        return -MAX(x, 0.0f) + 0.5f;
+    case PS_INPUTMAPPING_SIGNED_IDENTITY:
+        return x;
+    case PS_INPUTMAPPING_SIGNED_NEGATE:
+        return -x;
+    default:
+        assert(false);
+        return 0.0f;
     }
+}
 
-    struct InputInfo blank;
-    ps.final_input.enabled = state.final_inputs_0 || state.final_inputs_1;
-    if (ps.final_input.enabled) {
-        parse_combiner_inputs(state.final_inputs_0,
-                              &ps.final_input.a, &ps.final_input.b,
-                              &ps.final_input.c, &ps.final_input.d);
-        parse_combiner_inputs(state.final_inputs_1,
-                              &ps.final_input.e, &ps.final_input.f,
-                              &ps.final_input.g, &blank);
-        int flags = state.final_inputs_1 & 0xFF;
-        ps.final_input.clamp_sum = flags & PS_FINALCOMBINERSETTING_CLAMP_SUM;
-        ps.final_input.inv_v1 = flags & PS_FINALCOMBINERSETTING_COMPLEMENT_V1;
-        ps.final_input.inv_r0 = flags & PS_FINALCOMBINERSETTING_COMPLEMENT_R0;
+static float psh_map_output(float x, int mapping)
+{
+    switch (mapping) {
+    case PS_COMBINEROUTPUT_IDENTITY:
+        break;
+    case PS_COMBINEROUTPUT_BIAS:
+        x = x - 0.5f;
+        break;
+    case PS_COMBINEROUTPUT_SHIFTLEFT_1:
+        x = x * 2.0f;
+        break;
+    case PS_COMBINEROUTPUT_SHIFTLEFT_1_BIAS:
+        x = (x - 0.5f) * 2.0f;
+        break;
+    case PS_COMBINEROUTPUT_SHIFTLEFT_2:
+        x = x * 4.0f;
+        break;
+    case PS_COMBINEROUTPUT_SHIFTRIGHT_1:
+        x = x / 2.0f;
+        break;
+    default:
+        assert(false);
+        break;
+    }
+    return psh_clampf(x, -1.0f, 1.0f);
+}
+
+/* Reads three components for an RGB input or one for an alpha input */
+static void psh_read_input(const PshReg *regs, struct InputInfo in,
+                           bool is_alpha, float *out)
+{
+    const float *reg = regs[in.reg];
+    int i;
+
+    if (is_alpha) {
+        out[0] = psh_map_input(in.chan == PS_CHANNEL_ALPHA ? reg[3] : reg[2],
+                               in.mod);
+    } else {
+        for (i = 0; i < 3; i++) {
+            out[i] = psh_map_input(in.chan == PS_CHANNEL_ALPHA ? reg[3]
+                                                               : reg[i],
+                                   in.mod);
+        }
+    }
+}
+
+static void psh_write_output(PshReg *regs, int reg, const float *value,
+                             bool is_alpha)
+{
+    if (reg == PS_REGISTER_DISCARD) {
+        return;
     }
+    if (is_alpha) {
+        regs[reg][3] = value[0];
+    } else {
+        memcpy(regs[reg], value, 3 * sizeof(float));
+    }
+}
 
+static void psh_run_stage(const PshReg *in, PshReg *out,
+                          struct InputVarInfo input, struct OutputInfo output,
+                          bool is_alpha)
+{
+    float a[3], b[3], c[3], d[3];
+    float ab[3], cd[3], sum[3];
+    int n = is_alpha ? 1 : 3;
+    int i;
 
+    psh_read_input(in, input.a, is_alpha, a);
+    psh_read_input(in, input.b, is_alpha, b);
+    psh_read_input(in, input.c, is_alpha, c);
+    psh_read_input(in, input.d, is_alpha, d);
 
-    return psh_convert(&ps);
+    if (!is_alpha && output.ab_op == PS_COMBINEROUTPUT_AB_DOT_PRODUCT) {
+        ab[0] = ab[1] = ab[2] = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+    } else {
+        for (i = 0; i < n; i++) {
+            ab[i] = a[i] * b[i];
+        }
+    }
+    if (!is_alpha && output.cd_op == PS_COMBINEROUTPUT_CD_DOT_PRODUCT) {
+        cd[0] = cd[1] = cd[2] = c[0] * d[0] + c[1] * d[1] + c[2] * d[2];
+    } else {
+        for (i = 0; i < n; i++) {
+            cd[i] = c[i] * d[i];
+        }
+    }
+
+    bool mux_cd = in[PS_REGISTER_R0][3] >= 0.5f;
+    for (i = 0; i < n; i++) {
+        if (output.muxsum_op == PS_COMBINEROUTPUT_AB_CD_SUM) {
+            sum[i] = ab[i] + cd[i];
+        } else {
+            sum[i] = mux_cd ? cd[i] : ab[i];
+        }
+        ab[i] = psh_map_output(ab[i], output.mapping);
+        cd[i] = psh_map_output(cd[i], output.mapping);
+        sum[i] = psh_map_output(sum[i], output.mapping);
+    }
+
+    psh_write_output(out, output.ab, ab, is_alpha);
+    psh_write_output(out, output.cd, cd, is_alpha);
+    if (!is_alpha && output.flags & PS_COMBINEROUTPUT_AB_BLUE_TO_ALPHA
+        && output.ab != PS_REGISTER_DISCARD) {
+        out[output.ab][3] = ab[2];
+    }
+    if (!is_alpha && output.flags & PS_COMBINEROUTPUT_CD_BLUE_TO_ALPHA
+        && output.cd != PS_REGISTER_DISCARD) {
+        out[output.cd][3] = cd[2];
+    }
+    psh_write_output(out, output.muxsum, sum, is_alpha);
+}
+
+static void psh_load_constants(const struct PixelShader *ps,
+                               const PshEnvironment *env, PshReg *regs,
+                               int stage)
+{
+    int c0 = (ps->flags & PS_COMBINERCOUNT_UNIQUE_C0 || stage == 8) ? stage : 0;
+    int c1 = (ps->flags & PS_COMBINERCOUNT_UNIQUE_C1 || stage == 8) ? stage : 0;
+
+    memcpy(regs[PS_REGISTER_C0], env->c0[c0], sizeof(PshReg));
+    memcpy(regs[PS_REGISTER_C1], env->c1[c1], sizeof(PshReg));
+}
+
+static bool psh_alpha_test(enum PshAlphaFunc func, float alpha, float ref)
+{
+    switch (func) {
+    case ALPHA_FUNC_NEVER:    return false;
+    case ALPHA_FUNC_LESS:     return alpha < ref;
+    case ALPHA_FUNC_EQUAL:    return alpha == ref;
+    case ALPHA_FUNC_LEQUAL:   return alpha <= ref;
+    case ALPHA_FUNC_GREATER:  return alpha > ref;
+    case ALPHA_FUNC_NOTEQUAL: return alpha != ref;
+    case ALPHA_FUNC_GEQUAL:   return alpha >= ref;
+    case ALPHA_FUNC_ALWAYS:   return true;
+    default:
+        assert(false);
+        return true;
+    }
+}
+
+bool psh_program_run(const PshProgram *program, const PshEnvironment *env,
+                     const PshFragment *fragment, float color[4])
+{
+    const struct PixelShader *ps = &program->ps;
+    PshReg regs[16], next[16];
+    int i, j;
+
+    memset(regs, 0, sizeof(regs));
+    memcpy(regs[PS_REGISTER_V0], fragment->v0, sizeof(PshReg));
+    memcpy(regs[PS_REGISTER_V1], fragment->v1, sizeof(PshReg));
+    memcpy(regs[PS_REGISTER_FOG], env->fog_color, 3 * sizeof(float));
+    regs[PS_REGISTER_FOG][3] = psh_clampf(fragment->fog, 0.0f, 1.0f);
+
+    /* texture stages */
+    for (i = 0; i < 4; i++) {
+        const float *tc = fragment->texcoord[i];
+        float *t = regs[PS_REGISTER_T0 + i];
+        const float *prev = ps->input_tex[i] >= 0
+                                ? regs[PS_REGISTER_T0 + ps->input_tex[i]]
+                                : NULL;
+        bool sampled = true;
+
+        switch (ps->tex_modes[i]) {
+        case PS_TEXTUREMODES_NONE:
+            sampled = false;
+            break;
+        case PS_TEXTUREMODES_PROJECT2D:
+            env->sample(env->sample_opaque, i, tc[0] / tc[3], tc[1] / tc[3], t);
+            break;
+        case PS_TEXTUREMODES_PASSTHRU:
+            memcpy(t, tc, sizeof(PshReg));
+            sampled = false;
+            break;
+        case PS_TEXTUREMODES_CLIPPLANE:
+            for (j = 0; j < 4; j++) {
+                if (ps->state.compare_mode[i][j] ? tc[j] >= 0.0f
+                                                 : tc[j] < 0.0f) {
+                    return false;
+                }
+            }
+            sampled = false;
+            break;
+        case PS_TEXTUREMODES_DPNDNT_AR:
+            env->sample(env->sample_opaque, i, prev[3], prev[0], t);
+            break;
+        case PS_TEXTUREMODES_DPNDNT_GB:
+            env->sample(env->sample_opaque, i, prev[1], prev[2], t);
+            break;
+        case PS_TEXTUREMODES_DOTPRODUCT:
+            t[0] = t[1] = t[2] = t[3] =
+                tc[0] * prev[0] + tc[1] * prev[1] + tc[2] * prev[2];
+            sampled = false;
+            break;
+        default:
+            assert(false);
+            break;
+        }
+
+        if (sampled && ps->state.alphakill[i] && t[3] == 0.0f) {
+            return false;
+        }
+    }
+
+    regs[PS_REGISTER_R0][3] =
+        ps->tex_modes[0] != PS_TEXTUREMODES_NONE ? regs[PS_REGISTER_T0][3]
+                                                 : 1.0f;
+
+    for (i = 0; i < ps->num_stages; i++) {
+        psh_load_constants(ps, env, regs, i);
+        memcpy(next, regs, sizeof(regs));
+        psh_run_stage((const PshReg *)regs, next, ps->stage[i].rgb_input,
+                      ps->stage[i].rgb_output, false);
+        psh_run_stage((const PshReg *)regs, next, ps->stage[i].alpha_input,
+                      ps->stage[i].alpha_output, true);
+        memcpy(regs, next, sizeof(regs));
+    }
+
+    if (ps->final_input.enabled) {
+        const struct FCInputInfo *fc = &ps->final_input;
+        float a[3], b[3], c[3], d[3], e[3], f[3];
+
+        psh_load_constants(ps, env, regs, 8);
+
+        psh_read_input((const PshReg *)regs, fc->e, false, e);
+        psh_read_input((const PshReg *)regs, fc->f, false, f);
+        for (j = 0; j < 3; j++) {
+            float v1 = regs[PS_REGISTER_V1][j];
+            float r0 = regs[PS_REGISTER_R0][j];
+            if (fc->inv_v1) {
+                v1 = 1.0f - psh_clampf(v1, 0.0f, 1.0f);
+            }
+            if (fc->inv_r0) {
+                r0 = 1.0f - psh_clampf(r0, 0.0f, 1.0f);
+            }
+            regs[PS_REGISTER_V1R0_SUM][j] = fc->clamp_sum
+                ? psh_clampf(v1 + r0, 0.0f, 1.0f) : v1 + r0;
+            regs[PS_REGISTER_EF_PROD][j] = e[j] * f[j];
+        }
+        regs[PS_REGISTER_V1R0_SUM][3] = 0.0f;
+        regs[PS_REGISTER_EF_PROD][3] = 0.0f;
+
+        psh_read_input((const PshReg *)regs, fc->a, false, a);
+        psh_read_input((const PshReg *)regs, fc->b, false, b);
+        psh_read_input((const PshReg *)regs, fc->c, false, c);
+        psh_read_input((const PshReg *)regs, fc->d, false, d);
+        for (j = 0; j < 3; j++) {
+            color[j] = d[j] + c[j] * (1.0f - a[j]) + b[j] * a[j];
+        }
+        psh_read_input((const PshReg *)regs, fc->g, true, &color[3]);
+    } else {
+        memcpy(color, regs[PS_REGISTER_R0], sizeof(PshReg));
+    }
+
+    if (ps->state.alpha_test
+        && !psh_alpha_test(ps->state.alpha_func, color[3], env->alpha_ref)) {
+        return false;
+    }
+
+    for (j = 0; j < 4; j++) {
+        color[j] = psh_clampf(color[j], 0.0f, 1.0f);
+    }
+    return true;
 }
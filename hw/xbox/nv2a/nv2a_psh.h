@@ -48,6 +48,12 @@ typedef struct PshState {
     bool compare_mode[4][4];
     bool alphakill[4];
 
+    /* The texture holds palette indices or YUY2 as the guest wrote them,
+     * the shader looks them up or decodes them and so also filters */
+    bool palette_tex[4];
+    bool yuv_tex[4];
+    bool lookup_linear[4];
+
     bool alpha_test;
     enum PshAlphaFunc alpha_func;
 
@@ -57,4 +63,39 @@ typedef struct PshState {
 
 QString *psh_translate(const PshState state);
 
+/*
+ * Runs the register combiners on the CPU for the software renderer, with
+ * the same texture stage and combiner semantics as the translated shaders.
+ */
+
+typedef struct PshProgram PshProgram;
+
+/* Inputs that stay the same for a whole draw */
+typedef struct PshEnvironment {
+    float c0[9][4], c1[9][4];   /* per combiner stage, RGBA */
+    float fog_color[3];
+    float alpha_ref;
+
+    /* Looks up a texture stage like the GLSL sampler would, so s and t are
+     * in texels for linear textures and normalized otherwise */
+    void (*sample)(const void *opaque, int stage,
+                   float s, float t, float color[4]);
+    const void *sample_opaque;
+} PshEnvironment;
+
+/* Interpolated inputs of a fragment, already divided by w */
+typedef struct PshFragment {
+    float v0[4], v1[4];
+    float fog;
+    float texcoord[4][4];
+} PshFragment;
+
+/* Returns NULL if the program uses texture modes that can't be run */
+PshProgram *psh_program_new(const PshState *state);
+void psh_program_free(PshProgram *program);
+
+/* Returns false if the fragment is discarded, color is clamped to [0, 1] */
+bool psh_program_run(const PshProgram *program, const PshEnvironment *env,
+                     const PshFragment *fragment, float color[4]);
+
 #endif
@@ -516,6 +516,9 @@
 #       define NV_PGRAPH_TEXFILTER0_MIN_TENT_TENT_LOD               6
 #       define NV_PGRAPH_TEXFILTER0_MIN_CONVOLUTION_2D_LOD0         7
 #   define NV_PGRAPH_TEXFILTER0_MAG                             0x0F000000
+#       define NV_PGRAPH_TEXFILTER0_MAG_BOX_LOD0                    1
+#       define NV_PGRAPH_TEXFILTER0_MAG_TENT_LOD0                   2
+#       define NV_PGRAPH_TEXFILTER0_MAG_CONVOLUTION_2D_LOD0         4
 #   define NV_PGRAPH_TEXFILTER0_ASIGNED                         (1 << 28)
 #   define NV_PGRAPH_TEXFILTER0_RSIGNED                         (1 << 29)
 #   define NV_PGRAPH_TEXFILTER0_GSIGNED                         (1 << 30)
@@ -0,0 +1,298 @@
+/*
+ * QEMU Geforce NV2A persistent shader program cache
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "nv2a_debug.h"
+#include "nv2a_shader_cache.h"
+#include "xxhash.h"
+
+/* Bump whenever the file layout or the shader generators change */
+#define SHADER_DISK_CACHE_MAGIC   0x48535632 /* "2VSH" */
+#define SHADER_DISK_CACHE_VERSION 5
+
+typedef struct ShaderDiskCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t state_size;
+    uint32_t reserved;
+    uint64_t driver_hash;
+} ShaderDiskCacheHeader;
+
+typedef struct ShaderDiskCacheRecord {
+    uint64_t state_hash;
+    uint64_t binary_hash;
+    uint32_t binary_format;
+    uint32_t binary_length;
+    uint32_t gl_primitive_mode;
+    uint32_t reserved;
+} ShaderDiskCacheRecord;
+
+typedef struct ShaderDiskCacheEntry {
+    ShaderState state;
+    GLenum binary_format;
+    GLsizei binary_length;
+    GLenum gl_primitive_mode;
+    uint8_t binary[];
+} ShaderDiskCacheEntry;
+
+static guint shader_state_hash(gconstpointer key)
+{
+    return XXH64(key, sizeof(ShaderState), 0);
+}
+
+static gboolean shader_state_equal(gconstpointer a, gconstpointer b)
+{
+    return memcmp(a, b, sizeof(ShaderState)) == 0;
+}
+
+static uint64_t get_driver_hash(void)
+{
+    const char *strings[] = {
+        (const char *)glGetString(GL_VENDOR),
+        (const char *)glGetString(GL_RENDERER),
+        (const char *)glGetString(GL_VERSION),
+    };
+    uint64_t hash = 0;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(strings); i++) {
+        const char *s = strings[i] ? strings[i] : "";
+        hash = XXH64(s, strlen(s), hash);
+    }
+    return hash;
+}
+
+static void shader_disk_cache_insert(ShaderDiskCache *cache,
+                                     const ShaderState *state,
+                                     GLenum binary_format,
+                                     const void *binary,
+                                     GLsizei binary_length,
+                                     GLenum gl_primitive_mode)
+{
+    ShaderDiskCacheEntry *entry = g_malloc(sizeof(*entry) + binary_length);
+    memcpy(&entry->state, state, sizeof(ShaderState));
+    entry->binary_format = binary_format;
+    entry->binary_length = binary_length;
+    entry->gl_primitive_mode = gl_primitive_mode;
+    memcpy(entry->binary, binary, binary_length);
+
+    /* later records for the same state supersede earlier ones */
+    g_hash_table_replace(cache->entries, &entry->state, entry);
+}
+
+/* Returns the number of bytes of valid records at the start of the file */
+static size_t shader_disk_cache_parse(ShaderDiskCache *cache,
+                                      const uint8_t *data, size_t length,
+                                      uint64_t driver_hash)
+{
+    const ShaderDiskCacheHeader *header = (const ShaderDiskCacheHeader *)data;
+    size_t offset;
+
+    if (length < sizeof(*header)
+        || header->magic != SHADER_DISK_CACHE_MAGIC
+        || header->version != SHADER_DISK_CACHE_VERSION
+        || header->state_size != sizeof(ShaderState)
+        || header->driver_hash != driver_hash) {
+        NV2A_DPRINTF("shader cache: discarding stale %s\n", cache->path);
+        return 0;
+    }
+    offset = sizeof(*header);
+
+    while (offset + sizeof(ShaderDiskCacheRecord) + sizeof(ShaderState)
+             <= length) {
+        ShaderDiskCacheRecord record;
+        memcpy(&record, data + offset, sizeof(record));
+        const uint8_t *state = data + offset + sizeof(record);
+        const uint8_t *binary = state + sizeof(ShaderState);
+        size_t record_size = sizeof(record) + sizeof(ShaderState)
+                               + record.binary_length;
+
+        if (offset + record_size > length) {
+            /* truncated by an earlier crash */
+            break;
+        }
+        if (record.state_hash != XXH64(state, sizeof(ShaderState), 0)
+            || record.binary_hash != XXH64(binary, record.binary_length, 0)) {
+            break;
+        }
+
+        ShaderState s;
+        memcpy(&s, state, sizeof(s));
+        shader_disk_cache_insert(cache, &s, record.binary_format,
+                                 binary, record.binary_length,
+                                 record.gl_primitive_mode);
+        offset += record_size;
+    }
+
+    return offset;
+}
+
+ShaderDiskCache *shader_disk_cache_open(const char *path)
+{
+    GLint num_formats = 0;
+
+    if (!glo_check_extension("GL_ARB_get_program_binary")) {
+        fprintf(stderr, "nv2a: shader cache requires "
+                        "GL_ARB_get_program_binary, disabled\n");
+        return NULL;
+    }
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+    if (num_formats == 0) {
+        fprintf(stderr, "nv2a: host GL driver has no program binary "
+                        "formats, shader cache disabled\n");
+        return NULL;
+    }
+
+    ShaderDiskCache *cache = g_malloc0(sizeof(ShaderDiskCache));
+    qemu_mutex_init(&cache->lock);
+    cache->path = g_strdup(path);
+    cache->entries = g_hash_table_new_full(shader_state_hash,
+                                           shader_state_equal,
+                                           NULL, g_free);
+
+    uint64_t driver_hash = get_driver_hash();
+    gchar *data = NULL;
+    gsize length = 0;
+    size_t valid = 0;
+    if (g_file_get_contents(path, &data, &length, NULL)) {
+        valid = shader_disk_cache_parse(cache, (const uint8_t *)data, length,
+                                        driver_hash);
+    }
+
+    /* Rewrite the file if any part of it was unusable, so that new records
+     * are never appended after garbage */
+    if (valid == 0) {
+        cache->file = fopen(path, "wb");
+        if (cache->file) {
+            ShaderDiskCacheHeader header = {
+                .magic = SHADER_DISK_CACHE_MAGIC,
+                .version = SHADER_DISK_CACHE_VERSION,
+                .state_size = sizeof(ShaderState),
+                .driver_hash = driver_hash,
+            };
+            fwrite(&header, sizeof(header), 1, cache->file);
+        }
+    } else if (valid < length) {
+        cache->file = fopen(path, "wb");
+        if (cache->file) {
+            fwrite(data, valid, 1, cache->file);
+        }
+    } else {
+        cache->file = fopen(path, "ab");
+    }
+    g_free(data);
+
+    if (!cache->file) {
+        fprintf(stderr, "nv2a: failed to open shader cache %s: %s\n",
+                path, strerror(errno));
+    } else {
+        fflush(cache->file);
+    }
+
+    NV2A_DPRINTF("shader cache: loaded %u programs from %s\n",
+                 g_hash_table_size(cache->entries), path);
+
+    return cache;
+}
+
+void shader_disk_cache_close(ShaderDiskCache *cache)
+{
+    NV2A_DPRINTF("shader cache: %u hits, %u misses, %u rejected\n",
+                 cache->hits, cache->misses, cache->rejected);
+
+    if (cache->file) {
+        fclose(cache->file);
+    }
+    g_hash_table_destroy(cache->entries);
+    qemu_mutex_destroy(&cache->lock);
+    g_free(cache->path);
+    g_free(cache);
+}
+
+ShaderBinding *shader_disk_cache_lookup(ShaderDiskCache *cache,
+                                        const ShaderState *state)
+{
+    qemu_mutex_lock(&cache->lock);
+    ShaderDiskCacheEntry *entry = g_hash_table_lookup(cache->entries, state);
+    if (!entry) {
+        cache->misses++;
+        qemu_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+
+    /* the caller keeps the binding around, so the blob is no longer needed */
+    g_hash_table_steal(cache->entries, state);
+    qemu_mutex_unlock(&cache->lock);
+
+    ShaderBinding *binding =
+        generate_shaders_from_binary(entry->binary_format, entry->binary,
+                                     entry->binary_length,
+                                     entry->gl_primitive_mode);
+    g_free(entry);
+
+    qemu_mutex_lock(&cache->lock);
+    if (binding) {
+        cache->hits++;
+    } else {
+        NV2A_DPRINTF("shader cache: driver rejected program binary\n");
+        cache->rejected++;
+        cache->misses++;
+    }
+    qemu_mutex_unlock(&cache->lock);
+
+    return binding;
+}
+
+void shader_disk_cache_store(ShaderDiskCache *cache,
+                             const ShaderState *state,
+                             const ShaderBinding *binding)
+{
+    GLint binary_length = 0;
+    GLenum binary_format;
+
+    if (!cache->file) {
+        return;
+    }
+
+    glGetProgramiv(binding->gl_program, GL_PROGRAM_BINARY_LENGTH,
+                   &binary_length);
+    if (binary_length <= 0) {
+        return;
+    }
+
+    uint8_t *binary = g_malloc(binary_length);
+    glGetProgramBinary(binding->gl_program, binary_length, &binary_length,
+                       &binary_format, binary);
+
+    ShaderDiskCacheRecord record = {
+        .state_hash = XXH64(state, sizeof(ShaderState), 0),
+        .binary_hash = XXH64(binary, binary_length, 0),
+        .binary_format = binary_format,
+        .binary_length = binary_length,
+        .gl_primitive_mode = binding->gl_primitive_mode,
+    };
+
+    qemu_mutex_lock(&cache->lock);
+    fwrite(&record, sizeof(record), 1, cache->file);
+    fwrite(state, sizeof(ShaderState), 1, cache->file);
+    fwrite(binary, binary_length, 1, cache->file);
+    fflush(cache->file);
+    qemu_mutex_unlock(&cache->lock);
+
+    g_free(binary);
+}
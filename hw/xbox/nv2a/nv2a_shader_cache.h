@@ -0,0 +1,59 @@
+/*
+ * QEMU Geforce NV2A persistent shader program cache
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_NV2A_SHADER_CACHE_H
+#define HW_NV2A_SHADER_CACHE_H
+
+#include <stdio.h>
+#include <glib.h>
+
+#include "qemu/thread.h"
+#include "nv2a_shaders.h"
+
+/*
+ * Linked GL program binaries are kept in a single file, keyed by the hash of
+ * the ShaderState that generated them. The file header records the host GL
+ * driver (vendor, renderer and version strings), so binaries produced by a
+ * different driver are thrown away instead of being handed to glProgramBinary.
+ *
+ * All entries are read into memory when the cache is opened and are only
+ * linked on first use. Newly compiled programs are appended to the file as
+ * they are generated. Lookups and stores may come from several shader
+ * compiler threads.
+ */
+typedef struct ShaderDiskCache {
+    QemuMutex lock;
+    char *path;
+    FILE *file;
+    GHashTable *entries;
+
+    unsigned int hits;
+    unsigned int misses;
+    unsigned int rejected;
+} ShaderDiskCache;
+
+/* Must be called with the GL context current. Returns NULL if unsupported. */
+ShaderDiskCache *shader_disk_cache_open(const char *path);
+void shader_disk_cache_close(ShaderDiskCache *cache);
+
+ShaderBinding *shader_disk_cache_lookup(ShaderDiskCache *cache,
+                                        const ShaderState *state);
+void shader_disk_cache_store(ShaderDiskCache *cache,
+                             const ShaderState *state,
+                             const ShaderBinding *binding);
+
+#endif
@@ -0,0 +1,212 @@
+/*
+ * QEMU Geforce NV2A background shader compilation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/timer.h"
+#include "nv2a_debug.h"
+#include "nv2a_shader_compiler.h"
+#include "xxhash.h"
+
+typedef struct ShaderCompileJob {
+    ShaderState state;
+    ShaderBinding *binding;
+    bool done;
+} ShaderCompileJob;
+
+static guint shader_state_hash(gconstpointer key)
+{
+    return XXH64(key, sizeof(ShaderState), 0);
+}
+
+static gboolean shader_state_equal(gconstpointer a, gconstpointer b)
+{
+    return memcmp(a, b, sizeof(ShaderState)) == 0;
+}
+
+/* Needs a GL context current on the calling thread */
+static ShaderBinding *shader_compiler_compile(ShaderCompiler *compiler,
+                                              const ShaderState *state)
+{
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    ShaderBinding *binding = NULL;
+
+    if (compiler->disk_cache) {
+        binding = shader_disk_cache_lookup(compiler->disk_cache, state);
+    }
+    if (!binding) {
+        binding = generate_shaders(*state);
+        if (compiler->disk_cache) {
+            shader_disk_cache_store(compiler->disk_cache, state, binding);
+        }
+    }
+
+    int64_t elapsed = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    NV2A_DPRINTF("shader program %d ready after %" PRId64 " us\n",
+                 binding->gl_program, elapsed / 1000);
+
+    qemu_mutex_lock(&compiler->lock);
+    compiler->programs_compiled++;
+    compiler->compile_time_total_ns += elapsed;
+    compiler->compile_time_max_ns = MAX(compiler->compile_time_max_ns,
+                                        elapsed);
+    qemu_mutex_unlock(&compiler->lock);
+
+    return binding;
+}
+
+static void *shader_compiler_thread(void *arg)
+{
+    ShaderCompilerWorker *worker = (ShaderCompilerWorker *)arg;
+    ShaderCompiler *compiler = worker->compiler;
+
+    glo_set_current(worker->context);
+
+    qemu_mutex_lock(&compiler->lock);
+    while (true) {
+        while (!compiler->exiting && g_queue_is_empty(&compiler->queue)) {
+            qemu_cond_wait(&compiler->work_cond, &compiler->lock);
+        }
+        if (compiler->exiting) {
+            break;
+        }
+
+        ShaderCompileJob *job = g_queue_pop_head(&compiler->queue);
+        qemu_mutex_unlock(&compiler->lock);
+
+        ShaderBinding *binding = shader_compiler_compile(compiler,
+                                                         &job->state);
+
+        /* The program is used from the rendering context, make sure the
+         * driver has actually finished with it first */
+        glFinish();
+
+        qemu_mutex_lock(&compiler->lock);
+        job->binding = binding;
+        job->done = true;
+        qemu_cond_broadcast(&compiler->done_cond);
+    }
+    qemu_mutex_unlock(&compiler->lock);
+
+    glo_set_current(NULL);
+
+    return NULL;
+}
+
+void shader_compiler_init(ShaderCompiler *compiler, GloContext *shared,
+                          unsigned int num_threads,
+                          ShaderDiskCache *disk_cache)
+{
+    int i;
+
+    qemu_mutex_init(&compiler->lock);
+    qemu_cond_init(&compiler->work_cond);
+    qemu_cond_init(&compiler->done_cond);
+    g_queue_init(&compiler->queue);
+    compiler->jobs = g_hash_table_new_full(shader_state_hash,
+                                           shader_state_equal,
+                                           NULL, g_free);
+    compiler->exiting = false;
+    compiler->disk_cache = disk_cache;
+    compiler->num_threads = num_threads;
+
+    if (num_threads == 0) {
+        return;
+    }
+
+    compiler->workers = g_new0(ShaderCompilerWorker, num_threads);
+    for (i = 0; i < num_threads; i++) {
+        ShaderCompilerWorker *worker = &compiler->workers[i];
+        worker->compiler = compiler;
+        worker->context = glo_context_create_shared(shared);
+        assert(worker->context);
+    }
+
+    /* Creating a context makes it current, switch back before any of them
+     * are picked up by the worker threads */
+    glo_set_current(shared);
+
+    for (i = 0; i < num_threads; i++) {
+        ShaderCompilerWorker *worker = &compiler->workers[i];
+        qemu_thread_create(&worker->thread, "nv2a.shader_compiler",
+                           shader_compiler_thread,
+                           worker, QEMU_THREAD_JOINABLE);
+    }
+}
+
+void shader_compiler_destroy(ShaderCompiler *compiler)
+{
+    int i;
+
+    qemu_mutex_lock(&compiler->lock);
+    compiler->exiting = true;
+    qemu_cond_broadcast(&compiler->work_cond);
+    qemu_mutex_unlock(&compiler->lock);
+
+    for (i = 0; i < compiler->num_threads; i++) {
+        qemu_thread_join(&compiler->workers[i].thread);
+        glo_context_destroy(compiler->workers[i].context);
+    }
+    g_free(compiler->workers);
+
+    NV2A_DPRINTF("shader compiler: %u programs, %.2f ms average, "
+                 "%.2f ms max, %u draws skipped\n",
+                 compiler->programs_compiled,
+                 compiler->compile_time_total_ns / 1e6
+                     / MAX(compiler->programs_compiled, 1),
+                 compiler->compile_time_max_ns / 1e6,
+                 compiler->draws_skipped);
+
+    g_queue_clear(&compiler->queue);
+    g_hash_table_destroy(compiler->jobs);
+    qemu_cond_destroy(&compiler->work_cond);
+    qemu_cond_destroy(&compiler->done_cond);
+    qemu_mutex_destroy(&compiler->lock);
+}
+
+ShaderBinding *shader_compiler_get(ShaderCompiler *compiler,
+                                   const ShaderState *state, bool wait)
+{
+    if (compiler->num_threads == 0) {
+        return shader_compiler_compile(compiler, state);
+    }
+
+    qemu_mutex_lock(&compiler->lock);
+
+    ShaderCompileJob *job = g_hash_table_lookup(compiler->jobs, state);
+    if (!job) {
+        job = g_new0(ShaderCompileJob, 1);
+        memcpy(&job->state, state, sizeof(ShaderState));
+        g_hash_table_insert(compiler->jobs, &job->state, job);
+        g_queue_push_tail(&compiler->queue, job);
+        qemu_cond_signal(&compiler->work_cond);
+    }
+
+    while (wait && !job->done) {
+        qemu_cond_wait(&compiler->done_cond, &compiler->lock);
+    }
+
+    ShaderBinding *binding = NULL;
+    if (job->done) {
+        binding = job->binding;
+        g_hash_table_remove(compiler->jobs, state);
+    }
+
+    qemu_mutex_unlock(&compiler->lock);
+
+    return binding;
+}
@@ -0,0 +1,73 @@
+/*
+ * QEMU Geforce NV2A background shader compilation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_NV2A_SHADER_COMPILER_H
+#define HW_NV2A_SHADER_COMPILER_H
+
+#include <glib.h>
+
+#include "qemu/thread.h"
+#include "gl/gloffscreen.h"
+#include "nv2a_shaders.h"
+#include "nv2a_shader_cache.h"
+
+/*
+ * Programs are generated by a pool of worker threads, each with its own GL
+ * context sharing objects with the rendering context. With no worker threads
+ * programs are compiled on the calling thread, as before.
+ *
+ * Callers either block until a program is ready or get NULL back while it is
+ * still being compiled, in which case they ask again on the next draw.
+ */
+typedef struct ShaderCompiler ShaderCompiler;
+
+typedef struct ShaderCompilerWorker {
+    ShaderCompiler *compiler;
+    QemuThread thread;
+    GloContext *context;
+} ShaderCompilerWorker;
+
+struct ShaderCompiler {
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    GQueue queue;
+    GHashTable *jobs;
+    bool exiting;
+
+    unsigned int num_threads;
+    ShaderCompilerWorker *workers;
+
+    ShaderDiskCache *disk_cache;
+
+    /* statistics */
+    unsigned int programs_compiled;
+    int64_t compile_time_total_ns;
+    int64_t compile_time_max_ns;
+    unsigned int draws_skipped;
+};
+
+/* Must be called with the shared GL context current, which it leaves current */
+void shader_compiler_init(ShaderCompiler *compiler, GloContext *shared,
+                          unsigned int num_threads,
+                          ShaderDiskCache *disk_cache);
+void shader_compiler_destroy(ShaderCompiler *compiler);
+
+ShaderBinding *shader_compiler_get(ShaderCompiler *compiler,
+                                   const ShaderState *state, bool wait);
+
+#endif
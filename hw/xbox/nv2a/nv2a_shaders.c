@@ -310,9 +310,11 @@ static void generate_fixed_function(const ShaderState state,
 "#define reserved2     v14\n"
 "#define reserved3     v15\n"
 "\n"
-"uniform vec4 ltctxa[" stringify(NV2A_LTCTXA_COUNT) "];\n"
-"uniform vec4 ltctxb[" stringify(NV2A_LTCTXB_COUNT) "];\n"
-"uniform vec4 ltc1[" stringify(NV2A_LTC1_COUNT) "];\n"
+"layout(std140) uniform LightingConstants {\n"
+"    vec4 ltctxa[" stringify(NV2A_LTCTXA_COUNT) "];\n"
+"    vec4 ltctxb[" stringify(NV2A_LTCTXB_COUNT) "];\n"
+"    vec4 ltc1[" stringify(NV2A_LTC1_COUNT) "];\n"
+"};\n"
 "\n"
 GLSL_DEFINE(projectionMat, GLSL_C_MAT4(NV_IGRAPH_XF_XFCTX_PMAT0))
 GLSL_DEFINE(compositeMat, GLSL_C_MAT4(NV_IGRAPH_XF_XFCTX_CMAT0))
@@ -638,8 +640,10 @@ static QString *generate_vertex_shader(const ShaderState state,
 "uniform vec2 clipRange;\n"
 "uniform vec2 surfaceSize;\n"
 "\n"
-/* All constants in 1 array declaration */
-"uniform vec4 c[" stringify(NV2A_VERTEXSHADER_CONSTANTS) "];\n"
+/* All constants in 1 array declaration, backed by a uniform buffer */
+"layout(std140) uniform VshConstants {\n"
+"    vec4 c[" stringify(NV2A_VERTEXSHADER_CONSTANTS) "];\n"
+"};\n"
 "\n"
 "uniform vec4 fogColor;\n"
 "uniform float fogParam[2];\n"
@@ -695,6 +699,8 @@ STRUCT_VERTEX_DATA);
     if (state.fixed_function) {
         generate_fixed_function(state, header, body);
 
+    } else if (state.program_passthrough) {
+        vsh_translate_passthrough(state.z_perspective, body);
     } else if (state.vertex_program) {
         vsh_translate(VSH_VERSION_XVS,
                       (uint32_t*)state.program_data,
@@ -837,11 +843,104 @@ static GLuint create_gl_shader(GLenum gl_shader_type,
     return shader;
 }
 
-ShaderBinding* generate_shaders(const ShaderState state)
+static ShaderBinding* create_shader_binding(GLuint program,
+                                            GLenum gl_primitive_mode)
 {
     int i, j;
     char tmp[64];
 
+    glUseProgram(program);
+
+    /* set texture samplers */
+    for (i = 0; i < NV2A_MAX_TEXTURES; i++) {
+        char samplerName[16];
+        snprintf(samplerName, sizeof(samplerName), "texSamp%d", i);
+        GLint texSampLoc = glGetUniformLocation(program, samplerName);
+        if (texSampLoc >= 0) {
+            glUniform1i(texSampLoc, i);
+        }
+        snprintf(samplerName, sizeof(samplerName), "palSamp%d", i);
+        GLint palSampLoc = glGetUniformLocation(program, samplerName);
+        if (palSampLoc >= 0) {
+            glUniform1i(palSampLoc, NV2A_PALETTE_TEXTURE_UNIT(i));
+        }
+    }
+
+    /* validate the program */
+    glValidateProgram(program);
+    GLint valid = 0;
+    glGetProgramiv(program, GL_VALIDATE_STATUS, &valid);
+    if (!valid) {
+        return NULL;
+    }
+
+    ShaderBinding* ret = g_malloc0(sizeof(ShaderBinding));
+    ret->gl_program = program;
+    ret->gl_primitive_mode = gl_primitive_mode;
+
+    /* lookup fragment shader uniforms */
+    for (i = 0; i < 9; i++) {
+        for (j = 0; j < 2; j++) {
+            snprintf(tmp, sizeof(tmp), "c%d_%d", j, i);
+            ret->psh_constant_loc[i][j] = glGetUniformLocation(program, tmp);
+        }
+    }
+    ret->alpha_ref_loc = glGetUniformLocation(program, "alphaRef");
+    for (i = 0; i < NV2A_MAX_TEXTURES; i++) {
+        snprintf(tmp, sizeof(tmp), "palMaxLod%d", i);
+        ret->palette_max_lod_loc[i] = glGetUniformLocation(program, tmp);
+    }
+    for (i = 1; i < NV2A_MAX_TEXTURES; i++) {
+        snprintf(tmp, sizeof(tmp), "bumpMat%d", i);
+        ret->bump_mat_loc[i] = glGetUniformLocation(program, tmp);
+        snprintf(tmp, sizeof(tmp), "bumpScale%d", i);
+        ret->bump_scale_loc[i] = glGetUniformLocation(program, tmp);
+        snprintf(tmp, sizeof(tmp), "bumpOffset%d", i);
+        ret->bump_offset_loc[i] = glGetUniformLocation(program, tmp);
+    }
+
+    /* vertex program and lighting constants come from uniform buffers */
+    GLuint block = glGetUniformBlockIndex(program, "VshConstants");
+    if (block != GL_INVALID_INDEX) {
+        glUniformBlockBinding(program, block, NV2A_VSH_CONSTANTS_BINDING);
+    }
+    block = glGetUniformBlockIndex(program, "LightingConstants");
+    if (block != GL_INVALID_INDEX) {
+        glUniformBlockBinding(program, block, NV2A_LIGHTING_CONSTANTS_BINDING);
+    }
+
+    /* lookup vertex shader uniforms */
+    ret->surface_size_loc = glGetUniformLocation(program, "surfaceSize");
+    ret->clip_range_loc = glGetUniformLocation(program, "clipRange");
+    ret->fog_color_loc = glGetUniformLocation(program, "fogColor");
+    ret->fog_param_loc[0] = glGetUniformLocation(program, "fogParam[0]");
+    ret->fog_param_loc[1] = glGetUniformLocation(program, "fogParam[1]");
+
+    ret->inv_viewport_loc = glGetUniformLocation(program, "invViewport");
+    for (i = 0; i < NV2A_MAX_LIGHTS; i++) {
+        snprintf(tmp, sizeof(tmp), "lightInfiniteHalfVector%d", i);
+        ret->light_infinite_half_vector_loc[i] = glGetUniformLocation(program, tmp);
+        snprintf(tmp, sizeof(tmp), "lightInfiniteDirection%d", i);
+        ret->light_infinite_direction_loc[i] = glGetUniformLocation(program, tmp);
+
+        snprintf(tmp, sizeof(tmp), "lightLocalPosition%d", i);
+        ret->light_local_position_loc[i] = glGetUniformLocation(program, tmp);
+        snprintf(tmp, sizeof(tmp), "lightLocalAttenuation%d", i);
+        ret->light_local_attenuation_loc[i] = glGetUniformLocation(program, tmp);
+    }
+    for (i = 0; i < 8; i++) {
+        snprintf(tmp, sizeof(tmp), "clipRegion[%d]", i);
+        ret->clip_region_loc[i] = glGetUniformLocation(program, tmp);
+    }
+
+    return ret;
+}
+
+ShaderBinding* generate_shaders(const ShaderState state)
+{
+    int i;
+    char tmp[64];
+
     char vtx_prefix;
     GLuint program = glCreateProgram();
 
@@ -900,6 +999,12 @@ ShaderBinding* generate_shaders(const ShaderState state)
     qobject_unref(fragment_shader_code);
 
 
+    /* allow the linked program to be saved to the disk cache */
+    if (glo_check_extension("GL_ARB_get_program_binary")) {
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                            GL_TRUE);
+    }
+
     /* link the program */
     glLinkProgram(program);
     GLint linked = 0;
@@ -911,88 +1016,36 @@ ShaderBinding* generate_shaders(const ShaderState state)
         abort();
     }
 
-    glUseProgram(program);
-
-    /* set texture samplers */
-    for (i = 0; i < NV2A_MAX_TEXTURES; i++) {
-        char samplerName[16];
-        snprintf(samplerName, sizeof(samplerName), "texSamp%d", i);
-        GLint texSampLoc = glGetUniformLocation(program, samplerName);
-        if (texSampLoc >= 0) {
-            glUniform1i(texSampLoc, i);
-        }
-    }
-
-    /* validate the program */
-    glValidateProgram(program);
-    GLint valid = 0;
-    glGetProgramiv(program, GL_VALIDATE_STATUS, &valid);
-    if (!valid) {
+    ShaderBinding* ret = create_shader_binding(program, gl_primitive_mode);
+    if (!ret) {
         GLchar log[1024];
         glGetProgramInfoLog(program, 1024, NULL, log);
         fprintf(stderr, "nv2a: shader validation failed: %s\n", log);
         abort();
     }
 
-    ShaderBinding* ret = g_malloc0(sizeof(ShaderBinding));
-    ret->gl_program = program;
-    ret->gl_primitive_mode = gl_primitive_mode;
-
-    /* lookup fragment shader uniforms */
-    for (i = 0; i < 9; i++) {
-        for (j = 0; j < 2; j++) {
-            snprintf(tmp, sizeof(tmp), "c%d_%d", j, i);
-            ret->psh_constant_loc[i][j] = glGetUniformLocation(program, tmp);
-        }
-    }
-    ret->alpha_ref_loc = glGetUniformLocation(program, "alphaRef");
-    for (i = 1; i < NV2A_MAX_TEXTURES; i++) {
-        snprintf(tmp, sizeof(tmp), "bumpMat%d", i);
-        ret->bump_mat_loc[i] = glGetUniformLocation(program, tmp);
-        snprintf(tmp, sizeof(tmp), "bumpScale%d", i);
-        ret->bump_scale_loc[i] = glGetUniformLocation(program, tmp);
-        snprintf(tmp, sizeof(tmp), "bumpOffset%d", i);
-        ret->bump_offset_loc[i] = glGetUniformLocation(program, tmp);
-    }
+    return ret;
+}
 
-    /* lookup vertex shader uniforms */
-    for(i = 0; i < NV2A_VERTEXSHADER_CONSTANTS; i++) {
-        snprintf(tmp, sizeof(tmp), "c[%d]", i);
-        ret->vsh_constant_loc[i] = glGetUniformLocation(program, tmp);
-    }
-    ret->surface_size_loc = glGetUniformLocation(program, "surfaceSize");
-    ret->clip_range_loc = glGetUniformLocation(program, "clipRange");
-    ret->fog_color_loc = glGetUniformLocation(program, "fogColor");
-    ret->fog_param_loc[0] = glGetUniformLocation(program, "fogParam[0]");
-    ret->fog_param_loc[1] = glGetUniformLocation(program, "fogParam[1]");
+ShaderBinding* generate_shaders_from_binary(GLenum binary_format,
+                                            const void *binary,
+                                            GLsizei length,
+                                            GLenum gl_primitive_mode)
+{
+    GLuint program = glCreateProgram();
 
-    ret->inv_viewport_loc = glGetUniformLocation(program, "invViewport");
-    for (i = 0; i < NV2A_LTCTXA_COUNT; i++) {
-        snprintf(tmp, sizeof(tmp), "ltctxa[%d]", i);
-        ret->ltctxa_loc[i] = glGetUniformLocation(program, tmp);
-    }
-    for (i = 0; i < NV2A_LTCTXB_COUNT; i++) {
-        snprintf(tmp, sizeof(tmp), "ltctxb[%d]", i);
-        ret->ltctxb_loc[i] = glGetUniformLocation(program, tmp);
-    }
-    for (i = 0; i < NV2A_LTC1_COUNT; i++) {
-        snprintf(tmp, sizeof(tmp), "ltc1[%d]", i);
-        ret->ltc1_loc[i] = glGetUniformLocation(program, tmp);
+    /* the driver is free to reject binaries it doesn't like any more */
+    glProgramBinary(program, binary_format, binary, length);
+    GLint linked = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        glDeleteProgram(program);
+        return NULL;
     }
-    for (i = 0; i < NV2A_MAX_LIGHTS; i++) {
-        snprintf(tmp, sizeof(tmp), "lightInfiniteHalfVector%d", i);
-        ret->light_infinite_half_vector_loc[i] = glGetUniformLocation(program, tmp);
-        snprintf(tmp, sizeof(tmp), "lightInfiniteDirection%d", i);
-        ret->light_infinite_direction_loc[i] = glGetUniformLocation(program, tmp);
 
-        snprintf(tmp, sizeof(tmp), "lightLocalPosition%d", i);
-        ret->light_local_position_loc[i] = glGetUniformLocation(program, tmp);
-        snprintf(tmp, sizeof(tmp), "lightLocalAttenuation%d", i);
-        ret->light_local_attenuation_loc[i] = glGetUniformLocation(program, tmp);
-    }
-    for (i = 0; i < 8; i++) {
-        snprintf(tmp, sizeof(tmp), "clipRegion[%d]", i);
-        ret->clip_region_loc[i] = glGetUniformLocation(program, tmp);
+    ShaderBinding* ret = create_shader_binding(program, gl_primitive_mode);
+    if (!ret) {
+        glDeleteProgram(program);
     }
 
     return ret;
@@ -28,6 +28,18 @@
 #include "nv2a_psh.h"
 #include "nv2a_regs.h"
 
+/* Uniform buffer binding points of the std140 constant blocks */
+#define NV2A_VSH_CONSTANTS_BINDING      0
+#define NV2A_LIGHTING_CONSTANTS_BINDING 1
+
+/* Texture unit of the palette looked up by the pixel shader for a stage,
+ * after the units of the stages themselves */
+#define NV2A_PALETTE_TEXTURE_UNIT(stage) (NV2A_MAX_TEXTURES + (stage))
+
+/* ltctxa, ltctxb and ltc1 share one block */
+#define NV2A_LIGHTING_CONSTANTS \
+    (NV2A_LTCTXA_COUNT + NV2A_LTCTXB_COUNT + NV2A_LTC1_COUNT)
+
 enum ShaderPrimitiveMode {
     PRIM_TYPE_NONE,
     PRIM_TYPE_POINTS,
@@ -72,6 +84,8 @@ typedef struct ShaderState {
     uint32_t program_data[NV2A_MAX_TRANSFORM_PROGRAM_LENGTH][VSH_TOKEN_SIZE];
     int program_length;
     bool z_perspective;
+    /* the program runs on the CPU, only its outputs are passed on */
+    bool program_passthrough;
 
     /* primitive format for geometry shader */
     enum ShaderPolygonMode polygon_front_mode;
@@ -89,16 +103,12 @@ typedef struct ShaderBinding {
     GLint bump_mat_loc[NV2A_MAX_TEXTURES];
     GLint bump_scale_loc[NV2A_MAX_TEXTURES];
     GLint bump_offset_loc[NV2A_MAX_TEXTURES];
+    GLint palette_max_lod_loc[NV2A_MAX_TEXTURES];
 
     GLint surface_size_loc;
     GLint clip_range_loc;
 
-    GLint vsh_constant_loc[NV2A_VERTEXSHADER_CONSTANTS];
-
     GLint inv_viewport_loc;
-    GLint ltctxa_loc[NV2A_LTCTXA_COUNT];
-    GLint ltctxb_loc[NV2A_LTCTXB_COUNT];
-    GLint ltc1_loc[NV2A_LTC1_COUNT];
 
     GLint fog_color_loc;
     GLint fog_param_loc[2];
@@ -111,5 +121,9 @@ typedef struct ShaderBinding {
 } ShaderBinding;
 
 ShaderBinding* generate_shaders(const ShaderState state);
+ShaderBinding* generate_shaders_from_binary(GLenum binary_format,
+                                            const void *binary,
+                                            GLsizei length,
+                                            GLenum gl_primitive_mode);
 
 #endif
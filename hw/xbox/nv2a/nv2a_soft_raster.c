@@ -0,0 +1,689 @@
+/*
+ * QEMU Geforce NV2A software rasterizer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include <math.h>
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+#include "nv2a_soft_raster.h"
+
+#define SUBPIXEL_BITS 4
+#define SUBPIXEL_ONE (1 << SUBPIXEL_BITS)
+#define SUBPIXEL_HALF (SUBPIXEL_ONE / 2)
+
+/* keeps the edge function products well inside 64 bits */
+#define GUARD_BAND 1048576.0f
+
+struct SoftTriangle {
+    /* edge functions a * x + b * y + c in subpixels, inside when >= 0 */
+    int64_t a[3], b[3], c[3];
+
+    /* pixels that may be covered, already clipped to the target */
+    int min_x, min_y, max_x, max_y;
+
+    /* planes are relative to the first vertex */
+    float x0, y0;
+    float z, dzdx, dzdy;
+    float w, dwdx, dwdy;
+    SoftVec4 v[SOFT_RASTER_MAX_VARYINGS];
+    SoftVec4 vdx[SOFT_RASTER_MAX_VARYINGS];
+    SoftVec4 vdy[SOFT_RASTER_MAX_VARYINGS];
+};
+
+static inline int64_t floor_div(int64_t a, int64_t b)
+{
+    return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+static inline float clampf(float x, float lo, float hi)
+{
+    return (x < lo) ? lo : ((x > hi) ? hi : x);
+}
+
+static inline SoftVec4 soft_vec4_clamp(SoftVec4 v)
+{
+    SoftVec4 out;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        out[i] = clampf(v[i], 0.0f, 1.0f);
+    }
+    return out;
+}
+
+static bool soft_compare(enum SoftCompareFunc func, uint32_t a, uint32_t b)
+{
+    switch (func) {
+    case SOFT_COMPARE_NEVER: return false;
+    case SOFT_COMPARE_LESS: return a < b;
+    case SOFT_COMPARE_EQUAL: return a == b;
+    case SOFT_COMPARE_LEQUAL: return a <= b;
+    case SOFT_COMPARE_GREATER: return a > b;
+    case SOFT_COMPARE_NOTEQUAL: return a != b;
+    case SOFT_COMPARE_GEQUAL: return a >= b;
+    case SOFT_COMPARE_ALWAYS: return true;
+    default:
+        assert(false);
+        return true;
+    }
+}
+
+static unsigned int soft_color_bytes(enum SoftColorFormat format)
+{
+    switch (format) {
+    case SOFT_COLOR_NONE: return 0;
+    case SOFT_COLOR_R5G6B5: return 2;
+    default: return 4;
+    }
+}
+
+static unsigned int soft_zeta_bytes(enum SoftZetaFormat format)
+{
+    switch (format) {
+    case SOFT_ZETA_NONE: return 0;
+    case SOFT_ZETA_Z16: return 2;
+    default: return 4;
+    }
+}
+
+/* colours are (r, g, b, a) in [0, 1] */
+static SoftVec4 soft_read_color(const SoftTarget *t, const uint8_t *p)
+{
+    SoftVec4 c;
+
+    if (t->color_format == SOFT_COLOR_R5G6B5) {
+        uint16_t v = lduw_le_p(p);
+        c[0] = ((v >> 11) & 0x1F) / 31.0f;
+        c[1] = ((v >> 5) & 0x3F) / 63.0f;
+        c[2] = (v & 0x1F) / 31.0f;
+        c[3] = 1.0f;
+    } else {
+        uint32_t v = ldl_le_p(p);
+        c[0] = ((v >> 16) & 0xFF) / 255.0f;
+        c[1] = ((v >> 8) & 0xFF) / 255.0f;
+        c[2] = (v & 0xFF) / 255.0f;
+        c[3] = (t->color_format == SOFT_COLOR_A8R8G8B8)
+                   ? (v >> 24) / 255.0f : 1.0f;
+    }
+    return c;
+}
+
+static inline uint32_t soft_quantize(float x, unsigned int max)
+{
+    return (uint32_t)(clampf(x, 0.0f, 1.0f) * max + 0.5f);
+}
+
+static void soft_write_color(const SoftTarget *t, uint8_t *p, SoftVec4 c,
+                             unsigned int mask)
+{
+    if (t->color_format == SOFT_COLOR_R5G6B5) {
+        uint16_t bits = ((mask & SOFT_MASK_RED) ? 0xF800 : 0)
+                        | ((mask & SOFT_MASK_GREEN) ? 0x07E0 : 0)
+                        | ((mask & SOFT_MASK_BLUE) ? 0x001F : 0);
+        uint16_t v = (soft_quantize(c[0], 31) << 11)
+                     | (soft_quantize(c[1], 63) << 5)
+                     | soft_quantize(c[2], 31);
+        stw_le_p(p, (lduw_le_p(p) & ~bits) | (v & bits));
+    } else {
+        uint32_t bits = ((mask & SOFT_MASK_ALPHA) ? 0xFF000000 : 0)
+                        | ((mask & SOFT_MASK_RED) ? 0x00FF0000 : 0)
+                        | ((mask & SOFT_MASK_GREEN) ? 0x0000FF00 : 0)
+                        | ((mask & SOFT_MASK_BLUE) ? 0x000000FF : 0);
+        uint32_t alpha;
+        switch (t->color_format) {
+        case SOFT_COLOR_Z8R8G8B8: alpha = 0; break;
+        case SOFT_COLOR_O8R8G8B8: alpha = 0xFF; break;
+        default: alpha = soft_quantize(c[3], 255); break;
+        }
+        uint32_t v = (alpha << 24)
+                     | (soft_quantize(c[0], 255) << 16)
+                     | (soft_quantize(c[1], 255) << 8)
+                     | soft_quantize(c[2], 255);
+        stl_le_p(p, (ldl_le_p(p) & ~bits) | (v & bits));
+    }
+}
+
+static SoftVec4 soft_blend_factor(enum SoftBlendFactor factor,
+                                  SoftVec4 src, SoftVec4 dst,
+                                  SoftVec4 constant)
+{
+    SoftVec4 one = { 1.0f, 1.0f, 1.0f, 1.0f };
+    SoftVec4 f;
+
+    switch (factor) {
+    case SOFT_BLEND_ZERO: return one - one;
+    case SOFT_BLEND_ONE: return one;
+    case SOFT_BLEND_SRC_COLOR: return src;
+    case SOFT_BLEND_ONE_MINUS_SRC_COLOR: return one - src;
+    case SOFT_BLEND_SRC_ALPHA: return one * src[3];
+    case SOFT_BLEND_ONE_MINUS_SRC_ALPHA: return one - src[3];
+    case SOFT_BLEND_DST_ALPHA: return one * dst[3];
+    case SOFT_BLEND_ONE_MINUS_DST_ALPHA: return one - dst[3];
+    case SOFT_BLEND_DST_COLOR: return dst;
+    case SOFT_BLEND_ONE_MINUS_DST_COLOR: return one - dst;
+    case SOFT_BLEND_SRC_ALPHA_SATURATE:
+        f = one * MIN(src[3], 1.0f - dst[3]);
+        f[3] = 1.0f;
+        return f;
+    case SOFT_BLEND_CONSTANT_COLOR: return constant;
+    case SOFT_BLEND_ONE_MINUS_CONSTANT_COLOR: return one - constant;
+    case SOFT_BLEND_CONSTANT_ALPHA: return one * constant[3];
+    case SOFT_BLEND_ONE_MINUS_CONSTANT_ALPHA: return one - constant[3];
+    default:
+        assert(false);
+        return one;
+    }
+}
+
+static SoftVec4 soft_blend(const SoftRasterState *s, SoftVec4 src,
+                           SoftVec4 dst)
+{
+    SoftVec4 sf = soft_blend_factor(s->blend_src, src, dst, s->blend_color);
+    SoftVec4 df = soft_blend_factor(s->blend_dst, src, dst, s->blend_color);
+    SoftVec4 out;
+    int i;
+
+    switch (s->blend_equation) {
+    case SOFT_BLEND_EQ_SUBTRACT:
+        out = src * sf - dst * df;
+        break;
+    case SOFT_BLEND_EQ_REVERSE_SUBTRACT:
+    case SOFT_BLEND_EQ_REVERSE_SUBTRACT_SIGNED:
+        out = dst * df - src * sf;
+        break;
+    case SOFT_BLEND_EQ_ADD:
+    case SOFT_BLEND_EQ_ADD_SIGNED:
+        out = src * sf + dst * df;
+        break;
+    case SOFT_BLEND_EQ_MIN:
+        for (i = 0; i < 4; i++) {
+            out[i] = MIN(src[i], dst[i]);
+        }
+        break;
+    case SOFT_BLEND_EQ_MAX:
+        for (i = 0; i < 4; i++) {
+            out[i] = MAX(src[i], dst[i]);
+        }
+        break;
+    default:
+        assert(false);
+        out = src;
+        break;
+    }
+    return soft_vec4_clamp(out);
+}
+
+static uint8_t soft_stencil_op(enum SoftStencilOp op, uint8_t value,
+                               uint8_t ref)
+{
+    switch (op) {
+    case SOFT_STENCIL_OP_KEEP: return value;
+    case SOFT_STENCIL_OP_ZERO: return 0;
+    case SOFT_STENCIL_OP_REPLACE: return ref;
+    case SOFT_STENCIL_OP_INCRSAT: return (value == 0xFF) ? value : value + 1;
+    case SOFT_STENCIL_OP_DECRSAT: return value ? value - 1 : 0;
+    case SOFT_STENCIL_OP_INVERT: return ~value;
+    case SOFT_STENCIL_OP_INCR: return value + 1;
+    case SOFT_STENCIL_OP_DECR: return value - 1;
+    default:
+        assert(false);
+        return value;
+    }
+}
+
+typedef struct SoftTileStats {
+    uint64_t fragments_shaded;
+    uint64_t samples_passed;
+} SoftTileStats;
+
+static void soft_raster_triangle_tile(SoftRaster *r, const SoftTriangle *t,
+                                      int tile_x0, int tile_y0,
+                                      int tile_x1, int tile_y1,
+                                      SoftTileStats *stats)
+{
+    const SoftTarget *target = &r->target;
+    const SoftRasterState *s = &r->state;
+    unsigned int color_bytes = soft_color_bytes(target->color_format);
+    unsigned int zeta_bytes = soft_zeta_bytes(target->zeta_format);
+    uint32_t zeta_max = (target->zeta_format == SOFT_ZETA_Z16)
+                            ? 0xFFFF : 0xFFFFFF;
+    bool depth_clip = s->depth_min != s->depth_max;
+    SoftVec4 varyings[SOFT_RASTER_MAX_VARYINGS];
+    int x, y, i;
+
+    int min_x = MAX(t->min_x, tile_x0);
+    int max_x = MIN(t->max_x, tile_x1 - 1);
+    int min_y = MAX(t->min_y, tile_y0);
+    int max_y = MIN(t->max_y, tile_y1 - 1);
+    if (min_x > max_x || min_y > max_y) {
+        return;
+    }
+
+    int64_t px = (int64_t)min_x * SUBPIXEL_ONE + SUBPIXEL_HALF;
+    int64_t py = (int64_t)min_y * SUBPIXEL_ONE + SUBPIXEL_HALF;
+    int64_t row[3];
+    for (i = 0; i < 3; i++) {
+        row[i] = t->a[i] * px + t->b[i] * py + t->c[i];
+    }
+
+    for (y = min_y; y <= max_y; y++) {
+        int64_t e0 = row[0], e1 = row[1], e2 = row[2];
+        uint8_t *color_row = target->color
+                             ? target->color + y * target->color_pitch
+                             : NULL;
+        uint8_t *zeta_row = target->zeta
+                            ? target->zeta + y * target->zeta_pitch
+                            : NULL;
+        float fy = y + 0.5f - t->y0;
+
+        for (x = min_x; x <= max_x; x++,
+             e0 += t->a[0] * SUBPIXEL_ONE,
+             e1 += t->a[1] * SUBPIXEL_ONE,
+             e2 += t->a[2] * SUBPIXEL_ONE) {
+
+            if ((e0 | e1 | e2) < 0) {
+                continue;
+            }
+
+            float fx = x + 0.5f - t->x0;
+            float z = t->z + t->dzdx * fx + t->dzdy * fy;
+            if (depth_clip && (z < s->depth_min || z > s->depth_max)) {
+                continue;
+            }
+
+            uint8_t *zp = NULL;
+            uint32_t depth = 0;
+            bool depth_pass = true;
+            if (zeta_row) {
+                zp = zeta_row + x * zeta_bytes;
+                depth = (uint32_t)clampf(z, 0.0f, (float)zeta_max);
+                if (s->depth_test) {
+                    uint32_t stored = (target->zeta_format == SOFT_ZETA_Z16)
+                                          ? lduw_le_p(zp)
+                                          : ldl_le_p(zp) >> 8;
+                    depth_pass = soft_compare(s->depth_func, depth, stored);
+                }
+            }
+            if (!depth_pass && !s->stencil_test) {
+                continue;
+            }
+
+            float w = 1.0f / (t->w + t->dwdx * fx + t->dwdy * fy);
+            for (i = 0; i < s->num_varyings; i++) {
+                varyings[i] = (t->v[i] + t->vdx[i] * fx + t->vdy[i] * fy) * w;
+            }
+
+            SoftVec4 color;
+            stats->fragments_shaded++;
+            if (!s->shade(s->shade_opaque, varyings, &color)) {
+                continue;
+            }
+
+            if (s->stencil_test) {
+                uint32_t packed = ldl_le_p(zp);
+                uint8_t stencil = packed & 0xFF;
+                bool stencil_pass =
+                    soft_compare(s->stencil_func,
+                                 s->stencil_ref & s->stencil_read_mask,
+                                 stencil & s->stencil_read_mask);
+                enum SoftStencilOp op = !stencil_pass ? s->stencil_fail
+                                        : !depth_pass ? s->stencil_zfail
+                                        : s->stencil_zpass;
+                uint8_t value = soft_stencil_op(op, stencil, s->stencil_ref);
+                stencil = (stencil & ~s->stencil_write_mask)
+                          | (value & s->stencil_write_mask);
+                stl_le_p(zp, (packed & 0xFFFFFF00) | stencil);
+                if (!stencil_pass || !depth_pass) {
+                    continue;
+                }
+            }
+            stats->samples_passed++;
+
+            if (zp && s->depth_write) {
+                if (target->zeta_format == SOFT_ZETA_Z16) {
+                    stw_le_p(zp, depth);
+                } else {
+                    stl_le_p(zp, (depth << 8) | (ldl_le_p(zp) & 0xFF));
+                }
+            }
+
+            if (color_row && s->color_mask) {
+                uint8_t *cp = color_row + x * color_bytes;
+                color = soft_vec4_clamp(color);
+                if (s->blend) {
+                    color = soft_blend(s, color, soft_read_color(target, cp));
+                }
+                soft_write_color(target, cp, color, s->color_mask);
+            }
+        }
+
+        for (i = 0; i < 3; i++) {
+            row[i] += t->b[i] * SUBPIXEL_ONE;
+        }
+    }
+}
+
+static void soft_raster_bin(SoftRaster *r, unsigned int bin_index,
+                            SoftTileStats *stats)
+{
+    SoftBin *bin = &r->bins[bin_index];
+    int tile_x0 = (bin_index % r->tiles_x) * SOFT_RASTER_TILE_SIZE;
+    int tile_y0 = (bin_index / r->tiles_x) * SOFT_RASTER_TILE_SIZE;
+    int tile_x1 = MIN(tile_x0 + SOFT_RASTER_TILE_SIZE,
+                      r->target.clip_x + r->target.clip_width);
+    int tile_y1 = MIN(tile_y0 + SOFT_RASTER_TILE_SIZE,
+                      r->target.clip_y + r->target.clip_height);
+    unsigned int i;
+
+    for (i = 0; i < bin->count; i++) {
+        soft_raster_triangle_tile(r, &r->triangles[bin->triangles[i]],
+                                  tile_x0, tile_y0, tile_x1, tile_y1, stats);
+    }
+}
+
+/* Takes bins until there are none left, from any thread */
+static void soft_raster_work(void *opaque)
+{
+    SoftRaster *r = opaque;
+    SoftTileStats stats = { 0 };
+    unsigned int tiles = 0;
+    unsigned int i;
+
+    while (worker_pool_next(&r->pool, &i)) {
+        soft_raster_bin(r, r->active_bins[i], &stats);
+        tiles++;
+    }
+
+    qemu_mutex_lock(&r->lock);
+    r->tiles_rasterized += tiles;
+    r->fragments_shaded += stats.fragments_shaded;
+    r->samples_passed += stats.samples_passed;
+    qemu_mutex_unlock(&r->lock);
+}
+
+void soft_raster_init(SoftRaster *r, unsigned int num_threads)
+{
+    memset(r, 0, sizeof(*r));
+    qemu_mutex_init(&r->lock);
+    worker_pool_init(&r->pool, "nv2a.raster", num_threads, NULL);
+}
+
+void soft_raster_destroy(SoftRaster *r)
+{
+    unsigned int i;
+
+    worker_pool_destroy(&r->pool);
+
+    for (i = 0; i < r->num_bins; i++) {
+        g_free(r->bins[i].triangles);
+    }
+    g_free(r->bins);
+    g_free(r->active_bins);
+    g_free(r->triangles);
+
+    qemu_mutex_destroy(&r->lock);
+}
+
+void soft_raster_begin(SoftRaster *r, const SoftTarget *target,
+                       const SoftRasterState *state)
+{
+    unsigned int i;
+
+    assert(state->num_varyings <= SOFT_RASTER_MAX_VARYINGS);
+    assert(!state->stencil_test
+           || (target->zeta && target->zeta_format == SOFT_ZETA_Z24S8));
+    r->target = *target;
+    r->state = *state;
+    r->num_triangles = 0;
+    r->num_active_bins = 0;
+    r->samples_passed = 0;
+
+    unsigned int tiles_x = DIV_ROUND_UP(target->clip_x + target->clip_width,
+                                        SOFT_RASTER_TILE_SIZE);
+    unsigned int tiles_y = DIV_ROUND_UP(target->clip_y + target->clip_height,
+                                        SOFT_RASTER_TILE_SIZE);
+    unsigned int num_bins = tiles_x * tiles_y;
+    if (num_bins > r->num_bins) {
+        r->bins = g_renew(SoftBin, r->bins, num_bins);
+        memset(&r->bins[r->num_bins], 0,
+               (num_bins - r->num_bins) * sizeof(SoftBin));
+        r->active_bins = g_renew(unsigned int, r->active_bins, num_bins);
+        r->num_bins = num_bins;
+    }
+    r->tiles_x = tiles_x;
+    r->tiles_y = tiles_y;
+    for (i = 0; i < num_bins; i++) {
+        r->bins[i].count = 0;
+    }
+}
+
+static void soft_raster_bin_add(SoftRaster *r, unsigned int bin_index,
+                                unsigned int triangle)
+{
+    SoftBin *bin = &r->bins[bin_index];
+
+    if (bin->count == 0) {
+        r->active_bins[r->num_active_bins++] = bin_index;
+    }
+    if (bin->count == bin->size) {
+        bin->size = MAX(64, bin->size * 2);
+        bin->triangles = g_renew(unsigned int, bin->triangles, bin->size);
+    }
+    bin->triangles[bin->count++] = triangle;
+}
+
+/* True if every subpixel of the tile is on the outside of one edge */
+static bool soft_tile_outside(const SoftTriangle *t, int64_t x0, int64_t y0,
+                              int64_t x1, int64_t y1)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        int64_t x = (t->a[i] > 0) ? x1 : x0;
+        int64_t y = (t->b[i] > 0) ? y1 : y0;
+        if (t->a[i] * x + t->b[i] * y + t->c[i] < 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Plane through three values, relative to the first vertex */
+static void soft_plane(float dx1, float dy1, float dx2, float dy2,
+                       float inv_area, float a0, float a1, float a2,
+                       float *dadx, float *dady)
+{
+    *dadx = ((a1 - a0) * dy2 - (a2 - a0) * dy1) * inv_area;
+    *dady = ((a2 - a0) * dx1 - (a1 - a0) * dx2) * inv_area;
+}
+
+void soft_raster_triangle(SoftRaster *r, const SoftVertex *v0,
+                          const SoftVertex *v1, const SoftVertex *v2)
+{
+    const SoftTarget *target = &r->target;
+    const SoftVertex *v[3] = { v0, v1, v2 };
+    int64_t fx[3], fy[3];
+    int i, j;
+
+    for (i = 0; i < 3; i++) {
+        if (!(fabsf(v[i]->x) < GUARD_BAND && fabsf(v[i]->y) < GUARD_BAND)) {
+            r->triangles_culled++;
+            return;
+        }
+        fx[i] = (int64_t)floorf(v[i]->x * SUBPIXEL_ONE + 0.5f);
+        fy[i] = (int64_t)floorf(v[i]->y * SUBPIXEL_ONE + 0.5f);
+    }
+
+    /* positive when clockwise on screen, y points down */
+    int64_t area = (fx[1] - fx[0]) * (fy[2] - fy[0])
+                   - (fx[2] - fx[0]) * (fy[1] - fy[0]);
+    if (area == 0
+        || (area > 0 && r->state.cull == SOFT_CULL_CW)
+        || (area < 0 && r->state.cull == SOFT_CULL_CCW)) {
+        r->triangles_culled++;
+        return;
+    }
+    if (area < 0) {
+        const SoftVertex *tv = v[1];
+        int64_t tx = fx[1], ty = fy[1];
+        v[1] = v[2];
+        fx[1] = fx[2];
+        fy[1] = fy[2];
+        v[2] = tv;
+        fx[2] = tx;
+        fy[2] = ty;
+        area = -area;
+    }
+
+    int64_t min_fx = MIN(fx[0], MIN(fx[1], fx[2]));
+    int64_t max_fx = MAX(fx[0], MAX(fx[1], fx[2]));
+    int64_t min_fy = MIN(fy[0], MIN(fy[1], fy[2]));
+    int64_t max_fy = MAX(fy[0], MAX(fy[1], fy[2]));
+
+    /* pixels whose centre lies within the bounds */
+    int64_t min_x = floor_div(min_fx - SUBPIXEL_HALF + SUBPIXEL_ONE - 1,
+                              SUBPIXEL_ONE);
+    int64_t max_x = floor_div(max_fx - SUBPIXEL_HALF, SUBPIXEL_ONE);
+    int64_t min_y = floor_div(min_fy - SUBPIXEL_HALF + SUBPIXEL_ONE - 1,
+                              SUBPIXEL_ONE);
+    int64_t max_y = floor_div(max_fy - SUBPIXEL_HALF, SUBPIXEL_ONE);
+    min_x = MAX(min_x, (int64_t)target->clip_x);
+    min_y = MAX(min_y, (int64_t)target->clip_y);
+    max_x = MIN(max_x, (int64_t)(target->clip_x + target->clip_width) - 1);
+    max_y = MIN(max_y, (int64_t)(target->clip_y + target->clip_height) - 1);
+    if (min_x > max_x || min_y > max_y) {
+        r->triangles_culled++;
+        return;
+    }
+
+    if (r->num_triangles == r->triangles_size) {
+        r->triangles_size = MAX(256, r->triangles_size * 2);
+        r->triangles = g_renew(SoftTriangle, r->triangles, r->triangles_size);
+    }
+    unsigned int index = r->num_triangles++;
+    SoftTriangle *t = &r->triangles[index];
+
+    for (i = 0; i < 3; i++) {
+        j = (i + 1) % 3;
+        int64_t dx = fx[j] - fx[i];
+        int64_t dy = fy[j] - fy[i];
+        bool top_left = dy < 0 || (dy == 0 && dx > 0);
+        t->a[i] = -dy;
+        t->b[i] = dx;
+        t->c[i] = dy * fx[i] - dx * fy[i] - (top_left ? 0 : 1);
+    }
+    t->min_x = min_x;
+    t->max_x = max_x;
+    t->min_y = min_y;
+    t->max_y = max_y;
+
+    /* the planes go through the snapped positions */
+    t->x0 = (float)fx[0] / SUBPIXEL_ONE;
+    t->y0 = (float)fy[0] / SUBPIXEL_ONE;
+    float dx1 = (float)(fx[1] - fx[0]) / SUBPIXEL_ONE;
+    float dy1 = (float)(fy[1] - fy[0]) / SUBPIXEL_ONE;
+    float dx2 = (float)(fx[2] - fx[0]) / SUBPIXEL_ONE;
+    float dy2 = (float)(fy[2] - fy[0]) / SUBPIXEL_ONE;
+    float inv_area = 1.0f / (dx1 * dy2 - dx2 * dy1);
+
+    t->z = v[0]->z;
+    soft_plane(dx1, dy1, dx2, dy2, inv_area, v[0]->z, v[1]->z, v[2]->z,
+               &t->dzdx, &t->dzdy);
+    t->w = v[0]->inv_w;
+    soft_plane(dx1, dy1, dx2, dy2, inv_area,
+               v[0]->inv_w, v[1]->inv_w, v[2]->inv_w, &t->dwdx, &t->dwdy);
+
+    for (i = 0; i < r->state.num_varyings; i++) {
+        SoftVec4 a0 = v[0]->varyings[i] * v[0]->inv_w;
+        SoftVec4 a1 = v[1]->varyings[i] * v[1]->inv_w;
+        SoftVec4 a2 = v[2]->varyings[i] * v[2]->inv_w;
+        t->v[i] = a0;
+        t->vdx[i] = ((a1 - a0) * dy2 - (a2 - a0) * dy1) * inv_area;
+        t->vdy[i] = ((a2 - a0) * dx1 - (a1 - a0) * dx2) * inv_area;
+    }
+
+    int tx0 = min_x / SOFT_RASTER_TILE_SIZE;
+    int tx1 = max_x / SOFT_RASTER_TILE_SIZE;
+    int ty0 = min_y / SOFT_RASTER_TILE_SIZE;
+    int ty1 = max_y / SOFT_RASTER_TILE_SIZE;
+    int tx, ty;
+    for (ty = ty0; ty <= ty1; ty++) {
+        for (tx = tx0; tx <= tx1; tx++) {
+            int64_t x0 = (int64_t)tx * SOFT_RASTER_TILE_SIZE * SUBPIXEL_ONE
+                         + SUBPIXEL_HALF;
+            int64_t y0 = (int64_t)ty * SOFT_RASTER_TILE_SIZE * SUBPIXEL_ONE
+                         + SUBPIXEL_HALF;
+            int64_t x1 = x0 + (SOFT_RASTER_TILE_SIZE - 1) * SUBPIXEL_ONE;
+            int64_t y1 = y0 + (SOFT_RASTER_TILE_SIZE - 1) * SUBPIXEL_ONE;
+            if (soft_tile_outside(t, x0, y0, x1, y1)) {
+                continue;
+            }
+            soft_raster_bin_add(r, ty * r->tiles_x + tx, index);
+        }
+    }
+    r->triangles_binned++;
+}
+
+void soft_raster_end(SoftRaster *r)
+{
+    worker_pool_run(&r->pool, r->num_active_bins, soft_raster_work, r);
+}
+
+static void soft_fill(uint8_t *data, unsigned int pitch, unsigned int bytes,
+                      unsigned int x, unsigned int y,
+                      unsigned int width, unsigned int height,
+                      uint32_t value, uint32_t bits)
+{
+    unsigned int ix, iy;
+
+    for (iy = y; iy < y + height; iy++) {
+        uint8_t *p = data + iy * pitch + x * bytes;
+        for (ix = 0; ix < width; ix++, p += bytes) {
+            if (bytes == 2) {
+                stw_le_p(p, (lduw_le_p(p) & ~bits) | (value & bits));
+            } else {
+                stl_le_p(p, (ldl_le_p(p) & ~bits) | (value & bits));
+            }
+        }
+    }
+}
+
+void soft_raster_clear(const SoftTarget *target,
+                       unsigned int x, unsigned int y,
+                       unsigned int width, unsigned int height,
+                       bool color, uint32_t color_value, uint32_t color_bits,
+                       bool zeta, uint32_t zeta_value, uint32_t zeta_bits)
+{
+    unsigned int x1 = MIN(x + width, target->clip_x + target->clip_width);
+    unsigned int y1 = MIN(y + height, target->clip_y + target->clip_height);
+    x = MAX(x, target->clip_x);
+    y = MAX(y, target->clip_y);
+    if (x >= x1 || y >= y1) {
+        return;
+    }
+
+    if (color && target->color) {
+        soft_fill(target->color, target->color_pitch,
+                  soft_color_bytes(target->color_format),
+                  x, y, x1 - x, y1 - y, color_value, color_bits);
+    }
+    if (zeta && target->zeta) {
+        soft_fill(target->zeta, target->zeta_pitch,
+                  soft_zeta_bytes(target->zeta_format),
+                  x, y, x1 - x, y1 - y, zeta_value, zeta_bits);
+    }
+}
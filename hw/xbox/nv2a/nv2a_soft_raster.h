@@ -0,0 +1,229 @@
+/*
+ * QEMU Geforce NV2A software rasterizer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_NV2A_SOFT_RASTER_H
+#define HW_NV2A_SOFT_RASTER_H
+
+#include "nv2a_worker_pool.h"
+
+#define SOFT_RASTER_TILE_SIZE 64
+#define SOFT_RASTER_MAX_VARYINGS 8
+
+/*
+ * Rasterizes triangles straight into surfaces in guest memory.
+ *
+ * Triangles given between soft_raster_begin and soft_raster_end are set up
+ * and binned into screen tiles as they come in, soft_raster_end then hands
+ * the tiles out to the worker threads. Each tile is only ever touched by one
+ * thread and goes through its triangles in submission order, so the result
+ * doesn't depend on the number of threads or on scheduling.
+ *
+ * Edges are evaluated in 28.4 fixed point with a top-left fill rule, the
+ * interpolation and shading is done in single precision floats.
+ */
+
+typedef float SoftVec4 __attribute__((vector_size(16)));
+
+typedef struct SoftVertex {
+    /* window x and y in pixels, z in depth buffer units and 1/w */
+    float x, y, z, inv_w;
+    /* interpolated with perspective correction */
+    SoftVec4 varyings[SOFT_RASTER_MAX_VARYINGS];
+} SoftVertex;
+
+enum SoftColorFormat {
+    SOFT_COLOR_NONE,
+    SOFT_COLOR_R5G6B5,
+    SOFT_COLOR_Z8R8G8B8,    /* alpha written as zero */
+    SOFT_COLOR_O8R8G8B8,    /* alpha written as one */
+    SOFT_COLOR_A8R8G8B8,
+};
+
+enum SoftZetaFormat {
+    SOFT_ZETA_NONE,
+    SOFT_ZETA_Z16,
+    SOFT_ZETA_Z24S8,
+};
+
+/* The values of these match the NV2A registers */
+enum SoftCompareFunc {
+    SOFT_COMPARE_NEVER,
+    SOFT_COMPARE_LESS,
+    SOFT_COMPARE_EQUAL,
+    SOFT_COMPARE_LEQUAL,
+    SOFT_COMPARE_GREATER,
+    SOFT_COMPARE_NOTEQUAL,
+    SOFT_COMPARE_GEQUAL,
+    SOFT_COMPARE_ALWAYS,
+};
+
+/* The values of these match the NV2A registers too */
+enum SoftStencilOp {
+    SOFT_STENCIL_OP_KEEP = 1,
+    SOFT_STENCIL_OP_ZERO,
+    SOFT_STENCIL_OP_REPLACE,
+    SOFT_STENCIL_OP_INCRSAT,
+    SOFT_STENCIL_OP_DECRSAT,
+    SOFT_STENCIL_OP_INVERT,
+    SOFT_STENCIL_OP_INCR,
+    SOFT_STENCIL_OP_DECR,
+};
+
+enum SoftBlendFactor {
+    SOFT_BLEND_ZERO,
+    SOFT_BLEND_ONE,
+    SOFT_BLEND_SRC_COLOR,
+    SOFT_BLEND_ONE_MINUS_SRC_COLOR,
+    SOFT_BLEND_SRC_ALPHA,
+    SOFT_BLEND_ONE_MINUS_SRC_ALPHA,
+    SOFT_BLEND_DST_ALPHA,
+    SOFT_BLEND_ONE_MINUS_DST_ALPHA,
+    SOFT_BLEND_DST_COLOR,
+    SOFT_BLEND_ONE_MINUS_DST_COLOR,
+    SOFT_BLEND_SRC_ALPHA_SATURATE,
+    SOFT_BLEND_CONSTANT_COLOR = 12,
+    SOFT_BLEND_ONE_MINUS_CONSTANT_COLOR,
+    SOFT_BLEND_CONSTANT_ALPHA,
+    SOFT_BLEND_ONE_MINUS_CONSTANT_ALPHA,
+};
+
+enum SoftBlendEquation {
+    SOFT_BLEND_EQ_SUBTRACT,
+    SOFT_BLEND_EQ_REVERSE_SUBTRACT,
+    SOFT_BLEND_EQ_ADD,
+    SOFT_BLEND_EQ_MIN,
+    SOFT_BLEND_EQ_MAX,
+    SOFT_BLEND_EQ_REVERSE_SUBTRACT_SIGNED,
+    SOFT_BLEND_EQ_ADD_SIGNED,
+};
+
+enum SoftCull {
+    SOFT_CULL_NONE,
+    SOFT_CULL_CW,
+    SOFT_CULL_CCW,
+};
+
+#define SOFT_MASK_BLUE  (1 << 0)
+#define SOFT_MASK_GREEN (1 << 1)
+#define SOFT_MASK_RED   (1 << 2)
+#define SOFT_MASK_ALPHA (1 << 3)
+#define SOFT_MASK_RGBA  0xF
+
+typedef struct SoftTarget {
+    uint8_t *color;
+    unsigned int color_pitch;
+    enum SoftColorFormat color_format;
+
+    uint8_t *zeta;
+    unsigned int zeta_pitch;
+    enum SoftZetaFormat zeta_format;
+
+    /* pixels outside of this rectangle are never touched */
+    unsigned int clip_x, clip_y;
+    unsigned int clip_width, clip_height;
+} SoftTarget;
+
+/*
+ * Works out the colour of a fragment from its interpolated varyings, called
+ * from the worker threads. Returns false to discard the fragment.
+ */
+typedef bool (*SoftShadeFunc)(const void *opaque,
+                              const SoftVec4 *varyings, SoftVec4 *color);
+
+typedef struct SoftRasterState {
+    enum SoftCull cull;
+
+    bool depth_test;
+    bool depth_write;
+    enum SoftCompareFunc depth_func;
+    /* fragments with a depth outside this range are clipped */
+    float depth_min, depth_max;
+
+    /* only with a Z24S8 target, fragments are shaded before the tests
+     * then so discarded ones leave the stencil alone */
+    bool stencil_test;
+    enum SoftCompareFunc stencil_func;
+    uint8_t stencil_ref, stencil_read_mask, stencil_write_mask;
+    enum SoftStencilOp stencil_fail, stencil_zfail, stencil_zpass;
+
+    unsigned int color_mask;
+    bool blend;
+    enum SoftBlendFactor blend_src, blend_dst;
+    enum SoftBlendEquation blend_equation;
+    SoftVec4 blend_color;
+
+    unsigned int num_varyings;
+    SoftShadeFunc shade;
+    const void *shade_opaque;
+} SoftRasterState;
+
+typedef struct SoftTriangle SoftTriangle;
+
+typedef struct SoftBin {
+    unsigned int *triangles;
+    unsigned int count;
+    unsigned int size;
+} SoftBin;
+
+typedef struct SoftRaster {
+    WorkerPool pool;
+    QemuMutex lock;             /* taken to add to the totals */
+
+    SoftTarget target;
+    SoftRasterState state;
+
+    SoftTriangle *triangles;
+    unsigned int num_triangles;
+    unsigned int triangles_size;
+
+    unsigned int tiles_x, tiles_y;
+    SoftBin *bins;
+    unsigned int num_bins;
+    /* indices of the bins with something in them */
+    unsigned int *active_bins;
+    unsigned int num_active_bins;
+
+    /* totals, updated by soft_raster_end */
+    uint64_t triangles_binned;
+    uint64_t triangles_culled;
+    uint64_t tiles_rasterized;
+    uint64_t fragments_shaded;
+    /* fragments that passed the depth test in the last batch */
+    uint64_t samples_passed;
+} SoftRaster;
+
+/* num_threads extra threads, the caller of soft_raster_end also works */
+void soft_raster_init(SoftRaster *r, unsigned int num_threads);
+void soft_raster_destroy(SoftRaster *r);
+
+void soft_raster_begin(SoftRaster *r, const SoftTarget *target,
+                       const SoftRasterState *state);
+void soft_raster_triangle(SoftRaster *r, const SoftVertex *v0,
+                          const SoftVertex *v1, const SoftVertex *v2);
+void soft_raster_end(SoftRaster *r);
+
+/*
+ * Fills a rectangle of the target, like the NV2A the raw values are written
+ * with only the given bits of each pixel changing.
+ */
+void soft_raster_clear(const SoftTarget *target,
+                       unsigned int x, unsigned int y,
+                       unsigned int width, unsigned int height,
+                       bool color, uint32_t color_value, uint32_t color_bits,
+                       bool zeta, uint32_t zeta_value, uint32_t zeta_bits);
+
+#endif
@@ -0,0 +1,192 @@
+/*
+ * QEMU Geforce NV2A texture decoding
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+#include "swizzle.h"
+#include "nv2a_texture_decode.h"
+
+/* unswizzled data waiting to be converted, kept between textures */
+static __thread uint8_t *decode_scratch;
+static __thread size_t decode_scratch_size;
+
+static uint8_t *texture_decode_get_scratch(size_t size)
+{
+    if (size > decode_scratch_size) {
+        g_free(decode_scratch);
+        decode_scratch_size = MAX(size, decode_scratch_size * 2);
+        decode_scratch = g_malloc(decode_scratch_size);
+    }
+    return decode_scratch;
+}
+
+static void texture_decode_free_scratch(void)
+{
+    g_free(decode_scratch);
+    decode_scratch = NULL;
+    decode_scratch_size = 0;
+}
+
+static void convert_row_palette(const uint8_t *in, uint8_t *out,
+                                unsigned int width, const uint32_t *palette)
+{
+    uint32_t *out32 = (uint32_t *)out;
+    unsigned int x;
+
+    for (x = 0; x < width; x++) {
+        out32[x] = palette[in[x]];
+    }
+}
+
+static void convert_row_r6g5b5(const uint8_t *in, uint8_t *out,
+                               unsigned int width)
+{
+    unsigned int x;
+
+    for (x = 0; x < width; x++) {
+        uint16_t rgb655 = lduw_le_p(in + x * 2);
+        int8_t *pixel = (int8_t *)&out[x * 3];
+        /* Maps 5 bit G and B signed value range to 8 bit
+         * signed values. R is probably unsigned.
+         */
+        rgb655 ^= (1 << 9) | (1 << 4);
+        pixel[0] = ((rgb655 & 0xFC00) >> 10) * 0x7F / 0x3F;
+        pixel[1] = ((rgb655 & 0x03E0) >> 5) * 0xFF / 0x1F - 0x80;
+        pixel[2] = (rgb655 & 0x001F) * 0xFF / 0x1F - 0x80;
+    }
+}
+
+static unsigned int texture_decode_bytes_per_pixel(
+    enum TextureConversion conversion, unsigned int bytes_per_pixel)
+{
+    switch (conversion) {
+    case TEXTURE_CONVERT_PALETTE:
+        return 4;
+    case TEXTURE_CONVERT_R6G5B5:
+        return 3;
+    default:
+        return bytes_per_pixel;
+    }
+}
+
+size_t texture_decode_size(enum TextureConversion conversion,
+                           unsigned int bytes_per_pixel,
+                           unsigned int width, unsigned int height,
+                           unsigned int depth)
+{
+    return (size_t)width * height * depth
+        * texture_decode_bytes_per_pixel(conversion, bytes_per_pixel);
+}
+
+static void texture_decode_slice(TextureDecoder *dec,
+                                 const TextureDecodeSlice *s)
+{
+    unsigned int row_length = s->width * s->bytes_per_pixel;
+    unsigned int rows = s->height * s->depth;
+    unsigned int y;
+
+    if (s->compressed_size) {
+        memcpy(s->dst, s->src, s->compressed_size);
+        return;
+    }
+
+    const uint8_t *in = s->src;
+    unsigned int in_pitch = s->src_pitch;
+    if (s->swizzled) {
+        uint8_t *out = dec->conversion == TEXTURE_CONVERT_NONE
+                           ? s->dst
+                           : texture_decode_get_scratch(row_length * rows);
+        unswizzle_box(s->src, s->width, s->height, s->depth, out,
+                      row_length, row_length * s->height,
+                      s->bytes_per_pixel);
+        if (dec->conversion == TEXTURE_CONVERT_NONE) {
+            return;
+        }
+        in = out;
+        in_pitch = row_length;
+    }
+
+    unsigned int out_row_length = s->width
+        * texture_decode_bytes_per_pixel(dec->conversion,
+                                         s->bytes_per_pixel);
+    for (y = 0; y < rows; y++) {
+        const uint8_t *in_row = in + (size_t)y * in_pitch;
+        uint8_t *out_row = s->dst + (size_t)y * out_row_length;
+        switch (dec->conversion) {
+        case TEXTURE_CONVERT_NONE:
+            memcpy(out_row, in_row, row_length);
+            break;
+        case TEXTURE_CONVERT_PALETTE:
+            convert_row_palette(in_row, out_row, s->width,
+                                (const uint32_t *)dec->palette);
+            break;
+        case TEXTURE_CONVERT_R6G5B5:
+            convert_row_r6g5b5(in_row, out_row, s->width);
+            break;
+        default:
+            assert(false);
+            break;
+        }
+    }
+}
+
+static void texture_decoder_work(void *opaque)
+{
+    TextureDecoder *dec = opaque;
+    unsigned int i;
+
+    while (worker_pool_next(&dec->pool, &i)) {
+        texture_decode_slice(dec, &dec->slices[i]);
+    }
+}
+
+void texture_decoder_init(TextureDecoder *dec, unsigned int num_threads)
+{
+    memset(dec, 0, sizeof(*dec));
+    worker_pool_init(&dec->pool, "nv2a.texture_decode", num_threads,
+                     texture_decode_free_scratch);
+}
+
+void texture_decoder_destroy(TextureDecoder *dec)
+{
+    worker_pool_destroy(&dec->pool);
+}
+
+void texture_decoder_run(TextureDecoder *dec,
+                         enum TextureConversion conversion,
+                         const uint8_t *palette,
+                         const TextureDecodeSlice *slices,
+                         unsigned int num_slices)
+{
+    unsigned int i;
+
+    dec->conversion = conversion;
+    dec->palette = palette;
+    dec->slices = slices;
+
+    dec->slices_decoded += num_slices;
+    for (i = 0; i < num_slices; i++) {
+        const TextureDecodeSlice *s = &slices[i];
+        dec->bytes_decoded += s->compressed_size
+            ? s->compressed_size
+            : texture_decode_size(conversion, s->bytes_per_pixel,
+                                  s->width, s->height, s->depth);
+    }
+
+    worker_pool_run(&dec->pool, num_slices, texture_decoder_work, dec);
+}
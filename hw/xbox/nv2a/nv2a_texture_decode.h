@@ -0,0 +1,80 @@
+/*
+ * QEMU Geforce NV2A texture decoding
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_NV2A_TEXTURE_DECODE_H
+#define HW_NV2A_TEXTURE_DECODE_H
+
+#include "nv2a_worker_pool.h"
+
+/*
+ * Turns guest texture data into what GL takes, straight into a staging
+ * buffer. A texture is split into slices, one per face and mip level and
+ * bands of rows for large linear levels, which are handed out to the
+ * worker threads. The caller of texture_decoder_run works as well and
+ * returns once every slice is done.
+ */
+
+enum TextureConversion {
+    TEXTURE_CONVERT_NONE,
+    /* SZ_I8_A8R8G8B8 cube maps and 3D textures, 8 bit indices to 32 bit
+     * colors. 2D ones are looked up by the pixel shader. */
+    TEXTURE_CONVERT_PALETTE,
+    /* SZ_R6G5B5, to signed R8G8B8 */
+    TEXTURE_CONVERT_R6G5B5,
+};
+
+typedef struct TextureDecodeSlice {
+    const uint8_t *src;
+    uint8_t *dst;
+    unsigned int width, height, depth;
+    unsigned int bytes_per_pixel;
+    /* linear sources only, swizzled ones are packed */
+    unsigned int src_pitch;
+    bool swizzled;
+    /* compressed data is copied as is */
+    size_t compressed_size;
+} TextureDecodeSlice;
+
+typedef struct TextureDecoder {
+    WorkerPool pool;
+
+    enum TextureConversion conversion;
+    const uint8_t *palette;
+    const TextureDecodeSlice *slices;
+
+    /* totals, updated by texture_decoder_run */
+    uint64_t slices_decoded;
+    uint64_t bytes_decoded;
+} TextureDecoder;
+
+/* num_threads extra threads, the caller of texture_decoder_run also works */
+void texture_decoder_init(TextureDecoder *dec, unsigned int num_threads);
+void texture_decoder_destroy(TextureDecoder *dec);
+
+/* Bytes a width x height x depth slice takes once decoded */
+size_t texture_decode_size(enum TextureConversion conversion,
+                           unsigned int bytes_per_pixel,
+                           unsigned int width, unsigned int height,
+                           unsigned int depth);
+
+void texture_decoder_run(TextureDecoder *dec,
+                         enum TextureConversion conversion,
+                         const uint8_t *palette,
+                         const TextureDecodeSlice *slices,
+                         unsigned int num_slices);
+
+#endif
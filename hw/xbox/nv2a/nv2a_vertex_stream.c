@@ -0,0 +1,161 @@
+/*
+ * QEMU Geforce NV2A streaming vertex uploads
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "nv2a_debug.h"
+#include "nv2a_vertex_stream.h"
+
+/* keeps attribute and index offsets suitably aligned */
+#define VERTEX_STREAM_ALIGNMENT 64
+
+#define VERTEX_STREAM_MAP_FLAGS \
+    (GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT)
+
+static size_t vertex_stream_segment_size(VertexStream *s)
+{
+    return s->size / NV2A_VERTEX_STREAM_SEGMENTS;
+}
+
+/* Moves on to the next segment, waiting for the GPU to finish with it */
+static void vertex_stream_advance(VertexStream *s, unsigned int segment)
+{
+    s->unfenced |= 1 << s->segment;
+    s->segment = segment;
+
+    GLsync fence = s->fences[segment];
+    if (!fence) {
+        return;
+    }
+    if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+        GLenum result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                         GL_TIMEOUT_IGNORED);
+        assert(result != GL_WAIT_FAILED);
+        s->stalls++;
+    }
+    glDeleteSync(fence);
+    s->fences[segment] = 0;
+}
+
+void vertex_stream_init(VertexStream *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->size = NV2A_VERTEX_STREAM_SIZE;
+    s->persistent = glo_check_extension("GL_ARB_buffer_storage");
+
+    glGenBuffers(1, &s->gl_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, s->gl_buffer);
+    if (s->persistent) {
+        glBufferStorage(GL_ARRAY_BUFFER, s->size, NULL,
+                        VERTEX_STREAM_MAP_FLAGS);
+        s->map = glMapBufferRange(GL_ARRAY_BUFFER, 0, s->size,
+                                  VERTEX_STREAM_MAP_FLAGS);
+        assert(s->map != NULL);
+    } else {
+        NV2A_DPRINTF("no GL_ARB_buffer_storage, orphaning vertex stream\n");
+        glBufferData(GL_ARRAY_BUFFER, s->size, NULL, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void vertex_stream_destroy(VertexStream *s)
+{
+    int i;
+
+    if (s->persistent) {
+        glBindBuffer(GL_ARRAY_BUFFER, s->gl_buffer);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    for (i = 0; i < NV2A_VERTEX_STREAM_SEGMENTS; i++) {
+        if (s->fences[i]) {
+            glDeleteSync(s->fences[i]);
+        }
+    }
+    glDeleteBuffers(1, &s->gl_buffer);
+}
+
+bool vertex_stream_upload(VertexStream *s, GLenum target,
+                          const void *data, size_t length,
+                          GLintptr *offset)
+{
+    size_t segment_size = vertex_stream_segment_size(s);
+    size_t aligned = QEMU_ALIGN_UP(length, VERTEX_STREAM_ALIGNMENT);
+
+    assert(length > 0);
+    if (s->draw_bytes + aligned > segment_size) {
+        s->overflows++;
+        return false;
+    }
+
+    /* the ring is only wrapped between draws, see vertex_stream_end_draw */
+    assert(s->offset + aligned <= s->size);
+
+    if (s->persistent) {
+        unsigned int last = (s->offset + aligned - 1) / segment_size;
+        while (s->segment != last) {
+            vertex_stream_advance(s, s->segment + 1);
+        }
+    }
+
+    glBindBuffer(target, s->gl_buffer);
+    if (s->persistent) {
+        memcpy(s->map + s->offset, data, length);
+    } else {
+        glBufferSubData(target, s->offset, length, data);
+    }
+
+    *offset = s->offset;
+    s->offset += aligned;
+    s->draw_bytes += aligned;
+    s->bytes_streamed += length;
+
+    return true;
+}
+
+void vertex_stream_end_draw(VertexStream *s)
+{
+    size_t segment_size = vertex_stream_segment_size(s);
+    int i;
+
+    if (s->draw_bytes == 0) {
+        return;
+    }
+    s->draw_bytes = 0;
+
+    /* Wrap early enough that the next draw fits without wrapping, draws
+     * never have their data split across the end of the ring */
+    if (s->offset > s->size - segment_size) {
+        s->offset = 0;
+        s->wraps++;
+        if (s->persistent) {
+            vertex_stream_advance(s, 0);
+        } else {
+            glBindBuffer(GL_ARRAY_BUFFER, s->gl_buffer);
+            glBufferData(GL_ARRAY_BUFFER, s->size, NULL, GL_STREAM_DRAW);
+        }
+    }
+
+    /* everything that used the segments left behind is now queued up */
+    for (i = 0; i < NV2A_VERTEX_STREAM_SEGMENTS; i++) {
+        if (s->unfenced & (1 << i)) {
+            assert(!s->fences[i]);
+            s->fences[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        }
+    }
+    s->unfenced = 0;
+}
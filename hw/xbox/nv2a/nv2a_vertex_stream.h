@@ -0,0 +1,70 @@
+/*
+ * QEMU Geforce NV2A streaming vertex uploads
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_NV2A_VERTEX_STREAM_H
+#define HW_NV2A_VERTEX_STREAM_H
+
+#include "gl/gloffscreen.h"
+
+#define NV2A_VERTEX_STREAM_SIZE (16 * 1024 * 1024)
+#define NV2A_VERTEX_STREAM_SEGMENTS 4
+
+/*
+ * A ring buffer for vertex and index data that only lives for one draw.
+ *
+ * With GL_ARB_buffer_storage the buffer stays mapped and data is copied
+ * straight into it. The ring is split into segments, each guarded by a
+ * fence placed after the last draw that used it, so the CPU only waits
+ * when it laps the GPU. Without it the buffer is orphaned whenever the
+ * ring wraps and filled with glBufferSubData.
+ *
+ * A single draw may use at most one segment worth of the ring, callers fall
+ * back to their own buffers for anything bigger.
+ */
+typedef struct VertexStream {
+    GLuint gl_buffer;
+    bool persistent;
+    uint8_t *map;
+
+    size_t size;
+    size_t offset;
+    size_t draw_bytes;
+
+    unsigned int segment;
+    unsigned int unfenced;
+    GLsync fences[NV2A_VERTEX_STREAM_SEGMENTS];
+
+    /* statistics */
+    uint64_t bytes_streamed;
+    unsigned int wraps;
+    unsigned int stalls;
+    unsigned int overflows;
+} VertexStream;
+
+void vertex_stream_init(VertexStream *s);
+void vertex_stream_destroy(VertexStream *s);
+
+/* Copies data into the ring, leaving the buffer bound to target. Returns
+ * false if the draw would need more space than the ring can give it. */
+bool vertex_stream_upload(VertexStream *s, GLenum target,
+                          const void *data, size_t length,
+                          GLintptr *offset);
+
+/* Call after each draw that used data from the ring */
+void vertex_stream_end_draw(VertexStream *s);
+
+#endif
@@ -31,6 +31,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <math.h>
 
 #include "nv2a_shaders_common.h"
 #include "nv2a_vsh.h"
@@ -441,80 +442,86 @@ static QString* decode_opcode(const uint32_t *shader_token,
 }
 
 
+/* Copies an input into _inA, _inB or _inC, see decode_token */
+static void decode_token_input(QString *ret, char name, QString *input)
+{
+    qstring_append_fmt(ret, "  _in%c = _in(%s);\n",
+                       name, qstring_get_str(input));
+    qobject_unref(input);
+}
+
 static QString* decode_token(const uint32_t *shader_token)
 {
-    QString *ret;
+    QString *ret = qstring_new();
+    VshMAC mac = vsh_get_field(shader_token, FLD_MAC);
+    VshILU ilu = vsh_get_field(shader_token, FLD_ILU);
 
-    /* Since it's potentially used twice, decode input C once: */
-    QString *input_c =
-        decode_opcode_input(shader_token,
-                            vsh_get_field(shader_token, FLD_C_MUX),
-                            FLD_C_NEG,
-                            (vsh_get_field(shader_token, FLD_C_R_HIGH) << 2)
-                                | vsh_get_field(shader_token, FLD_C_R_LOW));
+    /* The MAC and ILU read all their inputs before either writes: a paired
+     * ILU reading the MAC's destination, or a MAC result also going to an
+     * output, has to see the register as it was. The inputs are copied
+     * first, as vsh_program_run does. */
+    if (mac != MAC_NOP && mac_opcode_params[mac].A) {
+        decode_token_input(ret, 'A',
+            decode_opcode_input(shader_token,
+                                vsh_get_field(shader_token, FLD_A_MUX),
+                                FLD_A_NEG,
+                                vsh_get_field(shader_token, FLD_A_R)));
+    }
+    if (mac != MAC_NOP && mac_opcode_params[mac].B) {
+        decode_token_input(ret, 'B',
+            decode_opcode_input(shader_token,
+                                vsh_get_field(shader_token, FLD_B_MUX),
+                                FLD_B_NEG,
+                                vsh_get_field(shader_token, FLD_B_R)));
+    }
+    if ((mac != MAC_NOP && mac_opcode_params[mac].C) || ilu != ILU_NOP) {
+        int c_reg = (vsh_get_field(shader_token, FLD_C_R_HIGH) << 2)
+                    | vsh_get_field(shader_token, FLD_C_R_LOW);
+        decode_token_input(ret, 'C',
+            decode_opcode_input(shader_token,
+                                vsh_get_field(shader_token, FLD_C_MUX),
+                                FLD_C_NEG, c_reg));
+    }
 
     /* See what MAC opcode is written to (if not masked away): */
-    VshMAC mac = vsh_get_field(shader_token, FLD_MAC);
     if (mac != MAC_NOP) {
         QString *inputs_mac = qstring_new();
         if (mac_opcode_params[mac].A) {
-            QString *input_a =
-                decode_opcode_input(shader_token,
-                                    vsh_get_field(shader_token, FLD_A_MUX),
-                                    FLD_A_NEG,
-                                    vsh_get_field(shader_token, FLD_A_R));
-            qstring_append(inputs_mac, ", ");
-            qstring_append(inputs_mac, qstring_get_str(input_a));
-            qobject_unref(input_a);
+            qstring_append(inputs_mac, ", _inA");
         }
         if (mac_opcode_params[mac].B) {
-            QString *input_b =
-                decode_opcode_input(shader_token,
-                                    vsh_get_field(shader_token, FLD_B_MUX),
-                                    FLD_B_NEG,
-                                    vsh_get_field(shader_token, FLD_B_R));
-            qstring_append(inputs_mac, ", ");
-            qstring_append(inputs_mac, qstring_get_str(input_b));
-            qobject_unref(input_b);
+            qstring_append(inputs_mac, ", _inB");
         }
         if (mac_opcode_params[mac].C) {
-            qstring_append(inputs_mac, ", ");
-            qstring_append(inputs_mac, qstring_get_str(input_c));
+            qstring_append(inputs_mac, ", _inC");
         }
 
         /* Then prepend these inputs with the actual opcode, mask, and input : */
-        ret = decode_opcode(shader_token,
-                            OMUX_MAC,
-                            vsh_get_field(shader_token, FLD_OUT_MAC_MASK),
-                            mac_opcode[mac],
-                            qstring_get_str(inputs_mac));
+        QString *mac_op = decode_opcode(shader_token,
+                                        OMUX_MAC,
+                                        vsh_get_field(shader_token,
+                                                      FLD_OUT_MAC_MASK),
+                                        mac_opcode[mac],
+                                        qstring_get_str(inputs_mac));
+        qstring_append(ret, qstring_get_str(mac_op));
+        qobject_unref(mac_op);
         qobject_unref(inputs_mac);
-    } else {
-        ret = qstring_new();
     }
 
     /* See if a ILU opcode is present too: */
-    VshILU ilu = vsh_get_field(shader_token, FLD_ILU);
     if (ilu != ILU_NOP) {
-        QString *inputs_c = qstring_from_str(", ");
-        qstring_append(inputs_c, qstring_get_str(input_c));
-
         /* Append the ILU opcode, mask and (the already determined) input C: */
         QString *ilu_op =
             decode_opcode(shader_token,
                           OMUX_ILU,
                           vsh_get_field(shader_token, FLD_OUT_ILU_MASK),
                           ilu_opcode[ilu],
-                          qstring_get_str(inputs_c));
+                          ", _inC");
 
         qstring_append(ret, qstring_get_str(ilu_op));
-
-        qobject_unref(inputs_c);
         qobject_unref(ilu_op);
     }
 
-    qobject_unref(input_c);
-
     return ret;
 }
 
@@ -552,6 +559,9 @@ static const char* vsh_header =
 //    "/* Make sure input is always a vec4 */\n"
 //   "#define _in(v) vec4(v)\n"
 //#endif
+    "\n"
+    "/* The current token's inputs, read before it writes anything */\n"
+    "vec4 _inA, _inB, _inC;\n"
     "\n"
     "#define INFINITY (1.0 / 0.0)\n"
     "\n"
@@ -713,6 +723,8 @@ static const char* vsh_header =
     "  return t;\n"
     "}\n";
 
+static void append_epilogue(bool z_perspective, QString *body);
+
 void vsh_translate(uint16_t version,
                    const uint32_t *tokens,
                    unsigned int length,
@@ -743,6 +755,24 @@ void vsh_translate(uint16_t version,
     }
     assert(has_final);
 
+    append_epilogue(z_perspective, body);
+}
+
+void vsh_translate_passthrough(bool z_perspective, QString *body)
+{
+    int i;
+
+    /* the program ran on the CPU already, attribute i holds output i */
+    qstring_append(body, "  oPos = v0;\n");
+    for (i = VSH_OUTPUT_D0; i < VSH_OUTPUTS; i++) {
+        qstring_append_fmt(body, "  %s = v%d;\n", out_reg_name[i], i);
+    }
+
+    append_epilogue(z_perspective, body);
+}
+
+static void append_epilogue(bool z_perspective, QString *body)
+{
     /* pre-divide and output the generated W so we can do persepctive correct
      * interpolation manually. OpenGL can't, since we give it a W of 1 to work
      * around the perspective divide */
@@ -789,3 +819,480 @@ void vsh_translate(uint16_t version,
 
 }
 
+
+
+/* Decoded form of the tokens for vsh_program_run */
+
+typedef struct VshSource {
+    VshParameterType type;
+    uint8_t index;
+    bool relative;  /* c[A0 + index] */
+    bool negate;
+    uint8_t swizzle[4];
+} VshSource;
+
+typedef struct VshInstruction {
+    VshMAC mac;
+    VshILU ilu;
+    VshSource src[3];   /* inputs A, B and C */
+
+    /* write masks have bit i set for component i */
+    uint8_t mac_reg, mac_mask;
+    uint8_t ilu_reg, ilu_mask;
+
+    VshOutputMux out_mux;
+    uint8_t out_reg, out_mask;
+} VshInstruction;
+
+struct VshProgram {
+    unsigned int length;
+    uint16_t inputs;
+    VshInstruction instructions[];
+};
+
+typedef int32_t VshLanesInt
+    __attribute__((vector_size(VSH_BATCH_SIZE * sizeof(int32_t))));
+
+static uint8_t convert_mask(uint8_t mask)
+{
+    /* the tokens have x in the high bit */
+    return ((mask >> 3) & 1) | ((mask >> 1) & 2)
+           | ((mask << 1) & 4) | ((mask << 3) & 8);
+}
+
+static bool decode_source(const uint32_t *token, VshFieldName mux_field,
+                          VshFieldName neg_field, int reg_num,
+                          VshSource *src)
+{
+    int i;
+
+    src->type = vsh_get_field(token, mux_field);
+    src->negate = vsh_get_field(token, neg_field);
+    src->relative = false;
+
+    switch (src->type) {
+    case PARAM_R:
+        /* R12 is oPos, nothing above it exists */
+        if (reg_num > 12) {
+            return false;
+        }
+        src->index = reg_num;
+        break;
+    case PARAM_V:
+        src->index = vsh_get_field(token, FLD_V);
+        break;
+    case PARAM_C:
+        src->index = convert_c_register(vsh_get_field(token, FLD_CONST));
+        src->relative = vsh_get_field(token, FLD_A0X);
+        break;
+    default:
+        return false;
+    }
+
+    /* same as decode_swizzle */
+    if (neg_field == FLD_C_NEG
+        && ilu_force_scalar[vsh_get_field(token, FLD_ILU)]) {
+        uint8_t x = vsh_get_field(token, FLD_C_SWZ_X);
+        for (i = 0; i < 4; i++) {
+            src->swizzle[i] = x;
+        }
+    } else {
+        for (i = 0; i < 4; i++) {
+            src->swizzle[i] = vsh_get_field(token, neg_field + 1 + i);
+        }
+    }
+    return true;
+}
+
+static bool decode_instruction(const uint32_t *token, VshInstruction *ins)
+{
+    memset(ins, 0, sizeof(*ins));
+
+    ins->mac = vsh_get_field(token, FLD_MAC);
+    ins->ilu = vsh_get_field(token, FLD_ILU);
+    if (ins->mac > MAC_ARL) {
+        return false;
+    }
+
+    int c_reg = (vsh_get_field(token, FLD_C_R_HIGH) << 2)
+                | vsh_get_field(token, FLD_C_R_LOW);
+    bool need_c = (ins->mac != MAC_NOP && mac_opcode_params[ins->mac].C)
+                  || ins->ilu != ILU_NOP;
+    if (need_c && !decode_source(token, FLD_C_MUX, FLD_C_NEG, c_reg,
+                                 &ins->src[2])) {
+        return false;
+    }
+    if (ins->mac != MAC_NOP) {
+        if (mac_opcode_params[ins->mac].A
+            && !decode_source(token, FLD_A_MUX, FLD_A_NEG,
+                              vsh_get_field(token, FLD_A_R), &ins->src[0])) {
+            return false;
+        }
+        if (mac_opcode_params[ins->mac].B
+            && !decode_source(token, FLD_B_MUX, FLD_B_NEG,
+                              vsh_get_field(token, FLD_B_R), &ins->src[1])) {
+            return false;
+        }
+    }
+
+    /* same pairing rules as decode_opcode */
+    int reg_num = vsh_get_field(token, FLD_OUT_R);
+    if (reg_num > 12) {
+        return false;
+    }
+    if (ins->mac != MAC_NOP && ins->mac != MAC_ARL) {
+        ins->mac_reg = reg_num;
+        if (ins->ilu == ILU_NOP || reg_num != 1) {
+            ins->mac_mask =
+                convert_mask(vsh_get_field(token, FLD_OUT_MAC_MASK));
+        }
+    }
+    if (ins->ilu != ILU_NOP) {
+        ins->ilu_reg = (ins->mac != MAC_NOP) ? 1 : reg_num;
+        ins->ilu_mask = convert_mask(vsh_get_field(token, FLD_OUT_ILU_MASK));
+    }
+
+    ins->out_mux = vsh_get_field(token, FLD_OUT_MUX);
+    ins->out_mask = convert_mask(vsh_get_field(token, FLD_OUT_O_MASK));
+    bool out_op = (ins->out_mux == OMUX_MAC) ? ins->mac != MAC_NOP
+                                             : ins->ilu != ILU_NOP;
+    if (!out_op) {
+        ins->out_mask = 0;
+    }
+    if (ins->out_mask) {
+        /* the GLSL has nowhere to write constants or A0.x to either */
+        ins->out_reg = vsh_get_field(token, FLD_OUT_ADDRESS) & 0xF;
+        if (vsh_get_field(token, FLD_OUT_ORB) == OUTPUT_C
+            || ins->out_reg >= VSH_OUTPUTS
+            || ins->out_reg == 1 || ins->out_reg == 2
+            || (ins->out_mux == OMUX_MAC && ins->mac == MAC_ARL)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+VshProgram *vsh_program_new(const uint32_t *tokens, unsigned int length)
+{
+    VshProgram *program = g_malloc(sizeof(VshProgram)
+                                   + length * sizeof(VshInstruction));
+    unsigned int slot;
+    int i;
+
+    program->length = 0;
+    program->inputs = 0;
+
+    for (slot = 0; slot < length; slot++) {
+        const uint32_t *cur_token = &tokens[slot * VSH_TOKEN_SIZE];
+        VshInstruction *ins = &program->instructions[slot];
+
+        if (!decode_instruction(cur_token, ins)) {
+            break;
+        }
+        for (i = 0; i < 3; i++) {
+            if (ins->src[i].type == PARAM_V) {
+                program->inputs |= 1 << ins->src[i].index;
+            }
+        }
+        if (vsh_get_field(cur_token, FLD_FINAL)) {
+            program->length = slot + 1;
+            return program;
+        }
+    }
+
+    g_free(program);
+    return NULL;
+}
+
+void vsh_program_free(VshProgram *program)
+{
+    g_free(program);
+}
+
+uint16_t vsh_program_inputs(const VshProgram *program)
+{
+    return program->inputs;
+}
+
+typedef struct VshRegisters {
+    VshLanes r[12][4];
+    VshLanes (*o)[4];
+    VshLanesInt a0;
+} VshRegisters;
+
+static VshLanes *vsh_temp(VshRegisters *regs, unsigned int index)
+{
+    /* R12 is a mirror of oPos */
+    return (index == 12) ? regs->o[VSH_OUTPUT_POS] : regs->r[index];
+}
+
+static void read_source(const VshSource *src, VshRegisters *regs,
+                        const float (*constants)[4],
+                        const VshLanes (*inputs)[4], VshLanes out[4])
+{
+    const VshLanes *reg;
+    VshLanes c[4];
+    int i, j;
+
+    switch (src->type) {
+    case PARAM_R:
+        reg = vsh_temp(regs, src->index);
+        break;
+    case PARAM_V:
+        reg = inputs[src->index];
+        break;
+    case PARAM_C:
+    default:
+        if (!src->relative) {
+            for (i = 0; i < 4; i++) {
+                float v = (src->index < VSH_CONSTANTS)
+                              ? constants[src->index][i] : 0.0f;
+                c[i] = (VshLanes){} + v;
+            }
+        } else {
+            /* every vertex can have its own A0 */
+            for (j = 0; j < VSH_BATCH_SIZE; j++) {
+                int index = src->index + regs->a0[j];
+                for (i = 0; i < 4; i++) {
+                    c[i][j] = (index >= 0 && index < VSH_CONSTANTS)
+                                  ? constants[index][i] : 0.0f;
+                }
+            }
+        }
+        reg = c;
+        break;
+    }
+
+    for (i = 0; i < 4; i++) {
+        out[i] = src->negate ? -reg[src->swizzle[i]] : reg[src->swizzle[i]];
+    }
+}
+
+static void write_dest(VshLanes *dest, uint8_t mask, const VshLanes value[4])
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if (mask & (1 << i)) {
+            dest[i] = value[i];
+        }
+    }
+}
+
+static VshLanes lanes_select(VshLanesInt mask, VshLanes a, VshLanes b)
+{
+    return (VshLanes)((mask & (VshLanesInt)a) | (~mask & (VshLanesInt)b));
+}
+
+static VshLanes lanes_set(VshLanesInt mask)
+{
+    return lanes_select(mask, (VshLanes){} + 1.0f, (VshLanes){});
+}
+
+static void run_mac(VshMAC mac, const VshLanes a[4], const VshLanes b[4],
+                    const VshLanes c[4], VshLanes out[4])
+{
+    VshLanes t;
+    int i;
+
+    switch (mac) {
+    case MAC_MOV:
+        for (i = 0; i < 4; i++) {
+            out[i] = a[i];
+        }
+        break;
+    case MAC_MUL:
+        for (i = 0; i < 4; i++) {
+            out[i] = a[i] * b[i];
+        }
+        break;
+    case MAC_ADD:
+        for (i = 0; i < 4; i++) {
+            out[i] = a[i] + c[i];
+        }
+        break;
+    case MAC_MAD:
+        for (i = 0; i < 4; i++) {
+            out[i] = a[i] * b[i] + c[i];
+        }
+        break;
+    case MAC_DP3:
+        t = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+        out[0] = out[1] = out[2] = out[3] = t;
+        break;
+    case MAC_DPH:
+        t = a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + b[3];
+        out[0] = out[1] = out[2] = out[3] = t;
+        break;
+    case MAC_DP4:
+        t = a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3];
+        out[0] = out[1] = out[2] = out[3] = t;
+        break;
+    case MAC_DST:
+        out[0] = (VshLanes){} + 1.0f;
+        out[1] = a[1] * b[1];
+        out[2] = a[2];
+        out[3] = b[3];
+        break;
+    case MAC_MIN:
+        for (i = 0; i < 4; i++) {
+            out[i] = lanes_select(a[i] < b[i], a[i], b[i]);
+        }
+        break;
+    case MAC_MAX:
+        for (i = 0; i < 4; i++) {
+            out[i] = lanes_select(a[i] > b[i], a[i], b[i]);
+        }
+        break;
+    case MAC_SLT:
+        for (i = 0; i < 4; i++) {
+            out[i] = lanes_set(a[i] < b[i]);
+        }
+        break;
+    case MAC_SGE:
+        for (i = 0; i < 4; i++) {
+            out[i] = lanes_set(a[i] >= b[i]);
+        }
+        break;
+    default:
+        assert(false);
+        break;
+    }
+}
+
+/* The ILU works on one component, these follow the GLSL helpers */
+static void run_ilu_lane(VshILU ilu, float x, const VshLanes c[4], int lane,
+                         float out[4])
+{
+    float t;
+
+    switch (ilu) {
+    case ILU_MOV:
+        out[0] = c[0][lane];
+        out[1] = c[1][lane];
+        out[2] = c[2][lane];
+        out[3] = c[3][lane];
+        break;
+    case ILU_RCP:
+        out[0] = out[1] = out[2] = out[3] = 1.0f / x;
+        break;
+    case ILU_RCC:
+        t = 1.0f / x;
+        if (t > 0.0f) {
+            t = MIN(MAX(t, 5.42101e-020f), 1.884467e+019f);
+        } else {
+            t = MIN(MAX(t, -1.884467e+019f), -5.42101e-020f);
+        }
+        out[0] = out[1] = out[2] = out[3] = t;
+        break;
+    case ILU_RSQ:
+        if (x == 0.0f) {
+            t = INFINITY;
+        } else if (isinf(x)) {
+            t = 0.0f;
+        } else {
+            t = 1.0f / sqrtf(fabsf(x));
+        }
+        out[0] = out[1] = out[2] = out[3] = t;
+        break;
+    case ILU_EXP:
+        out[0] = exp2f(floorf(x));
+        out[1] = x - floorf(x);
+        out[2] = exp2f(x);
+        out[3] = 1.0f;
+        break;
+    case ILU_LOG:
+        t = fabsf(x);
+        if (t == 0.0f) {
+            out[0] = -INFINITY;
+            out[1] = 1.0f;
+            out[2] = -INFINITY;
+        } else {
+            out[0] = floorf(log2f(t));
+            out[1] = t / exp2f(out[0]);
+            out[2] = log2f(t);
+        }
+        out[3] = 1.0f;
+        break;
+    case ILU_LIT: {
+        float epsilon = 1.0f / 256.0f;
+        float sx = MAX(c[0][lane], 0.0f);
+        float sy = MAX(c[1][lane], 0.0f);
+        float sw = MIN(MAX(c[3][lane], -(128.0f - epsilon)),
+                       128.0f - epsilon);
+        out[0] = 1.0f;
+        out[1] = sx;
+        out[2] = (sx > 0.0f) ? exp2f(sw * log2f(sy)) : 0.0f;
+        out[3] = 1.0f;
+        break;
+    }
+    default:
+        assert(false);
+        break;
+    }
+}
+
+void vsh_program_run(const VshProgram *program,
+                     const float (*constants)[4],
+                     const VshLanes (*inputs)[4],
+                     VshLanes (*outputs)[4])
+{
+    VshRegisters regs;
+    unsigned int n;
+    int i, j;
+
+    memset(&regs, 0, sizeof(regs));
+    regs.o = outputs;
+    for (i = 0; i < VSH_OUTPUTS; i++) {
+        for (j = 0; j < 3; j++) {
+            outputs[i][j] = (VshLanes){};
+        }
+        outputs[i][3] = (VshLanes){} + 1.0f;
+    }
+    /* see generate_vertex_shader */
+    outputs[VSH_OUTPUT_FOG][0] = (VshLanes){} + 1.0f;
+
+    for (n = 0; n < program->length; n++) {
+        const VshInstruction *ins = &program->instructions[n];
+        VshLanes src[3][4];
+        VshLanes mac_out[4], ilu_out[4];
+
+        /* all inputs are read before anything is written */
+        for (i = 0; i < 3; i++) {
+            if (ins->src[i].type != PARAM_UNKNOWN) {
+                read_source(&ins->src[i], &regs, constants, inputs, src[i]);
+            }
+        }
+
+        if (ins->mac == MAC_ARL) {
+            /* with the same bias as _ARL */
+            for (j = 0; j < VSH_BATCH_SIZE; j++) {
+                regs.a0[j] = (int32_t)floorf(src[0][0][j] + 0.001f);
+            }
+        } else if (ins->mac != MAC_NOP) {
+            run_mac(ins->mac, src[0], src[1], src[2], mac_out);
+        }
+
+        if (ins->ilu != ILU_NOP) {
+            for (j = 0; j < VSH_BATCH_SIZE; j++) {
+                float lane[4];
+                run_ilu_lane(ins->ilu, src[2][0][j], src[2], j, lane);
+                for (i = 0; i < 4; i++) {
+                    ilu_out[i][j] = lane[i];
+                }
+            }
+        }
+
+        if (ins->mac_mask) {
+            write_dest(vsh_temp(&regs, ins->mac_reg), ins->mac_mask, mac_out);
+        }
+        if (ins->ilu_mask) {
+            write_dest(vsh_temp(&regs, ins->ilu_reg), ins->ilu_mask, ilu_out);
+        }
+        if (ins->out_mask) {
+            write_dest(outputs[ins->out_reg], ins->out_mask,
+                       (ins->out_mux == OMUX_MAC) ? mac_out : ilu_out);
+        }
+    }
+}
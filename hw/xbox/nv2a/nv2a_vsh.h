@@ -136,5 +136,53 @@ void vsh_translate(uint16_t version,
                    bool z_perspective,
                    QString *header, QString *body);
 
+/* Reads the outputs of a program run on the CPU from attributes v0 to v12 */
+void vsh_translate_passthrough(bool z_perspective, QString *body);
+
+/*
+ * Runs vertex programs on the CPU. The tokens are decoded once into a
+ * compact form, which is then run over VSH_BATCH_SIZE vertices at a time
+ * with one vertex per vector lane.
+ */
+
+#ifdef __AVX__
+#define VSH_BATCH_SIZE 8
+#else
+#define VSH_BATCH_SIZE 4
+#endif
+
+#define VSH_INPUTS 16
+#define VSH_CONSTANTS 192
+
+/* Output registers, numbered like in the tokens */
+#define VSH_OUTPUT_POS 0
+#define VSH_OUTPUT_D0  3
+#define VSH_OUTPUT_D1  4
+#define VSH_OUTPUT_FOG 5
+#define VSH_OUTPUT_PTS 6
+#define VSH_OUTPUT_B0  7
+#define VSH_OUTPUT_B1  8
+#define VSH_OUTPUT_T0  9
+#define VSH_OUTPUTS    13
+
+typedef float VshLanes
+    __attribute__((vector_size(VSH_BATCH_SIZE * sizeof(float))));
+
+typedef struct VshProgram VshProgram;
+
+/* Returns NULL if the tokens can't be run, the GLSL would not compile
+ * either in that case */
+VshProgram *vsh_program_new(const uint32_t *tokens, unsigned int length);
+void vsh_program_free(VshProgram *program);
+
+/* Bit i is set if the program reads v[i] */
+uint16_t vsh_program_inputs(const VshProgram *program);
+
+/* inputs[i][j] holds component j of v[i] and outputs[i][j] component j of
+ * output register i, one vertex per lane */
+void vsh_program_run(const VshProgram *program,
+                     const float (*constants)[4],
+                     const VshLanes (*inputs)[4],
+                     VshLanes (*outputs)[4]);
 
 #endif
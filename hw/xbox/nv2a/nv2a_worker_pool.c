@@ -0,0 +1,123 @@
+/*
+ * QEMU Geforce NV2A worker threads
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "nv2a_worker_pool.h"
+
+static void *worker_pool_thread(void *opaque)
+{
+    WorkerPool *pool = opaque;
+    unsigned int generation = 0;
+
+    qemu_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->generation == generation && !pool->exiting) {
+            qemu_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->exiting) {
+            break;
+        }
+        generation = pool->generation;
+
+        qemu_mutex_unlock(&pool->lock);
+        pool->work(pool->opaque);
+        qemu_mutex_lock(&pool->lock);
+
+        if (--pool->busy == 0) {
+            qemu_cond_signal(&pool->done_cond);
+        }
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    if (pool->thread_exit) {
+        pool->thread_exit();
+    }
+    return NULL;
+}
+
+void worker_pool_init(WorkerPool *pool, const char *name,
+                      unsigned int num_threads, void (*thread_exit)(void))
+{
+    unsigned int i;
+
+    memset(pool, 0, sizeof(*pool));
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->work_cond);
+    qemu_cond_init(&pool->done_cond);
+
+    pool->thread_exit = thread_exit;
+    pool->num_threads = num_threads;
+    pool->threads = g_new0(QemuThread, num_threads);
+    for (i = 0; i < num_threads; i++) {
+        qemu_thread_create(&pool->threads[i], name, worker_pool_thread,
+                           pool, QEMU_THREAD_JOINABLE);
+    }
+}
+
+void worker_pool_destroy(WorkerPool *pool)
+{
+    unsigned int i;
+
+    qemu_mutex_lock(&pool->lock);
+    pool->exiting = true;
+    qemu_cond_broadcast(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->num_threads; i++) {
+        qemu_thread_join(&pool->threads[i]);
+    }
+    g_free(pool->threads);
+
+    qemu_mutex_destroy(&pool->lock);
+    qemu_cond_destroy(&pool->work_cond);
+    qemu_cond_destroy(&pool->done_cond);
+}
+
+void worker_pool_run(WorkerPool *pool, unsigned int num_items,
+                     WorkerPoolFunc *work, void *opaque)
+{
+    if (num_items == 0) {
+        return;
+    }
+
+    pool->work = work;
+    pool->opaque = opaque;
+    pool->num_items = num_items;
+    pool->next_item = 0;
+
+    /* waking the workers costs more than a single item */
+    if (pool->num_threads == 0 || num_items == 1) {
+        work(opaque);
+        return;
+    }
+
+    qemu_mutex_lock(&pool->lock);
+    pool->busy = pool->num_threads;
+    pool->generation++;
+    qemu_cond_broadcast(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    work(opaque);
+
+    qemu_mutex_lock(&pool->lock);
+    while (pool->busy) {
+        qemu_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    qemu_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,68 @@
+/*
+ * QEMU Geforce NV2A worker threads
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_NV2A_WORKER_POOL_H
+#define HW_NV2A_WORKER_POOL_H
+
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+
+/*
+ * A parallel for over a batch of items. worker_pool_run wakes the workers
+ * and runs the work function on every one of them and on the calling
+ * thread, each taking items with worker_pool_next until there are none
+ * left, then returns once all of them are done.
+ */
+
+typedef void WorkerPoolFunc(void *opaque);
+
+typedef struct WorkerPool {
+    QemuThread *threads;
+    unsigned int num_threads;
+
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    unsigned int generation;    /* bumped for every batch */
+    unsigned int busy;          /* workers still on the current batch */
+    bool exiting;
+
+    WorkerPoolFunc *work;
+    void *opaque;
+    unsigned int num_items;
+    unsigned int next_item;
+
+    /* called on each worker before it exits */
+    void (*thread_exit)(void);
+} WorkerPool;
+
+/* num_threads extra threads, the caller of worker_pool_run also works */
+void worker_pool_init(WorkerPool *pool, const char *name,
+                      unsigned int num_threads, void (*thread_exit)(void));
+void worker_pool_destroy(WorkerPool *pool);
+
+void worker_pool_run(WorkerPool *pool, unsigned int num_items,
+                     WorkerPoolFunc *work, void *opaque);
+
+/* Takes the next item of the current batch, false once there are none */
+static inline bool worker_pool_next(WorkerPool *pool, unsigned int *index)
+{
+    *index = atomic_fetch_inc(&pool->next_item);
+    return *index < pool->num_items;
+}
+
+#endif
@@ -24,6 +24,10 @@
 #include <assert.h>
 #include "qemu/osdep.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "swizzle.h"
 
 /* This should be pretty straightforward.
@@ -55,64 +59,194 @@ static void generate_swizzle_masks(unsigned int width,
     *mask_z = z;
 }
 
-/* This fills a pattern with a value if your value has bits abcd and your
- * pattern is 11010100100 this will return: 0a0b0c00d00
+/* Fills table[i] with the byte offset of coordinate i along the axis
+ * described by mask, for i in 0..n-1. Stepping to the next coordinate is
+ * done by carrying through the bits that are not part of the mask.
  */
-static uint32_t fill_pattern(uint32_t pattern, uint32_t value)
+static void generate_swizzle_table(uint32_t mask, unsigned int n,
+                                   unsigned int bytes_per_pixel,
+                                   uint32_t *table)
 {
-    uint32_t result = 0;
-    uint32_t bit = 1;
-    while(value) {
-        if (pattern & bit) {
-            /* Copy bit to result */
-            result |= value & 1 ? bit : 0;
-            value >>= 1;
+    uint32_t offset = 0;
+    unsigned int i;
+    for (i = 0; i < n; i++) {
+        table[i] = offset * bytes_per_pixel;
+        offset = ((offset | ~mask) + 1) & mask;
+    }
+}
+
+/* Once width and height are both at least 4 the lowest four bits of the
+ * pattern are always yxyx, so every aligned 4x4 block of pixels occupies
+ * 16 consecutive swizzled pixels. Pixels come in horizontal pairs:
+ *
+ *    0  1  4  5
+ *    2  3  6  7
+ *    8  9 12 13
+ *   10 11 14 15
+ */
+static void swizzle_tile_generic(const uint8_t *linear, unsigned int pitch,
+                                 uint8_t *swizzled,
+                                 unsigned int bytes_per_pixel)
+{
+    unsigned int pair_size = 2 * bytes_per_pixel;
+    unsigned int i;
+    for (i = 0; i < 8; i++) {
+        unsigned int x = (i & 2);
+        unsigned int y = (i & 1) | ((i & 4) >> 1);
+        memcpy(swizzled + i * pair_size,
+               linear + y * pitch + x * bytes_per_pixel, pair_size);
+    }
+}
+
+static void unswizzle_tile_generic(const uint8_t *swizzled,
+                                   uint8_t *linear, unsigned int pitch,
+                                   unsigned int bytes_per_pixel)
+{
+    unsigned int pair_size = 2 * bytes_per_pixel;
+    unsigned int i;
+    for (i = 0; i < 8; i++) {
+        unsigned int x = (i & 2);
+        unsigned int y = (i & 1) | ((i & 4) >> 1);
+        memcpy(linear + y * pitch + x * bytes_per_pixel,
+               swizzled + i * pair_size, pair_size);
+    }
+}
+
+#ifdef __SSE2__
+static void swizzle_tile_sse2(const uint8_t *linear, unsigned int pitch,
+                              uint8_t *swizzled,
+                              unsigned int bytes_per_pixel)
+{
+    if (bytes_per_pixel == 4) {
+        int i;
+        for (i = 0; i < 2; i++) {
+            __m128i r0 = _mm_loadu_si128((const __m128i *)linear);
+            __m128i r1 = _mm_loadu_si128((const __m128i *)(linear + pitch));
+            _mm_storeu_si128((__m128i *)swizzled, _mm_unpacklo_epi64(r0, r1));
+            _mm_storeu_si128((__m128i *)(swizzled + 16),
+                             _mm_unpackhi_epi64(r0, r1));
+            linear += 2 * pitch;
+            swizzled += 32;
         }
-        bit <<= 1;
+    } else if (bytes_per_pixel == 2) {
+        int i;
+        for (i = 0; i < 2; i++) {
+            __m128i r0 = _mm_loadl_epi64((const __m128i *)linear);
+            __m128i r1 = _mm_loadl_epi64((const __m128i *)(linear + pitch));
+            __m128i t = _mm_unpacklo_epi64(r0, r1);
+            _mm_storeu_si128((__m128i *)swizzled,
+                             _mm_shuffle_epi32(t, _MM_SHUFFLE(3, 1, 2, 0)));
+            linear += 2 * pitch;
+            swizzled += 16;
+        }
+    } else {
+        swizzle_tile_generic(linear, pitch, swizzled, bytes_per_pixel);
     }
-    return result;
 }
 
-static unsigned int get_swizzled_offset(
-    unsigned int x, unsigned int y, unsigned int z,
-    uint32_t mask_x, uint32_t mask_y, uint32_t mask_z,
-    unsigned int bytes_per_pixel)
+static void unswizzle_tile_sse2(const uint8_t *swizzled,
+                                uint8_t *linear, unsigned int pitch,
+                                unsigned int bytes_per_pixel)
 {
-    return bytes_per_pixel * (fill_pattern(mask_x, x)
-                           | fill_pattern(mask_y, y)
-                           | fill_pattern(mask_z, z));
+    if (bytes_per_pixel == 4) {
+        int i;
+        for (i = 0; i < 2; i++) {
+            __m128i a = _mm_loadu_si128((const __m128i *)swizzled);
+            __m128i b = _mm_loadu_si128((const __m128i *)(swizzled + 16));
+            _mm_storeu_si128((__m128i *)linear, _mm_unpacklo_epi64(a, b));
+            _mm_storeu_si128((__m128i *)(linear + pitch),
+                             _mm_unpackhi_epi64(a, b));
+            linear += 2 * pitch;
+            swizzled += 32;
+        }
+    } else if (bytes_per_pixel == 2) {
+        int i;
+        for (i = 0; i < 2; i++) {
+            __m128i a = _mm_loadu_si128((const __m128i *)swizzled);
+            __m128i t = _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));
+            _mm_storel_epi64((__m128i *)linear, t);
+            _mm_storel_epi64((__m128i *)(linear + pitch),
+                             _mm_unpackhi_epi64(t, t));
+            linear += 2 * pitch;
+            swizzled += 16;
+        }
+    } else {
+        unswizzle_tile_generic(swizzled, linear, pitch, bytes_per_pixel);
+    }
 }
 
-void swizzle_box(
-    const uint8_t *src_buf,
+#define swizzle_tile swizzle_tile_sse2
+#define unswizzle_tile unswizzle_tile_sse2
+#else
+#define swizzle_tile swizzle_tile_generic
+#define unswizzle_tile unswizzle_tile_generic
+#endif
+
+static void swizzle_box_internal(
+    uint8_t *swizzled_buf,
+    uint8_t *linear_buf,
     unsigned int width,
     unsigned int height,
     unsigned int depth,
-    uint8_t *dst_buf,
     unsigned int row_pitch,
     unsigned int slice_pitch,
-    unsigned int bytes_per_pixel)
+    unsigned int bytes_per_pixel,
+    bool swizzle)
 {
     uint32_t mask_x, mask_y, mask_z;
     generate_swizzle_masks(width, height, depth, &mask_x, &mask_y, &mask_z);
 
-    int x, y, z;
+    uint32_t *offset_x = g_new(uint32_t, width + height + depth);
+    uint32_t *offset_y = offset_x + width;
+    uint32_t *offset_z = offset_y + height;
+    generate_swizzle_table(mask_x, width, bytes_per_pixel, offset_x);
+    generate_swizzle_table(mask_y, height, bytes_per_pixel, offset_y);
+    generate_swizzle_table(mask_z, depth, bytes_per_pixel, offset_z);
+
+    bool tiled = depth == 1 && width >= 4 && height >= 4
+                 && (width | height) % 4 == 0;
+
+    unsigned int x, y, z;
     for (z = 0; z < depth; z++) {
+        uint8_t *swizzled_slice = swizzled_buf + offset_z[z];
+        uint8_t *linear_slice = linear_buf + z * slice_pitch;
+
+        if (tiled) {
+            for (y = 0; y < height; y += 4) {
+                uint8_t *swizzled_row = swizzled_slice + offset_y[y];
+                uint8_t *linear_row = linear_slice + y * row_pitch;
+                for (x = 0; x < width; x += 4) {
+                    uint8_t *s = swizzled_row + offset_x[x];
+                    uint8_t *l = linear_row + x * bytes_per_pixel;
+                    if (swizzle) {
+                        swizzle_tile(l, row_pitch, s, bytes_per_pixel);
+                    } else {
+                        unswizzle_tile(s, l, row_pitch, bytes_per_pixel);
+                    }
+                }
+            }
+            continue;
+        }
+
         for (y = 0; y < height; y++) {
+            uint8_t *swizzled_row = swizzled_slice + offset_y[y];
+            uint8_t *linear_row = linear_slice + y * row_pitch;
             for (x = 0; x < width; x++) {
-                const uint8_t *src = src_buf
-                                         + y * row_pitch + x * bytes_per_pixel;
-                uint8_t *dst = dst_buf + get_swizzled_offset(x, y, 0,
-                                                             mask_x, mask_y, 0,
-                                                             bytes_per_pixel);
-                memcpy(dst, src, bytes_per_pixel);
+                uint8_t *s = swizzled_row + offset_x[x];
+                uint8_t *l = linear_row + x * bytes_per_pixel;
+                if (swizzle) {
+                    memcpy(s, l, bytes_per_pixel);
+                } else {
+                    memcpy(l, s, bytes_per_pixel);
+                }
             }
         }
-        src_buf += slice_pitch;
     }
+
+    g_free(offset_x);
 }
 
-void unswizzle_box(
+void swizzle_box(
     const uint8_t *src_buf,
     unsigned int width,
     unsigned int height,
@@ -122,22 +256,22 @@ void unswizzle_box(
     unsigned int slice_pitch,
     unsigned int bytes_per_pixel)
 {
-    uint32_t mask_x, mask_y, mask_z;
-    generate_swizzle_masks(width, height, depth, &mask_x, &mask_y, &mask_z);
+    swizzle_box_internal(dst_buf, (uint8_t *)src_buf, width, height, depth,
+                         row_pitch, slice_pitch, bytes_per_pixel, true);
+}
 
-    int x, y, z;
-    for (z = 0; z < depth; z++) {
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                const uint8_t *src = src_buf
-                    + get_swizzled_offset(x, y, z, mask_x, mask_y, mask_z,
-                                          bytes_per_pixel);
-                uint8_t *dst = dst_buf + y * row_pitch + x * bytes_per_pixel;
-                memcpy(dst, src, bytes_per_pixel);
-            }
-        }
-        dst_buf += slice_pitch;
-    }
+void unswizzle_box(
+    const uint8_t *src_buf,
+    unsigned int width,
+    unsigned int height,
+    unsigned int depth,
+    uint8_t *dst_buf,
+    unsigned int row_pitch,
+    unsigned int slice_pitch,
+    unsigned int bytes_per_pixel)
+{
+    swizzle_box_internal((uint8_t *)src_buf, dst_buf, width, height, depth,
+                         row_pitch, slice_pitch, bytes_per_pixel, false);
 }
 
 void unswizzle_rect(
@@ -0,0 +1,94 @@
+/*
+ * QEMU Geforce NV2A vertex attribute conversion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "vertex_convert.h"
+
+static void convert_cmp_value(uint32_t p, float *xyz)
+{
+    xyz[0] = ((int32_t)(((p >>  0) & 0x7FF) << 21) >> 21) / 1023.0f;
+    xyz[1] = ((int32_t)(((p >> 11) & 0x7FF) << 21) >> 21) / 1023.0f;
+    xyz[2] = ((int32_t)(((p >> 22) & 0x3FF) << 22) >> 22) / 511.0f;
+}
+
+#ifdef __SSE2__
+/* Unpacks four CMP values, sign extending each field with a shift pair and
+ * transposing the x, y and z vectors into 12 consecutive floats. The
+ * divisions match the scalar code bit for bit. */
+static void convert_cmp_value_x4(__m128i p, float *out)
+{
+    __m128 x = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(p, 21), 21));
+    __m128 y = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(p, 10), 21));
+    __m128 z = _mm_cvtepi32_ps(_mm_srai_epi32(p, 22));
+    x = _mm_div_ps(x, _mm_set1_ps(1023.0f));
+    y = _mm_div_ps(y, _mm_set1_ps(1023.0f));
+    z = _mm_div_ps(z, _mm_set1_ps(511.0f));
+
+    __m128 xy_lo = _mm_unpacklo_ps(x, y); /* x0 y0 x1 y1 */
+    __m128 xy_hi = _mm_unpackhi_ps(x, y); /* x2 y2 x3 y3 */
+
+    /* z0 z0 x1 x1 -> x0 y0 z0 x1 */
+    __m128 t = _mm_shuffle_ps(z, xy_lo, _MM_SHUFFLE(2, 2, 0, 0));
+    _mm_storeu_ps(&out[0], _mm_shuffle_ps(xy_lo, t, _MM_SHUFFLE(2, 0, 1, 0)));
+
+    /* y1 y1 z1 z1 -> y1 z1 x2 y2 */
+    t = _mm_shuffle_ps(xy_lo, z, _MM_SHUFFLE(1, 1, 3, 3));
+    _mm_storeu_ps(&out[4], _mm_shuffle_ps(t, xy_hi, _MM_SHUFFLE(1, 0, 2, 0)));
+
+    /* z2 z2 x3 x3 and y3 y3 z3 z3 -> z2 x3 y3 z3 */
+    t = _mm_shuffle_ps(z, xy_hi, _MM_SHUFFLE(2, 2, 2, 2));
+    __m128 u = _mm_shuffle_ps(xy_hi, z, _MM_SHUFFLE(3, 3, 3, 3));
+    _mm_storeu_ps(&out[8], _mm_shuffle_ps(t, u, _MM_SHUFFLE(2, 0, 2, 0)));
+}
+#endif
+
+void convert_cmp_to_float(
+    const uint8_t *src,
+    unsigned int stride,
+    unsigned int count,
+    unsigned int num_elements,
+    float *dst)
+{
+    unsigned int i = 0, c;
+
+#ifdef __SSE2__
+    if (count == 1) {
+        /* normals and the like, one value per element */
+        for (; i + 4 <= num_elements; i += 4) {
+            const uint8_t *in = src + i * stride;
+            __m128i p = _mm_set_epi32(ldl_le_p(in + 3 * stride),
+                                      ldl_le_p(in + 2 * stride),
+                                      ldl_le_p(in + stride),
+                                      ldl_le_p(in));
+            convert_cmp_value_x4(p, &dst[i * 3]);
+        }
+    }
+#endif
+
+    for (; i < num_elements; i++) {
+        const uint8_t *in = src + i * stride;
+        for (c = 0; c < count; c++) {
+            convert_cmp_value(ldl_le_p(in + c * 4), &dst[(i * count + c) * 3]);
+        }
+    }
+}
@@ -0,0 +1,33 @@
+/*
+ * QEMU Geforce NV2A vertex attribute conversion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_XBOX_VERTEX_CONVERT_H
+#define HW_XBOX_VERTEX_CONVERT_H
+
+/*
+ * Unpacks num_elements elements of count CMP values each, starting stride
+ * bytes apart. Every CMP value holds three signed, normalized components
+ * packed as 11:11:10 bits and becomes three floats in dst.
+ */
+void convert_cmp_to_float(
+    const uint8_t *src,
+    unsigned int stride,
+    unsigned int count,
+    unsigned int num_elements,
+    float *dst);
+
+#endif
@@ -186,11 +186,15 @@ static inline bool cpu_physical_memory_get_dirty_flag(ram_addr_t addr,
 static inline bool cpu_physical_memory_is_clean(ram_addr_t addr)
 {
     bool nv2a = cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_NV2A);
+    bool nv2a_tex =
+        cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_NV2A_TEX);
+    bool nv2a_capture =
+        cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_NV2A_CAPTURE);
     bool vga = cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_VGA);
     bool code = cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_CODE);
     bool migration =
         cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_MIGRATION);
-    return !(nv2a && vga && code && migration);
+    return !(nv2a && nv2a_tex && nv2a_capture && vga && code && migration);
 }
 
 static inline uint8_t cpu_physical_memory_range_includes_clean(ram_addr_t start,
@@ -203,6 +207,15 @@ static inline uint8_t cpu_physical_memory_range_includes_clean(ram_addr_t start,
         !cpu_physical_memory_all_dirty(start, length, DIRTY_MEMORY_NV2A)) {
         ret |= (1 << DIRTY_MEMORY_NV2A);
     }
+    if (mask & (1 << DIRTY_MEMORY_NV2A_TEX) &&
+        !cpu_physical_memory_all_dirty(start, length, DIRTY_MEMORY_NV2A_TEX)) {
+        ret |= (1 << DIRTY_MEMORY_NV2A_TEX);
+    }
+    if (mask & (1 << DIRTY_MEMORY_NV2A_CAPTURE) &&
+        !cpu_physical_memory_all_dirty(start, length,
+                                       DIRTY_MEMORY_NV2A_CAPTURE)) {
+        ret |= (1 << DIRTY_MEMORY_NV2A_CAPTURE);
+    }
     if (mask & (1 << DIRTY_MEMORY_VGA) &&
         !cpu_physical_memory_all_dirty(start, length, DIRTY_MEMORY_VGA)) {
         ret |= (1 << DIRTY_MEMORY_VGA);
@@ -279,6 +292,14 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
             bitmap_set_atomic(blocks[DIRTY_MEMORY_NV2A]->blocks[idx],
                               offset, next - page);
         }
+        if (unlikely(mask & (1 << DIRTY_MEMORY_NV2A_TEX))) {
+            bitmap_set_atomic(blocks[DIRTY_MEMORY_NV2A_TEX]->blocks[idx],
+                              offset, next - page);
+        }
+        if (unlikely(mask & (1 << DIRTY_MEMORY_NV2A_CAPTURE))) {
+            bitmap_set_atomic(blocks[DIRTY_MEMORY_NV2A_CAPTURE]->blocks[idx],
+                              offset, next - page);
+        }
         if (unlikely(mask & (1 << DIRTY_MEMORY_CODE))) {
             bitmap_set_atomic(blocks[DIRTY_MEMORY_CODE]->blocks[idx],
                               offset, next - page);
@@ -334,6 +355,9 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
                 atomic_or(&blocks[DIRTY_MEMORY_MIGRATION][idx][offset], temp);
                 atomic_or(&blocks[DIRTY_MEMORY_VGA][idx][offset], temp);
                 atomic_or(&blocks[DIRTY_MEMORY_NV2A][idx][offset], temp);
+                atomic_or(&blocks[DIRTY_MEMORY_NV2A_TEX][idx][offset], temp);
+                atomic_or(&blocks[DIRTY_MEMORY_NV2A_CAPTURE][idx][offset],
+                          temp);
                 if (tcg_enabled()) {
                     atomic_or(&blocks[DIRTY_MEMORY_CODE][idx][offset], temp);
                 }
@@ -389,6 +413,10 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
     cpu_physical_memory_test_and_clear_dirty(start, length, DIRTY_MEMORY_MIGRATION);
     cpu_physical_memory_test_and_clear_dirty(start, length, DIRTY_MEMORY_VGA);
     cpu_physical_memory_test_and_clear_dirty(start, length, DIRTY_MEMORY_NV2A);
+    cpu_physical_memory_test_and_clear_dirty(start, length,
+                                             DIRTY_MEMORY_NV2A_TEX);
+    cpu_physical_memory_test_and_clear_dirty(start, length,
+                                             DIRTY_MEMORY_NV2A_CAPTURE);
     cpu_physical_memory_test_and_clear_dirty(start, length, DIRTY_MEMORY_CODE);
 }
 
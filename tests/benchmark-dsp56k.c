@@ -0,0 +1,317 @@
+/*
+ * MCPX DSP56300 interpreter speed benchmark
+ *
+ * Runs GP microcode with and without the per PRAM address opcode cache,
+ * frames of it with and without skipping the cycles an idle core would
+ * spin for, and full frame budgets interpreted and translated to host
+ * code. Each pair is checked to leave the core in the same state. Reports
+ * millions of instructions per second and how long a full frame's cycle
+ * budget takes against real time.
+ *
+ * By default small synthetic mixing loops are run. A captured GP memory
+ * image can be given instead: 32 bit little endian words, the 4096 words
+ * of P memory followed optionally by 4096 words of X and 2048 of Y memory.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+
+#include "../hw/xbox/dsp/dsp.h"
+
+#define PRAM_WORDS 4096
+#define XRAM_WORDS 4096
+#define YRAM_WORDS 2048
+
+/* Instructions run per frame by the speed test */
+#define FRAME_INSTRUCTIONS 500
+
+/* As in mcpx_apu.c, 160MHz and 32 samples at 48kHz */
+#define FRAME_CYCLES (160000000 / 48000 * 32)
+#define FRAME_SECONDS (32 / 48000.0)
+
+#define SCRATCH_SIZE (64 * 1024)
+
+/* Never idles */
+static const uint32_t synthetic_microcode[] = {
+    0x053fa0,           /* movec #$3f,m0 */
+    0x053fa4,           /* movec #$3f,m4 */
+    0x200013,           /* clr a */
+    0x062080, 0x00000a, /* do #$20,p:$000a */
+    0xf098d2,           /* mac y0,x0,a x:(r0)+,x0 y:(r4)+,y0 */
+    0x014188,           /* add #1,b */
+    0x0ac563,           /* bset #3,x1 */
+    0x0bc563,           /* btst #3,x1 */
+    0x0ac543,           /* bclr #3,x1 */
+    0x000009,           /* inc b */
+    0x00000b,           /* dec b */
+    0x0c0002,           /* jmp p:$0002 */
+};
+
+/* Mixes a frame once it's started, then polls for the next one */
+static const uint32_t synthetic_frame_microcode[] = {
+    0x053fa0,           /* movec #$3f,m0 */
+    0x053fa4,           /* movec #$3f,m4 */
+    0x0a8581, 0x000002, /* jclr #1,x:$ffffc5,p:$0002 */
+    0x0a8521,           /* bset #1,x:$ffffc5 */
+    0x200013,           /* clr a */
+    0x062080, 0x000009, /* do #$20,p:$0009 */
+    0xf098d2,           /* mac y0,x0,a x:(r0)+,x0 y:(r4)+,y0 */
+    0x014188,           /* add #1,b */
+    0x0c0002,           /* jmp p:$0002 */
+};
+
+static const char *image_path;
+static uint8_t scratch[SCRATCH_SIZE];
+
+static void scratch_rw(void *opaque, uint8_t *ptr, uint32_t addr,
+                       size_t len, bool dir)
+{
+    g_assert(addr + len <= SCRATCH_SIZE);
+    if (dir) {
+        memcpy(&scratch[addr], ptr, len);
+    } else {
+        memcpy(ptr, &scratch[addr], len);
+    }
+}
+
+static void fifo_rw(void *opaque, uint8_t *ptr, unsigned int index,
+                    unsigned int item_size, size_t len, bool dir)
+{
+    if (!dir) {
+        memset(ptr, 0, len);
+    }
+}
+
+static void load_words(DSPState *dsp, char space, const uint8_t *data,
+                       size_t words)
+{
+    size_t i;
+
+    for (i = 0; i < words; i++) {
+        dsp_write_memory(dsp, space, i, ldl_le_p(data + i * 4) & 0xffffff);
+    }
+}
+
+static DSPState *load_microcode(const uint32_t *microcode, size_t words,
+                                bool cache, bool idle_skip, bool jit)
+{
+    DSPState *dsp = dsp_init(NULL, scratch_rw, fifo_rw);
+    dsp_set_opcode_cache(dsp, cache);
+    dsp_set_idle_skip(dsp, idle_skip);
+    dsp_set_jit(dsp, jit);
+
+    if (image_path) {
+        gchar *data;
+        gsize length;
+        GError *err = NULL;
+
+        if (!g_file_get_contents(image_path, &data, &length, &err)) {
+            g_printerr("%s\n", err->message);
+            exit(1);
+        }
+        g_assert(length >= PRAM_WORDS * 4);
+        load_words(dsp, 'P', (uint8_t *)data, PRAM_WORDS);
+        if (length >= (PRAM_WORDS + XRAM_WORDS + YRAM_WORDS) * 4) {
+            load_words(dsp, 'X', (uint8_t *)data + PRAM_WORDS * 4,
+                       XRAM_WORDS);
+            load_words(dsp, 'Y',
+                       (uint8_t *)data + (PRAM_WORDS + XRAM_WORDS) * 4,
+                       YRAM_WORDS);
+        }
+        g_free(data);
+    } else {
+        size_t i;
+        for (i = 0; i < words; i++) {
+            dsp_write_memory(dsp, 'P', i, microcode[i]);
+        }
+    }
+
+    return dsp;
+}
+
+static void run_frame(DSPState *dsp)
+{
+    unsigned int i;
+
+    dsp_start_frame(dsp);
+    for (i = 0; i < FRAME_INSTRUCTIONS; i++) {
+        dsp_step(dsp);
+    }
+}
+
+static double time_frames(bool cache)
+{
+    DSPState *dsp = load_microcode(synthetic_microcode,
+                                   ARRAY_SIZE(synthetic_microcode),
+                                   cache, false, false);
+    double instructions = 0.0;
+
+    g_test_timer_start();
+    do {
+        run_frame(dsp);
+        instructions += FRAME_INSTRUCTIONS;
+    } while (g_test_timer_elapsed() < 1.0);
+
+    dsp_destroy(dsp);
+    return instructions / 1e6 / g_test_timer_last();
+}
+
+static void check_registers(DSPState *a, DSPState *b)
+{
+    static const char *const names[] = {
+        "A0", "A1", "A2", "B0", "B1", "B2", "X0", "X1", "Y0", "Y1",
+        "R0", "R4", "LA", "LC", "PC", "SR", "SP",
+    };
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(names); i++) {
+        uint32_t *reg_a, *reg_b, mask;
+        g_assert(dsp_get_register_address(a, names[i], &reg_a, &mask));
+        g_assert(dsp_get_register_address(b, names[i], &reg_b, &mask));
+        g_assert_cmphex(*reg_a & mask, ==, *reg_b & mask);
+    }
+}
+
+static void check_state(DSPState *a, DSPState *b)
+{
+    uint32_t addr;
+
+    check_registers(a, b);
+    for (addr = 0; addr < XRAM_WORDS; addr++) {
+        g_assert_cmphex(dsp_read_memory(a, 'X', addr), ==,
+                        dsp_read_memory(b, 'X', addr));
+    }
+    for (addr = 0; addr < YRAM_WORDS; addr++) {
+        g_assert_cmphex(dsp_read_memory(a, 'Y', addr), ==,
+                        dsp_read_memory(b, 'Y', addr));
+    }
+}
+
+static void test_dsp56k_speed(void)
+{
+    DSPState *uncached = load_microcode(synthetic_microcode,
+                                        ARRAY_SIZE(synthetic_microcode),
+                                        false, false, false);
+    DSPState *cached = load_microcode(synthetic_microcode,
+                                      ARRAY_SIZE(synthetic_microcode),
+                                      true, false, false);
+    unsigned int i;
+
+    for (i = 0; i < 100; i++) {
+        run_frame(uncached);
+        run_frame(cached);
+    }
+    check_state(uncached, cached);
+    dsp_destroy(uncached);
+    dsp_destroy(cached);
+
+    double before = time_frames(false);
+    double after = time_frames(true);
+
+    g_print("%s: uncached %.2f MIPS, cached %.2f MIPS (%.1fx)\n",
+            image_path ? image_path : "synthetic",
+            before, after, after / before);
+}
+
+static void run_budget(DSPState *dsp)
+{
+    dsp_start_frame(dsp);
+    dsp_run(dsp, FRAME_CYCLES);
+}
+
+static double time_budget(const uint32_t *microcode, size_t words,
+                          bool idle_skip, bool jit)
+{
+    DSPState *dsp = load_microcode(microcode, words, true, idle_skip, jit);
+    unsigned int frames = 0;
+
+    g_test_timer_start();
+    do {
+        run_budget(dsp);
+        frames++;
+    } while (g_test_timer_elapsed() < 1.0);
+
+    dsp_destroy(dsp);
+    return g_test_timer_last() / frames / FRAME_SECONDS;
+}
+
+static void test_dsp56k_idle_skip(void)
+{
+    DSPState *spinning = load_microcode(synthetic_frame_microcode,
+                                        ARRAY_SIZE(synthetic_frame_microcode),
+                                        true, false, false);
+    DSPState *skipping = load_microcode(synthetic_frame_microcode,
+                                        ARRAY_SIZE(synthetic_frame_microcode),
+                                        true, true, false);
+    unsigned int i;
+
+    for (i = 0; i < 20; i++) {
+        run_budget(spinning);
+        run_budget(skipping);
+        check_state(spinning, skipping);
+    }
+    dsp_destroy(spinning);
+    dsp_destroy(skipping);
+
+    double spin = time_budget(synthetic_frame_microcode,
+                              ARRAY_SIZE(synthetic_frame_microcode),
+                              false, false);
+    double skip = time_budget(synthetic_frame_microcode,
+                              ARRAY_SIZE(synthetic_frame_microcode),
+                              true, false);
+
+    g_print("%s: %u cycle frames take %.1f%% of real time spinning, "
+            "%.1f%% skipping idle cycles\n",
+            image_path ? image_path : "synthetic", FRAME_CYCLES,
+            spin * 100.0, skip * 100.0);
+}
+
+/* The microcode never idles, so every cycle of the budget is run */
+static void test_dsp56k_jit(void)
+{
+    DSPState *interpreted = load_microcode(synthetic_microcode,
+                                           ARRAY_SIZE(synthetic_microcode),
+                                           true, false, false);
+    DSPState *translated = load_microcode(synthetic_microcode,
+                                          ARRAY_SIZE(synthetic_microcode),
+                                          true, false, true);
+    unsigned int i;
+
+    for (i = 0; i < 20; i++) {
+        run_budget(interpreted);
+        run_budget(translated);
+        check_state(interpreted, translated);
+    }
+    dsp_destroy(interpreted);
+    dsp_destroy(translated);
+
+    double before = time_budget(synthetic_microcode,
+                                ARRAY_SIZE(synthetic_microcode),
+                                false, false);
+    double after = time_budget(synthetic_microcode,
+                               ARRAY_SIZE(synthetic_microcode),
+                               false, true);
+
+    g_print("%s: %u cycle frames take %.1f%% of real time interpreted, "
+            "%.1f%% translated (%.1fx)\n",
+            image_path ? image_path : "synthetic", FRAME_CYCLES,
+            before * 100.0, after * 100.0, before / after);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    if (argc > 1) {
+        image_path = argv[1];
+    }
+
+    g_test_add_func("/dsp56k/speed", test_dsp56k_speed);
+    g_test_add_func("/dsp56k/idle-skip", test_dsp56k_idle_skip);
+    g_test_add_func("/dsp56k/jit", test_dsp56k_jit);
+
+    return g_test_run();
+}
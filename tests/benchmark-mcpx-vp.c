@@ -0,0 +1,222 @@
+/*
+ * MCPX Voice Processor mixing speed benchmark
+ *
+ * Mixes frames of N active voices the way the VP does: decode the source
+ * samples a frame needs, resample them to 48kHz and accumulate into the
+ * voice's 8 mixbins, then convert the mixbins for the GP. Voices alternate
+ * between 16 bit PCM and ADPCM, mono and stereo, at pitches from an
+ * octave down to an octave up. Reports how much of a 32 sample frame's
+ * real time that takes. The vector resampler and mixer are checked
+ * against scalar versions first.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+
+#include "../hw/xbox/mcpx_vp_mix.h"
+
+#define FRAME_SECONDS (VP_FRAME_SAMPLES / 48000.0)
+
+/* in samples, each voice loops over its buffer */
+#define BUFFER_SAMPLES (VP_ADPCM_SAMPLES_PER_BLOCK * 1024)
+
+typedef struct BenchVoice {
+    VPVoiceBuffer buf;
+    uint32_t pos;
+    float frac;
+    float rate;
+    unsigned int bins[VP_VOICE_BINS];
+    float volume[VP_VOICE_BINS];
+} BenchVoice;
+
+static VPVoiceScratch scratch;
+static float src[2][VP_MAX_SOURCE_SAMPLES];
+
+static void read_host(void *opaque, uint32_t offset, uint8_t *buf,
+                      size_t len)
+{
+    memcpy(buf, (uint8_t *)opaque + offset, len);
+}
+
+static void voice_init(BenchVoice *v, unsigned int index)
+{
+    unsigned int i;
+
+    v->buf.base = 0;
+    v->buf.format = index % 2 ? VP_FORMAT_ADPCM : VP_FORMAT_S16;
+    v->buf.channels = index % 3 ? 1 : 2;
+    v->buf.lbo = 0;
+    v->buf.ebo = BUFFER_SAMPLES - 1;
+    v->buf.loop = true;
+    v->buf.read = read_host;
+
+    size_t size = (size_t)vp_sample_frame_size(v->buf.format,
+                                               v->buf.channels)
+                  * (v->buf.format == VP_FORMAT_ADPCM
+                     ? BUFFER_SAMPLES / VP_ADPCM_SAMPLES_PER_BLOCK
+                     : BUFFER_SAMPLES);
+    uint8_t *data = g_malloc(size);
+    for (i = 0; i < size; i++) {
+        data[i] = g_test_rand_int();
+    }
+    if (v->buf.format == VP_FORMAT_ADPCM) {
+        /* keep the step indices in range */
+        size_t block;
+        for (block = 0; block < size; block += VP_ADPCM_BLOCK_SIZE) {
+            data[block + 2] %= 89;
+        }
+    }
+    v->buf.opaque = data;
+
+    int pitch = g_test_rand_int_range(-4096, 4097);
+    v->rate = exp2f(pitch / 4096.0f);
+    v->pos = g_test_rand_int_range(0, BUFFER_SAMPLES);
+    v->frac = 0.0f;
+    for (i = 0; i < VP_VOICE_BINS; i++) {
+        v->bins[i] = g_test_rand_int_range(0, VP_NUM_MIXBINS);
+        v->volume[i] = vp_volume_gain(g_test_rand_int_range(0, 0x400));
+    }
+}
+
+static void voice_mix(BenchVoice *v, VPMixbins *mix)
+{
+    static const float gain[VP_FRAME_SAMPLES] = {
+        [0 ... VP_FRAME_SAMPLES - 1] = 1.0f
+    };
+    float samples[VP_FRAME_SAMPLES];
+    unsigned int channels = v->buf.channels;
+    unsigned int ch;
+
+    vp_voice_fill(&v->buf, &scratch, v->pos,
+                  vp_resample_span(v->frac, v->rate), src[0], src[1]);
+    for (ch = 0; ch < channels; ch++) {
+        vp_resample(src[ch], v->frac, v->rate, samples);
+        vp_mix(mix, samples, gain, &v->bins[ch * 4], &v->volume[ch * 4],
+               &v->volume[ch * 4], channels == 1 ? VP_VOICE_BINS : 4);
+    }
+    vp_voice_advance(&v->buf, &v->pos, &v->frac, v->rate);
+}
+
+static double time_frames(unsigned int num_voices)
+{
+    BenchVoice *voices = g_new(BenchVoice, num_voices);
+    VPMixbins *mix = g_new(VPMixbins, 1);
+    int32_t out[VP_NUM_MIXBINS][VP_FRAME_SAMPLES];
+    unsigned int frames = 0;
+    unsigned int i;
+
+    for (i = 0; i < num_voices; i++) {
+        voice_init(&voices[i], i);
+    }
+
+    g_test_timer_start();
+    do {
+        memset(mix, 0, sizeof(*mix));
+        for (i = 0; i < num_voices; i++) {
+            voice_mix(&voices[i], mix);
+        }
+        vp_mixbins_to_s24(mix, out);
+        frames++;
+    } while (g_test_timer_elapsed() < 1.0);
+
+    for (i = 0; i < num_voices; i++) {
+        g_free(voices[i].buf.opaque);
+    }
+    g_free(voices);
+    g_free(mix);
+
+    return g_test_timer_last() / frames;
+}
+
+static void test_vp_resample(void)
+{
+    float in[VP_MAX_SOURCE_SAMPLES];
+    float out[VP_FRAME_SAMPLES];
+    unsigned int i, n;
+
+    for (i = 0; i < ARRAY_SIZE(in); i++) {
+        in[i] = sinf(i * 0.01f);
+    }
+
+    for (n = 0; n < 100; n++) {
+        float rate = exp2f(g_test_rand_int_range(-32768, 32768) / 4096.0f);
+        float frac = g_test_rand_double_range(0.0, 1.0);
+        g_assert_cmpuint(vp_resample_span(frac, rate), <=,
+                         VP_MAX_SOURCE_SAMPLES);
+        vp_resample(in, frac, rate, out);
+        for (i = 0; i < VP_FRAME_SAMPLES; i++) {
+            float p = frac + i * rate;
+            unsigned int index = p;
+            float t = p - index;
+            float expected = in[index] * (1.0f - t) + in[index + 1] * t;
+            g_assert_cmpfloat(fabsf(out[i] - expected), <, 1e-5f);
+        }
+    }
+}
+
+static void test_vp_mix(void)
+{
+    VPMixbins mix;
+    float expected[VP_NUM_MIXBINS][VP_FRAME_SAMPLES] = { { 0 } };
+    float samples[VP_FRAME_SAMPLES], gain[VP_FRAME_SAMPLES];
+    unsigned int bins[VP_VOICE_BINS];
+    float start[VP_VOICE_BINS], end[VP_VOICE_BINS];
+    unsigned int n, i, b;
+
+    memset(&mix, 0, sizeof(mix));
+    for (n = 0; n < 64; n++) {
+        for (i = 0; i < VP_FRAME_SAMPLES; i++) {
+            samples[i] = g_test_rand_double_range(-1.0, 1.0);
+            gain[i] = g_test_rand_double_range(0.0, 1.0);
+        }
+        for (b = 0; b < VP_VOICE_BINS; b++) {
+            bins[b] = g_test_rand_int_range(0, VP_NUM_MIXBINS + 2);
+            start[b] = vp_volume_gain(g_test_rand_int_range(0, 0x1000));
+            end[b] = vp_volume_gain(g_test_rand_int_range(0, 0x1000));
+            if (bins[b] >= VP_NUM_MIXBINS) {
+                continue;
+            }
+            for (i = 0; i < VP_FRAME_SAMPLES; i++) {
+                float volume = start[b] + (end[b] - start[b])
+                               * i / (float)VP_FRAME_SAMPLES;
+                expected[bins[b]][i] += samples[i] * gain[i] * volume;
+            }
+        }
+        vp_mix(&mix, samples, gain, bins, start, end, VP_VOICE_BINS);
+    }
+
+    for (b = 0; b < VP_NUM_MIXBINS; b++) {
+        const float *out = (const float *)mix.bins[b];
+        for (i = 0; i < VP_FRAME_SAMPLES; i++) {
+            g_assert_cmpfloat(fabsf(out[i] - expected[b][i]), <, 1e-4f);
+        }
+    }
+}
+
+static void test_vp_speed(void)
+{
+    static const unsigned int counts[] = { 1, 64, 128, 256 };
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(counts); i++) {
+        double frame = time_frames(counts[i]);
+        g_print("%3u voices: %7.1fus a frame, %5.1f%% of real time\n",
+                counts[i], frame * 1e6, frame / FRAME_SECONDS * 100.0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    vp_mix_init();
+
+    g_test_add_func("/mcpx-vp/resample", test_vp_resample);
+    g_test_add_func("/mcpx-vp/mix", test_vp_mix);
+    g_test_add_func("/mcpx-vp/speed", test_vp_speed);
+
+    return g_test_run();
+}
@@ -0,0 +1,239 @@
+/*
+ * NV2A texture swizzling speed benchmark
+ *
+ * Compares the table driven swizzle routines against the original per-pixel
+ * bit scattering implementation, and checks that both produce the same
+ * results and that unswizzling gives back what was swizzled. Besides the
+ * square sizes that are timed, the checks cover non-square textures,
+ * textures smaller than a 4x4 tile and volume textures.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+
+#include "../hw/xbox/nv2a/swizzle.c"
+
+typedef struct SwizzleBench {
+    unsigned int width, height, depth;
+    unsigned int bytes_per_pixel;
+    bool swizzle;
+} SwizzleBench;
+
+/* Reference implementation, as it was before the lookup tables */
+
+static uint32_t ref_fill_pattern(uint32_t pattern, uint32_t value)
+{
+    uint32_t result = 0;
+    uint32_t bit = 1;
+    while (value) {
+        if (pattern & bit) {
+            result |= value & 1 ? bit : 0;
+            value >>= 1;
+        }
+        bit <<= 1;
+    }
+    return result;
+}
+
+static void ref_swizzle_box(const uint8_t *src_buf, unsigned int width,
+                            unsigned int height, unsigned int depth,
+                            uint8_t *dst_buf, unsigned int row_pitch,
+                            unsigned int slice_pitch,
+                            unsigned int bytes_per_pixel, bool swizzle)
+{
+    uint32_t mask_x, mask_y, mask_z;
+    generate_swizzle_masks(width, height, depth, &mask_x, &mask_y, &mask_z);
+
+    unsigned int x, y, z;
+    for (z = 0; z < depth; z++) {
+        for (y = 0; y < height; y++) {
+            for (x = 0; x < width; x++) {
+                unsigned int swizzled = bytes_per_pixel
+                    * (ref_fill_pattern(mask_x, x)
+                       | ref_fill_pattern(mask_y, y)
+                       | ref_fill_pattern(mask_z, z));
+                unsigned int linear = z * slice_pitch + y * row_pitch
+                                      + x * bytes_per_pixel;
+                if (swizzle) {
+                    memcpy(dst_buf + swizzled, src_buf + linear,
+                           bytes_per_pixel);
+                } else {
+                    memcpy(dst_buf + linear, src_buf + swizzled,
+                           bytes_per_pixel);
+                }
+            }
+        }
+    }
+}
+
+static void run_swizzle(const SwizzleBench *b, bool reference, bool swizzle,
+                        const uint8_t *src, uint8_t *dst,
+                        unsigned int row_pitch)
+{
+    unsigned int slice_pitch = row_pitch * b->height;
+
+    if (reference) {
+        ref_swizzle_box(src, b->width, b->height, b->depth, dst, row_pitch,
+                        slice_pitch, b->bytes_per_pixel, swizzle);
+    } else if (swizzle) {
+        swizzle_box(src, b->width, b->height, b->depth, dst, row_pitch,
+                    slice_pitch, b->bytes_per_pixel);
+    } else {
+        unswizzle_box(src, b->width, b->height, b->depth, dst, row_pitch,
+                      slice_pitch, b->bytes_per_pixel);
+    }
+}
+
+/*
+ * Checks both directions against the reference, and that unswizzling gives
+ * back the pixels swizzled. Rows are padded so that writes outside the
+ * texture show up.
+ */
+static void check_swizzle(const SwizzleBench *b)
+{
+    unsigned int row_length = b->width * b->bytes_per_pixel;
+    unsigned int row_pitch = row_length + 8;
+    size_t linear_length = (size_t)row_pitch * b->height * b->depth;
+    size_t swizzled_length = (size_t)row_length * b->height * b->depth;
+    uint8_t *linear = g_malloc(linear_length);
+    uint8_t *swizzled = g_malloc(swizzled_length);
+    uint8_t *ref = g_malloc(swizzled_length);
+    uint8_t *back = g_malloc(linear_length);
+    uint8_t *ref_back = g_malloc(linear_length);
+    size_t i;
+
+    for (i = 0; i < linear_length; i++) {
+        linear[i] = g_test_rand_int();
+    }
+    memset(back, 0xAA, linear_length);
+    memset(ref_back, 0xAA, linear_length);
+
+    run_swizzle(b, false, true, linear, swizzled, row_pitch);
+    run_swizzle(b, true, true, linear, ref, row_pitch);
+    g_assert(memcmp(swizzled, ref, swizzled_length) == 0);
+
+    run_swizzle(b, false, false, swizzled, back, row_pitch);
+    run_swizzle(b, true, false, swizzled, ref_back, row_pitch);
+    g_assert(memcmp(back, ref_back, linear_length) == 0);
+
+    for (i = 0; i < linear_length; i += row_pitch) {
+        g_assert(memcmp(back + i, linear + i, row_length) == 0);
+        g_assert(back[i + row_length] == 0xAA);
+    }
+
+    g_free(linear);
+    g_free(swizzled);
+    g_free(ref);
+    g_free(back);
+    g_free(ref_back);
+}
+
+static void test_swizzle_correct(const void *opaque)
+{
+    check_swizzle(opaque);
+}
+
+static double time_swizzle(const SwizzleBench *b, bool reference,
+                           const uint8_t *src, uint8_t *dst, size_t length)
+{
+    unsigned int row_pitch = b->width * b->bytes_per_pixel;
+    double total = 0.0;
+
+    g_test_timer_start();
+    do {
+        run_swizzle(b, reference, b->swizzle, src, dst, row_pitch);
+        total += length;
+    } while (g_test_timer_elapsed() < 1.0);
+
+    return total / MiB / g_test_timer_last();
+}
+
+static void test_swizzle_speed(const void *opaque)
+{
+    const SwizzleBench *b = opaque;
+    size_t length = (size_t)b->width * b->height * b->depth
+                    * b->bytes_per_pixel;
+    uint8_t *src = g_malloc(length);
+    uint8_t *dst = g_malloc0(length);
+    uint8_t *ref = g_malloc0(length);
+    size_t i;
+
+    check_swizzle(b);
+
+    for (i = 0; i < length; i++) {
+        src[i] = g_test_rand_int();
+    }
+
+    double reference = time_swizzle(b, true, src, ref, length);
+    double current = time_swizzle(b, false, src, dst, length);
+
+    g_print("%s %ux%u %ubpp: reference %.2f MB/sec, "
+            "current %.2f MB/sec (%.1fx)\n",
+            b->swizzle ? "swizzle" : "unswizzle",
+            b->width, b->height, b->bytes_per_pixel * 8,
+            reference, current, current / reference);
+
+    g_free(src);
+    g_free(dst);
+    g_free(ref);
+}
+
+int main(int argc, char **argv)
+{
+    static const unsigned int bytes_per_pixel[] = { 1, 2, 4 };
+    /* non-square, smaller than a tile in one or both directions, and
+     * volumes */
+    static const unsigned int sizes[][3] = {
+        { 1, 1, 1 }, { 2, 1, 1 }, { 1, 2, 1 }, { 2, 2, 1 }, { 2, 4, 1 },
+        { 4, 2, 1 }, { 1, 16, 1 }, { 16, 1, 1 }, { 2, 64, 1 },
+        { 4, 4, 1 }, { 64, 16, 1 }, { 8, 256, 1 }, { 512, 4, 1 },
+        { 1024, 32, 1 }, { 2, 2, 2 }, { 1, 1, 8 }, { 4, 4, 4 },
+        { 16, 8, 4 }, { 8, 8, 16 }, { 32, 4, 2 }, { 4, 64, 8 },
+    };
+    unsigned int size;
+    int i, j, swizzle;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        for (j = 0; j < ARRAY_SIZE(bytes_per_pixel); j++) {
+            SwizzleBench *b = g_new(SwizzleBench, 1);
+            b->width = sizes[i][0];
+            b->height = sizes[i][1];
+            b->depth = sizes[i][2];
+            b->bytes_per_pixel = bytes_per_pixel[j];
+            b->swizzle = true;
+
+            gchar *name = g_strdup_printf("/nv2a/swizzle/correct-%ux%ux%u-%u",
+                                          b->width, b->height, b->depth,
+                                          b->bytes_per_pixel * 8);
+            g_test_add_data_func_full(name, b, test_swizzle_correct, g_free);
+            g_free(name);
+        }
+    }
+
+    for (swizzle = 0; swizzle < 2; swizzle++) {
+        for (size = 64; size <= 1024; size *= 2) {
+            for (i = 0; i < ARRAY_SIZE(bytes_per_pixel); i++) {
+                SwizzleBench *b = g_new(SwizzleBench, 1);
+                b->width = size;
+                b->height = size;
+                b->depth = 1;
+                b->bytes_per_pixel = bytes_per_pixel[i];
+                b->swizzle = swizzle;
+
+                gchar *name = g_strdup_printf("/nv2a/%s/speed-%u-%u",
+                                              swizzle ? "swizzle"
+                                                      : "unswizzle",
+                                              size, b->bytes_per_pixel * 8);
+                g_test_add_data_func_full(name, b, test_swizzle_speed, g_free);
+                g_free(name);
+            }
+        }
+    }
+
+    return g_test_run();
+}
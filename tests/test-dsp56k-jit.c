@@ -0,0 +1,312 @@
+/*
+ * DSP56300 basic block translator test
+ *
+ * Runs GP microcode on two cores, one translating basic blocks and one
+ * only interpreting, for the same varying cycle budgets. After every
+ * dsp_run both have to be in the same state: registers, stack, and X, Y
+ * and P memory. The microcode is a mixing loop, a frame driven one that
+ * idles, one going through REP, nested and exited DO loops, loops ending
+ * on two word instructions, subroutines and code that rewrites itself,
+ * and random parallel move and ALU sequences in a DO loop.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+
+#include "../hw/xbox/dsp/dsp.h"
+
+#define PRAM_WORDS 4096
+#define XRAM_WORDS 4096
+#define YRAM_WORDS 2048
+
+/* As in mcpx_apu.c, 160MHz and 32 samples at 48kHz */
+#define FRAME_CYCLES (160000000 / 48000 * 32)
+
+#define RUNS 2000
+#define DATA_WORDS 64
+
+static const uint32_t mixing_microcode[] = {
+    0x053fa0,           /* movec #$3f,m0 */
+    0x053fa4,           /* movec #$3f,m4 */
+    0x200013,           /* clr a */
+    0x062080, 0x00000a, /* do #$20,p:$000a */
+    0xf098d2,           /* mac y0,x0,a x:(r0)+,x0 y:(r4)+,y0 */
+    0x014188,           /* add #1,b */
+    0x0ac563,           /* bset #3,x1 */
+    0x0bc563,           /* btst #3,x1 */
+    0x0ac543,           /* bclr #3,x1 */
+    0x000009,           /* inc b */
+    0x00000b,           /* dec b */
+    0x0c0002,           /* jmp p:$0002 */
+};
+
+static const uint32_t frame_microcode[] = {
+    0x053fa0,           /* movec #$3f,m0 */
+    0x053fa4,           /* movec #$3f,m4 */
+    0x0a8581, 0x000002, /* jclr #1,x:$ffffc5,p:$0002 */
+    0x0a8521,           /* bset #1,x:$ffffc5 */
+    0x200013,           /* clr a */
+    0x062080, 0x000009, /* do #$20,p:$0009 */
+    0xf098d2,           /* mac y0,x0,a x:(r0)+,x0 y:(r4)+,y0 */
+    0x014188,           /* add #1,b */
+    0x0c0002,           /* jmp p:$0002 */
+};
+
+static const uint32_t control_microcode[] = {
+    0x053fa0,           /* $00 movec #$3f,m0 */
+    0x053fa4,           /* $01 movec #$3f,m4 */
+    0x0501a1,           /* $02 movec #$01,m1 */
+    0x310800,           /* $03 move #$08,r1 */
+    0x0605a0,           /* $04 rep #$05 */
+    0xf098d2,           /* $05 mac y0,x0,a x:(r0)+,x0 y:(r4)+,y0 */
+    0x060380, 0x00000c, /* $06 do #$03,p:$000c */
+    0x014188,           /* $08 add #1,b */
+    0x0d002d,           /* $09 jsr p:$002d */
+    0x000009,           /* $0a inc b */
+    0x0140c0, 0x000005, /* $0b add #$000005,a */
+    0x060480, 0x000010, /* $0d do #$04,p:$0010 */
+    0x014184,           /* $0f sub #1,a */
+    0x00000b,           /* $10 dec b */
+    0x060880, 0x000016, /* $11 do #$08,p:$0016 */
+    0x000008,           /* $13 inc a */
+    0x00008c,           /* $14 enddo */
+    0x0c0017,           /* $15 jmp p:$0017 */
+    0x000000,           /* $16 nop */
+    0x077091, 0x00002f, /* $17 movem r1,p:$002f */
+    0x045911,           /* $19 lua (r1)+,r1 */
+    0x01438d,           /* $1a cmp #3,b */
+    0x0e701e,           /* $1b jgt p:$001e */
+    0x014188,           /* $1c add #1,b */
+    0x0c0004,           /* $1d jmp p:$0004 */
+    0x20001b,           /* $1e clr b */
+    0x0c0004,           /* $1f jmp p:$0004 */
+    [0x2d] = 0x000008,  /* $2d inc a */
+    0x014188,           /* $2e add #1,b */
+    0x000009,           /* $2f inc b, rewritten as inc a and back */
+    0x000000,           /* $30 nop */
+    0x00000c,           /* $31 rts */
+};
+
+static uint8_t scratch[64 * 1024];
+
+static void scratch_rw(void *opaque, uint8_t *ptr, uint32_t addr,
+                       size_t len, bool dir)
+{
+    g_assert(addr + len <= sizeof(scratch));
+    if (dir) {
+        memcpy(&scratch[addr], ptr, len);
+    } else {
+        memcpy(ptr, &scratch[addr], len);
+    }
+}
+
+static void fifo_rw(void *opaque, uint8_t *ptr, unsigned int index,
+                    unsigned int item_size, size_t len, bool dir)
+{
+    if (!dir) {
+        memset(ptr, 0, len);
+    }
+}
+
+static DSPState *load_microcode(const uint32_t *microcode, size_t words,
+                                const uint32_t *data, bool jit)
+{
+    DSPState *dsp = dsp_init(NULL, scratch_rw, fifo_rw);
+    size_t i;
+
+    dsp_set_jit(dsp, jit);
+    for (i = 0; i < words; i++) {
+        dsp_write_memory(dsp, 'P', i, microcode[i]);
+    }
+    /* the microcode only addresses the start of X and Y */
+    for (i = 0; i < DATA_WORDS; i++) {
+        dsp_write_memory(dsp, 'X', i, data[i]);
+        dsp_write_memory(dsp, 'Y', i, data[DATA_WORDS + i]);
+    }
+
+    return dsp;
+}
+
+static void check_memory(DSPState *a, DSPState *b, char space,
+                         uint32_t words)
+{
+    uint32_t addr;
+
+    for (addr = 0; addr < words; addr++) {
+        g_assert_cmphex(dsp_read_memory(a, space, addr), ==,
+                        dsp_read_memory(b, space, addr));
+    }
+}
+
+/* Memory beyond what the microcode uses is only checked when full */
+static void check_state(DSPState *a, DSPState *b, bool full)
+{
+    static const char *const names[] = {
+        "A0", "A1", "A2", "B0", "B1", "B2", "LA", "LC",
+        "M0", "M1", "M2", "M3", "M4", "M5", "M6", "M7",
+        "N0", "N1", "N2", "N3", "N4", "N5", "N6", "N7",
+        "OMR", "PC",
+        "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7",
+        "SSH", "SSL", "SP", "SR", "X0", "X1", "Y0", "Y1",
+    };
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(names); i++) {
+        uint32_t *reg_a, *reg_b, mask;
+        g_assert(dsp_get_register_address(a, names[i], &reg_a, &mask));
+        g_assert(dsp_get_register_address(b, names[i], &reg_b, &mask));
+        if ((*reg_a & mask) != (*reg_b & mask)) {
+            g_test_message("%s: %06x, interpreted %06x", names[i],
+                           *reg_a & mask, *reg_b & mask);
+            g_assert_not_reached();
+        }
+    }
+    check_memory(a, b, 'X', full ? XRAM_WORDS : DATA_WORDS);
+    check_memory(a, b, 'Y', full ? YRAM_WORDS : DATA_WORDS);
+    check_memory(a, b, 'P', full ? PRAM_WORDS : DATA_WORDS);
+}
+
+static void run_both(const uint32_t *microcode, size_t words)
+{
+    uint32_t data[DATA_WORDS * 2];
+    DSPState *translated, *interpreted;
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(data); i++) {
+        data[i] = g_test_rand_int() & 0xffffff;
+    }
+    translated = load_microcode(microcode, words, data, true);
+    interpreted = load_microcode(microcode, words, data, false);
+
+    for (i = 0; i < RUNS; i++) {
+        /* mostly short budgets, to stop in all the places a block can */
+        int cycles = g_test_rand_int_range(0, 8) ? g_test_rand_int_range(1, 64)
+                                                 : FRAME_CYCLES / 32;
+        if (i % 16 == 0) {
+            dsp_start_frame(translated);
+            dsp_start_frame(interpreted);
+        }
+        dsp_run(translated, cycles);
+        dsp_run(interpreted, cycles);
+        check_state(translated, interpreted, false);
+    }
+    check_state(translated, interpreted, true);
+
+    dsp_destroy(translated);
+    dsp_destroy(interpreted);
+}
+
+static void test_dsp56k_jit_mixing(void)
+{
+    run_both(mixing_microcode, ARRAY_SIZE(mixing_microcode));
+}
+
+static void test_dsp56k_jit_frame(void)
+{
+    run_both(frame_microcode, ARRAY_SIZE(frame_microcode));
+}
+
+static void test_dsp56k_jit_control(void)
+{
+    run_both(control_microcode, ARRAY_SIZE(control_microcode));
+}
+
+/* A parallel instruction with a defined ALU operation */
+static uint32_t random_parallel(void)
+{
+    static const uint32_t moves[] = {
+        0x200000,       /* none */
+        0x204000,       /* update Rn */
+        0x240000,       /* #xx,x0 */
+        0x250000,       /* #xx,x1 */
+        0x260000,       /* #xx,y0 */
+        0x270000,       /* #xx,y1 */
+        0x800000,       /* x:ea,D1 y:ea,D2 and the other ways round */
+    };
+    uint32_t alu, move;
+
+    do {
+        alu = g_test_rand_int_range(0, 0x100);
+    } while (alu == 0x04 || alu == 0x08 || alu == 0x0c || alu == 0x15);
+
+    move = moves[g_test_rand_int_range(0, ARRAY_SIZE(moves))];
+    switch (move) {
+    case 0x200000:
+        return move | alu;
+    case 0x204000:
+        return move | g_test_rand_int_range(0, 0x20) << 8 | alu;
+    case 0x800000:
+        return move | (g_test_rand_int() & 0x7fff00) | alu;
+    default:
+        return move | g_test_rand_int_range(0, 0x100) << 8 | alu;
+    }
+}
+
+static void test_dsp56k_jit_random(void)
+{
+    static const uint32_t nonparallel[] = {
+        0x014188,       /* add #1,b */
+        0x014184,       /* sub #1,a */
+        0x01438d,       /* cmp #3,b */
+        0x000008,       /* inc a */
+        0x00000b,       /* dec b */
+        0x0ac563,       /* bset #3,x1 */
+        0x0bc563,       /* btst #3,x1 */
+        0x0ac543,       /* bclr #3,x1 */
+    };
+    uint32_t microcode[256];
+    unsigned int n, i;
+
+    for (n = 0; n < 16; n++) {
+        size_t words = 0;
+        unsigned int body;
+
+        for (i = 0; i < 8; i++) {
+            microcode[words++] = 0x053fa0 + i;   /* movec #$3f,mi */
+        }
+        body = g_test_rand_int_range(1, 100);
+        microcode[words++] = 0x060080 | g_test_rand_int_range(1, 0x100) << 8;
+        microcode[words] = words + body;
+        words++;
+        for (i = 0; i < body; i++) {
+            unsigned int kind = g_test_rand_int_range(0, 16);
+            if (kind == 0 && i + 2 < body) {
+                microcode[words++] = 0x0600a0
+                                     | g_test_rand_int_range(1, 8) << 8;
+                microcode[words++] = random_parallel();
+                i++;
+            } else if (kind == 1 && i + 2 < body) {
+                /* jcc over the next instruction */
+                microcode[words] = 0x0e0000
+                                   | g_test_rand_int_range(0, 16) << 12
+                                   | (words + 2);
+                words++;
+                microcode[words++] = random_parallel();
+                i++;
+            } else if (kind < 4) {
+                microcode[words++] = nonparallel[
+                    g_test_rand_int_range(0, ARRAY_SIZE(nonparallel))];
+            } else {
+                microcode[words++] = random_parallel();
+            }
+        }
+        microcode[words] = 0x0c0000 | 8;     /* jmp p:$0008 */
+        words++;
+
+        run_both(microcode, words);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/dsp56k/jit/mixing", test_dsp56k_jit_mixing);
+    g_test_add_func("/dsp56k/jit/frame", test_dsp56k_jit_frame);
+    g_test_add_func("/dsp56k/jit/control", test_dsp56k_jit_control);
+    g_test_add_func("/dsp56k/jit/random", test_dsp56k_jit_random);
+
+    return g_test_run();
+}
@@ -0,0 +1,371 @@
+/*
+ * MCPX Voice Processor voice test
+ *
+ * Decodes known PCM and IMA ADPCM vectors, then runs voices through the
+ * buffer code the VP uses: reading across the loop and the end of a
+ * buffer, moving the CBO on at different pitches, and stepping the
+ * amplitude envelope through its phases and a release.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+
+#include "../hw/xbox/mcpx_vp_mix.h"
+
+#define BUFFER_SAMPLES 256
+
+static void read_host(void *opaque, uint32_t offset, uint8_t *buf,
+                      size_t len)
+{
+    memcpy(buf, (uint8_t *)opaque + offset, len);
+}
+
+static void assert_samples(const float *out, const int *expected,
+                           unsigned int count, float scale)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        g_assert_cmpfloat(out[i], ==, expected[i] / scale);
+    }
+}
+
+static void test_vp_decode_pcm(void)
+{
+    static const uint8_t u8[] = { 0x00, 0x40, 0x80, 0xFF };
+    static const int u8_expected[] = { -128, -64, 0, 127 };
+    static const int16_t s16[] = { -32768, -1, 0, 0x4000, 32767 };
+    static const uint32_t s24[] = {
+        0x80000000, 0xFFFFFF00, 0x00000100, 0x7FFFFF00, 0x000000FF,
+    };
+    static const int s24_expected[] = { -8388608, -1, 1, 8388607, 0 };
+    static const uint32_t s32[] = { 0x80000000, 0xC0000000, 0x00000001 };
+    float left[8], right[8];
+    uint8_t raw[32];
+    unsigned int i;
+
+    vp_decode_pcm(VP_FORMAT_U8, 1, u8, ARRAY_SIZE(u8), left, right);
+    assert_samples(left, u8_expected, ARRAY_SIZE(u8), 128.0f);
+
+    for (i = 0; i < ARRAY_SIZE(s16); i++) {
+        stw_le_p(raw + i * 2, s16[i]);
+    }
+    vp_decode_pcm(VP_FORMAT_S16, 1, raw, ARRAY_SIZE(s16), left, right);
+    for (i = 0; i < ARRAY_SIZE(s16); i++) {
+        g_assert_cmpfloat(left[i], ==, s16[i] / 32768.0f);
+    }
+
+    /* 24 bit samples sit in the top of their container */
+    for (i = 0; i < ARRAY_SIZE(s24); i++) {
+        stl_le_p(raw + i * 4, s24[i]);
+    }
+    vp_decode_pcm(VP_FORMAT_S24, 1, raw, ARRAY_SIZE(s24), left, right);
+    assert_samples(left, s24_expected, ARRAY_SIZE(s24), 8388608.0f);
+
+    for (i = 0; i < ARRAY_SIZE(s32); i++) {
+        stl_le_p(raw + i * 4, s32[i]);
+    }
+    vp_decode_pcm(VP_FORMAT_S32, 1, raw, ARRAY_SIZE(s32), left, right);
+    g_assert_cmpfloat(left[0], ==, -1.0f);
+    g_assert_cmpfloat(left[1], ==, -0.5f);
+    g_assert_cmpfloat(left[2], ==, 1.0f / 2147483648.0f);
+
+    /* stereo interleaves left and right */
+    stw_le_p(raw, 0x8000);
+    stw_le_p(raw + 2, 0x0000);
+    stw_le_p(raw + 4, 0xC000);
+    stw_le_p(raw + 6, 0x4000);
+    vp_decode_pcm(VP_FORMAT_S16, 2, raw, 2, left, right);
+    g_assert_cmpfloat(left[0], ==, -1.0f);
+    g_assert_cmpfloat(right[0], ==, 0.0f);
+    g_assert_cmpfloat(left[1], ==, -0.5f);
+    g_assert_cmpfloat(right[1], ==, 0.5f);
+}
+
+/* A block header, predictor then step index */
+static void adpcm_header(uint8_t *p, int16_t predictor, uint8_t index)
+{
+    stw_le_p(p, predictor);
+    p[2] = index;
+    p[3] = 0;
+}
+
+static void test_vp_decode_adpcm(void)
+{
+    /* nibbles 7 7 f 0 8 0 4 3, low nibble first, from a zero predictor */
+    static const uint8_t word[] = { 0x77, 0x0F, 0x08, 0x34 };
+    static const int word_expected[] = {
+        0, 11, 41, -22, -13, -21, -14, 47, 104,
+    };
+    /* zero nibbles only step the index down */
+    static const int zero_expected[] = {
+        1000, 1001, 1002, 1003, 1004, 1004, 1004, 1004, 1004,
+    };
+    uint8_t raw[VP_ADPCM_BLOCK_SIZE * 2 * 2];
+    float left[VP_ADPCM_SAMPLES_PER_BLOCK * 2];
+    float right[VP_ADPCM_SAMPLES_PER_BLOCK * 2];
+
+    memset(raw, 0, sizeof(raw));
+    adpcm_header(raw, 0, 0);
+    memcpy(raw + 4, word, sizeof(word));
+    /* the next block starts over from its own header, saturating */
+    adpcm_header(raw + VP_ADPCM_BLOCK_SIZE, 32760, 88);
+    raw[VP_ADPCM_BLOCK_SIZE + 4] = 0x07;
+    vp_decode_adpcm(1, raw, 2, left, right);
+    assert_samples(left, word_expected, ARRAY_SIZE(word_expected),
+                   32768.0f);
+    g_assert_cmpfloat(left[VP_ADPCM_SAMPLES_PER_BLOCK], ==,
+                      32760 / 32768.0f);
+    g_assert_cmpfloat(left[VP_ADPCM_SAMPLES_PER_BLOCK + 1], ==,
+                      32767 / 32768.0f);
+
+    /* stereo blocks interleave the channels every 4 bytes */
+    memset(raw, 0, sizeof(raw));
+    adpcm_header(raw, 0, 0);
+    adpcm_header(raw + 4, 1000, 4);
+    memcpy(raw + 8, word, sizeof(word));
+    vp_decode_adpcm(2, raw, 1, left, right);
+    assert_samples(left, word_expected, ARRAY_SIZE(word_expected),
+                   32768.0f);
+    assert_samples(right, zero_expected, ARRAY_SIZE(zero_expected),
+                   32768.0f);
+}
+
+/* S16 samples counting up from 0, each channel on its own sign */
+static uint8_t *make_pcm_buffer(unsigned int channels)
+{
+    uint8_t *data = g_malloc(BUFFER_SAMPLES * 2 * channels);
+    unsigned int i;
+
+    for (i = 0; i < BUFFER_SAMPLES; i++) {
+        stw_le_p(data + i * 2 * channels, i);
+        if (channels == 2) {
+            stw_le_p(data + i * 4 + 2, -i);
+        }
+    }
+    return data;
+}
+
+static void test_vp_voice_fill(void)
+{
+    static VPVoiceScratch scratch;
+    float left[64], right[64];
+    unsigned int i;
+
+    VPVoiceBuffer buf = {
+        .base = 2 * 4,
+        .format = VP_FORMAT_S16,
+        .channels = 2,
+        .lbo = 4,
+        .ebo = 9,
+        .loop = true,
+        .read = read_host,
+        .opaque = make_pcm_buffer(2),
+    };
+
+    /* base is where sample 0 is, the loop wraps from EBO to LBO */
+    static const int looped[] = { 10, 11, 6, 7, 8, 9, 10, 11, 6, 7 };
+    vp_voice_fill(&buf, &scratch, 8, ARRAY_SIZE(looped), left, right);
+    for (i = 0; i < ARRAY_SIZE(looped); i++) {
+        g_assert_cmpfloat(left[i], ==, looped[i] / 32768.0f);
+        g_assert_cmpfloat(right[i], ==, -looped[i] / 32768.0f);
+    }
+
+    /* without the loop the voice runs out into silence */
+    buf.loop = false;
+    static const int one_shot[] = { 10, 11, 0, 0, 0 };
+    vp_voice_fill(&buf, &scratch, 8, ARRAY_SIZE(one_shot), left, right);
+    assert_samples(left, one_shot, ARRAY_SIZE(one_shot), 32768.0f);
+    assert_samples(right, one_shot, ARRAY_SIZE(one_shot), -32768.0f);
+
+    g_free(buf.opaque);
+}
+
+static void test_vp_voice_fill_adpcm(void)
+{
+    static VPVoiceScratch scratch;
+    unsigned int blocks = 4;
+    unsigned int samples = blocks * VP_ADPCM_SAMPLES_PER_BLOCK;
+    uint8_t *data = g_malloc(blocks * VP_ADPCM_BLOCK_SIZE);
+    float *whole = g_new(float, samples);
+    float left[VP_FRAME_SAMPLES * 8], right[VP_FRAME_SAMPLES * 8];
+    unsigned int i;
+
+    for (i = 0; i < blocks * VP_ADPCM_BLOCK_SIZE; i++) {
+        data[i] = g_test_rand_int();
+    }
+    for (i = 0; i < blocks; i++) {
+        data[i * VP_ADPCM_BLOCK_SIZE + 2] %= 89;
+    }
+    vp_decode_adpcm(1, data, blocks, whole, NULL);
+
+    /* a loop starting and ending mid block picks the samples out of the
+     * blocks around it */
+    VPVoiceBuffer buf = {
+        .format = VP_FORMAT_ADPCM,
+        .channels = 1,
+        .lbo = 40,
+        .ebo = 200,
+        .loop = true,
+        .read = read_host,
+        .opaque = data,
+    };
+    uint32_t pos = 150;
+    vp_voice_fill(&buf, &scratch, pos, ARRAY_SIZE(left), left, right);
+    for (i = 0; i < ARRAY_SIZE(left); i++) {
+        g_assert_cmpfloat(left[i], ==, whole[pos]);
+        pos = pos == buf.ebo ? buf.lbo : pos + 1;
+    }
+
+    g_free(whole);
+    g_free(data);
+}
+
+static void test_vp_voice_advance(void)
+{
+    VPVoiceBuffer buf = {
+        .lbo = 100,
+        .ebo = 199,
+        .loop = true,
+    };
+    uint32_t pos = 0;
+    float frac = 0.0f;
+
+    /* an octave down moves half a frame on, keeping the fraction */
+    g_assert_true(vp_voice_advance(&buf, &pos, &frac, 0.5f));
+    g_assert_cmpuint(pos, ==, VP_FRAME_SAMPLES / 2);
+    frac = 0.75f;
+    g_assert_true(vp_voice_advance(&buf, &pos, &frac, 0.5f));
+    g_assert_cmpuint(pos, ==, VP_FRAME_SAMPLES);
+    g_assert_cmpfloat(frac, ==, 0.75f);
+
+    /* past the EBO the CBO wraps to as far past the LBO */
+    pos = 190;
+    frac = 0.0f;
+    g_assert_true(vp_voice_advance(&buf, &pos, &frac, 1.0f));
+    g_assert_cmpuint(pos, ==, 100 + 190 + VP_FRAME_SAMPLES - 200);
+
+    /* more than a loop a frame wraps more than once */
+    pos = 190;
+    g_assert_true(vp_voice_advance(&buf, &pos, &frac, 8.0f));
+    g_assert_cmpuint(pos, ==, 100 + (190 + VP_FRAME_SAMPLES * 8 - 200) % 100);
+
+    /* without the loop the voice stops on its last sample */
+    buf.loop = false;
+    pos = 190;
+    g_assert_false(vp_voice_advance(&buf, &pos, &frac, 1.0f));
+    g_assert_cmpuint(pos, ==, 199);
+}
+
+static void test_vp_envelope(void)
+{
+    float sustain = 51 / 255.0f;
+    float gain[VP_FRAME_SAMPLES];
+    unsigned int i;
+
+    /* as a voice starts: delay, attack, hold, decay, then sustain */
+    VPEnvelope env = {
+        .phase = VP_ENVELOPE_DELAY,
+        .delay = 16,
+        .attack = 32,
+        .hold = 16,
+        .decay = 32,
+        .sustain = 51,
+        .release = 48,
+    };
+
+    g_assert_true(vp_envelope_run(&env, gain));
+    for (i = 0; i < 16; i++) {
+        g_assert_cmpfloat(gain[i], ==, 0.0f);
+    }
+    for (i = 16; i < VP_FRAME_SAMPLES; i++) {
+        g_assert_cmpfloat(gain[i], ==, (i - 16) / 32.0f);
+    }
+    g_assert_cmpuint(env.phase, ==, VP_ENVELOPE_ATTACK);
+    g_assert_cmpuint(env.count, ==, 16);
+    g_assert_cmpuint(env.level, ==, lrintf(15 / 32.0f * 255.0f));
+
+    g_assert_true(vp_envelope_run(&env, gain));
+    for (i = 0; i < 16; i++) {
+        g_assert_cmpfloat(gain[i], ==, (i + 16) / 32.0f);
+        g_assert_cmpfloat(gain[i + 16], ==, 1.0f);
+    }
+    g_assert_cmpuint(env.phase, ==, VP_ENVELOPE_HOLD);
+
+    g_assert_true(vp_envelope_run(&env, gain));
+    for (i = 0; i < VP_FRAME_SAMPLES; i++) {
+        g_assert_cmpfloat(gain[i], ==, 1.0f - (1.0f - sustain) * (i / 32.0f));
+    }
+    g_assert_cmpuint(env.phase, ==, VP_ENVELOPE_DECAY);
+
+    g_assert_true(vp_envelope_run(&env, gain));
+    for (i = 0; i < VP_FRAME_SAMPLES; i++) {
+        g_assert_cmpfloat(gain[i], ==, sustain);
+    }
+    g_assert_cmpuint(env.phase, ==, VP_ENVELOPE_SUSTAIN);
+    g_assert_cmpuint(env.level, ==, 51);
+
+    /* sustain holds until the voice is released */
+    g_assert_true(vp_envelope_run(&env, gain));
+    g_assert_cmpuint(env.phase, ==, VP_ENVELOPE_SUSTAIN);
+
+    /* VOICE_RELEASE fades out from the level reached, then the voice
+     * stops */
+    env.phase = VP_ENVELOPE_RELEASE;
+    env.count = 0;
+    g_assert_true(vp_envelope_run(&env, gain));
+    for (i = 0; i < VP_FRAME_SAMPLES; i++) {
+        g_assert_cmpfloat(gain[i], ==, sustain * (1.0f - i / 48.0f));
+    }
+    g_assert_cmpuint(env.level, ==, 51);
+
+    g_assert_false(vp_envelope_run(&env, gain));
+    for (i = 0; i < 16; i++) {
+        g_assert_cmpfloat(gain[i], ==,
+                          sustain * (1.0f - (i + 32) / 48.0f));
+        g_assert_cmpfloat(gain[i + 16], ==, 0.0f);
+    }
+}
+
+static void test_vp_envelope_off(void)
+{
+    float gain[VP_FRAME_SAMPLES];
+    unsigned int i;
+
+    /* voices without an envelope play at full volume */
+    VPEnvelope env = { .phase = VP_ENVELOPE_OFF };
+
+    g_assert_true(vp_envelope_run(&env, gain));
+    for (i = 0; i < VP_FRAME_SAMPLES; i++) {
+        g_assert_cmpfloat(gain[i], ==, 1.0f);
+    }
+    g_assert_cmpuint(env.phase, ==, VP_ENVELOPE_OFF);
+    g_assert_cmpuint(env.count, ==, 0);
+
+    /* and stop as soon as they're released */
+    env.phase = VP_ENVELOPE_RELEASE;
+    g_assert_false(vp_envelope_run(&env, gain));
+    for (i = 0; i < VP_FRAME_SAMPLES; i++) {
+        g_assert_cmpfloat(gain[i], ==, 0.0f);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    vp_mix_init();
+
+    g_test_add_func("/mcpx-vp/decode/pcm", test_vp_decode_pcm);
+    g_test_add_func("/mcpx-vp/decode/adpcm", test_vp_decode_adpcm);
+    g_test_add_func("/mcpx-vp/voice/fill", test_vp_voice_fill);
+    g_test_add_func("/mcpx-vp/voice/fill-adpcm", test_vp_voice_fill_adpcm);
+    g_test_add_func("/mcpx-vp/voice/advance", test_vp_voice_advance);
+    g_test_add_func("/mcpx-vp/envelope", test_vp_envelope);
+    g_test_add_func("/mcpx-vp/envelope/off", test_vp_envelope_off);
+
+    return g_test_run();
+}
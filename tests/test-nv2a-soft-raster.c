@@ -0,0 +1,374 @@
+/*
+ * NV2A software rasterizer golden image test
+ *
+ * Draws a small fixed scene into an A8R8G8B8 surface with a Z24S8 depth
+ * buffer: a clear, a Gouraud shaded triangle, a flat one cutting through it
+ * with a sloped depth, one hidden behind both, a stencil mask where a
+ * fourth one passes the depth test which only lets a fifth through there,
+ * a blended one over the top, and a textured one shaded by the register
+ * combiners as the software renderer runs them: a texture stage with alpha
+ * kill, a general combiner stage, fog in the final combiner and an alpha
+ * test. The colour buffer has to match tests/nv2a-soft-raster-data/
+ * scene.ppm exactly, and be the same whatever the number of worker threads.
+ *
+ * Run with TEST_NV2A_REBUILD_GOLDEN set to write a new golden image.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+
+#include "../hw/xbox/nv2a/nv2a_soft_raster.h"
+#include "../hw/xbox/nv2a/nv2a_psh.h"
+
+#define REBUILD_GOLDEN "TEST_NV2A_REBUILD_GOLDEN"
+#define GOLDEN_PATH SRC_PATH "/tests/nv2a-soft-raster-data/scene.ppm"
+
+#define SIZE 64
+#define ZETA_MAX 0xFFFFFF
+
+/* Combiner register and texture mode encodings, as in nv2a_psh.c */
+#define PS_TEXTUREMODES_PROJECT2D 0x01
+#define PS_REGISTER_ZERO 0x00
+#define PS_REGISTER_C0 0x01
+#define PS_REGISTER_FOG 0x03
+#define PS_REGISTER_V0 0x04
+#define PS_REGISTER_V1 0x05
+#define PS_REGISTER_T0 0x08
+#define PS_REGISTER_R0 0x0c
+#define PS_CHANNEL_ALPHA 0x10
+
+#define COMBINER_INPUTS(a, b, c, d) \
+    ((uint32_t)(a) << 24 | (b) << 16 | (c) << 8 | (d))
+
+/* Varyings of the combiner triangle, laid out as the renderer's */
+#define VARYING_D0 0
+#define VARYING_D1 1
+#define VARYING_FOG 2
+#define VARYING_T0 3
+#define NUM_COMBINER_VARYINGS 4
+
+#define CHECKER_SIZE 4
+
+typedef struct Scene {
+    uint8_t color[SIZE * SIZE * 4];
+    uint8_t zeta[SIZE * SIZE * 4];
+    uint64_t samples_passed;
+} Scene;
+
+static bool shade_varying(const void *opaque, const SoftVec4 *varyings,
+                          SoftVec4 *color)
+{
+    *color = varyings[0];
+    return true;
+}
+
+/* A checker with transparent texels on one diagonal, point sampled with
+ * wrapping; s and t are normalized */
+static void sample_checker(const void *opaque, int stage, float s, float t,
+                           float color[4])
+{
+    int x = (int)floorf(s * CHECKER_SIZE) & (CHECKER_SIZE - 1);
+    int y = (int)floorf(t * CHECKER_SIZE) & (CHECKER_SIZE - 1);
+    float v = (x + y) & 1 ? 1.0f : 0.25f;
+
+    g_assert_cmpint(stage, ==, 0);
+    color[0] = v;
+    color[1] = v;
+    color[2] = 1.0f - v;
+    color[3] = x == y ? 0.0f : 0.75f;
+}
+
+/* As soft_shade in nv2a_pgraph_soft.c */
+static bool shade_combiners(const void *opaque, const SoftVec4 *varyings,
+                            SoftVec4 *color)
+{
+    const PshProgram *program = opaque;
+    static const PshEnvironment env = {
+        .c0 = { { 0.0f, 0.0f, 0.5f, 1.0f } },
+        .fog_color = { 0.5f, 0.5f, 0.5f },
+        .alpha_ref = 0.25f,
+        .sample = sample_checker,
+    };
+    PshFragment fragment;
+    float out[4];
+    int j;
+
+    memset(&fragment, 0, sizeof(fragment));
+    for (j = 0; j < 4; j++) {
+        fragment.v0[j] = varyings[VARYING_D0][j];
+        fragment.v1[j] = varyings[VARYING_D1][j];
+        fragment.texcoord[0][j] = varyings[VARYING_T0][j];
+    }
+    fragment.fog = varyings[VARYING_FOG][0];
+
+    if (!psh_program_run(program, &env, &fragment, out)) {
+        return false;
+    }
+    for (j = 0; j < 4; j++) {
+        (*color)[j] = out[j];
+    }
+    return true;
+}
+
+/*
+ * R0.rgb = T0 * V0 + C0 * V1, R0.a = T0.a * V0.a in a general stage, then
+ * fog.a * R0 + (1 - fog.a) * fog in the final combiner. Texels with no
+ * alpha are killed and the rest have to pass alpha > 1/4.
+ */
+static PshProgram *combiner_program(void)
+{
+    PshState state;
+
+    memset(&state, 0, sizeof(state));
+    state.combiner_control = 1;
+    state.shader_stage_program = PS_TEXTUREMODES_PROJECT2D;
+    state.rgb_inputs[0] = COMBINER_INPUTS(PS_REGISTER_T0, PS_REGISTER_V0,
+                                          PS_REGISTER_C0, PS_REGISTER_V1);
+    state.rgb_outputs[0] = PS_REGISTER_R0 << 8;
+    state.alpha_inputs[0] = COMBINER_INPUTS(PS_REGISTER_T0 | PS_CHANNEL_ALPHA,
+                                            PS_REGISTER_V0 | PS_CHANNEL_ALPHA,
+                                            PS_REGISTER_ZERO,
+                                            PS_REGISTER_ZERO);
+    state.alpha_outputs[0] = PS_REGISTER_R0 << 4;
+    state.final_inputs_0 = COMBINER_INPUTS(PS_REGISTER_FOG | PS_CHANNEL_ALPHA,
+                                           PS_REGISTER_R0, PS_REGISTER_FOG,
+                                           PS_REGISTER_ZERO);
+    state.final_inputs_1 = COMBINER_INPUTS(PS_REGISTER_ZERO, PS_REGISTER_ZERO,
+                                           PS_REGISTER_R0 | PS_CHANNEL_ALPHA,
+                                           0);
+    state.alphakill[0] = true;
+    state.alpha_test = true;
+    state.alpha_func = ALPHA_FUNC_GREATER;
+
+    return psh_program_new(&state);
+}
+
+static void combiner_vertex(SoftVertex *v, float x, float y,
+                            float r, float g, float b, float a,
+                            float fog, float s, float t)
+{
+    memset(v, 0, sizeof(*v));
+    v->x = x;
+    v->y = y;
+    v->inv_w = 1.0f;
+    v->varyings[VARYING_D0] = (SoftVec4){ r, g, b, a };
+    v->varyings[VARYING_D1] = (SoftVec4){ 1.0f - r, 1.0f - g, 1.0f - b, 1.0f };
+    v->varyings[VARYING_FOG] = (SoftVec4){ fog, 0.0f, 0.0f, 0.0f };
+    v->varyings[VARYING_T0] = (SoftVec4){ s, t, 0.0f, 1.0f };
+}
+
+static void vertex(SoftVertex *v, float x, float y, float depth,
+                   float r, float g, float b, float a)
+{
+    memset(v, 0, sizeof(*v));
+    v->x = x;
+    v->y = y;
+    v->z = depth * ZETA_MAX;
+    v->inv_w = 1.0f;
+    v->varyings[0] = (SoftVec4){ r, g, b, a };
+}
+
+static void draw_scene(Scene *scene, unsigned int num_threads)
+{
+    PshProgram *program = combiner_program();
+    SoftRaster raster;
+    SoftVertex v[3];
+    SoftTarget target = {
+        .color = scene->color,
+        .color_pitch = SIZE * 4,
+        .color_format = SOFT_COLOR_A8R8G8B8,
+        .zeta = scene->zeta,
+        .zeta_pitch = SIZE * 4,
+        .zeta_format = SOFT_ZETA_Z24S8,
+        .clip_width = SIZE,
+        .clip_height = SIZE,
+    };
+    SoftRasterState state = {
+        .cull = SOFT_CULL_NONE,
+        .depth_test = true,
+        .depth_write = true,
+        .depth_func = SOFT_COMPARE_LESS,
+        .depth_min = 0.0f,
+        .depth_max = ZETA_MAX,
+        .color_mask = SOFT_MASK_RGBA,
+        .num_varyings = 1,
+        .shade = shade_varying,
+    };
+
+    soft_raster_init(&raster, num_threads);
+    soft_raster_clear(&target, 0, 0, SIZE, SIZE,
+                      true, 0xFF202040, 0xFFFFFFFF,
+                      true, 0xFFFFFF00, 0xFFFFFFFF);
+    scene->samples_passed = 0;
+
+    soft_raster_begin(&raster, &target, &state);
+    vertex(&v[0], 4.0f, 4.0f, 0.5f, 1.0f, 0.0f, 0.0f, 1.0f);
+    vertex(&v[1], 60.0f, 12.0f, 0.5f, 0.0f, 1.0f, 0.0f, 1.0f);
+    vertex(&v[2], 16.0f, 58.0f, 0.5f, 0.0f, 0.0f, 1.0f, 1.0f);
+    soft_raster_triangle(&raster, &v[0], &v[1], &v[2]);
+    /* in front of the first on the left, behind it on the right */
+    vertex(&v[0], 2.0f, 30.0f, 0.25f, 1.0f, 1.0f, 0.0f, 1.0f);
+    vertex(&v[1], 62.5f, 20.25f, 0.75f, 1.0f, 1.0f, 0.0f, 1.0f);
+    vertex(&v[2], 40.75f, 62.0f, 0.75f, 1.0f, 1.0f, 0.0f, 1.0f);
+    soft_raster_triangle(&raster, &v[0], &v[1], &v[2]);
+    /* behind everything drawn so far */
+    vertex(&v[0], 8.0f, 8.0f, 0.9f, 1.0f, 0.0f, 1.0f, 1.0f);
+    vertex(&v[1], 40.0f, 8.0f, 0.9f, 1.0f, 0.0f, 1.0f, 1.0f);
+    vertex(&v[2], 8.0f, 40.0f, 0.9f, 1.0f, 0.0f, 1.0f, 1.0f);
+    soft_raster_triangle(&raster, &v[0], &v[1], &v[2]);
+    soft_raster_end(&raster);
+    scene->samples_passed += raster.samples_passed;
+
+    /* mark where this is in front without drawing it */
+    state.depth_write = false;
+    state.color_mask = 0;
+    state.stencil_test = true;
+    state.stencil_func = SOFT_COMPARE_ALWAYS;
+    state.stencil_ref = 0x81;
+    state.stencil_read_mask = 0xFF;
+    state.stencil_write_mask = 0x0F;
+    state.stencil_fail = SOFT_STENCIL_OP_KEEP;
+    state.stencil_zfail = SOFT_STENCIL_OP_INCR;
+    state.stencil_zpass = SOFT_STENCIL_OP_REPLACE;
+    soft_raster_begin(&raster, &target, &state);
+    vertex(&v[0], 0.0f, 40.0f, 0.6f, 0.0f, 0.0f, 0.0f, 1.0f);
+    vertex(&v[1], 48.0f, 40.0f, 0.6f, 0.0f, 0.0f, 0.0f, 1.0f);
+    vertex(&v[2], 0.0f, 64.0f, 0.6f, 0.0f, 0.0f, 0.0f, 1.0f);
+    soft_raster_triangle(&raster, &v[0], &v[1], &v[2]);
+    soft_raster_end(&raster);
+    scene->samples_passed += raster.samples_passed;
+
+    /* only the low bits were written, so the marked pixels hold 1 */
+    state.depth_test = false;
+    state.color_mask = SOFT_MASK_RGBA;
+    state.stencil_func = SOFT_COMPARE_EQUAL;
+    state.stencil_ref = 0x01;
+    state.stencil_zpass = SOFT_STENCIL_OP_KEEP;
+    soft_raster_begin(&raster, &target, &state);
+    vertex(&v[0], 0.0f, 36.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f);
+    vertex(&v[1], 56.0f, 36.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f);
+    vertex(&v[2], 0.0f, 64.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f);
+    soft_raster_triangle(&raster, &v[0], &v[1], &v[2]);
+    soft_raster_end(&raster);
+    scene->samples_passed += raster.samples_passed;
+
+    state.stencil_test = false;
+    state.blend = true;
+    state.blend_src = SOFT_BLEND_SRC_ALPHA;
+    state.blend_dst = SOFT_BLEND_ONE_MINUS_SRC_ALPHA;
+    state.blend_equation = SOFT_BLEND_EQ_ADD;
+    soft_raster_begin(&raster, &target, &state);
+    vertex(&v[0], 32.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f, 0.5f);
+    vertex(&v[1], 64.0f, 64.0f, 0.0f, 1.0f, 1.0f, 1.0f, 0.5f);
+    vertex(&v[2], 24.0f, 48.0f, 0.0f, 1.0f, 1.0f, 1.0f, 0.5f);
+    soft_raster_triangle(&raster, &v[0], &v[1], &v[2]);
+    soft_raster_end(&raster);
+    scene->samples_passed += raster.samples_passed;
+
+    g_assert(program != NULL);
+    state.blend = false;
+    state.num_varyings = NUM_COMBINER_VARYINGS;
+    state.shade = shade_combiners;
+    state.shade_opaque = program;
+    soft_raster_begin(&raster, &target, &state);
+    combiner_vertex(&v[0], 2.0f, 2.0f, 1.0f, 0.5f, 0.0f, 1.0f,
+                    1.0f, 0.0f, 0.0f);
+    combiner_vertex(&v[1], 30.0f, 6.0f, 0.0f, 1.0f, 0.5f, 0.5f,
+                    0.0f, 2.0f, 0.0f);
+    combiner_vertex(&v[2], 6.0f, 34.0f, 1.0f, 1.0f, 1.0f, 1.0f,
+                    0.5f, 0.0f, 2.0f);
+    soft_raster_triangle(&raster, &v[0], &v[1], &v[2]);
+    soft_raster_end(&raster);
+    scene->samples_passed += raster.samples_passed;
+
+    soft_raster_destroy(&raster);
+    psh_program_free(program);
+}
+
+static void scene_to_rgb(const Scene *scene, uint8_t *rgb)
+{
+    unsigned int i;
+
+    for (i = 0; i < SIZE * SIZE; i++) {
+        uint32_t c = ldl_le_p(&scene->color[i * 4]);
+        rgb[i * 3] = c >> 16;
+        rgb[i * 3 + 1] = c >> 8;
+        rgb[i * 3 + 2] = c;
+    }
+}
+
+static void test_soft_raster_threads(void)
+{
+    static const unsigned int threads[] = { 1, 3, 8 };
+    Scene *reference = g_new(Scene, 1);
+    Scene *scene = g_new(Scene, 1);
+    unsigned int i;
+
+    /* tiles are only ever shaded by one thread each, so this is exact */
+    draw_scene(reference, 0);
+    for (i = 0; i < ARRAY_SIZE(threads); i++) {
+        draw_scene(scene, threads[i]);
+        g_assert(!memcmp(scene->color, reference->color,
+                         sizeof(scene->color)));
+        g_assert(!memcmp(scene->zeta, reference->zeta, sizeof(scene->zeta)));
+        g_assert_cmpuint(scene->samples_passed, ==,
+                         reference->samples_passed);
+    }
+
+    g_free(reference);
+    g_free(scene);
+}
+
+static void test_soft_raster_golden(void)
+{
+    static const char header[] = "P6\n64 64\n255\n";
+    Scene *scene = g_new(Scene, 1);
+    uint8_t rgb[SIZE * SIZE * 3];
+    gchar *golden;
+    gsize length;
+    unsigned int i;
+
+    draw_scene(scene, 0);
+    scene_to_rgb(scene, rgb);
+
+    if (getenv(REBUILD_GOLDEN)) {
+        gchar *ppm = g_malloc(strlen(header) + sizeof(rgb));
+        memcpy(ppm, header, strlen(header));
+        memcpy(ppm + strlen(header), rgb, sizeof(rgb));
+        g_assert(g_file_set_contents(GOLDEN_PATH, ppm,
+                                     strlen(header) + sizeof(rgb), NULL));
+        g_free(ppm);
+        g_free(scene);
+        return;
+    }
+
+    g_assert(g_file_get_contents(GOLDEN_PATH, &golden, &length, NULL));
+    g_assert_cmpuint(length, ==, strlen(header) + sizeof(rgb));
+    g_assert(!memcmp(golden, header, strlen(header)));
+
+    for (i = 0; i < sizeof(rgb); i++) {
+        int expected = (uint8_t)golden[strlen(header) + i];
+        if (rgb[i] != expected) {
+            g_test_message("pixel %u,%u channel %u: got %u, expected %d",
+                           i / 3 % SIZE, i / 3 / SIZE, i % 3, rgb[i],
+                           expected);
+            g_assert_not_reached();
+        }
+    }
+
+    g_free(golden);
+    g_free(scene);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/nv2a/soft-raster/threads", test_soft_raster_threads);
+    g_test_add_func("/nv2a/soft-raster/golden", test_soft_raster_golden);
+
+    return g_test_run();
+}